@@ -48,7 +48,7 @@ fn build_for_ios(out_dir: &str) {
 
     add_link_search_path(onnx_runtime_libs_dir);
     add_link_search_path(format!("{cmake_build_dir}/Release"));
-    link_static_libs(&["neural_pitch_detector", "RTNeural", "onnxruntime"]);
+    link_static_libs(&["neural_pitch_detector", "onnxruntime"]);
 }
 
 fn build_for_ios_sim(out_dir: &str) {
@@ -78,7 +78,7 @@ fn build_for_ios_sim(out_dir: &str) {
 
     add_link_search_path(onnx_runtime_libs_dir);
     add_link_search_path(cmake_build_dir);
-    link_static_libs(&["neural_pitch_detector", "RTNeural", "onnxruntime"]);
+    link_static_libs(&["neural_pitch_detector", "onnxruntime"]);
 }
 
 fn build_for_macos(out_dir: &str) {
@@ -106,7 +106,7 @@ fn build_for_macos(out_dir: &str) {
 
     add_link_search_path(onnx_runtime_libs_dir);
     add_link_search_path(cmake_build_dir);
-    link_static_libs(&["neural_pitch_detector", "RTNeural", "onnxruntime"]);
+    link_static_libs(&["neural_pitch_detector", "onnxruntime"]);
 }
 
 fn build_for_android(out_dir: &str) {
@@ -168,7 +168,7 @@ fn build_for_android(out_dir: &str) {
     ]);
 
     add_link_search_path(cmake_build_dir);
-    link_static_libs(&["neural_pitch_detector", "RTNeural"]);
+    link_static_libs(&["neural_pitch_detector"]);
 }
 
 fn build_with_cmake(build_dir: &str, args: &[&str]) {
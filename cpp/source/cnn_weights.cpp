@@ -0,0 +1,113 @@
+#include "cnn_weights.h"
+
+#include <cstring>
+
+/**
+ * @return Number of weights of a layer.
+ */
+static uint64_t num_weights(const Conv2d::Shape &shape) {
+    return (uint64_t)shape.kernel_time * shape.kernel_feature *
+           shape.channels_in * shape.channels_out;
+}
+
+static size_t align_offset(size_t offset) {
+    return (offset + cnn_weights_alignment - 1) / cnn_weights_alignment *
+           cnn_weights_alignment;
+}
+
+std::vector<uint8_t>
+pack_cnn_weights(const std::vector<const Conv2d *> &layers) {
+    CnnWeightsHeader header{};
+    std::memcpy(header.magic, cnn_weights_magic, sizeof(header.magic));
+    header.version = cnn_weights_version;
+    header.num_layers = static_cast<uint32_t>(layers.size());
+
+    std::vector<CnnWeightsLayer> table(layers.size());
+    size_t offset = sizeof(header) + table.size() * sizeof(CnnWeightsLayer);
+    for (size_t i = 0; i < layers.size(); i++) {
+        table[i].shape = layers[i]->shape();
+        table[i].weights_offset = align_offset(offset);
+        table[i].bias_offset = align_offset(
+            table[i].weights_offset + num_weights(table[i].shape) * 4);
+        offset = table[i].bias_offset + table[i].shape.channels_out * 4;
+    }
+
+    std::vector<uint8_t> file(offset, 0);
+    std::memcpy(file.data(), &header, sizeof(header));
+    std::memcpy(file.data() + sizeof(header), table.data(),
+                table.size() * sizeof(CnnWeightsLayer));
+    for (size_t i = 0; i < layers.size(); i++) {
+        std::memcpy(file.data() + table[i].weights_offset,
+                    layers[i]->weight_values(),
+                    num_weights(table[i].shape) * sizeof(float));
+        std::memcpy(file.data() + table[i].bias_offset,
+                    layers[i]->bias_values(),
+                    table[i].shape.channels_out * sizeof(float));
+    }
+
+    return file;
+}
+
+/**
+ * @return True if [offset, offset + num_floats floats) is inside the file and
+ * aligned for floats.
+ */
+static bool is_float_array(BinaryBlob file, uint64_t offset,
+                           uint64_t num_floats) {
+    return offset <= file.num_bytes &&
+           num_floats <= (file.num_bytes - offset) / sizeof(float) &&
+           reinterpret_cast<uintptr_t>(file.data + offset) % alignof(float) ==
+               0;
+}
+
+static bool is_valid_shape(const Conv2d::Shape &shape) {
+    // Bounds keep the weight counts far from overflowing.
+    auto in_range = [](int32_t value) { return value > 0 && value <= 4096; };
+    return in_range(shape.kernel_time) &&
+           shape.kernel_time <= Conv2d::max_kernel_time &&
+           in_range(shape.kernel_feature) &&
+           in_range(shape.stride) && in_range(shape.channels_in) &&
+           in_range(shape.channels_out) && in_range(shape.num_features_in) &&
+           shape.activation >= Conv2d::Linear &&
+           shape.activation <= Conv2d::Sigmoid;
+}
+
+std::vector<PackedConv2d> unpack_cnn_weights(BinaryBlob file) {
+    CnnWeightsHeader header{};
+    if (file.data == nullptr || file.num_bytes < sizeof(header)) {
+        return {};
+    }
+
+    std::memcpy(&header, file.data, sizeof(header));
+    if (std::memcmp(header.magic, cnn_weights_magic, sizeof(header.magic)) !=
+            0 ||
+        header.version != cnn_weights_version ||
+        header.num_layers > (file.num_bytes - sizeof(header)) /
+                                sizeof(CnnWeightsLayer)) {
+        return {};
+    }
+
+    std::vector<PackedConv2d> layers(header.num_layers);
+    for (size_t i = 0; i < layers.size(); i++) {
+        CnnWeightsLayer entry{};
+        std::memcpy(&entry,
+                    file.data + sizeof(header) + i * sizeof(CnnWeightsLayer),
+                    sizeof(entry));
+
+        if (!is_valid_shape(entry.shape) ||
+            !is_float_array(file, entry.weights_offset,
+                            num_weights(entry.shape)) ||
+            !is_float_array(file, entry.bias_offset,
+                            (uint64_t)entry.shape.channels_out)) {
+            return {};
+        }
+
+        layers[i].shape = entry.shape;
+        layers[i].weights =
+            reinterpret_cast<const float *>(file.data + entry.weights_offset);
+        layers[i].bias =
+            reinterpret_cast<const float *>(file.data + entry.bias_offset);
+    }
+
+    return layers;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "constants.h"
+#include "conv2d.h"
+
+/**
+ * Prepacked CNN weight file: conv layers with their weights already in the
+ * layout of Conv2d, so that a memory mapped file is used in place instead of
+ * parsing and copying the json models. Written by tools/pack_cnn_weights.
+ *
+ * Layout, in native byte order: a CnnWeightsHeader, num_layers
+ * CnnWeightsLayer, then the weight and bias arrays of the layers, each
+ * aligned to cnn_weights_alignment bytes.
+ */
+struct CnnWeightsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_layers;
+};
+
+struct CnnWeightsLayer {
+    Conv2d::Shape shape;
+    uint32_t reserved;
+    // Offsets from the start of the file
+    uint64_t weights_offset;
+    uint64_t bias_offset;
+};
+
+static constexpr char cnn_weights_magic[8] = {'N', 'P', 'C', 'N',
+                                              'N', 'W', 'T', '\0'};
+static constexpr uint32_t cnn_weights_version = 1;
+static constexpr size_t cnn_weights_alignment = 64;
+
+/**
+ * Layer of a prepacked weight file, pointing into the file.
+ */
+struct PackedConv2d {
+    Conv2d::Shape shape;
+    const float *weights;
+    const float *bias;
+};
+
+/**
+ * @param layers Layers to write, in order.
+ * @return Content of the weight file.
+ */
+std::vector<uint8_t>
+pack_cnn_weights(const std::vector<const Conv2d *> &layers);
+
+/**
+ * Check a weight file and list its layers.
+ * @param file Content of the weight file.
+ * @return Layers pointing into file, in order. Empty if file is not a valid
+ * weight file.
+ */
+std::vector<PackedConv2d> unpack_cnn_weights(BinaryBlob file);
@@ -0,0 +1,461 @@
+#include "conv2d.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <string>
+#include <tuple>
+
+void Conv2d::load(const nlohmann::json &layer) {
+    assert(layer.at("type").get<std::string>() == "conv2d");
+    assert(layer.at("padding").get<std::string>() == "same");
+    assert(layer.at("dilation").get<int>() == 1);
+
+    Shape layer_shape{};
+    layer_shape.kernel_time = layer.at("kernel_size_time").get<int>();
+    layer_shape.kernel_feature = layer.at("kernel_size_feature").get<int>();
+    layer_shape.stride = layer.at("strides").get<int>();
+    layer_shape.channels_in = layer.at("num_filters_in").get<int>();
+    layer_shape.channels_out = layer.at("num_filters_out").get<int>();
+    layer_shape.num_features_in = layer.at("num_features_in").get<int>();
+
+    const auto activation_name = layer.at("activation").get<std::string>();
+    if (activation_name == "relu") {
+        layer_shape.activation = Relu;
+    } else if (activation_name == "sigmoid") {
+        layer_shape.activation = Sigmoid;
+    } else {
+        assert(activation_name.empty() || activation_name == "linear");
+        layer_shape.activation = Linear;
+    }
+
+    const auto &json_weights = layer.at("weights");
+
+    weights.clear();
+    weights.reserve((size_t)layer_shape.kernel_time *
+                    layer_shape.kernel_feature * layer_shape.channels_in *
+                    layer_shape.channels_out);
+    for (const auto &time_slice : json_weights.at(0)) {
+        for (const auto &feature_slice : time_slice) {
+            for (const auto &in_slice : feature_slice) {
+                for (const auto &w : in_slice) {
+                    weights.push_back(w.get<float>());
+                }
+            }
+        }
+    }
+    assert(weights.size() ==
+           (size_t)layer_shape.kernel_time * layer_shape.kernel_feature *
+               layer_shape.channels_in * layer_shape.channels_out);
+
+    bias = json_weights.at(1).get<std::vector<float>>();
+    assert(bias.size() == (size_t)layer_shape.channels_out);
+
+    external_weights = nullptr;
+    external_bias = nullptr;
+
+    set_shape(layer_shape);
+}
+
+void Conv2d::load(const Shape &shape, const float *weights_in_place,
+                  const float *bias_in_place) {
+    assert(weights_in_place != nullptr && bias_in_place != nullptr);
+
+    weights.clear();
+    weights.shrink_to_fit();
+    bias.clear();
+    bias.shrink_to_fit();
+
+    external_weights = weights_in_place;
+    external_bias = bias_in_place;
+
+    set_shape(shape);
+}
+
+Conv2d::Shape Conv2d::shape() const {
+    Shape layer_shape{};
+    layer_shape.kernel_time = kernel_time;
+    layer_shape.kernel_feature = kernel_feature;
+    layer_shape.stride = stride;
+    layer_shape.channels_in = channels_in;
+    layer_shape.channels_out = channels_out;
+    layer_shape.num_features_in = num_in;
+    layer_shape.activation = activation;
+    return layer_shape;
+}
+
+void Conv2d::set_shape(const Shape &shape) {
+    assert(shape.activation >= Linear && shape.activation <= Sigmoid);
+
+    kernel_time = shape.kernel_time;
+    kernel_feature = shape.kernel_feature;
+    stride = shape.stride;
+    channels_in = shape.channels_in;
+    channels_out = shape.channels_out;
+    num_in = shape.num_features_in;
+    activation = static_cast<Activation>(shape.activation);
+
+    // "same" padding as in tensorflow
+    num_out = (num_in + stride - 1) / stride;
+    const int pad_total =
+        std::max((num_out - 1) * stride + kernel_feature - num_in, 0);
+    pad_left = pad_total / 2;
+
+    assert(kernel_time <= max_kernel_time);
+    kernel = use_specialized_kernel
+                 ? find_conv2d_kernel(kernel_time, kernel_feature, channels_in,
+                                      channels_out, stride)
+                 : nullptr;
+
+    sparse_kernel = nullptr;
+    sparse_rows.clear();
+
+    set_num_streams(1);
+    set_output_range(0, num_out);
+}
+
+void Conv2d::set_specialized_kernel(bool enabled) {
+    use_specialized_kernel = enabled;
+    kernel = enabled ? find_conv2d_kernel(kernel_time, kernel_feature,
+                                          channels_in, channels_out, stride)
+                     : nullptr;
+    sparse_kernel = enabled && !sparse_rows.empty()
+                        ? find_sparse_conv2d_kernel(kernel_time,
+                                                    kernel_feature, channels_in,
+                                                    channels_out, stride)
+                        : nullptr;
+}
+
+float Conv2d::prune(float tolerance) {
+    const auto candidate_kernel = find_sparse_conv2d_kernel(
+        kernel_time, kernel_feature, channels_in, channels_out, stride);
+    if (candidate_kernel == nullptr) {
+        return 0.0f;
+    }
+
+    const int kernel_window = kernel_feature * channels_in;
+    const int num_rows = kernel_time * kernel_window;
+    assert(kernel_window <= UINT16_MAX + 1);
+
+    const float *w = weight_values();
+    float max_abs = 0.0f;
+    for (int i = 0; i < num_rows * channels_out; i++) {
+        max_abs = std::max(max_abs, std::abs(w[i]));
+    }
+    const float threshold = tolerance * max_abs;
+
+    std::vector<bool> is_pruned(num_rows);
+    bool has_changes = false;
+    int num_pruned = 0;
+    for (int row = 0; row < num_rows; row++) {
+        const float *w_row = w + (size_t)row * channels_out;
+        is_pruned[row] = std::all_of(
+            w_row, w_row + channels_out,
+            [=](float value) { return std::abs(value) <= threshold; });
+        if (is_pruned[row]) {
+            num_pruned++;
+            has_changes |= std::any_of(w_row, w_row + channels_out,
+                                       [](float value) { return value != 0; });
+        }
+    }
+
+    const float fraction = static_cast<float>(num_pruned) / num_rows;
+    if (fraction < min_sparse_fraction) {
+        return 0.0f;
+    }
+
+    if (has_changes) {
+        if (external_weights != nullptr) {
+            weights.assign(external_weights,
+                           external_weights + (size_t)num_rows * channels_out);
+            bias.assign(external_bias, external_bias + channels_out);
+            external_weights = nullptr;
+            external_bias = nullptr;
+        }
+        for (int row = 0; row < num_rows; row++) {
+            if (is_pruned[row]) {
+                std::fill(weights.begin() + (long)row * channels_out,
+                          weights.begin() + (long)(row + 1) * channels_out,
+                          0.0f);
+            }
+        }
+    }
+
+    sparse_rows.clear();
+    for (int t = 0; t < kernel_time; t++) {
+        sparse_row_begin[(size_t)t] = static_cast<int>(sparse_rows.size());
+        for (int m = 0; m < kernel_window; m++) {
+            if (!is_pruned[t * kernel_window + m]) {
+                sparse_rows.push_back(static_cast<uint16_t>(m));
+            }
+        }
+    }
+    sparse_row_begin[(size_t)kernel_time] =
+        static_cast<int>(sparse_rows.size());
+
+    sparse_kernel = use_specialized_kernel ? candidate_kernel : nullptr;
+    return fraction;
+}
+
+void Conv2d::set_num_streams(int num_streams) {
+    assert(num_streams > 0);
+    streams = num_streams;
+
+    history.assign((size_t)kernel_time * num_in * channels_in * streams, 0.0f);
+    outs.assign((size_t)num_out * channels_out * streams, 0.0f);
+
+    reset();
+}
+
+void Conv2d::reset_stream(int stream) {
+    assert(stream >= 0 && stream < streams);
+
+    for (size_t i = (size_t)stream; i < history.size(); i += streams) {
+        history[i] = 0.0f;
+    }
+    for (size_t i = (size_t)stream; i < outs.size(); i += streams) {
+        outs[i] = 0.0f;
+    }
+}
+
+void Conv2d::reset() {
+    std::fill(history.begin(), history.end(), 0.0f);
+    std::fill(outs.begin(), outs.end(), 0.0f);
+    history_index = 0;
+}
+
+void Conv2d::save_state(StateWriter &writer) const {
+    writer.write(shape());
+    writer.write<int32_t>(out_begin);
+    writer.write<int32_t>(out_end);
+    writer.write<int32_t>(streams);
+    writer.write<int32_t>(history_index);
+    writer.write_floats(history.data(), history.size());
+}
+
+bool Conv2d::restore_state(StateReader &reader) {
+    int32_t saved_history_index = 0;
+    if (!reader.expect(shape()) || !reader.expect<int32_t>(out_begin) ||
+        !reader.expect<int32_t>(out_end) || !reader.expect<int32_t>(streams) ||
+        !reader.read(saved_history_index)) {
+        return false;
+    }
+    if (saved_history_index < 0 || saved_history_index >= kernel_time) {
+        return reader.fail();
+    }
+
+    history_index = saved_history_index;
+    return reader.read_floats(history.data(), history.size());
+}
+
+void Conv2d::set_output_range(int begin, int end) {
+    out_begin = std::clamp(begin, 0, num_out);
+    out_end = std::clamp(end, out_begin, num_out);
+
+    std::tie(in_begin, in_end) = input_range(out_begin, out_end);
+
+    reset();
+}
+
+std::pair<int, int> Conv2d::input_range(int begin, int end) const {
+    begin = std::max(begin, 0);
+    end = std::min(end, num_out);
+    if (begin >= end) {
+        return {0, 0};
+    }
+
+    return {std::max(begin * stride - pad_left, 0),
+            std::min((end - 1) * stride - pad_left + kernel_feature, num_in)};
+}
+
+void Conv2d::forward(const float *in) {
+    const size_t frame_size = (size_t)num_in * channels_in * streams;
+    const size_t feature_size = (size_t)channels_in * streams;
+
+    std::copy(in + in_begin * feature_size, in + in_end * feature_size,
+              history.begin() + (long)(history_index * frame_size +
+                                       in_begin * feature_size));
+
+    if (streams > 1) {
+        forward_streams();
+        return;
+    }
+
+    std::array<const float *, max_kernel_time> frames{};
+    for (int t = 0; t < kernel_time; t++) {
+        // t = 0 is the oldest frame
+        const int slot = (history_index + 1 + t) % kernel_time;
+        frames[(size_t)t] = history.data() + slot * frame_size;
+    }
+
+    forward_frames(frames.data(), out_begin, out_end);
+
+    history_index = (history_index + 1) % kernel_time;
+}
+
+void Conv2d::forward_frames(const float *const *frames, int begin, int end) {
+    assert(streams == 1);
+
+    begin = std::max(begin, out_begin);
+    end = std::min(end, out_end);
+    if (begin >= end) {
+        return;
+    }
+
+    if (kernel == nullptr) {
+        forward_generic(frames, begin, end);
+        activate(outs.data() + (size_t)begin * channels_out,
+                 (end - begin) * channels_out);
+        return;
+    }
+
+    // Outputs whose kernel window doesn't need padding
+    const int interior_begin =
+        std::clamp((pad_left + stride - 1) / stride, begin, end);
+    const int interior_end =
+        std::clamp((num_in + pad_left - kernel_feature) / stride + 1,
+                   interior_begin, end);
+
+    forward_generic(frames, begin, interior_begin);
+    activate(outs.data() + (size_t)begin * channels_out,
+             (interior_begin - begin) * channels_out);
+
+    // ReLU is applied by the kernel
+    const bool relu = activation == Relu;
+    if (sparse_kernel != nullptr) {
+        sparse_kernel(frames, weight_values(), sparse_rows.data(),
+                      sparse_row_begin.data(), bias_values(), outs.data(),
+                      interior_begin, interior_end, pad_left, relu);
+    } else {
+        kernel(frames, weight_values(), bias_values(), outs.data(),
+               interior_begin, interior_end, pad_left, relu);
+    }
+    if (!relu) {
+        activate(outs.data() + (size_t)interior_begin * channels_out,
+                 (interior_end - interior_begin) * channels_out);
+    }
+
+    forward_generic(frames, interior_end, end);
+    activate(outs.data() + (size_t)interior_end * channels_out,
+             (end - interior_end) * channels_out);
+}
+
+void Conv2d::forward_generic(const float *const *frames, int begin, int end) {
+    for (int j = begin; j < end; j++) {
+        float *out = outs.data() + (size_t)j * channels_out;
+        std::copy(bias_values(), bias_values() + channels_out, out);
+
+        // Kernel window clipped to the input features
+        const int first_feature = j * stride - pad_left;
+        const int k_begin = std::max(0, -first_feature);
+        const int k_end = std::min(kernel_feature, num_in - first_feature);
+        const int num_values = (k_end - k_begin) * channels_in;
+
+        for (int t = 0; t < kernel_time; t++) {
+            const float *x =
+                frames[t] + (size_t)(first_feature + k_begin) * channels_in;
+            const float *w =
+                weight_values() +
+                ((size_t)(t * kernel_feature + k_begin) * channels_in) *
+                    channels_out;
+
+            if (channels_out == 1) {
+                float sum = 0.0f;
+                for (int m = 0; m < num_values; m++) {
+                    sum += x[m] * w[m];
+                }
+                out[0] += sum;
+            } else if (!sparse_rows.empty()) {
+                // Kept rows of this time step inside the clipped window
+                const int m_offset = k_begin * channels_in;
+                const auto *rows_begin = sparse_rows.data() +
+                                         sparse_row_begin[(size_t)t];
+                const auto *rows_end = sparse_rows.data() +
+                                       sparse_row_begin[(size_t)t + 1];
+                for (const auto *row = std::lower_bound(rows_begin, rows_end,
+                                                        m_offset);
+                     row != rows_end && *row < m_offset + num_values; row++) {
+                    const int m = *row - m_offset;
+                    const float value = x[m];
+                    const float *w_m = w + (size_t)m * channels_out;
+                    for (int c = 0; c < channels_out; c++) {
+                        out[c] += value * w_m[c];
+                    }
+                }
+            } else {
+                for (int m = 0; m < num_values; m++) {
+                    const float value = x[m];
+                    const float *w_m = w + (size_t)m * channels_out;
+                    for (int c = 0; c < channels_out; c++) {
+                        out[c] += value * w_m[c];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Conv2d::forward_streams() {
+    const size_t frame_size = (size_t)num_in * channels_in * streams;
+
+    for (int j = out_begin; j < out_end; j++) {
+        float *out = outs.data() + (size_t)j * channels_out * streams;
+        for (int c = 0; c < channels_out; c++) {
+            std::fill(out + c * streams, out + (c + 1) * streams,
+                      bias_values()[c]);
+        }
+
+        // Kernel window clipped to the input features
+        const int first_feature = j * stride - pad_left;
+        const int k_begin = std::max(0, -first_feature);
+        const int k_end = std::min(kernel_feature, num_in - first_feature);
+        const int num_values = (k_end - k_begin) * channels_in;
+
+        for (int t = 0; t < kernel_time; t++) {
+            // t = 0 is the oldest frame
+            const int slot = (history_index + 1 + t) % kernel_time;
+            const float *x =
+                history.data() + slot * frame_size +
+                (size_t)(first_feature + k_begin) * channels_in * streams;
+            const float *w =
+                weight_values() +
+                ((size_t)(t * kernel_feature + k_begin) * channels_in) *
+                    channels_out;
+
+            // Each weight is loaded once and applied to all streams.
+            for (int m = 0; m < num_values; m++) {
+                const float *x_m = x + (size_t)m * streams;
+                const float *w_m = w + (size_t)m * channels_out;
+                for (int c = 0; c < channels_out; c++) {
+                    const float weight = w_m[c];
+                    float *out_c = out + (size_t)c * streams;
+                    for (int s = 0; s < streams; s++) {
+                        out_c[s] += weight * x_m[s];
+                    }
+                }
+            }
+        }
+
+        activate(out, channels_out * streams);
+    }
+
+    history_index = (history_index + 1) % kernel_time;
+}
+
+void Conv2d::activate(float *values, int num_values) const {
+    switch (activation) {
+    case Relu:
+        for (int i = 0; i < num_values; i++) {
+            values[i] = std::max(values[i], 0.0f);
+        }
+        break;
+    case Sigmoid:
+        for (int i = 0; i < num_values; i++) {
+            values[i] = 1.0f / (1.0f + std::exp(-values[i]));
+        }
+        break;
+    case Linear:
+        break;
+    }
+}
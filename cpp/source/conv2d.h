@@ -0,0 +1,258 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+#include "conv2d_kernels.h"
+#include "state_io.h"
+
+/**
+ * Streaming 2D convolution on (time, feature) inputs with fused activation.
+ * Frames are processed one at a time, as RTNeural's Conv2DT does: the time
+ * axis is valid-padded (the last kernel_size_time input frames are kept) and
+ * the feature axis uses tensorflow's "same" padding. Memory layout is
+ * channels last: index = feature * num_channels + channel.
+ *
+ * The range of output features to compute can be restricted, in which case
+ * only the input features this range depends on are read.
+ *
+ * Single stream layers with the shape of a basic pitch layer run on a
+ * specialized kernel for the instruction sets of the CPU (see
+ * conv2d_kernels.h), others on a generic loop.
+ *
+ * Several independent streams can be run at once. Inputs, outputs and states
+ * are then interleaved, index = (feature * num_channels + channel) *
+ * num_streams + stream, and each weight is read once for all streams.
+ */
+class Conv2d {
+  public:
+    enum Activation { Linear = 0, Relu, Sigmoid };
+
+    static constexpr int max_kernel_time = 8;
+
+    /**
+     * Layer shape and activation. Fixed size fields: it is also the layer
+     * description of prepacked weight files (see cnn_weights.h).
+     */
+    struct Shape {
+        int32_t kernel_time;
+        int32_t kernel_feature;
+        int32_t stride;
+        int32_t channels_in;
+        int32_t channels_out;
+        int32_t num_features_in;
+        int32_t activation;
+    };
+
+    /**
+     * Load weights and shape from a conv2d layer of an RTNeural json model.
+     * Resets the layer and sets the output range to all output features.
+     * @param layer Json layer.
+     */
+    void load(const nlohmann::json &layer);
+
+    /**
+     * Load a layer whose weights are already in the layout of this class,
+     * e.g. from a memory mapped file. Weights are used in place, not copied:
+     * they must outlive the layer and its copies. Resets the layer and sets
+     * the output range to all output features.
+     * @param shape Layer shape.
+     * @param weights [kernel_time][kernel_feature][channels_in][channels_out]
+     * weights.
+     * @param bias channels_out biases.
+     */
+    void load(const Shape &shape, const float *weights, const float *bias);
+
+    /**
+     * Clear the input history and outputs.
+     */
+    void reset();
+
+    /**
+     * Write the input history, which is the state carried from frame to
+     * frame, along with the shape, output range and number of streams it
+     * depends on.
+     */
+    void save_state(StateWriter &writer) const;
+
+    /**
+     * Restore a state written by save_state.
+     * @return False if the blob is truncated or the layer settings differ
+     * from the saved ones. The history is then undefined until reset.
+     */
+    bool restore_state(StateReader &reader);
+
+    /**
+     * Prune the weights and switch to a block-sparse kernel (see
+     * SparseConv2dKernel). Weight rows whose values are all within tolerance
+     * times the largest weight magnitude of the layer are set to zero, and
+     * zero rows are then skipped. This is only done for layer shapes that
+     * have a block-sparse kernel and if at least min_sparse_fraction of the
+     * rows are zero, otherwise the weights are left as they are. Weights used
+     * in place are copied if a row changes.
+     * @param tolerance Relative tolerance. 0 only skips rows that are already
+     * zero, e.g. in a weight file pruned beforehand.
+     * @return Fraction of the weight rows that are skipped.
+     */
+    float prune(float tolerance);
+
+    // Sparse kernels skip rows in a loop with runtime bounds: below this
+    // fraction of zero rows, the dense kernel is faster.
+    static constexpr float min_sparse_fraction = 0.1f;
+
+    /**
+     * Use the specialized kernel for this layer shape if there is one
+     * (default), or the generic loop. Mostly for benchmarks.
+     * @param enabled True to use the specialized kernel.
+     */
+    void set_specialized_kernel(bool enabled);
+
+    /**
+     * Set the number of interleaved streams. Resets the layer.
+     * @param num_streams Number of streams, 1 by default.
+     */
+    void set_num_streams(int num_streams);
+
+    /**
+     * Clear the input history and outputs of a single stream.
+     * @param stream Stream index.
+     */
+    void reset_stream(int stream);
+
+    /**
+     * Restrict computation to output features [begin, end). Other outputs
+     * are 0. Resets the layer.
+     * @param begin First output feature.
+     * @param end Output feature past the last one.
+     */
+    void set_output_range(int begin, int end);
+
+    /**
+     * @param begin First output feature.
+     * @param end Output feature past the last one.
+     * @return Range [first, past last) of input features needed to compute
+     * output features [begin, end). Empty if the output range is.
+     */
+    [[nodiscard]] std::pair<int, int> input_range(int begin, int end) const;
+
+    /**
+     * Process one frame.
+     * @param in Input frame of num_features_in() * num_channels_in() *
+     * num_streams() elements. Only the input features needed by the output
+     * range are read.
+     */
+    void forward(const float *in);
+
+    /**
+     * Compute outputs [begin, end) of the current frame from an input history
+     * kept by the caller, e.g. shared by layers that read the same input. The
+     * layer's own history is not used nor updated. Single stream only.
+     * @param frames kernel_size_time() input frames, oldest first.
+     * @param begin First output feature. Clipped to the output range.
+     * @param end Output feature past the last one. Clipped to the output
+     * range.
+     */
+    void forward_frames(const float *const *frames, int begin, int end);
+
+    /**
+     * @return Output frame of num_features_out() * num_channels_out() *
+     * num_streams() elements.
+     */
+    [[nodiscard]] const float *outputs() const { return outs.data(); }
+
+    [[nodiscard]] int num_features_in() const { return num_in; }
+    [[nodiscard]] int num_features_out() const { return num_out; }
+    [[nodiscard]] int num_channels_in() const { return channels_in; }
+    [[nodiscard]] int num_channels_out() const { return channels_out; }
+    [[nodiscard]] int kernel_size_time() const { return kernel_time; }
+    [[nodiscard]] int num_streams() const { return streams; }
+
+    [[nodiscard]] Shape shape() const;
+
+    /**
+     * @return [kernel_time][kernel_feature][channels_in][channels_out]
+     * weights.
+     */
+    [[nodiscard]] const float *weight_values() const {
+        return external_weights != nullptr ? external_weights : weights.data();
+    }
+
+    /**
+     * @return channels_out biases.
+     */
+    [[nodiscard]] const float *bias_values() const {
+        return external_bias != nullptr ? external_bias : bias.data();
+    }
+
+  private:
+    /**
+     * Set the shape, derive padding and kernel from it. Resets the layer and
+     * sets the output range to all output features.
+     */
+    void set_shape(const Shape &shape);
+
+    /**
+     * Single stream forward without specialized kernel nor activation.
+     * @param frames kernel_time input frames, oldest first.
+     * @param begin First output feature.
+     * @param end Output feature past the last one.
+     */
+    void forward_generic(const float *const *frames, int begin, int end);
+
+    /**
+     * forward for more than one stream.
+     */
+    void forward_streams();
+
+    /**
+     * Apply activation in place.
+     * @param values Pre-activations.
+     * @param num_values Number of values.
+     */
+    void activate(float *values, int num_values) const;
+
+    int kernel_time = 1;
+    int kernel_feature = 1;
+    int stride = 1;
+    int channels_in = 1;
+    int channels_out = 1;
+    int num_in = 0;
+    int num_out = 0;
+    int pad_left = 0;
+    int streams = 1;
+    Activation activation = Linear;
+
+    bool use_specialized_kernel = true;
+    Conv2dKernel kernel = nullptr;
+
+    // Used instead of kernel after prune, if not nullptr. sparse_rows holds
+    // the indices of the kept weight rows, sparse_row_begin[t] the first one
+    // of time step t.
+    SparseConv2dKernel sparse_kernel = nullptr;
+    std::vector<uint16_t> sparse_rows;
+    std::array<int, max_kernel_time + 1> sparse_row_begin{};
+
+    // [kernel_time][kernel_feature][channels_in][channels_out]
+    std::vector<float> weights;
+    std::vector<float> bias;
+
+    // Weights used in place instead of the vectors above, if not nullptr.
+    const float *external_weights = nullptr;
+    const float *external_bias = nullptr;
+
+    // Last kernel_time input frames. history_index is the slot written by the
+    // next forward, that is the oldest frame.
+    std::vector<float> history;
+    int history_index = 0;
+
+    std::vector<float> outs;
+
+    int out_begin = 0;
+    int out_end = 0;
+    int in_begin = 0;
+    int in_end = 0;
+};
@@ -0,0 +1,72 @@
+#include "conv2d_kernels_impl.h"
+
+#include "cpu_features.h"
+
+Conv2dKernel find_conv2d_kernel_generic(int kernel_time, int kernel_feature,
+                                        int channels_in, int channels_out,
+                                        int stride) {
+    return find_kernel(kernel_time, kernel_feature, channels_in, channels_out,
+                       stride);
+}
+
+Conv2dKernel find_conv2d_kernel(int kernel_time, int kernel_feature,
+                                int channels_in, int channels_out,
+                                int stride) {
+    Conv2dKernel kernel = nullptr;
+
+    switch (cpu_level()) {
+    case CpuAvx512:
+        kernel = find_conv2d_kernel_avx512(kernel_time, kernel_feature,
+                                           channels_in, channels_out, stride);
+        if (kernel != nullptr) {
+            return kernel;
+        }
+        [[fallthrough]];
+    case CpuAvx2:
+        kernel = find_conv2d_kernel_avx2(kernel_time, kernel_feature,
+                                         channels_in, channels_out, stride);
+        if (kernel != nullptr) {
+            return kernel;
+        }
+        [[fallthrough]];
+    default:
+        return find_conv2d_kernel_generic(kernel_time, kernel_feature,
+                                          channels_in, channels_out, stride);
+    }
+}
+
+SparseConv2dKernel find_sparse_conv2d_kernel_generic(int kernel_time,
+                                                     int kernel_feature,
+                                                     int channels_in,
+                                                     int channels_out,
+                                                     int stride) {
+    return find_sparse_kernel(kernel_time, kernel_feature, channels_in,
+                              channels_out, stride);
+}
+
+SparseConv2dKernel find_sparse_conv2d_kernel(int kernel_time,
+                                             int kernel_feature,
+                                             int channels_in, int channels_out,
+                                             int stride) {
+    SparseConv2dKernel kernel = nullptr;
+
+    switch (cpu_level()) {
+    case CpuAvx512:
+        kernel = find_sparse_conv2d_kernel_avx512(
+            kernel_time, kernel_feature, channels_in, channels_out, stride);
+        if (kernel != nullptr) {
+            return kernel;
+        }
+        [[fallthrough]];
+    case CpuAvx2:
+        kernel = find_sparse_conv2d_kernel_avx2(
+            kernel_time, kernel_feature, channels_in, channels_out, stride);
+        if (kernel != nullptr) {
+            return kernel;
+        }
+        [[fallthrough]];
+    default:
+        return find_sparse_conv2d_kernel_generic(
+            kernel_time, kernel_feature, channels_in, channels_out, stride);
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Specialized direct convolution kernels (see conv2d_kernels_impl.h), built
+ * once per instruction set and picked at runtime from cpu_level().
+ *
+ * A kernel computes outputs [j_begin, j_end) of one frame, with ReLU applied
+ * if relu is true and no activation otherwise. The kernel window of these
+ * outputs must be inside the input features. frames holds the kernel_time
+ * input frames, oldest first.
+ */
+typedef void (*Conv2dKernel)(const float *const *frames, const float *weights,
+                             const float *bias, float *outs, int j_begin,
+                             int j_end, int pad_left, bool relu);
+
+/**
+ * Block-sparse version of Conv2dKernel, for layers pruned by Conv2d::prune.
+ * A weight row is the channels_out weights of one kernel tap and input
+ * channel, the unit the kernels vectorize over, and only the rows that are
+ * not all zero are computed: rows[row_begin[t]] to rows[row_begin[t + 1] - 1]
+ * are the indices (feature * channels_in + channel) of the rows kept for time
+ * step t, in increasing order. Weights keep their dense layout.
+ */
+typedef void (*SparseConv2dKernel)(const float *const *frames,
+                                   const float *weights, const uint16_t *rows,
+                                   const int *row_begin, const float *bias,
+                                   float *outs, int j_begin, int j_end,
+                                   int pad_left, bool relu);
+
+/**
+ * @return Specialized kernel for the given layer shape, for the best
+ * instruction set allowed by cpu_level(). nullptr if there is none.
+ */
+Conv2dKernel find_conv2d_kernel(int kernel_time, int kernel_feature,
+                                int channels_in, int channels_out, int stride);
+
+// Kernels of each instruction set. nullptr if there is none for the shape, or
+// if the library was built without that instruction set.
+Conv2dKernel find_conv2d_kernel_generic(int kernel_time, int kernel_feature,
+                                        int channels_in, int channels_out,
+                                        int stride);
+Conv2dKernel find_conv2d_kernel_avx2(int kernel_time, int kernel_feature,
+                                     int channels_in, int channels_out,
+                                     int stride);
+Conv2dKernel find_conv2d_kernel_avx512(int kernel_time, int kernel_feature,
+                                       int channels_in, int channels_out,
+                                       int stride);
+
+/**
+ * @return Block-sparse kernel for the given layer shape, for the best
+ * instruction set allowed by cpu_level(). nullptr if there is none.
+ */
+SparseConv2dKernel find_sparse_conv2d_kernel(int kernel_time,
+                                             int kernel_feature,
+                                             int channels_in, int channels_out,
+                                             int stride);
+
+SparseConv2dKernel find_sparse_conv2d_kernel_generic(int kernel_time,
+                                                     int kernel_feature,
+                                                     int channels_in,
+                                                     int channels_out,
+                                                     int stride);
+SparseConv2dKernel find_sparse_conv2d_kernel_avx2(int kernel_time,
+                                                  int kernel_feature,
+                                                  int channels_in,
+                                                  int channels_out,
+                                                  int stride);
+SparseConv2dKernel find_sparse_conv2d_kernel_avx512(int kernel_time,
+                                                    int kernel_feature,
+                                                    int channels_in,
+                                                    int channels_out,
+                                                    int stride);
@@ -0,0 +1,34 @@
+// Built with -mavx512f -mfma on x86 (see CMakeLists.txt).
+
+#include "conv2d_kernels.h"
+
+#if defined(__AVX512F__) && defined(__FMA__)
+
+#include "conv2d_kernels_impl.h"
+
+Conv2dKernel find_conv2d_kernel_avx512(int kernel_time, int kernel_feature,
+                                       int channels_in, int channels_out,
+                                       int stride) {
+    return find_kernel(kernel_time, kernel_feature, channels_in, channels_out,
+                       stride);
+}
+
+SparseConv2dKernel
+find_sparse_conv2d_kernel_avx512(int kernel_time, int kernel_feature,
+                                 int channels_in, int channels_out,
+                                 int stride) {
+    return find_sparse_kernel(kernel_time, kernel_feature, channels_in,
+                              channels_out, stride);
+}
+
+#else
+
+Conv2dKernel find_conv2d_kernel_avx512(int, int, int, int, int) {
+    return nullptr;
+}
+
+SparseConv2dKernel find_sparse_conv2d_kernel_avx512(int, int, int, int, int) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,454 @@
+#pragma once
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#else
+#include <algorithm>
+#endif
+
+#include "conv2d_kernels.h"
+
+/**
+ * Direct convolution kernels specialized for the layer shapes of the basic
+ * pitch CNN. Sizes are template parameters so all loops have compile-time
+ * bounds and strides, and accumulators are kept in registers.
+ *
+ * The instruction set is the one the compiler targets for the including
+ * translation unit: AVX-512 (-mavx512f), AVX2 (-mavx2 -mfma), NEON (arm64),
+ * or portable code the compiler can auto-vectorize otherwise. This header is
+ * included once per instruction set (see conv2d_kernels.h), so everything is
+ * in an anonymous namespace: each copy is local to its translation unit and
+ * the linker can't mix code built for different instruction sets. For the
+ * same reason, standard library functions are avoided in the vector paths.
+ *
+ * All kernels compute outputs [j_begin, j_end) of one frame, with ReLU
+ * applied if relu is true and no activation otherwise.
+ * The kernel window of these outputs must be inside the input features (no
+ * padding to handle). frames holds the kernel_time input frames, oldest
+ * first. Layout is channels last, as in Conv2d.
+ */
+
+namespace {
+
+/**
+ * 8 floats. One AVX register, two NEON registers.
+ */
+struct Float8 {
+    static constexpr int width = 8;
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+    __m256 v;
+
+    static Float8 load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static Float8 broadcast(float x) { return {_mm256_set1_ps(x)}; }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    /** @return a * b + c */
+    static Float8 fma(Float8 a, Float8 b, Float8 c) {
+        return {_mm256_fmadd_ps(a.v, b.v, c.v)};
+    }
+
+    static Float8 max(Float8 a, Float8 b) { return {_mm256_max_ps(a.v, b.v)}; }
+
+    [[nodiscard]] float sum() const {
+        const __m128 s =
+            _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        const __m128 s2 = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s2, _mm_shuffle_ps(s2, s2, 1)));
+    }
+#elif defined(__aarch64__)
+    float32x4_t lo, hi;
+
+    static Float8 load(const float *p) {
+        return {vld1q_f32(p), vld1q_f32(p + 4)};
+    }
+    static Float8 broadcast(float x) {
+        return {vdupq_n_f32(x), vdupq_n_f32(x)};
+    }
+    void store(float *p) const {
+        vst1q_f32(p, lo);
+        vst1q_f32(p + 4, hi);
+    }
+
+    /** @return a * b + c */
+    static Float8 fma(Float8 a, Float8 b, Float8 c) {
+        return {vfmaq_f32(c.lo, a.lo, b.lo), vfmaq_f32(c.hi, a.hi, b.hi)};
+    }
+
+    static Float8 max(Float8 a, Float8 b) {
+        return {vmaxq_f32(a.lo, b.lo), vmaxq_f32(a.hi, b.hi)};
+    }
+
+    [[nodiscard]] float sum() const { return vaddvq_f32(vaddq_f32(lo, hi)); }
+#else
+    float v[8];
+
+    static Float8 load(const float *p) {
+        Float8 r;
+        std::copy(p, p + 8, r.v);
+        return r;
+    }
+    static Float8 broadcast(float x) {
+        Float8 r;
+        std::fill(r.v, r.v + 8, x);
+        return r;
+    }
+    void store(float *p) const { std::copy(v, v + 8, p); }
+
+    /** @return a * b + c */
+    static Float8 fma(Float8 a, Float8 b, Float8 c) {
+        for (int i = 0; i < 8; i++) {
+            c.v[i] += a.v[i] * b.v[i];
+        }
+        return c;
+    }
+
+    static Float8 max(Float8 a, Float8 b) {
+        for (int i = 0; i < 8; i++) {
+            a.v[i] = (a.v[i] > b.v[i]) ? a.v[i] : b.v[i];
+        }
+        return a;
+    }
+
+    [[nodiscard]] float sum() const {
+        return ((v[0] + v[4]) + (v[1] + v[5])) +
+               ((v[2] + v[6]) + (v[3] + v[7]));
+    }
+#endif
+};
+
+/**
+ * 16 floats. One AVX-512 register, else two Float8.
+ */
+struct Float16 {
+    static constexpr int width = 16;
+
+#if defined(__AVX512F__)
+    __m512 v;
+
+    static Float16 load(const float *p) { return {_mm512_loadu_ps(p)}; }
+    static Float16 broadcast(float x) { return {_mm512_set1_ps(x)}; }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+    /** @return a * b + c */
+    static Float16 fma(Float16 a, Float16 b, Float16 c) {
+        return {_mm512_fmadd_ps(a.v, b.v, c.v)};
+    }
+
+    // Masked form, same instruction: the unmasked one merges into an
+    // undefined vector that GCC 12 reports as maybe uninitialized.
+    static Float16 max(Float16 a, Float16 b) {
+        return {_mm512_mask_max_ps(a.v, 0xffff, a.v, b.v)};
+    }
+#else
+    Float8 lo, hi;
+
+    static Float16 load(const float *p) {
+        return {Float8::load(p), Float8::load(p + 8)};
+    }
+    static Float16 broadcast(float x) {
+        const auto b = Float8::broadcast(x);
+        return {b, b};
+    }
+    void store(float *p) const {
+        lo.store(p);
+        hi.store(p + 8);
+    }
+
+    /** @return a * b + c */
+    static Float16 fma(Float16 a, Float16 b, Float16 c) {
+        return {Float8::fma(a.lo, b.lo, c.lo), Float8::fma(a.hi, b.hi, c.hi)};
+    }
+
+    static Float16 max(Float16 a, Float16 b) {
+        return {Float8::max(a.lo, b.lo), Float8::max(a.hi, b.hi)};
+    }
+#endif
+};
+
+/**
+ * Kernel for layers with a multiple of V::width output channels, e.g. the
+ * 3x39 contour harmonic conv. Output channels are held in registers for
+ * num_rows consecutive output features, so each weight vector is loaded once
+ * and used num_rows times.
+ */
+template <typename V, int KT, int KF, int CIN, int COUT, int STRIDE,
+          int num_rows>
+inline void conv2d_channels_rows(const float *const *frames,
+                                 const float *weights, const float *bias,
+                                 float *outs, int j, int pad_left,
+                                 bool relu) {
+    static_assert(COUT % V::width == 0, "COUT must be a multiple of width");
+    constexpr int num_vectors = COUT / V::width;
+
+    V acc[num_rows][num_vectors];
+    for (int n = 0; n < num_vectors; n++) {
+        const auto b = V::load(bias + n * V::width);
+        for (int r = 0; r < num_rows; r++) {
+            acc[r][n] = b;
+        }
+    }
+
+    for (int t = 0; t < KT; t++) {
+        const float *x = frames[t] + (j * STRIDE - pad_left) * CIN;
+        const float *w_t = weights + t * KF * CIN * COUT;
+
+        for (int m = 0; m < KF * CIN; m++) {
+            V w[num_vectors];
+            for (int n = 0; n < num_vectors; n++) {
+                w[n] = V::load(w_t + m * COUT + n * V::width);
+            }
+            for (int r = 0; r < num_rows; r++) {
+                const auto value = V::broadcast(x[r * STRIDE * CIN + m]);
+                for (int n = 0; n < num_vectors; n++) {
+                    acc[r][n] = V::fma(value, w[n], acc[r][n]);
+                }
+            }
+        }
+    }
+
+    if (relu) {
+        const auto zero = V::broadcast(0.0f);
+        for (int r = 0; r < num_rows; r++) {
+            for (int n = 0; n < num_vectors; n++) {
+                acc[r][n] = V::max(acc[r][n], zero);
+            }
+        }
+    }
+
+    for (int r = 0; r < num_rows; r++) {
+        for (int n = 0; n < num_vectors; n++) {
+            acc[r][n].store(outs + (j + r) * COUT + n * V::width);
+        }
+    }
+}
+
+template <typename V, int KT, int KF, int CIN, int COUT, int STRIDE>
+void conv2d_channels_kernel(const float *const *frames, const float *weights,
+                            const float *bias, float *outs, int j_begin,
+                            int j_end, int pad_left, bool relu) {
+    // Keep about 4 vectors of 16 floats of accumulators
+    constexpr int num_rows = (COUT < 64) ? 64 / COUT : 1;
+
+    int j = j_begin;
+    for (; j + num_rows <= j_end; j += num_rows) {
+        conv2d_channels_rows<V, KT, KF, CIN, COUT, STRIDE, num_rows>(
+            frames, weights, bias, outs, j, pad_left, relu);
+    }
+    for (; j < j_end; j++) {
+        conv2d_channels_rows<V, KT, KF, CIN, COUT, STRIDE, 1>(
+            frames, weights, bias, outs, j, pad_left, relu);
+    }
+}
+
+/**
+ * Block-sparse conv2d_channels_rows: only the weight rows listed in rows are
+ * read (see SparseConv2dKernel).
+ */
+template <typename V, int KT, int CIN, int COUT, int STRIDE, int num_rows>
+inline void conv2d_sparse_channels_rows(const float *const *frames,
+                                        const float *weights,
+                                        const uint16_t *rows,
+                                        const int *row_begin,
+                                        const float *bias, float *outs, int j,
+                                        int pad_left, int kernel_window,
+                                        bool relu) {
+    static_assert(COUT % V::width == 0, "COUT must be a multiple of width");
+    constexpr int num_vectors = COUT / V::width;
+
+    V acc[num_rows][num_vectors];
+    for (int n = 0; n < num_vectors; n++) {
+        const auto b = V::load(bias + n * V::width);
+        for (int r = 0; r < num_rows; r++) {
+            acc[r][n] = b;
+        }
+    }
+
+    for (int t = 0; t < KT; t++) {
+        const float *x = frames[t] + (j * STRIDE - pad_left) * CIN;
+        const float *w_t = weights + t * kernel_window * COUT;
+
+        for (int i = row_begin[t]; i < row_begin[t + 1]; i++) {
+            const int m = rows[i];
+            V w[num_vectors];
+            for (int n = 0; n < num_vectors; n++) {
+                w[n] = V::load(w_t + m * COUT + n * V::width);
+            }
+            for (int r = 0; r < num_rows; r++) {
+                const auto value = V::broadcast(x[r * STRIDE * CIN + m]);
+                for (int n = 0; n < num_vectors; n++) {
+                    acc[r][n] = V::fma(value, w[n], acc[r][n]);
+                }
+            }
+        }
+    }
+
+    if (relu) {
+        const auto zero = V::broadcast(0.0f);
+        for (int r = 0; r < num_rows; r++) {
+            for (int n = 0; n < num_vectors; n++) {
+                acc[r][n] = V::max(acc[r][n], zero);
+            }
+        }
+    }
+
+    for (int r = 0; r < num_rows; r++) {
+        for (int n = 0; n < num_vectors; n++) {
+            acc[r][n].store(outs + (j + r) * COUT + n * V::width);
+        }
+    }
+}
+
+template <typename V, int KT, int KF, int CIN, int COUT, int STRIDE>
+void conv2d_sparse_channels_kernel(const float *const *frames,
+                                   const float *weights, const uint16_t *rows,
+                                   const int *row_begin, const float *bias,
+                                   float *outs, int j_begin, int j_end,
+                                   int pad_left, bool relu) {
+    constexpr int num_rows = (COUT < 64) ? 64 / COUT : 1;
+
+    int j = j_begin;
+    for (; j + num_rows <= j_end; j += num_rows) {
+        conv2d_sparse_channels_rows<V, KT, CIN, COUT, STRIDE, num_rows>(
+            frames, weights, rows, row_begin, bias, outs, j, pad_left,
+            KF * CIN, relu);
+    }
+    for (; j < j_end; j++) {
+        conv2d_sparse_channels_rows<V, KT, CIN, COUT, STRIDE, 1>(
+            frames, weights, rows, row_begin, bias, outs, j, pad_left,
+            KF * CIN, relu);
+    }
+}
+
+/**
+ * Kernel for layers with a single output channel, e.g. the 5x5 contour conv.
+ * The kernel window of one time step is contiguous in memory: each output is
+ * a dot product, computed for num_rows outputs at once.
+ */
+template <int KT, int KF, int CIN, int STRIDE, int num_rows>
+inline void conv2d_dot_rows(const float *const *frames, const float *weights,
+                            const float *bias, float *outs, int j,
+                            int pad_left, bool relu) {
+    constexpr int window = KF * CIN;
+    constexpr int num_vectors = window / Float8::width;
+
+    Float8 acc[num_rows];
+    float tail[num_rows] = {};
+    for (int r = 0; r < num_rows; r++) {
+        acc[r] = Float8::broadcast(0.0f);
+    }
+
+    for (int t = 0; t < KT; t++) {
+        const float *x = frames[t] + (j * STRIDE - pad_left) * CIN;
+        const float *w_t = weights + t * window;
+
+        for (int n = 0; n < num_vectors; n++) {
+            const auto w = Float8::load(w_t + n * Float8::width);
+            for (int r = 0; r < num_rows; r++) {
+                acc[r] = Float8::fma(
+                    Float8::load(x + r * STRIDE * CIN + n * Float8::width), w,
+                    acc[r]);
+            }
+        }
+        for (int m = num_vectors * Float8::width; m < window; m++) {
+            for (int r = 0; r < num_rows; r++) {
+                tail[r] += x[r * STRIDE * CIN + m] * w_t[m];
+            }
+        }
+    }
+
+    for (int r = 0; r < num_rows; r++) {
+        const float out = bias[0] + acc[r].sum() + tail[r];
+        outs[j + r] = (relu && out < 0.0f) ? 0.0f : out;
+    }
+}
+
+template <int KT, int KF, int CIN, int STRIDE>
+void conv2d_dot_kernel(const float *const *frames, const float *weights,
+                       const float *bias, float *outs, int j_begin, int j_end,
+                       int pad_left, bool relu) {
+    constexpr int num_rows = 4;
+
+    int j = j_begin;
+    for (; j + num_rows <= j_end; j += num_rows) {
+        conv2d_dot_rows<KT, KF, CIN, STRIDE, num_rows>(
+            frames, weights, bias, outs, j, pad_left, relu);
+    }
+    for (; j < j_end; j++) {
+        conv2d_dot_rows<KT, KF, CIN, STRIDE, 1>(frames, weights, bias, outs,
+                                                j, pad_left, relu);
+    }
+}
+
+/**
+ * @return Kernel of this translation unit for the given layer shape, nullptr
+ * if there is none.
+ */
+Conv2dKernel find_kernel(int kernel_time, int kernel_feature, int channels_in,
+                         int channels_out, int stride) {
+    struct Entry {
+        int kernel_time, kernel_feature, channels_in, channels_out, stride;
+        Conv2dKernel kernel;
+    };
+
+    static const Entry kernels[] = {
+        // Contour model
+        {3, 39, 8, 8, 1, conv2d_channels_kernel<Float8, 3, 39, 8, 8, 1>},
+        {5, 5, 8, 1, 1, conv2d_dot_kernel<5, 5, 8, 1>},
+        // Note model
+        {7, 7, 1, 32, 3, conv2d_channels_kernel<Float16, 7, 7, 1, 32, 3>},
+        {7, 3, 32, 1, 1, conv2d_dot_kernel<7, 3, 32, 1>},
+        // Onset models
+        {5, 5, 8, 32, 3, conv2d_channels_kernel<Float16, 5, 5, 8, 32, 3>},
+        {3, 3, 33, 1, 1, conv2d_dot_kernel<3, 3, 33, 1>},
+    };
+
+    for (const auto &entry : kernels) {
+        if (entry.kernel_time == kernel_time &&
+            entry.kernel_feature == kernel_feature &&
+            entry.channels_in == channels_in &&
+            entry.channels_out == channels_out && entry.stride == stride) {
+            return entry.kernel;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * @return Block-sparse kernel of this translation unit for the given layer
+ * shape, nullptr if there is none. Only layers with several output channels
+ * have one: for a single output channel, a row is a single weight.
+ */
+SparseConv2dKernel find_sparse_kernel(int kernel_time, int kernel_feature,
+                                      int channels_in, int channels_out,
+                                      int stride) {
+    struct Entry {
+        int kernel_time, kernel_feature, channels_in, channels_out, stride;
+        SparseConv2dKernel kernel;
+    };
+
+    static const Entry kernels[] = {
+        {3, 39, 8, 8, 1,
+         conv2d_sparse_channels_kernel<Float8, 3, 39, 8, 8, 1>},
+        {7, 7, 1, 32, 3,
+         conv2d_sparse_channels_kernel<Float16, 7, 7, 1, 32, 3>},
+        {5, 5, 8, 32, 3,
+         conv2d_sparse_channels_kernel<Float16, 5, 5, 8, 32, 3>},
+    };
+
+    for (const auto &entry : kernels) {
+        if (entry.kernel_time == kernel_time &&
+            entry.kernel_feature == kernel_feature &&
+            entry.channels_in == channels_in &&
+            entry.channels_out == channels_out && entry.stride == stride) {
+            return entry.kernel;
+        }
+    }
+
+    return nullptr;
+}
+
+} // namespace
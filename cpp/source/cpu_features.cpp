@@ -0,0 +1,71 @@
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+static std::atomic<int> cpu_level_override{-1};
+
+static CpuLevel detect() {
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+    // Also checks that the OS saves the AVX registers.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma")) {
+        return CpuAvx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return CpuAvx2;
+    }
+#endif
+    return CpuGeneric;
+}
+
+static int environment_cpu_level() {
+    const char *value = std::getenv("NEURAL_PITCH_CPU_LEVEL");
+    if (value == nullptr) {
+        return -1;
+    }
+
+    for (int level = 0; level < NumCpuLevels; level++) {
+        if (std::strcmp(value, cpu_level_name((CpuLevel)level)) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+CpuLevel detected_cpu_level() {
+    static const CpuLevel level = detect();
+    return level;
+}
+
+CpuLevel cpu_level() {
+    static const int environment_level = environment_cpu_level();
+
+    int level = cpu_level_override.load();
+    if (level < 0) {
+        level = environment_level;
+    }
+
+    if (level < 0) {
+        return detected_cpu_level();
+    }
+    return (CpuLevel)std::min(level, (int)detected_cpu_level());
+}
+
+void set_cpu_level(int level) {
+    cpu_level_override.store(std::clamp(level, -1, NumCpuLevels - 1));
+}
+
+const char *cpu_level_name(CpuLevel level) {
+    switch (level) {
+    case CpuAvx2:
+        return "avx2";
+    case CpuAvx512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
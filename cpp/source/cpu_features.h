@@ -0,0 +1,35 @@
+#pragma once
+
+/**
+ * Instruction sets the CNN kernels are built for, from lowest to highest.
+ * Generic is the baseline of the target: SSE2 on x86-64, NEON on arm64.
+ */
+enum CpuLevel { CpuGeneric = 0, CpuAvx2, CpuAvx512, NumCpuLevels };
+
+/**
+ * @return Highest level supported by the CPU running this process.
+ */
+CpuLevel detected_cpu_level();
+
+/**
+ * Level the kernels are picked for: the detected level, unless lowered by
+ * set_cpu_level() or by the NEURAL_PITCH_CPU_LEVEL environment variable
+ * (generic, avx2 or avx512), e.g. to A/B test instruction sets on one machine.
+ * An override is never raised above the detected level.
+ * @return CPU level.
+ */
+CpuLevel cpu_level();
+
+/**
+ * Override the CPU level. Takes precedence over the environment variable and
+ * applies to models loaded afterwards.
+ * @param level CPU level, or -1 to go back to the environment variable or
+ * detected level.
+ */
+void set_cpu_level(int level);
+
+/**
+ * @param level CPU level.
+ * @return Name of the level, as in NEURAL_PITCH_CPU_LEVEL.
+ */
+const char *cpu_level_name(CpuLevel level);
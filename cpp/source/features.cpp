@@ -2,13 +2,72 @@
 #include "features.h"
 #include "constants.h"
 
-Features::Features(BinaryBlob features_model_ort)
+#include <cmath>
+#include <onnxruntime_session_options_config_keys.h>
+#include <random>
+
+#include "trace.h"
+
+/**
+ * Session options of the features models: single threaded, as the CNN runs
+ * after the features anyway.
+ */
+static Ort::SessionOptions make_session_options(bool use_model_bytes_in_place) {
+    Ort::SessionOptions options;
+    options.SetInterOpNumThreads(1);
+    options.SetIntraOpNumThreads(1);
+
+    if (use_model_bytes_in_place) {
+        options.AddConfigEntry(kOrtSessionOptionsConfigUseORTModelBytesDirectly,
+                               "1");
+        options.AddConfigEntry(
+            kOrtSessionOptionsConfigUseORTModelBytesForInitializers, "1");
+    }
+    return options;
+}
+
+/**
+ * @return Audio the optimized features models are checked on: 3 seconds of
+ * tones with harmonics, a chord and noise, same on every platform.
+ */
+static std::vector<float> equivalence_test_signal() {
+    constexpr double two_pi = 6.283185307179586;
+    constexpr size_t num_samples = 3 * AUDIO_SAMPLE_RATE;
+    constexpr size_t note_num_samples = AUDIO_SAMPLE_RATE / 4;
+
+    std::vector<float> audio(num_samples, 0.0f);
+    for (size_t i = 0; i < num_samples; i++) {
+        // A note every quarter second over 4 octaves, with a chord below.
+        const double t = static_cast<double>(i) / AUDIO_SAMPLE_RATE;
+        const auto note = static_cast<double>(36 + (i / note_num_samples) * 4);
+        const double frequency = 440.0 * std::pow(2.0, (note - 69.0) / 12.0);
+        for (int harmonic = 1; harmonic <= 3; harmonic++) {
+            audio[i] += static_cast<float>(
+                0.3 / harmonic * std::sin(two_pi * frequency * harmonic * t));
+        }
+        for (double chord_hz : {130.81, 164.81, 196.0}) {
+            audio[i] +=
+                static_cast<float>(0.1 * std::sin(two_pi * chord_hz * t));
+        }
+    }
+
+    // Raw engine output, not a distribution: the same on every platform.
+    std::minstd_rand rng(1);
+    for (auto &x : audio) {
+        x += 0.02f * (static_cast<float>(rng() - rng.min()) /
+                          static_cast<float>(rng.max() - rng.min()) -
+                      0.5f);
+    }
+    return audio;
+}
+
+Features::Features(BinaryBlob features_model_ort,
+                   bool use_model_bytes_in_place)
     : memory_info(nullptr), session(nullptr) {
 
     memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
 
-    session_options.SetInterOpNumThreads(1);
-    session_options.SetIntraOpNumThreads(1);
+    session_options = make_session_options(use_model_bytes_in_place);
 
     session = Ort::Session(env, features_model_ort.data,
                            features_model_ort.num_bytes, session_options);
@@ -16,6 +75,75 @@ Features::Features(BinaryBlob features_model_ort)
 
 const float *Features::compute_features(float *in_audio, size_t in_num_samples,
                                         size_t &out_num_frames) {
+    TraceScope trace_scope("Features::compute_features");
+
+    const float *stacked_cqt =
+        run(session, in_audio, in_num_samples, out_num_frames);
+    assert(stacked_cqt != nullptr);
+
+    return stacked_cqt;
+}
+
+void Features::release_features() { output.clear(); }
+
+bool Features::use_optimized_model(BinaryBlob model_ort, float tolerance,
+                                   bool use_model_bytes_in_place,
+                                   float *out_max_difference) {
+    auto audio = equivalence_test_signal();
+    static constexpr size_t frame_size = NUM_HARMONICS * NUM_FREQ_IN;
+
+    size_t num_frames = 0;
+    const float *reference_features =
+        run(session, audio.data(), audio.size(), num_frames);
+    const std::vector<float> expected(
+        reference_features, reference_features + num_frames * frame_size);
+    release_features();
+
+    Ort::Session candidate(nullptr);
+    float max_difference = INFINITY;
+    bool failed = false;
+    // ONNX Runtime throws if the variant can't be loaded or run, e.g. a
+    // corrupt file or operators it doesn't have.
+    try {
+        auto options = make_session_options(use_model_bytes_in_place);
+        options.SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+        candidate =
+            Ort::Session(env, model_ort.data, model_ort.num_bytes, options);
+
+        size_t candidate_num_frames = 0;
+        const float *candidate_features =
+            run(candidate, audio.data(), audio.size(), candidate_num_frames);
+        if (candidate_features != nullptr &&
+            candidate_num_frames == num_frames) {
+            max_difference = 0.0f;
+            for (size_t i = 0; i < expected.size(); i++) {
+                // NaN compares false: count it as out of tolerance.
+                const float diff =
+                    std::abs(candidate_features[i] - expected[i]);
+                max_difference =
+                    diff <= max_difference ? max_difference : diff;
+            }
+        }
+    } catch (const Ort::Exception &) {
+        input.clear();
+        max_difference = INFINITY;
+        failed = true;
+    }
+    release_features();
+
+    if (out_max_difference != nullptr) {
+        *out_max_difference = max_difference;
+    }
+    if (failed || !(max_difference <= tolerance)) {
+        return false;
+    }
+
+    session = std::move(candidate);
+    return true;
+}
+
+const float *Features::run(Ort::Session &model, float *in_audio,
+                           size_t in_num_samples, size_t &out_num_frames) {
     input_shape[0] = 1;
     input_shape[1] = static_cast<int64_t>(in_num_samples);
     input_shape[2] = 1;
@@ -26,16 +154,126 @@ const float *Features::compute_features(float *in_audio, size_t in_num_samples,
         input_shape.size()));
 
     output =
-        session.Run(run_options, input_names, input.data(), 1, output_names, 1);
+        model.Run(run_options, input_names, input.data(), 1, output_names, 1);
 
-    const auto out_shape = output[0].GetTensorTypeAndShapeInfo().GetShape();
+    input.clear();
 
-    assert(out_shape[0] == 1 && out_shape[2] == NUM_FREQ_IN &&
-           out_shape[3] == NUM_HARMONICS);
+    const auto out_shape = output[0].GetTensorTypeAndShapeInfo().GetShape();
+    if (out_shape.size() != 4 || out_shape[0] != 1 ||
+        out_shape[2] != NUM_FREQ_IN || out_shape[3] != NUM_HARMONICS ||
+        output[0].GetTensorTypeAndShapeInfo().GetElementType() !=
+            ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+        out_num_frames = 0;
+        return nullptr;
+    }
 
     out_num_frames = static_cast<size_t>(out_shape[1]);
+    return output[0].GetTensorData<float>();
+}
 
-    input.clear();
+FeatureStream::FeatureStream(Features &features) : features(features) {}
 
-    return output[0].GetTensorData<float>();
+void FeatureStream::reset() {
+    audio_buffer.clear();
+    next_window_index = 0;
+    next_frame_index = 0;
+    num_samples_pushed = 0;
+}
+
+void FeatureStream::push_audio(const float *audio, size_t num_samples) {
+    audio_buffer.insert(audio_buffer.end(), audio, audio + num_samples);
+    num_samples_pushed += num_samples;
+}
+
+void FeatureStream::save_state(StateWriter &writer) const {
+    writer.write<uint64_t>(next_window_index);
+    writer.write<uint64_t>(next_frame_index);
+    writer.write<uint64_t>(num_samples_pushed);
+    writer.write_vector(audio_buffer);
+}
+
+bool FeatureStream::restore_state(StateReader &reader) {
+    uint64_t window_index = 0;
+    uint64_t frame_index = 0;
+    uint64_t samples_pushed = 0;
+    reader.read(window_index);
+    reader.read(frame_index);
+    reader.read(samples_pushed);
+    reader.read_vector(audio_buffer);
+
+    if (!reader.ok() || audio_buffer.size() > samples_pushed) {
+        reset();
+        return reader.fail();
+    }
+
+    next_window_index = window_index;
+    next_frame_index = frame_index;
+    num_samples_pushed = samples_pushed;
+    return true;
+}
+
+size_t FeatureStream::compute_frames(bool flush,
+                                     std::vector<float> &out_frames) {
+    static constexpr size_t frame_size = NUM_HARMONICS * NUM_FREQ_IN;
+    static constexpr size_t hop_num_samples = hop_num_frames * FFT_HOP;
+    static constexpr size_t keep_end_centre =
+        num_overlap_frames / 2 + hop_num_frames;
+
+    // Same number of frames as the features model gives for the whole signal.
+    const size_t total_num_frames =
+        num_samples_pushed > 0 ? num_samples_pushed / FFT_HOP + 1 : 0;
+
+    size_t num_new_frames = 0;
+
+    while (true) {
+        const bool is_last_window = audio_buffer.size() <= window_num_samples;
+
+        if (flush ? next_frame_index >= total_num_frames
+                  : audio_buffer.size() < window_num_samples) {
+            break;
+        }
+
+        const size_t window_first_frame = next_window_index * hop_num_frames;
+
+        // The last window is padded with zeros to a full window, as Basic
+        // Pitch does: the features model fails on very short audio.
+        float *window_audio = audio_buffer.data();
+        if (audio_buffer.size() < window_num_samples) {
+            padded_window.assign(window_num_samples, 0.0f);
+            std::copy(audio_buffer.begin(), audio_buffer.end(),
+                      padded_window.begin());
+            window_audio = padded_window.data();
+        }
+
+        size_t num_window_frames = 0;
+        const float *window_features = features.compute_features(
+            window_audio, window_num_samples, num_window_frames);
+
+        // Keep the centre of the window, or everything left at the end of the
+        // stream. The first window keeps its start since there is no earlier
+        // window to take it from.
+        const size_t keep_begin = next_frame_index - window_first_frame;
+        const size_t keep_end = std::min(
+            (flush && is_last_window) ? total_num_frames - window_first_frame
+                                      : keep_end_centre,
+            num_window_frames);
+
+        if (keep_end > keep_begin) {
+            out_frames.insert(out_frames.end(),
+                              window_features + keep_begin * frame_size,
+                              window_features + keep_end * frame_size);
+            num_new_frames += keep_end - keep_begin;
+            next_frame_index = window_first_frame + keep_end;
+        }
+
+        if (flush && is_last_window) {
+            break;
+        }
+
+        audio_buffer.erase(audio_buffer.begin(),
+                           audio_buffer.begin() + (long)hop_num_samples);
+        next_window_index++;
+    }
+
+    return num_new_frames;
 }
@@ -3,12 +3,21 @@
 
 #include <cassert>
 #include <onnxruntime_cxx_api.h>
+#include <vector>
 
 #include "constants.h"
+#include "state_io.h"
 
 class Features {
   public:
-    explicit Features(BinaryBlob features_model_ort);
+    /**
+     * @param features_model_ort Features model in ORT format.
+     * @param use_model_bytes_in_place If true, ONNX Runtime uses the model
+     * bytes and initializers in place instead of copying them, e.g. for a
+     * memory mapped model. The bytes must then outlive Features.
+     */
+    explicit Features(BinaryBlob features_model_ort,
+                      bool use_model_bytes_in_place = false);
 
     ~Features() = default;
 
@@ -22,7 +31,45 @@ class Features {
     const float *compute_features(float *in_audio, size_t in_num_samples,
                                   size_t &out_num_frames);
 
+    /**
+     * Free the features returned by the latest compute_features.
+     */
+    void release_features();
+
+    /**
+     * Switch to an optimized variant of the features model, graph optimized
+     * and possibly float16 or int8 quantized, see
+     * tools/optimize_features_model.cpp. The variant is only used if its
+     * features on a test signal are within tolerance of those of the current
+     * model. Graph optimizations are not rerun when it is loaded.
+     * @param model_ort Model in ORT format, same input and output as the
+     * reference model.
+     * @param tolerance Maximum absolute difference of the features, which
+     * are in [0, 1].
+     * @param use_model_bytes_in_place See the constructor.
+     * @param out_max_difference If not nullptr, set to the difference
+     * measured, infinity if the shapes differ or the variant can't be loaded
+     * or run.
+     * @return True if the variant is used from now on, false if it is out of
+     * tolerance or ONNX Runtime fails on it. The current model is then kept.
+     */
+    bool use_optimized_model(
+        BinaryBlob model_ort,
+        float tolerance = default_optimized_model_tolerance,
+        bool use_model_bytes_in_place = false,
+        float *out_max_difference = nullptr);
+
+    static constexpr float default_optimized_model_tolerance = 1e-3f;
+
   private:
+    /**
+     * Run a features model.
+     * @return Pointer to features, valid until the next run, or nullptr if
+     * the output shape is not the expected one.
+     */
+    const float *run(Ort::Session &model, float *in_audio,
+                     size_t in_num_samples, size_t &out_num_frames);
+
     // ONNX Runtime Data
     std::vector<Ort::Value> input;
     std::vector<Ort::Value> output;
@@ -40,3 +87,74 @@ class Features {
     Ort::Session session;
     Ort::RunOptions run_options;
 };
+
+/**
+ * Computes features incrementally for an audio stream that grows over time.
+ * The features model normalizes over its whole input, so the stream is cut in
+ * overlapping windows like Basic Pitch does for long files, and only the
+ * centre frames of each window are kept.
+ */
+class FeatureStream {
+  public:
+    explicit FeatureStream(Features &features);
+
+    /**
+     * Forget all pushed audio and start a new stream.
+     */
+    void reset();
+
+    /**
+     * Append audio to the stream.
+     * @param audio Audio at 22050 Hz.
+     * @param num_samples Number of samples in audio.
+     */
+    void push_audio(const float *audio, size_t num_samples);
+
+    /**
+     * Compute all frames whose window is complete and append them to
+     * out_frames (NUM_HARMONICS * NUM_FREQ_IN floats per frame).
+     * @param flush If true, the stream is considered finished and all
+     * remaining frames are computed.
+     * @param out_frames Vector to append frames to.
+     * @return Number of frames appended.
+     */
+    size_t compute_frames(bool flush, std::vector<float> &out_frames);
+
+    /**
+     * Write the audio not consumed yet and the stream position.
+     */
+    void save_state(StateWriter &writer) const;
+
+    /**
+     * Restore a state written by save_state.
+     * @return False if the blob is truncated or inconsistent. The stream is
+     * then reset.
+     */
+    bool restore_state(StateReader &reader);
+
+    /**
+     * @return Number of frames computed since reset.
+     */
+    [[nodiscard]] size_t num_frames_computed() const {
+        return next_frame_index;
+    }
+
+    // 2 seconds window (as in Basic Pitch) rounded down to a whole number of
+    // hops, with 30 overlapping frames between consecutive windows.
+    static constexpr int window_num_hops =
+        (AUDIO_SAMPLE_RATE * AUDIO_WINDOW_LENGTH - FFT_HOP) / FFT_HOP;
+    static constexpr int window_num_samples = window_num_hops * FFT_HOP;
+    static constexpr int num_overlap_frames = 30;
+    static constexpr int hop_num_frames = window_num_hops - num_overlap_frames;
+
+  private:
+    Features &features;
+
+    // Audio starting at the first sample of the next window to compute.
+    std::vector<float> audio_buffer;
+    // Last window of a flushed stream, padded with zeros.
+    std::vector<float> padded_window;
+    size_t next_window_index = 0;
+    size_t next_frame_index = 0;
+    size_t num_samples_pushed = 0;
+};
@@ -1,7 +1,13 @@
 
 
+#include "cpu_features.h"
 #include "neural_pitch.h"
 #include "pitch_detector.h"
+#include "trace.h"
+#include "transcription_job.h"
+
+#include <algorithm>
+#include <cstring>
 
 extern "C" {
 
@@ -29,17 +35,24 @@ PitchDetector *pitch_detector_create(ModelFiles model_files) {
     return new PitchDetector(convert_mf_types(model_files));
 }
 
+PitchDetector *pitch_detector_create_from_files(const char *features_model_path,
+                                                const char *cnn_weights_path) {
+    return PitchDetector::from_files(features_model_path, cnn_weights_path)
+        .release();
+}
+
 void pitch_detector_reset(PitchDetector *detector) { detector->reset(); }
 
-void pitch_detector_transcribe_to_midi(PitchDetector *detector, float *audio,
-                                       int num_samples) {
-    detector->transcribe_to_midi(audio, num_samples);
+int pitch_detector_transcribe_to_midi(PitchDetector *detector, float *audio,
+                                      int num_samples) {
+    return detector->transcribe_to_midi(audio, num_samples) !=
+           TranscriptionRejected;
 }
 
 void pitch_detector_get_note_events(PitchDetector *detector,
                                     NoteEvent **out_events,
                                     int *out_num_events) {
-    auto &events = detector->latest_note_events();
+    auto &events = detector->latest_compact_note_events().events;
     auto *target_buffer = new NoteEvent[events.size()];
     for (auto i = 0; i < events.size(); ++i) {
         auto &event = events[i];
@@ -63,4 +76,178 @@ void pitch_detector_set_parameters(PitchDetector *detector,
 }
 
 void pitch_detector_destroy(PitchDetector *detector) { delete detector; }
+
+void pitch_detector_set_pitch_bend(PitchDetector *detector, int pitch_bend) {
+    detector->set_pitch_bend(static_cast<PitchBendModes>(pitch_bend));
+}
+
+void pitch_detector_set_frequency_range(PitchDetector *detector,
+                                        float min_frequency,
+                                        float max_frequency) {
+    detector->set_frequency_range(min_frequency, max_frequency);
+}
+
+void pitch_detector_set_silence_gate(PitchDetector *detector,
+                                     float threshold) {
+    detector->set_silence_gate(threshold);
+}
+
+int pitch_detector_get_num_skipped_frames(PitchDetector *detector) {
+    return static_cast<int>(detector->num_skipped_frames());
+}
+
+float pitch_detector_prune_cnn_weights(PitchDetector *detector,
+                                       float tolerance) {
+    return detector->prune_cnn_weights(tolerance);
+}
+
+void pitch_detector_set_num_note_threads(PitchDetector *detector,
+                                         int num_threads) {
+    detector->set_num_note_threads(num_threads);
+}
+
+void pitch_detector_set_posteriorgram_precision(PitchDetector *detector,
+                                                int precision) {
+    detector->set_posteriorgram_precision(
+        static_cast<PosteriorgramPrecision>(precision));
+}
+
+void pitch_detector_set_segmented_features(PitchDetector *detector,
+                                           int segmented) {
+    detector->set_segmented_features(segmented != 0);
+}
+
+void pitch_detector_set_memory_limit(PitchDetector *detector,
+                                     long long max_bytes) {
+    detector->set_memory_limit(static_cast<size_t>(std::max(max_bytes, 0LL)));
+}
+
+long long pitch_detector_estimate_memory(PitchDetector *detector,
+                                         int num_samples) {
+    return static_cast<long long>(
+        detector
+            ->estimate_memory(static_cast<size_t>(std::max(num_samples, 0)))
+            .peak_bytes);
+}
+
+void pitch_detector_set_posteriorgram_cache_size(PitchDetector *detector,
+                                                 long long max_bytes) {
+    detector->set_posteriorgram_cache(
+        max_bytes > 0 ? std::make_shared<PosteriorgramCache>(
+                            static_cast<size_t>(max_bytes))
+                      : nullptr);
+}
+
+long long pitch_detector_get_cache_hits(PitchDetector *detector) {
+    const auto *cache = detector->posteriorgram_cache();
+    return cache != nullptr ? static_cast<long long>(cache->num_hits()) : 0;
+}
+
+long long pitch_detector_get_cache_misses(PitchDetector *detector) {
+    const auto *cache = detector->posteriorgram_cache();
+    return cache != nullptr ? static_cast<long long>(cache->num_misses()) : 0;
+}
+
+void pitch_detector_set_cpu_level(int level) { set_cpu_level(level); }
+
+int pitch_detector_get_cpu_level(void) { return cpu_level(); }
+
+void pitch_detector_set_tracing(int enabled, int events_per_thread) {
+    if (events_per_thread > 0) {
+        trace_set_enabled(enabled != 0,
+                          static_cast<size_t>(events_per_thread));
+    } else {
+        trace_set_enabled(enabled != 0);
+    }
+}
+
+char *pitch_detector_dump_trace(void) {
+    const auto json = trace_dump();
+    auto *out = new char[json.size() + 1];
+    std::memcpy(out, json.c_str(), json.size() + 1);
+    return out;
+}
+
+void pitch_detector_free_trace(char *trace) { delete[] trace; }
+
+TranscriptionJob *pitch_detector_submit(PitchDetector *detector,
+                                        const float *audio, int num_samples) {
+    return new TranscriptionJob(*detector, audio, num_samples);
+}
+
+int pitch_detector_job_poll(TranscriptionJob *job) { return job->poll(); }
+
+int pitch_detector_job_wait(TranscriptionJob *job) { return job->wait(); }
+
+float pitch_detector_job_progress(TranscriptionJob *job) {
+    return job->progress();
+}
+
+void pitch_detector_job_cancel(TranscriptionJob *job) { job->cancel(); }
+
+void pitch_detector_job_destroy(TranscriptionJob *job) { delete job; }
+
+void pitch_detector_start_stream(PitchDetector *detector,
+                                 int ring_buffer_num_samples) {
+    detector->start_stream(static_cast<size_t>(ring_buffer_num_samples));
+}
+
+void pitch_detector_start_online_stream(PitchDetector *detector,
+                                        int ring_buffer_num_samples,
+                                        int max_note_latency_frames) {
+    detector->start_stream(static_cast<size_t>(ring_buffer_num_samples), true,
+                           max_note_latency_frames);
+}
+
+int pitch_detector_push_audio(PitchDetector *detector, const float *audio,
+                              int num_samples) {
+    return static_cast<int>(
+        detector->push_audio(audio, static_cast<size_t>(num_samples)));
+}
+
+int pitch_detector_pop_stream_events(PitchDetector *detector,
+                                     NoteEvent *out_events, int max_events) {
+    int num_events = 0;
+    StreamNoteEvent event{};
+    while (num_events < max_events &&
+           detector->pop_stream_events(&event, 1) == 1) {
+        out_events[num_events++] = NoteEvent{
+            .start_time = event.start_time,
+            .end_time = event.end_time,
+            .midi_note = event.midi_note_number,
+            .amplitude = event.amplitude,
+        };
+    }
+    return num_events;
+}
+
+int pitch_detector_get_num_dropped_stream_events(PitchDetector *detector) {
+    return static_cast<int>(detector->num_dropped_stream_events());
+}
+
+void pitch_detector_stop_stream(PitchDetector *detector) {
+    detector->stop_stream();
+}
+
+BinaryFile pitch_detector_save_stream_state(PitchDetector *detector) {
+    const auto state = detector->save_stream_state();
+    auto *data = new unsigned char[state.size()];
+    std::copy(state.begin(), state.end(), data);
+    return {
+        .data = data,
+        .num_bytes = state.size(),
+    };
+}
+
+void pitch_detector_free_stream_state(BinaryFile state) {
+    delete[] state.data;
+}
+
+int pitch_detector_restore_stream_state(PitchDetector *detector,
+                                        BinaryFile state,
+                                        int ring_buffer_num_samples) {
+    return detector->restore_stream_state(
+        binary_file_to_blob(state),
+        static_cast<size_t>(ring_buffer_num_samples));
+}
 }
\ No newline at end of file
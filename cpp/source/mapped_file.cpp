@@ -0,0 +1,53 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat file_stat {};
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        void *mapping = mmap(nullptr, static_cast<size_t>(file_stat.st_size),
+                             PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            address = static_cast<const uint8_t *>(mapping);
+            num_bytes = static_cast<size_t>(file_stat.st_size);
+        }
+    }
+
+    // The mapping stays valid after the file is closed.
+    close(fd);
+}
+
+MappedFile::~MappedFile() { unmap(); }
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : address(other.address), num_bytes(other.num_bytes) {
+    other.address = nullptr;
+    other.num_bytes = 0;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        unmap();
+        address = other.address;
+        num_bytes = other.num_bytes;
+        other.address = nullptr;
+        other.num_bytes = 0;
+    }
+    return *this;
+}
+
+void MappedFile::unmap() {
+    if (address != nullptr) {
+        munmap(const_cast<uint8_t *>(address), num_bytes);
+        address = nullptr;
+        num_bytes = 0;
+    }
+}
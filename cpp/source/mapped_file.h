@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "constants.h"
+
+/**
+ * Read-only memory mapping of a whole file. Pages are shared with every
+ * other process mapping the same file and are only read from disk when
+ * touched, so loading costs no copy. Move only.
+ */
+class MappedFile {
+  public:
+    MappedFile() = default;
+
+    /**
+     * Map a file. is_open() is false if it can't be opened or is empty.
+     * @param path File path.
+     */
+    explicit MappedFile(const char *path);
+
+    ~MappedFile();
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    [[nodiscard]] bool is_open() const { return address != nullptr; }
+    [[nodiscard]] const uint8_t *data() const { return address; }
+    [[nodiscard]] size_t size() const { return num_bytes; }
+
+    /**
+     * @return The mapped bytes. Read-only, even if BinaryBlob::data is not
+     * const.
+     */
+    [[nodiscard]] BinaryBlob blob() const {
+        return {const_cast<uint8_t *>(address), num_bytes};
+    }
+
+  private:
+    void unmap();
+
+    const uint8_t *address = nullptr;
+    size_t num_bytes = 0;
+};
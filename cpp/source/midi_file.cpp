@@ -0,0 +1,225 @@
+#include "midi_file.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+
+namespace {
+
+constexpr int num_channels = 16;
+constexpr int drum_channel = 9;
+constexpr int pitch_bend_range_semitones = 2;
+
+// Messages at the same tick are written in this order, so that a note
+// restarting on a channel starts after the previous one stopped, and with
+// its own bend.
+enum MessageOrder { NoteOff = 0, BendReset, Bend, NoteOn };
+
+struct Message {
+    int64_t tick;
+    MessageOrder order;
+    uint8_t status;
+    uint8_t data_1;
+    uint8_t data_2;
+};
+
+int64_t seconds_to_ticks(double seconds) {
+    constexpr double ticks_per_second =
+        MidiFile::ticks_per_quarter_note * MidiFile::tempo_bpm / 60.0;
+    return std::max<int64_t>(std::llround(seconds * ticks_per_second), 0);
+}
+
+Message bend_message(int64_t tick, MessageOrder order, int channel,
+                     int value) {
+    const int unsigned_value = value + 8192;
+    return {tick, order, static_cast<uint8_t>(0xe0 | channel),
+            static_cast<uint8_t>(unsigned_value & 0x7f),
+            static_cast<uint8_t>(unsigned_value >> 7)};
+}
+
+void write_u16(std::vector<uint8_t> &out, uint32_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void write_u32(std::vector<uint8_t> &out, uint32_t value) {
+    write_u16(out, value >> 16);
+    write_u16(out, value & 0xffff);
+}
+
+void write_variable_length(std::vector<uint8_t> &out, uint64_t value) {
+    uint8_t bytes[10];
+    int num_bytes = 0;
+    do {
+        bytes[num_bytes++] = static_cast<uint8_t>(value & 0x7f);
+        value >>= 7;
+    } while (value > 0);
+
+    while (num_bytes > 1) {
+        out.push_back(bytes[--num_bytes] | 0x80);
+    }
+    out.push_back(bytes[0]);
+}
+
+/**
+ * @return Channel of each event. Notes that overlap get different channels
+ * while one is free.
+ */
+std::vector<int> assign_channels(const std::vector<Notes::Event> &events) {
+    std::vector<int> channels(events.size(), 0);
+
+    const bool has_bends =
+        std::any_of(events.begin(), events.end(),
+                    [](const Notes::Event &event) {
+                        return std::any_of(event.bends.begin(),
+                                           event.bends.end(),
+                                           [](int bend) { return bend != 0; });
+                    });
+    if (!has_bends) {
+        return channels;
+    }
+
+    std::vector<size_t> order(events.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return events[a].start_time < events[b].start_time;
+    });
+
+    std::array<int64_t, num_channels> channel_end_tick;
+    channel_end_tick.fill(-1);
+    channel_end_tick[drum_channel] = INT64_MAX;
+
+    for (auto i : order) {
+        const auto start_tick = seconds_to_ticks(events[i].start_time);
+
+        // First free channel, or the one that frees up first.
+        int channel = 0;
+        for (int c = 0; c < num_channels; c++) {
+            if (channel_end_tick[c] <= start_tick) {
+                channel = c;
+                break;
+            }
+            if (channel_end_tick[c] < channel_end_tick[channel]) {
+                channel = c;
+            }
+        }
+
+        channels[i] = channel;
+        channel_end_tick[channel] =
+            std::max(channel_end_tick[channel],
+                     seconds_to_ticks(events[i].end_time));
+    }
+
+    return channels;
+}
+
+} // namespace
+
+int MidiFile::pitch_bend_value(int bend) {
+    const int value = static_cast<int>(std::lround(
+        bend * 8192.0 /
+        (pitch_bend_range_semitones * CONTOURS_BINS_PER_SEMITONE)));
+    return std::clamp(value, -8192, 8191);
+}
+
+std::vector<uint8_t>
+MidiFile::from_note_events(const std::vector<Notes::Event> &events) {
+    const auto channels = assign_channels(events);
+
+    std::vector<Message> messages;
+    messages.reserve(events.size() * 2);
+    std::array<bool, num_channels> is_channel_used{};
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const auto &event = events[i];
+        const int channel = channels[i];
+        is_channel_used[channel] = true;
+
+        const auto start_tick = seconds_to_ticks(event.start_time);
+        const auto end_tick =
+            std::max(seconds_to_ticks(event.end_time), start_tick + 1);
+        const auto note = static_cast<uint8_t>(
+            std::clamp(event.midi_note_number, 0, 127));
+        const auto velocity = static_cast<uint8_t>(std::clamp(
+            static_cast<int>(std::lround(127.0 * event.amplitude)), 1, 127));
+
+        messages.push_back({start_tick, NoteOn,
+                            static_cast<uint8_t>(0x90 | channel), note,
+                            velocity});
+        messages.push_back({end_tick, NoteOff,
+                            static_cast<uint8_t>(0x80 | channel), note, 0});
+
+        // One bend per frame, at the start of the frame. Only changes are
+        // written.
+        int last_value = 0;
+        const auto num_bends = event.bends.size();
+        for (size_t k = 0; k < num_bends; k++) {
+            const int value = pitch_bend_value(event.bends[k]);
+            const auto tick = seconds_to_ticks(
+                event.start_time + (event.end_time - event.start_time) *
+                                       static_cast<double>(k) /
+                                       static_cast<double>(num_bends));
+            if ((value == last_value && k > 0) || (k > 0 && tick >= end_tick)) {
+                continue;
+            }
+            messages.push_back(bend_message(tick, Bend, channel, value));
+            last_value = value;
+        }
+
+        if (last_value != 0) {
+            messages.push_back(bend_message(end_tick, BendReset, channel, 0));
+        }
+    }
+
+    std::stable_sort(messages.begin(), messages.end(),
+                     [](const Message &a, const Message &b) {
+                         if (a.tick != b.tick) {
+                             return a.tick < b.tick;
+                         }
+                         return a.order < b.order;
+                     });
+
+    std::vector<uint8_t> track;
+    track.reserve(messages.size() * 4 + 64);
+
+    // Tempo
+    constexpr uint32_t us_per_quarter_note = 60000000 / tempo_bpm;
+    track.insert(track.end(), {0x00, 0xff, 0x51, 0x03});
+    track.push_back(static_cast<uint8_t>(us_per_quarter_note >> 16));
+    track.push_back(static_cast<uint8_t>(us_per_quarter_note >> 8));
+    track.push_back(static_cast<uint8_t>(us_per_quarter_note));
+
+    for (int channel = 0; channel < num_channels; channel++) {
+        if (is_channel_used[channel]) {
+            track.insert(track.end(),
+                         {0x00, static_cast<uint8_t>(0xc0 | channel),
+                          static_cast<uint8_t>(program)});
+        }
+    }
+
+    int64_t last_tick = 0;
+    for (const auto &message : messages) {
+        write_variable_length(track,
+                              static_cast<uint64_t>(message.tick - last_tick));
+        track.insert(track.end(),
+                     {message.status, message.data_1, message.data_2});
+        last_tick = message.tick;
+    }
+
+    // End of track
+    track.insert(track.end(), {0x00, 0xff, 0x2f, 0x00});
+
+    std::vector<uint8_t> out;
+    out.reserve(track.size() + 22);
+    out.insert(out.end(), {'M', 'T', 'h', 'd'});
+    write_u32(out, 6);
+    write_u16(out, 0); // Format 0: a single track
+    write_u16(out, 1);
+    write_u16(out, ticks_per_quarter_note);
+    out.insert(out.end(), {'M', 'T', 'r', 'k'});
+    write_u32(out, static_cast<uint32_t>(track.size()));
+    out.insert(out.end(), track.begin(), track.end());
+
+    return out;
+}
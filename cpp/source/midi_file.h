@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "notes.h"
+
+/**
+ * Standard MIDI File writer for note events, laid out like the files written
+ * by Basic Pitch: one track at 120 bpm, Electric Piano, velocities scaled
+ * from amplitudes and pitch bends cropped to the default +-2 semitone range.
+ *
+ * Pitch bends apply to a whole channel. Without bends, all notes are on the
+ * first channel. With bends, overlapping notes are spread over the 15
+ * melodic channels so that each keeps its own bend (as with
+ * MultiPitchBend), and a channel is only shared by overlapping notes if more
+ * than 15 are on at once.
+ */
+class MidiFile {
+  public:
+    static constexpr int ticks_per_quarter_note = 480;
+    static constexpr int tempo_bpm = 120;
+    // Electric Piano 1
+    static constexpr int program = 4;
+
+    /**
+     * @param events Note events, as returned by Notes::convert.
+     * @return Bytes of the file.
+     */
+    static std::vector<uint8_t>
+    from_note_events(const std::vector<Notes::Event> &events);
+
+    /**
+     * @param bend Pitch bend in 1/3 semitones, see Notes::Event.
+     * @return Pitch bend value, 0 for no bend, within [-8192, 8191].
+     */
+    static int pitch_bend_value(int bend);
+};
@@ -0,0 +1,205 @@
+#include "multi_stream_pitch_cnn.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+
+#include "trace.h"
+
+MultiStreamPitchCnn::MultiStreamPitchCnn(int num_streams,
+                                         BinaryBlob cnn_contour_model_json,
+                                         BinaryBlob cnn_note_model_json,
+                                         BinaryBlob cnn_onset_1_model_json,
+                                         BinaryBlob cnn_onset_2_model_json)
+    : streams(num_streams) {
+    assert(num_streams > 0);
+
+    // Load layers once through PitchCnn, then widen them to all streams.
+    // PitchCnn holds large buffers, keep it off the stack.
+    const auto model = std::make_unique<PitchCnn>(
+        cnn_contour_model_json, cnn_note_model_json, cnn_onset_1_model_json,
+        cnn_onset_2_model_json);
+
+    init(*model);
+}
+
+MultiStreamPitchCnn::MultiStreamPitchCnn(
+    int num_streams, const std::vector<PackedConv2d> &cnn_layers)
+    : streams(num_streams) {
+    assert(num_streams > 0);
+
+    init(*std::make_unique<PitchCnn>(cnn_layers));
+}
+
+void MultiStreamPitchCnn::init(const PitchCnn &model) {
+    contour_conv_1 = model.contour_conv_1;
+    contour_conv_2 = model.contour_conv_2;
+    note_conv_1 = model.note_conv_1;
+    note_conv_2 = model.note_conv_2;
+    onset_input_conv = model.onset_input_conv;
+    onset_output_conv = model.onset_output_conv;
+
+    for (auto *layer : {&contour_conv_1, &contour_conv_2, &note_conv_1,
+                        &note_conv_2, &onset_input_conv, &onset_output_conv}) {
+        layer->set_num_streams(streams);
+    }
+
+    input_array.resize((size_t)NUM_HARMONICS * NUM_FREQ_IN * streams);
+    concat_array.resize((size_t)33 * NUM_FREQ_OUT * streams);
+
+    contours_circular_buffer.resize((size_t)num_contour_stored * NUM_FREQ_IN *
+                                    streams);
+    notes_circular_buffer.resize((size_t)num_note_stored * NUM_FREQ_OUT *
+                                 streams);
+    concat_2_circular_buffer.resize((size_t)num_concat_2_stored * 32 *
+                                    NUM_FREQ_OUT * streams);
+
+    reset();
+}
+
+void MultiStreamPitchCnn::reset() {
+    for (auto *buffer : {&contours_circular_buffer, &notes_circular_buffer,
+                         &concat_2_circular_buffer, &input_array}) {
+        std::fill(buffer->begin(), buffer->end(), 0.0f);
+    }
+
+    for (auto *layer : {&contour_conv_1, &contour_conv_2, &note_conv_1,
+                        &note_conv_2, &onset_input_conv, &onset_output_conv}) {
+        layer->reset();
+    }
+
+    contour_index = 0;
+    note_index = 0;
+    concat_2_index = 0;
+}
+
+void MultiStreamPitchCnn::reset_stream(int stream) {
+    assert(stream >= 0 && stream < streams);
+
+    // A zeroed state is the same whatever the circular buffer indices are.
+    for (auto *buffer : {&contours_circular_buffer, &notes_circular_buffer,
+                         &concat_2_circular_buffer}) {
+        for (size_t i = (size_t)stream; i < buffer->size(); i += streams) {
+            (*buffer)[i] = 0.0f;
+        }
+    }
+
+    for (auto *layer : {&contour_conv_1, &contour_conv_2, &note_conv_1,
+                        &note_conv_2, &onset_input_conv, &onset_output_conv}) {
+        layer->reset_stream(stream);
+    }
+}
+
+void MultiStreamPitchCnn::frame_inference(const float *const *in_data,
+                                          float *const *out_contours,
+                                          float *const *out_notes,
+                                          float *const *out_onsets) {
+    // Interleave inputs
+    for (int s = 0; s < streams; s++) {
+        const float *in = in_data[s];
+        for (size_t i = 0; i < NUM_HARMONICS * NUM_FREQ_IN; i++) {
+            input_array[i * streams + s] = (in != nullptr) ? in[i] : 0.0f;
+        }
+    }
+
+    run_models();
+
+    // Fill outputs, with the same delays as PitchCnn
+    const float *onsets = onset_output_conv.outputs();
+    const float *notes =
+        notes_circular_buffer.data() +
+        (size_t)((note_index + 1) % num_note_stored) * NUM_FREQ_OUT * streams;
+    const float *contours = contours_circular_buffer.data() +
+                            (size_t)((contour_index + 1) % num_contour_stored) *
+                                NUM_FREQ_IN * streams;
+
+    for (int s = 0; s < streams; s++) {
+        if (out_onsets != nullptr && out_onsets[s] != nullptr) {
+            deinterleave(onsets, s, NUM_FREQ_OUT, out_onsets[s]);
+        }
+        if (out_notes != nullptr && out_notes[s] != nullptr) {
+            deinterleave(notes, s, NUM_FREQ_OUT, out_notes[s]);
+        }
+        if (out_contours != nullptr && out_contours[s] != nullptr) {
+            deinterleave(contours, s, NUM_FREQ_IN, out_contours[s]);
+        }
+    }
+
+    // Increment index for different circular buffers
+    contour_index =
+        (contour_index == num_contour_stored - 1) ? 0 : contour_index + 1;
+
+    note_index = (note_index == num_note_stored - 1) ? 0 : note_index + 1;
+
+    concat_2_index =
+        (concat_2_index == num_concat_2_stored - 1) ? 0 : concat_2_index + 1;
+}
+
+void MultiStreamPitchCnn::run_models() {
+    const size_t contours_size = (size_t)NUM_FREQ_IN * streams;
+    const size_t notes_size = (size_t)NUM_FREQ_OUT * streams;
+    const size_t concat_2_size = (size_t)32 * NUM_FREQ_OUT * streams;
+
+    TraceScope trace_scope("MultiStreamPitchCnn::run_models");
+
+    // Run models and push results in appropriate circular buffer
+    {
+        TraceScope layer_scope("onset_input_conv");
+        onset_input_conv.forward(input_array.data());
+    }
+    std::copy(onset_input_conv.outputs(),
+              onset_input_conv.outputs() + concat_2_size,
+              concat_2_circular_buffer.begin() +
+                  (long)(concat_2_index * concat_2_size));
+
+    {
+        TraceScope layer_scope("contour_conv_1");
+        contour_conv_1.forward(input_array.data());
+    }
+    {
+        TraceScope layer_scope("contour_conv_2");
+        contour_conv_2.forward(contour_conv_1.outputs());
+    }
+    std::copy(contour_conv_2.outputs(), contour_conv_2.outputs() + contours_size,
+              contours_circular_buffer.begin() +
+                  (long)(contour_index * contours_size));
+
+    {
+        TraceScope layer_scope("note_conv_1");
+        note_conv_1.forward(contour_conv_2.outputs());
+    }
+    {
+        TraceScope layer_scope("note_conv_2");
+        note_conv_2.forward(note_conv_1.outputs());
+    }
+    std::copy(note_conv_2.outputs(), note_conv_2.outputs() + notes_size,
+              notes_circular_buffer.begin() + (long)(note_index * notes_size));
+
+    // Concat operation with correct frame shift
+    concat();
+
+    TraceScope layer_scope("onset_output_conv");
+    onset_output_conv.forward(concat_array.data());
+}
+
+void MultiStreamPitchCnn::concat() {
+    const size_t concat_2_size = (size_t)32 * NUM_FREQ_OUT * streams;
+    const float *concat_2 =
+        concat_2_circular_buffer.data() +
+        (size_t)((concat_2_index + 1) % num_concat_2_stored) * concat_2_size;
+    const float *notes = note_conv_2.outputs();
+
+    for (size_t i = 0; i < NUM_FREQ_OUT; i++) {
+        float *concat_i = concat_array.data() + i * 33 * streams;
+        std::copy(notes + i * streams, notes + (i + 1) * streams, concat_i);
+        std::copy(concat_2 + i * 32 * streams, concat_2 + (i + 1) * 32 * streams,
+                  concat_i + streams);
+    }
+}
+
+void MultiStreamPitchCnn::deinterleave(const float *interleaved, int stream,
+                                       int num_values, float *out) const {
+    for (int i = 0; i < num_values; i++) {
+        out[i] = interleaved[(size_t)i * streams + stream];
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+
+#include "pitch_cnn.h"
+
+/**
+ * PitchCnn for several independent streams at once, e.g. many live inputs on
+ * one server. States and circular buffers of all streams are interleaved
+ * (index = value_index * num_streams + stream) so that each layer runs once
+ * per frame for all streams and its weights are read once instead of once
+ * per stream. Outputs are the same as num_streams separate PitchCnn.
+ */
+class MultiStreamPitchCnn {
+  public:
+    /**
+     * @param num_streams Number of streams.
+     * Other parameters are the model files, as for PitchCnn.
+     */
+    MultiStreamPitchCnn(int num_streams, BinaryBlob cnn_contour_model_json,
+                        BinaryBlob cnn_note_model_json,
+                        BinaryBlob cnn_onset_1_model_json,
+                        BinaryBlob cnn_onset_2_model_json);
+
+    /**
+     * @param num_streams Number of streams.
+     * @param cnn_layers Layers of a prepacked weight file, as for PitchCnn.
+     */
+    MultiStreamPitchCnn(int num_streams,
+                        const std::vector<PackedConv2d> &cnn_layers);
+
+    /**
+     * Resets the internal state of all streams.
+     */
+    void reset();
+
+    /**
+     * Resets the internal state of a single stream, e.g. when a new input
+     * takes its slot. Other streams are not affected.
+     * @param stream Stream index.
+     */
+    void reset_stream(int stream);
+
+    /**
+     * @return Number of streams.
+     */
+    [[nodiscard]] int num_streams() const { return streams; }
+
+    /**
+     * Run inference for one frame of every stream. Same lookahead as
+     * PitchCnn::num_frames_lookahead.
+     * @param in_data Features frame (8 * 264 elements) of each stream. A
+     * nullptr entry is a zero frame.
+     * @param out_contours Output contours (264 elements) of each stream. The
+     * array or any entry may be nullptr to skip.
+     * @param out_notes Output notes (88 elements) of each stream. The array or
+     * any entry may be nullptr to skip.
+     * @param out_onsets Output onsets (88 elements) of each stream. The array
+     * or any entry may be nullptr to skip.
+     */
+    void frame_inference(const float *const *in_data,
+                         float *const *out_contours, float *const *out_notes,
+                         float *const *out_onsets);
+
+  private:
+    /**
+     * Take the layers of a single stream model and size all buffers.
+     * @param model Loaded model.
+     */
+    void init(const PitchCnn &model);
+
+    /**
+     * Same as PitchCnn::run_models on interleaved data.
+     */
+    void run_models();
+
+    /**
+     * Same as PitchCnn::concat on interleaved data.
+     */
+    void concat();
+
+    /**
+     * Copy one stream out of an interleaved array.
+     * @param interleaved Interleaved array.
+     * @param stream Stream index.
+     * @param num_values Number of values per stream.
+     * @param out Output array of num_values elements.
+     */
+    void deinterleave(const float *interleaved, int stream, int num_values,
+                      float *out) const;
+
+    static constexpr int num_contour_stored = PitchCnn::num_contour_stored;
+    static constexpr int num_note_stored = PitchCnn::num_note_stored;
+    static constexpr int num_concat_2_stored = PitchCnn::num_concat_2_stored;
+
+    const int streams;
+
+    std::vector<float> input_array;
+    std::vector<float> concat_array;
+
+    // Each is num_*_stored consecutive interleaved frames.
+    std::vector<float> contours_circular_buffer;
+    std::vector<float> notes_circular_buffer;
+    std::vector<float> concat_2_circular_buffer;
+
+    int contour_index = 0;
+    int note_index = 0;
+    int concat_2_index = 0;
+
+    Conv2d contour_conv_1;
+    Conv2d contour_conv_2;
+    Conv2d note_conv_1;
+    Conv2d note_conv_2;
+    Conv2d onset_input_conv;
+    Conv2d onset_output_conv;
+};
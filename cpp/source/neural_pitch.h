@@ -8,6 +8,7 @@ extern "C" {
 // =============================================================================
 
 typedef struct PitchDetector PitchDetector;
+typedef struct TranscriptionJob TranscriptionJob;
 
 typedef struct {
     unsigned char *data;
@@ -33,6 +34,13 @@ typedef struct {
 
 PitchDetector *pitch_detector_create(ModelFiles model_files);
 
+// Create a detector from model files, which are memory mapped and shared by
+// all processes using them. cnn_weights_path is a prepacked CNN weight file
+// (see tools/pack_cnn_weights). Returns NULL if a file can't be mapped, the
+// weight file is not valid or the features model can't be loaded.
+PitchDetector *pitch_detector_create_from_files(const char *features_model_path,
+                                                const char *cnn_weights_path);
+
 void pitch_detector_reset(PitchDetector *detector);
 
 void pitch_detector_set_parameters(PitchDetector *detector,
@@ -40,8 +48,10 @@ void pitch_detector_set_parameters(PitchDetector *detector,
                                    float split_sensibility,
                                    float min_note_duration_ms);
 
-void pitch_detector_transcribe_to_midi(PitchDetector *detector, float *audio,
-                                       int num_samples);
+// Returns 1 if transcribed, 0 if not run because it would exceed the memory
+// limit (the detector is then reset, see pitch_detector_set_memory_limit).
+int pitch_detector_transcribe_to_midi(PitchDetector *detector, float *audio,
+                                      int num_samples);
 
 void pitch_detector_get_note_events(PitchDetector *detector,
                                     NoteEvent **out_events,
@@ -49,6 +59,176 @@ void pitch_detector_get_note_events(PitchDetector *detector,
 
 void pitch_detector_destroy(PitchDetector *detector);
 
+// Pitch bend mode: 0 none, 1 single, 2 multi. Reset to 2 by
+// pitch_detector_set_parameters. Note events of this API carry no pitch bends,
+// and with 0 the contour posteriorgrams are neither computed nor stored.
+void pitch_detector_set_pitch_bend(PitchDetector *detector, int pitch_bend);
+
+// Only transcribe notes between min_frequency and max_frequency (in Hz, -1 for
+// no limit). The CNN then only computes what these notes depend on.
+void pitch_detector_set_frequency_range(PitchDetector *detector,
+                                        float min_frequency,
+                                        float max_frequency);
+
+// Skip CNN inference on silent stretches. threshold applies to the features,
+// negative disables the gate (default).
+void pitch_detector_set_silence_gate(PitchDetector *detector, float threshold);
+
+// Number of frames skipped by the silence gate in the latest transcription or
+// stream.
+int pitch_detector_get_num_skipped_frames(PitchDetector *detector);
+
+// Prune the CNN weights below tolerance times the largest weight of their
+// layer and skip them, see PitchDetector::prune_cnn_weights. Returns the
+// fraction of CNN multiply-adds skipped. Notes degrade from ~0.1.
+float pitch_detector_prune_cnn_weights(PitchDetector *detector,
+                                       float tolerance);
+
+// Number of threads note events are extracted with, 1 by default, 0 for the
+// number of cores. Note events are the same whatever the number.
+void pitch_detector_set_num_note_threads(PitchDetector *detector,
+                                         int num_threads);
+
+// Storage of the posteriorgrams kept for parameter updates: 0 float32
+// (default), 1 float16, 2 bfloat16. Half precision halves their memory, and
+// can move a note boundary by a frame where a value rounds across a threshold.
+// Applies from the next transcription.
+void pitch_detector_set_posteriorgram_precision(PitchDetector *detector,
+                                                int precision);
+
+// Compute the features in 2 second windows, as Basic Pitch does for long
+// files: they then take constant memory instead of about 17 KB per frame
+// (86 frames per second), but notes can differ slightly. Off by default.
+void pitch_detector_set_segmented_features(PitchDetector *detector,
+                                           int segmented);
+
+// Cap the memory a transcription allocates, in bytes (0 for no limit, the
+// default). Features are segmented if needed, and transcriptions that would
+// still exceed the limit are not run: their note events are empty and
+// pitch_detector_transcribe_to_midi returns 0, or their job is rejected.
+// Transcriptions found in the posteriorgram cache always run.
+void pitch_detector_set_memory_limit(PitchDetector *detector,
+                                     long long max_bytes);
+
+// Estimated peak memory in bytes of transcribing num_samples samples with
+// the current options and memory limit, detector itself excluded.
+long long pitch_detector_estimate_memory(PitchDetector *detector,
+                                         int num_samples);
+
+// Cache the posteriorgrams of up to max_bytes of recent transcriptions:
+// transcribing the same audio again with the same settings then only
+// extracts notes, e.g. with new parameters. 0 disables the cache (default)
+// and frees it.
+void pitch_detector_set_posteriorgram_cache_size(PitchDetector *detector,
+                                                 long long max_bytes);
+
+// Number of transcriptions found in the posteriorgram cache, and not found,
+// since it was enabled.
+long long pitch_detector_get_cache_hits(PitchDetector *detector);
+long long pitch_detector_get_cache_misses(PitchDetector *detector);
+
+// Instruction set of the CNN kernels: 0 generic, 1 AVX2, 2 AVX-512. Detected
+// at startup, can be lowered with the NEURAL_PITCH_CPU_LEVEL environment
+// variable (generic, avx2, avx512) or with pitch_detector_set_cpu_level, e.g.
+// for A/B tests. Applies to detectors created afterwards; -1 restores the
+// default.
+void pitch_detector_set_cpu_level(int level);
+
+int pitch_detector_get_cpu_level(void);
+
+// Timeline tracing of the pipeline stages (features, each CNN layer, note
+// extraction passes) for all detectors, off by default. While on, each thread
+// records into its own buffer of events_per_thread events (0 for the
+// default, 262144); events that don't fit are dropped.
+void pitch_detector_set_tracing(int enabled, int events_per_thread);
+
+// Take the recorded events out of the buffers, as Chrome trace JSON to open
+// in chrome://tracing or ui.perfetto.dev. Free with pitch_detector_free_trace.
+char *pitch_detector_dump_trace(void);
+
+void pitch_detector_free_trace(char *trace);
+
+// =============================================================================
+// Asynchronous transcription: the job runs pitch_detector_transcribe_to_midi
+// on its own thread. The detector must not be used until the job is done or
+// cancelled, its note events are then read with
+// pitch_detector_get_note_events. A cancelled or rejected job leaves the
+// detector reset.
+
+// Job status: 0 running, 1 done, 2 cancelled, 3 rejected (over the memory
+// limit, not run).
+#define PITCH_DETECTOR_JOB_RUNNING 0
+#define PITCH_DETECTOR_JOB_DONE 1
+#define PITCH_DETECTOR_JOB_CANCELLED 2
+#define PITCH_DETECTOR_JOB_REJECTED 3
+
+// Start transcribing. The audio is copied.
+TranscriptionJob *pitch_detector_submit(PitchDetector *detector,
+                                        const float *audio, int num_samples);
+
+// Job status, without blocking.
+int pitch_detector_job_poll(TranscriptionJob *job);
+
+// Block until the job has finished, returns its final status.
+int pitch_detector_job_wait(TranscriptionJob *job);
+
+// Fraction of the CNN frames computed, from 0 to 1. 1 once done.
+float pitch_detector_job_progress(TranscriptionJob *job);
+
+// Request cancellation. It is checked between CNN frames and between note
+// extraction passes; the features, computed in a single model run, are not
+// interrupted.
+void pitch_detector_job_cancel(TranscriptionJob *job);
+
+// Cancel the job if still running, wait for it and free it.
+void pitch_detector_job_destroy(TranscriptionJob *job);
+
+// =============================================================================
+// Streaming: push_audio is wait-free and may be called from a real-time audio
+// thread, it accepts nothing while not streaming. Events are read from a single
+// other thread. Notes still sounding after about 12 s of uninterrupted notes
+// are split in two, see PitchDetector::start_stream.
+
+void pitch_detector_start_stream(PitchDetector *detector,
+                                 int ring_buffer_num_samples);
+
+// Like pitch_detector_start_stream, but each note is published as soon as it
+// is final (no melodia pass). max_note_latency_frames bounds the delay
+// between note start and publication, -1 for unbounded (the worker time per
+// frame then grows with the longest note, 1024 frames bound it as segments).
+void pitch_detector_start_online_stream(PitchDetector *detector,
+                                        int ring_buffer_num_samples,
+                                        int max_note_latency_frames);
+
+// pitch_detector_push_audio and pitch_detector_pop_stream_events can run at
+// the same time on two threads, e.g. the audio callback and a UI thread. Each
+// must only be called from one thread at a time, and no other function on
+// the detector while they run.
+int pitch_detector_push_audio(PitchDetector *detector, const float *audio,
+                              int num_samples);
+
+int pitch_detector_pop_stream_events(PitchDetector *detector,
+                                     NoteEvent *out_events, int max_events);
+
+// Number of events dropped because the stream event queue (4096 events) was
+// full, i.e. events were not popped often enough.
+int pitch_detector_get_num_dropped_stream_events(PitchDetector *detector);
+
+void pitch_detector_stop_stream(PitchDetector *detector);
+
+// Checkpoint a running stream, see PitchDetector::save_stream_state. The
+// returned state is empty if not streaming. Free with
+// pitch_detector_free_stream_state.
+BinaryFile pitch_detector_save_stream_state(PitchDetector *detector);
+
+void pitch_detector_free_stream_state(BinaryFile state);
+
+// Start a stream from a saved state. Returns 0 if the state is invalid or
+// was saved with other models or settings.
+int pitch_detector_restore_stream_state(PitchDetector *detector,
+                                        BinaryFile state,
+                                        int ring_buffer_num_samples);
+
 // =============================================================================
 
 #ifdef __cplusplus
@@ -0,0 +1,444 @@
+#include "note_tracker.h"
+
+#include <algorithm>
+#include <climits>
+
+NoteTracker::NoteTracker(Notes::ConvertParams convert_params,
+                         int max_latency_frames)
+    : convert_params(convert_params),
+      max_latency_frames(
+          max_latency_frames < 0
+              ? -1
+              : std::max(max_latency_frames,
+                         convert_params.min_note_len_frames +
+                             convert_params.energy_threshold + 2)) {
+    // constrain frequencies, as in Notes::convert
+    max_note_idx =
+        (convert_params.max_frequency < 0)
+            ? NUM_FREQ_OUT - 1
+            : Notes::ftom(convert_params.max_frequency) - MIDI_OFFSET;
+    min_note_idx =
+        (convert_params.min_frequency < 0)
+            ? 0
+            : Notes::ftom(convert_params.min_frequency) - MIDI_OFFSET;
+
+    reset();
+}
+
+void NoteTracker::reset() {
+    notes_buffer.clear();
+    onsets_buffer.clear();
+    buffer_first_frame = 0;
+    base_frame = 0;
+    frame_count = 0;
+
+    emitted_notes.clear();
+    forced_onsets.clear();
+    onset_peaks.clear();
+    remaining_energy.clear();
+    energy_first_frame = 0;
+
+    for (auto &notes : previous_notes) {
+        notes.assign(NUM_FREQ_OUT, 0.0f);
+    }
+    max_onset = 0.0f;
+    max_min_notes_diff = 0.0f;
+
+    open_pitches.assign(NUM_FREQ_OUT, false);
+    replay_needed = true;
+}
+
+void NoteTracker::save_state(StateWriter &writer) const {
+    writer.write<int32_t>(buffer_first_frame);
+    writer.write<int32_t>(base_frame);
+    writer.write<int32_t>(frame_count);
+
+    writer.write<uint64_t>(notes_buffer.size());
+    for (size_t i = 0; i < notes_buffer.size(); i++) {
+        writer.write_floats(notes_buffer[i].data(), NUM_FREQ_OUT);
+        writer.write_floats(onsets_buffer[i].data(), NUM_FREQ_OUT);
+    }
+
+    for (const auto *notes : {&emitted_notes, &forced_onsets}) {
+        writer.write<uint64_t>(notes->size());
+        for (const auto &note : *notes) {
+            writer.write<int32_t>(note.first);
+            writer.write<int32_t>(note.second);
+        }
+    }
+
+    for (const auto &notes : previous_notes) {
+        writer.write_floats(notes.data(), NUM_FREQ_OUT);
+    }
+    writer.write(max_onset);
+    writer.write(max_min_notes_diff);
+}
+
+bool NoteTracker::restore_state(StateReader &reader) {
+    reset();
+
+    reader.read(buffer_first_frame);
+    reader.read(base_frame);
+    reader.read(frame_count);
+
+    constexpr size_t frame_bytes = NUM_FREQ_OUT * sizeof(float);
+    uint64_t num_buffered = 0;
+    if (reader.read(num_buffered) &&
+        num_buffered > reader.remaining() / (2 * frame_bytes)) {
+        reader.fail();
+    }
+    for (uint64_t i = 0; i < num_buffered && reader.ok(); i++) {
+        notes_buffer.emplace_back(NUM_FREQ_OUT);
+        onsets_buffer.emplace_back(NUM_FREQ_OUT);
+        reader.read_floats(notes_buffer.back().data(), NUM_FREQ_OUT);
+        reader.read_floats(onsets_buffer.back().data(), NUM_FREQ_OUT);
+    }
+
+    for (auto *notes : {&emitted_notes, &forced_onsets}) {
+        uint64_t num_notes = 0;
+        if (reader.read(num_notes) &&
+            num_notes > reader.remaining() / (2 * sizeof(int32_t))) {
+            reader.fail();
+        }
+        for (uint64_t i = 0; i < num_notes && reader.ok(); i++) {
+            int32_t start_frame = 0;
+            int32_t note_idx = 0;
+            reader.read(start_frame);
+            reader.read(note_idx);
+            if (note_idx < min_note_idx || note_idx > max_note_idx) {
+                reader.fail();
+            }
+            notes->emplace(start_frame, note_idx);
+        }
+    }
+
+    for (auto &notes : previous_notes) {
+        reader.read_floats(notes.data(), NUM_FREQ_OUT);
+    }
+    reader.read(max_onset);
+    reader.read(max_min_notes_diff);
+
+    // The frame before base_frame is read for the onset peak picking.
+    if (!reader.ok() || buffer_first_frame < 0 || base_frame < 0 ||
+        buffer_first_frame > std::max(base_frame - 1, 0) ||
+        base_frame > frame_count ||
+        buffer_first_frame + (int64_t)num_buffered != frame_count) {
+        reset();
+        return reader.fail();
+    }
+
+    for (int frame = base_frame; frame < frame_count - 1; frame++) {
+        find_onset_peaks(frame);
+    }
+    for (const auto &notes : notes_buffer) {
+        remaining_energy.insert(remaining_energy.end(), notes.begin(),
+                                notes.end());
+    }
+    energy_first_frame = buffer_first_frame;
+    return true;
+}
+
+void NoteTracker::push_frame(const float *notes, const float *onsets,
+                             std::vector<Notes::Event> &out_events) {
+    notes_buffer.emplace_back(notes, notes + NUM_FREQ_OUT);
+    onsets_buffer.emplace_back(onsets, onsets + NUM_FREQ_OUT);
+    remaining_energy.insert(remaining_energy.end(), notes,
+                            notes + NUM_FREQ_OUT);
+
+    if (convert_params.infer_onsets) {
+        // Same as Notes::inferred_onsets, one frame at a time.
+        static constexpr int num_diffs = 2;
+        auto &frame_onsets = onsets_buffer.back();
+        min_notes_diff.assign(NUM_FREQ_OUT, 1.0f);
+
+        for (int j = 0; j < NUM_FREQ_OUT; j++) {
+            auto &min = min_notes_diff[j];
+            for (int n = 0; n < num_diffs; n++) {
+                auto diff = notes[j] - previous_notes[n][j];
+                if (diff < min) {
+                    diff = (diff < 0) ? 0 : diff;
+                    min = (frame_count >= num_diffs) ? diff : 0;
+                }
+            }
+
+            max_onset = std::max(max_onset, onsets[j]);
+            max_min_notes_diff = std::max(max_min_notes_diff, min);
+        }
+
+        for (int j = 0; j < NUM_FREQ_OUT; j++) {
+            const auto inferred =
+                (max_min_notes_diff > 0)
+                    ? max_onset * min_notes_diff[j] / max_min_notes_diff
+                    : 0.0f;
+            frame_onsets[j] = std::max(frame_onsets[j], inferred);
+        }
+
+        previous_notes[1] = previous_notes[0];
+        previous_notes[0].assign(notes, notes + NUM_FREQ_OUT);
+    }
+
+    frame_count++;
+    if (frame_count >= 2) {
+        find_onset_peaks(frame_count - 2);
+    }
+
+    if (needs_replay()) {
+        process(false, out_events);
+    }
+}
+
+void NoteTracker::find_onset_peaks(int frame) {
+    auto onsets = [this](int frame) -> const std::vector<float> & {
+        return onsets_buffer[(size_t)(frame - buffer_first_frame)];
+    };
+    const auto &current = onsets(frame);
+    const auto &prev = onsets(std::max(frame - 1, 0));
+    const auto &next = onsets(frame + 1);
+
+    for (int note_idx = min_note_idx; note_idx <= max_note_idx; note_idx++) {
+        if (!((current[note_idx] < convert_params.onset_threshold) ||
+              (current[note_idx] < prev[note_idx]) ||
+              (current[note_idx] < next[note_idx]))) {
+            onset_peaks.emplace_back(frame, note_idx);
+        }
+    }
+}
+
+bool NoteTracker::needs_replay() {
+    if (replay_needed) {
+        return true;
+    }
+
+    const int last_frame = frame_count - 1;
+    if (max_latency_frames >= 0 &&
+        base_frame < last_frame - max_latency_frames) {
+        return true;
+    }
+
+    // The frame before the last one is read by the replay for the first time.
+    const int frame = last_frame - 1;
+    const auto &notes = notes_buffer[(size_t)(frame - buffer_first_frame)];
+    for (int note_idx = min_note_idx; note_idx <= max_note_idx; note_idx++) {
+        if (open_pitches[note_idx] &&
+            notes[note_idx] < convert_params.frame_threshold) {
+            return true;
+        }
+    }
+
+    // It can also start a note.
+    for (auto peak = onset_peaks.rbegin();
+         peak != onset_peaks.rend() && peak->first == frame; ++peak) {
+        open_pitches[peak->second] = true;
+    }
+    for (auto forced = forced_onsets.lower_bound({frame, 0});
+         forced != forced_onsets.end() && forced->first == frame; ++forced) {
+        open_pitches[forced->second] = true;
+    }
+    return false;
+}
+
+void NoteTracker::flush(std::vector<Notes::Event> &out_events) {
+    process(true, out_events);
+}
+
+void NoteTracker::process(bool is_final,
+                          std::vector<Notes::Event> &out_events) {
+    // As in Notes::convert, the last frame is only used as neighbour of the
+    // frame before it.
+    const int last_frame = frame_count - 1;
+    if (last_frame <= base_frame) {
+        return;
+    }
+
+    auto energy = [this](int frame, int note) -> float & {
+        return remaining_energy[(size_t)(frame - energy_first_frame) *
+                                    NUM_FREQ_OUT +
+                                note];
+    };
+
+    const auto frame_threshold = convert_params.frame_threshold;
+    candidates.clear();
+    // Candidates are visited by decreasing start: the earliest start of the
+    // candidates that are not stable, per note.
+    unstable_start.assign(NUM_FREQ_OUT, INT_MAX);
+
+    // Replay of the onset pass of Notes::convert, backwards in time. A note is
+    // stable if it ended before the last frame and no note that is not stable
+    // starts where it read the remaining energy. Onsets are visited in the
+    // order of the frame and note loops of Notes::convert: the onset peaks
+    // and the forced onsets, merged.
+    auto peak = onset_peaks.rbegin();
+    auto forced = forced_onsets.rbegin();
+    while (peak != onset_peaks.rend() || forced != forced_onsets.rend()) {
+        std::pair<int, int> next_onset;
+        if (peak != onset_peaks.rend() &&
+            (forced == forced_onsets.rend() || *peak >= *forced)) {
+            next_onset = *peak;
+            if (forced != forced_onsets.rend() && *forced == *peak) {
+                ++forced;
+            }
+            ++peak;
+        } else {
+            next_onset = *forced;
+            ++forced;
+        }
+
+        const int frame_idx = next_onset.first;
+        const int note_idx = next_onset.second;
+        if (frame_idx >= last_frame) {
+            continue;
+        }
+        if (frame_idx < base_frame) {
+            break;
+        }
+
+        int i = frame_idx + 1;
+        int k = 0;
+        while (i < last_frame && k < convert_params.energy_threshold) {
+            if (energy(i, note_idx) < frame_threshold) {
+                k++;
+            } else {
+                k = 0;
+            }
+            i++;
+        }
+
+        const bool reached_last_frame = k < convert_params.energy_threshold;
+        const int last_frame_read = i - 1;
+
+        bool stable = is_final || !reached_last_frame;
+        for (int other_note = std::max(note_idx - 1, 0);
+             other_note <= std::min(note_idx + 1, MAX_NOTE_IDX); other_note++) {
+            if (unstable_start[other_note] <= last_frame_read) {
+                stable = false;
+            }
+        }
+
+        i -= k; // go back to frame above threshold
+
+        Candidate candidate{frame_idx, i, note_idx, 0.0,
+                            false,     stable, reached_last_frame};
+
+        if ((i - frame_idx) > convert_params.min_note_len_frames) {
+            candidate.accepted = true;
+
+            for (int f = frame_idx; f < i; f++) {
+                candidate.amplitude += energy(f, note_idx);
+                energy(f, note_idx) = 0;
+
+                if (note_idx < MAX_NOTE_IDX) {
+                    energy(f, note_idx + 1) = 0;
+                }
+                if (note_idx > 0) {
+                    energy(f, note_idx - 1) = 0;
+                }
+            }
+            candidate.amplitude /= (i - frame_idx);
+        }
+
+        candidates.push_back(candidate);
+        if (!stable) {
+            unstable_start[note_idx] = frame_idx;
+        }
+    }
+
+    // Undo the zeroing for the next replay.
+    for (const auto &candidate : candidates) {
+        if (!candidate.accepted) {
+            continue;
+        }
+        const int first_note = std::max(candidate.note_idx - 1, 0);
+        const int last_note = std::min(candidate.note_idx + 1, MAX_NOTE_IDX);
+        for (int f = candidate.start_frame; f < candidate.end_frame; f++) {
+            const auto &notes = notes_buffer[(size_t)(f - buffer_first_frame)];
+            for (int note = first_note; note <= last_note; note++) {
+                energy(f, note) = notes[note];
+            }
+        }
+    }
+
+    replay_needed = false;
+    open_pitches.assign(NUM_FREQ_OUT, false);
+    for (const auto &candidate : candidates) {
+        if (candidate.reached_last_frame) {
+            open_pitches[candidate.note_idx] = true;
+        }
+    }
+
+    const auto num_events_before = out_events.size();
+    int new_base_frame = last_frame;
+
+    auto emit = [&](const Candidate &candidate) {
+        if (!emitted_notes.insert({candidate.start_frame, candidate.note_idx})
+                 .second) {
+            return false;
+        }
+
+        out_events.push_back(Notes::Event{
+            Notes::model_frame_to_seconds(candidate.start_frame),
+            Notes::model_frame_to_seconds(candidate.end_frame),
+            candidate.start_frame,
+            candidate.end_frame,
+            candidate.note_idx + MIDI_OFFSET,
+            candidate.amplitude,
+            {},
+        });
+        return true;
+    };
+
+    for (const auto &candidate : candidates) {
+        if (candidate.stable) {
+            if (candidate.accepted) {
+                emit(candidate);
+            }
+            continue;
+        }
+
+        if (max_latency_frames >= 0 &&
+            candidate.start_frame < last_frame - max_latency_frames) {
+            // Too old: emit as it is now and let it continue as a new note.
+            if (candidate.accepted && emit(candidate) &&
+                candidate.reached_last_frame) {
+                forced_onsets.insert(
+                    {candidate.end_frame, candidate.note_idx});
+                new_base_frame =
+                    std::min(new_base_frame, candidate.end_frame);
+            }
+            continue;
+        }
+
+        new_base_frame = std::min(new_base_frame, candidate.start_frame);
+    }
+
+    std::sort(out_events.begin() + (long)num_events_before, out_events.end(),
+              [](const Notes::Event &a, const Notes::Event &b) {
+                  return a.start_frame < b.start_frame;
+              });
+
+    // Drop what is before the new base frame.
+    base_frame = new_base_frame;
+
+    emitted_notes.erase(emitted_notes.begin(),
+                        emitted_notes.lower_bound({base_frame, 0}));
+    forced_onsets.erase(forced_onsets.begin(),
+                        forced_onsets.lower_bound({base_frame, 0}));
+    while (!onset_peaks.empty() && onset_peaks.front().first < base_frame) {
+        onset_peaks.pop_front();
+    }
+
+    while (buffer_first_frame < base_frame - 1) {
+        notes_buffer.pop_front();
+        onsets_buffer.pop_front();
+        buffer_first_frame++;
+    }
+
+    // Compacted once the dropped frames are half of it, so frames are moved
+    // a constant number of times on average.
+    const auto num_dropped =
+        (size_t)(base_frame - energy_first_frame) * NUM_FREQ_OUT;
+    if (num_dropped > remaining_energy.size() / 2) {
+        remaining_energy.erase(remaining_energy.begin(),
+                               remaining_energy.begin() + (long)num_dropped);
+        energy_first_frame = base_frame;
+    }
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <deque>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "notes.h"
+#include "state_io.h"
+
+/**
+ * Online version of the onset-driven pass of Notes::convert.
+ * Posteriorgram frames are pushed in order and a note is emitted as soon as
+ * later frames can't change it anymore: its energy has been below
+ * frame_threshold for energy_threshold frames and every later note that could
+ * cut it is final as well. Within that window the offline backward pass is
+ * replayed, so the emitted notes are the ones Notes::convert would find with
+ * the melodia trick disabled.
+ *
+ * Differences with Notes::convert: the melodia pass needs the whole file and
+ * is not run, and inferred onsets are scaled with the maxima seen so far
+ * instead of the maxima of the whole file.
+ */
+class NoteTracker {
+  public:
+    /**
+     * @param convert_params Parameters as for Notes::convert. melodia_trick and
+     * pitch_bend are ignored.
+     * @param max_latency_frames Maximum number of frames between the start of
+     * a note and its emission. A note still sounding after that is emitted
+     * truncated and continues as a new note. -1 means unbounded. Values below
+     * min_note_len_frames + energy_threshold + 2 are raised to that. Frames
+     * that may finalize a note replay the onsets since the oldest note that
+     * is not final, in time linear in its length, so unbounded tracking of
+     * long notes among others costs time quadratic in their length.
+     */
+    explicit NoteTracker(Notes::ConvertParams convert_params,
+                         int max_latency_frames = -1);
+
+    /**
+     * Forget all frames and start over at frame 0.
+     */
+    void reset();
+
+    /**
+     * Push the next posteriorgram frame.
+     * @param notes Note posteriorgram frame. Size should be 88
+     * @param onsets Onset posteriorgram frame. Size should be 88
+     * @param out_events Notes that became final are appended to this.
+     */
+    void push_frame(const float *notes, const float *onsets,
+                    std::vector<Notes::Event> &out_events);
+
+    /**
+     * Signal the end of the input and emit all remaining notes.
+     * @param out_events Remaining notes are appended to this.
+     */
+    void flush(std::vector<Notes::Event> &out_events);
+
+    /**
+     * Write the frames and notes that are not final yet and the inferred
+     * onset maxima. Parameters are not part of the state.
+     */
+    void save_state(StateWriter &writer) const;
+
+    /**
+     * Restore a state written by save_state, by a tracker with the same
+     * parameters.
+     * @return False if the blob is truncated or inconsistent. The tracker is
+     * then reset.
+     */
+    bool restore_state(StateReader &reader);
+
+    /**
+     * @return Number of frames pushed since reset.
+     */
+    [[nodiscard]] int num_frames() const { return frame_count; }
+
+  private:
+    typedef struct {
+        int start_frame;
+        int end_frame;
+        int note_idx;
+        double amplitude;
+        bool accepted;
+        bool stable;
+        bool reached_last_frame;
+    } Candidate;
+
+    /**
+     * Replay the onset pass over the frames that are not final yet, emit the
+     * notes that became final and drop frames that are no longer needed.
+     * @param is_final True if no more frames will be pushed.
+     * @param out_events Output event vector.
+     */
+    void process(bool is_final, std::vector<Notes::Event> &out_events);
+
+    /**
+     * Append the onset peaks of a frame to onset_peaks, as picked by
+     * Notes::convert. The next frame must have been pushed.
+     * @param frame Frame index.
+     */
+    void find_onset_peaks(int frame);
+
+    /**
+     * Check whether replaying the window after the latest frame can emit a
+     * note or move base_frame, and mark the pitches of new onsets as open.
+     * A replay can only finalize notes if a note that reached the last frame
+     * may have ended, which needs its pitch to be quiet on the frame the
+     * replay reads newly, or if max_latency_frames forces an emission. New
+     * onsets only add notes that reach the last frame: they can't change the
+     * notes that are final.
+     */
+    bool needs_replay();
+
+    const Notes::ConvertParams convert_params;
+    const int max_latency_frames;
+    int min_note_idx = 0;
+    int max_note_idx = MAX_NOTE_IDX;
+
+    // Posteriorgram frames from buffer_first_frame up to the last pushed one.
+    // One frame before base_frame is kept for the onset peak picking.
+    std::deque<std::vector<float>> notes_buffer;
+    std::deque<std::vector<float>> onsets_buffer;
+    int buffer_first_frame = 0;
+
+    // First frame where an onset may still give a note that is not final.
+    int base_frame = 0;
+    int frame_count = 0;
+
+    // (start frame, note index) of emitted notes at or after base_frame, and
+    // of note continuations forced by max_latency_frames.
+    std::set<std::pair<int, int>> emitted_notes;
+    std::set<std::pair<int, int>> forced_onsets;
+
+    // (frame, note index) of the onset peaks at or after base_frame, in
+    // order. The peaks of a frame are known once the next one is pushed.
+    std::deque<std::pair<int, int>> onset_peaks;
+
+    // Running state for the inferred onsets.
+    std::vector<float> previous_notes[2];
+    float max_onset = 0.0f;
+    float max_min_notes_diff = 0.0f;
+
+    // Pitches of the notes that reached the last frame at the latest replay
+    // and of the onsets pushed since. Replays are skipped until one of them
+    // is quiet, see needs_replay.
+    std::vector<bool> open_pitches;
+    bool replay_needed = true;
+
+    // Note posteriorgrams from energy_first_frame, zeroed by the replay and
+    // restored after it, so frames are only copied once.
+    std::vector<float> remaining_energy;
+    int energy_first_frame = 0;
+
+    // Scratch buffers for push_frame() and process()
+    std::vector<float> min_notes_diff;
+    std::vector<Candidate> candidates;
+    std::vector<int> unstable_start;
+};
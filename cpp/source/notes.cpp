@@ -1,6 +1,56 @@
 
 #include "notes.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "trace.h"
+
+static bool is_cancelled(const std::atomic<bool> *cancel) {
+    return cancel != nullptr && cancel->load(std::memory_order_relaxed);
+}
+
+Notes::Event Notes::CompactEvents::event(size_t index) const {
+    const auto &event = events[index];
+    const auto *event_bends = bends.data() + event.bends_begin;
+
+    return Notes::Event{event.start_time,
+                        event.end_time,
+                        event.start_frame,
+                        event.end_frame,
+                        event.midi_note_number,
+                        event.amplitude,
+                        std::vector<int>(event_bends,
+                                         event_bends + event.num_bends)};
+}
+
+void Notes::CompactEvents::append(const CompactEvents &other) {
+    const auto bends_offset = (uint32_t)bends.size();
+
+    bends.insert(bends.end(), other.bends.begin(), other.bends.end());
+
+    const auto first_event = events.size();
+    events.insert(events.end(), other.events.begin(), other.events.end());
+    for (size_t i = first_event; i < events.size(); i++) {
+        events[i].bends_begin += bends_offset;
+    }
+}
+
+void Notes::CompactEvents::clear() {
+    events.clear();
+    bends.clear();
+}
+
+std::vector<Notes::Event> Notes::to_events(const CompactEvents &events) {
+    std::vector<Notes::Event> out;
+    out.reserve(events.size());
+    for (size_t i = 0; i < events.size(); i++) {
+        out.push_back(events.event(i));
+    }
+    return out;
+}
+
 bool Notes::Event::operator==(const Notes::Event &other) const {
     return this->start_time == other.start_time &&
            this->end_time == other.end_time &&
@@ -15,35 +65,246 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
                const std::vector<std::vector<float>> &onsets_posteriorgrams,
                const std::vector<std::vector<float>> &contours_posteriorgrams,
                ConvertParams convert_params) {
-    std::vector<Notes::Event> events;
-    events.reserve(1000);
+    return convert_parallel(notes_posteriorgrams, onsets_posteriorgrams,
+                            contours_posteriorgrams, convert_params, 1);
+}
+
+std::vector<Notes::Event> Notes::convert_parallel(
+    const std::vector<std::vector<float>> &notes_posteriorgrams,
+    const std::vector<std::vector<float>> &onsets_posteriorgrams,
+    const std::vector<std::vector<float>> &contours_posteriorgrams,
+    ConvertParams convert_params, int num_threads) {
+    return to_events(convert_compact(notes_posteriorgrams,
+                                     onsets_posteriorgrams,
+                                     contours_posteriorgrams, convert_params,
+                                     num_threads));
+}
+
+Notes::CompactEvents
+Notes::convert_compact(const HalfPosteriorgram &notes_posteriorgram,
+                       const HalfPosteriorgram &onsets_posteriorgram,
+                       const HalfPosteriorgram &contours_posteriorgram,
+                       ConvertParams convert_params, int num_threads,
+                       const std::atomic<bool> *cancel) {
+    return convert_compact(notes_posteriorgram.to_frames(),
+                           onsets_posteriorgram.to_frames(),
+                           contours_posteriorgram.to_frames(), convert_params,
+                           num_threads, cancel);
+}
+
+Notes::CompactEvents Notes::convert_compact(
+    const std::vector<std::vector<float>> &notes_posteriorgrams,
+    const std::vector<std::vector<float>> &onsets_posteriorgrams,
+    const std::vector<std::vector<float>> &contours_posteriorgrams,
+    ConvertParams convert_params, int num_threads,
+    const std::atomic<bool> *cancel) {
+    TraceScope trace_scope("Notes::convert");
+
+    CompactEvents events;
+    events.events.reserve(1000);
 
     auto n_frames = notes_posteriorgrams.size();
     if (n_frames == 0) {
         return events;
     }
 
-    auto n_notes = notes_posteriorgrams[0].size();
     assert(n_frames == onsets_posteriorgrams.size());
-    assert(n_frames == contours_posteriorgrams.size());
-    assert(n_notes == onsets_posteriorgrams[0].size());
-
+    // Contours are only needed for pitch bends
+    assert(n_frames == contours_posteriorgrams.size() ||
+           (convert_params.pitch_bend == NoPitchBend &&
+            contours_posteriorgrams.empty()));
+    assert(notes_posteriorgrams[0].size() == onsets_posteriorgrams[0].size());
+
+    // Onsets are inferred on the whole posteriorgrams: they are rescaled by
+    // their global maximum.
     std::vector<std::vector<float>> inferred_onsets;
     auto onsets_ptr = &onsets_posteriorgrams;
     if (convert_params.infer_onsets) {
+        TraceScope onsets_scope("Notes::inferred_onsets");
         inferred_onsets = Notes::inferred_onsets<float>(onsets_posteriorgrams,
                                                         notes_posteriorgrams);
         onsets_ptr = &inferred_onsets;
     }
-    auto &onsets = *onsets_ptr;
+
+    if (is_cancelled(cancel)) {
+        return {};
+    }
 
     // deep copy
+    TraceScope copy_scope("Notes copy remaining energy");
     auto remaining_energy = notes_posteriorgrams;
+    copy_scope.end();
+
+    // stop 1 frame early to prevent edge case
+    // as per
+    // https://github.com/spotify/basic-pitch/blob/f85a8e9ade1f297b8adb39b155c483e2312e1aca/basic_pitch/note_creation.py#L399
+    const int last_frame = static_cast<int>(n_frames) - 1;
+
+    TraceScope segments_scope("Notes::find_segments");
+    const auto segment_bounds =
+        find_segments(notes_posteriorgrams, convert_params, last_frame);
+    segments_scope.end();
+
+    if (is_cancelled(cancel)) {
+        return {};
+    }
+
+    const int num_segments = static_cast<int>(segment_bounds.size()) - 1;
+
+    if (num_threads <= 0) {
+        num_threads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    num_threads = std::clamp(num_threads, 1, std::max(num_segments, 1));
+
+    // Each thread converts consecutive segments holding about the same number
+    // of frames. Segments only read and write their own frames of
+    // remaining_energy.
+    std::vector<CompactEvents> segment_events(
+        (size_t)std::max(num_segments, 0));
+
+    auto convert_segments = [&](int first_segment, int end_segment) {
+        TraceScope thread_scope("Notes convert segments");
+
+        // Reused by the segments of this thread
+        std::vector<PosteriorgramIndex> remaining_energy_index;
+
+        for (int n = first_segment; n < end_segment && !is_cancelled(cancel);
+             n++) {
+            auto &out = segment_events[(size_t)n];
+            convert_segment(notes_posteriorgrams, *onsets_ptr,
+                            remaining_energy, convert_params, last_frame,
+                            segment_bounds[(size_t)n],
+                            segment_bounds[(size_t)n + 1],
+                            remaining_energy_index, out.events, cancel);
+            if (convert_params.pitch_bend != NoPitchBend) {
+                TraceScope bends_scope("Notes::add_pitch_bends");
+                add_pitch_bends(out, contours_posteriorgrams);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    int first_segment = 0;
+    for (int t = 0; t < num_threads; t++) {
+        const auto frame_end = (int64_t)last_frame * (t + 1) / num_threads;
+        int end_segment = first_segment;
+        while (end_segment < num_segments &&
+               (t == num_threads - 1 ||
+                segment_bounds[(size_t)end_segment] < frame_end)) {
+            end_segment++;
+        }
+
+        if (t == num_threads - 1) {
+            convert_segments(first_segment, end_segment);
+        } else if (end_segment > first_segment) {
+            threads.emplace_back([&convert_segments, first_segment,
+                                  end_segment]() {
+                trace_set_thread_name("note worker");
+                convert_segments(first_segment, end_segment);
+            });
+        }
+        first_segment = end_segment;
+    }
+
+    TraceScope join_scope("Notes join threads");
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    join_scope.end();
+
+    // Segments may have been skipped or cut short
+    if (is_cancelled(cancel)) {
+        return {};
+    }
+
+    TraceScope merge_scope("Notes merge segments");
+    size_t num_events = 0;
+    size_t num_bends = 0;
+    for (const auto &segment : segment_events) {
+        num_events += segment.size();
+        num_bends += segment.bends.size();
+    }
+    events.events.reserve(num_events);
+    events.bends.reserve(num_bends);
+
+    for (const auto &segment : segment_events) {
+        events.append(segment);
+    }
+
+    sort_events(events.events);
+
+    if (convert_params.pitch_bend == SinglePitchBend) {
+        drop_overlapping_pitch_bends(events.events);
+    }
+
+    return events;
+}
+
+size_t Notes::working_memory(size_t num_frames,
+                             const ConvertParams &convert_params) {
+    // Copy of the note posteriorgram for the remaining energy
+    size_t bytes = float_posteriorgram_bytes(num_frames, NUM_FREQ_OUT);
+
+    if (convert_params.infer_onsets) {
+        bytes += float_posteriorgram_bytes(num_frames, NUM_FREQ_OUT);
+    }
+
+    // Each thread keeps the index of its largest segment: all frames at
+    // most.
+    if (convert_params.melodia_trick) {
+        bytes += num_frames * NUM_FREQ_OUT * sizeof(PosteriorgramIndex);
+    }
+
+    return bytes;
+}
+
+std::vector<int>
+Notes::find_segments(const std::vector<std::vector<float>> &notes_posteriorgrams,
+                     const ConvertParams &convert_params, int last_frame) {
+    std::vector<int> bounds = {0};
+
+    // A note started before a quiet stretch ends at most energy_threshold
+    // frames into it, and one started inside it ends before it unless it
+    // starts less than energy_threshold frames before its end: cut there.
+    const int energy_threshold = convert_params.energy_threshold;
+    int num_quiet_frames = 0;
+    for (int frame_idx = 0; frame_idx < last_frame; frame_idx++) {
+        const auto &frame = notes_posteriorgrams[(size_t)frame_idx];
+        const bool is_quiet = *std::max_element(frame.begin(), frame.end()) <
+                              convert_params.frame_threshold;
+
+        if (is_quiet) {
+            num_quiet_frames++;
+            continue;
+        }
+
+        if (num_quiet_frames > energy_threshold && energy_threshold >= 0) {
+            bounds.push_back(frame_idx - energy_threshold);
+        }
+        num_quiet_frames = 0;
+    }
+
+    bounds.push_back(std::max(last_frame, 0));
+    return bounds;
+}
+
+void Notes::convert_segment(
+    const std::vector<std::vector<float>> &notes_posteriorgrams,
+    const std::vector<std::vector<float>> &onsets,
+    std::vector<std::vector<float>> &remaining_energy,
+    const ConvertParams &convert_params, int last_frame, int begin_frame,
+    int end_frame, std::vector<PosteriorgramIndex> &remaining_energy_index,
+    std::vector<Notes::CompactEvent> &events,
+    const std::atomic<bool> *cancel) {
+    TraceScope onset_scope("Notes onset pass");
+
+    auto n_notes = notes_posteriorgrams[0].size();
 
     // to-be-sorted index of remaining_energy
-    std::vector<PosteriorgramIndex> remaining_energy_index;
+    remaining_energy_index.clear();
     if (convert_params.melodia_trick) {
-        remaining_energy_index.reserve(n_frames * n_notes);
+        remaining_energy_index.reserve((size_t)(end_frame - begin_frame) *
+                                       n_notes);
     }
 
     const auto frame_threshold = convert_params.frame_threshold;
@@ -60,13 +321,13 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             ? 0
             : ((ftom(convert_params.min_frequency) - MIDI_OFFSET)));
 
-    // stop 1 frame early to prevent edge case
-    // as per
-    // https://github.com/spotify/basic-pitch/blob/f85a8e9ade1f297b8adb39b155c483e2312e1aca/basic_pitch/note_creation.py#L399
-    int last_frame = static_cast<int>(n_frames) - 1;
+    // Searches stop at the segment end: only quiet frames may follow it up to
+    // where they would have stopped, so notes are the same.
+    const int search_end = std::min(end_frame, last_frame);
 
     // Go backwards in time
-    for (int frame_idx = last_frame - 1; frame_idx >= 0; frame_idx--) {
+    for (int frame_idx = end_frame - 1; frame_idx >= begin_frame;
+         frame_idx--) {
         for (int note_idx = max_note_idx; note_idx >= min_note_idx;
              note_idx--) {
             auto onset = onsets[frame_idx][note_idx];
@@ -93,7 +354,7 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             // below an energy threshold
             int i = frame_idx + 1;
             int k = 0; // number of frames since energy dropped below threshold
-            while (i < last_frame && k < convert_params.energy_threshold) {
+            while (i < search_end && k < convert_params.energy_threshold) {
                 if (remaining_energy[i][note_idx] < frame_threshold) {
                     k++;
                 } else {
@@ -123,23 +384,40 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             }
             amplitude /= (i - frame_idx);
 
-            events.push_back(Notes::Event{
+            events.push_back(Notes::CompactEvent{
                 model_frame_to_seconds(frame_idx) /* startTime */,
                 model_frame_to_seconds(i) /* endTime */,
                 frame_idx /* startFrame */,
                 i /* endFrame */,
                 note_idx + MIDI_OFFSET /* pitch */,
                 amplitude /* amplitude */,
+                0 /* bends_begin */,
+                0 /* num_bends */,
             });
         }
     }
 
-    if (convert_params.melodia_trick) {
+    onset_scope.end();
+
+    if (convert_params.melodia_trick && !is_cancelled(cancel)) {
+        TraceScope melodia_scope("Notes melodia pass");
+
+        // Ties are broken by index order, so the order doesn't depend on
+        // how the posteriorgrams are split into segments.
         std::sort(remaining_energy_index.begin(), remaining_energy_index.end(),
                   [](const PosteriorgramIndex &a, const PosteriorgramIndex &b) {
-                      return *a.value > *b.value;
+                      if (*a.value != *b.value) {
+                          return *a.value > *b.value;
+                      }
+                      return a.frame_index > b.frame_index ||
+                             (a.frame_index == b.frame_index &&
+                              a.note_index > b.note_index);
                   });
 
+        // Backward searches stop at the segment start, as forward ones do at
+        // its end. Frame 0 is never reached, as in basic pitch.
+        const int search_begin = std::max(begin_frame - 1, 0);
+
         // loop through each remaining note probability in descending order
         // until reaching frame_threshold.
         for (auto rei : remaining_energy_index) {
@@ -182,7 +460,7 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             // forward pass
             int i = frame_idx + 1;
             int k = 0;
-            while (i < last_frame && k < convert_params.energy_threshold) {
+            while (i < search_end && k < convert_params.energy_threshold) {
                 k = inhibit(remaining_energy, i, note_idx, frame_threshold, k);
                 i++;
             }
@@ -192,7 +470,7 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             // backward pass
             i = frame_idx - 1;
             k = 0;
-            while (i > 0 && k < convert_params.energy_threshold) {
+            while (i > search_begin && k < convert_params.energy_threshold) {
                 k = inhibit(remaining_energy, i, note_idx, frame_threshold, k);
                 i--;
             }
@@ -210,35 +488,38 @@ Notes::convert(const std::vector<std::vector<float>> &notes_posteriorgrams,
             }
             amplitude /= (i_end - i_start);
 
-            events.push_back(Notes::Event{
+            events.push_back(Notes::CompactEvent{
                 model_frame_to_seconds(i_start /* startTime */),
                 model_frame_to_seconds(i_end) /* endTime */,
                 i_start /* startFrame */,
                 i_end /* endFrame */,
                 note_idx + MIDI_OFFSET /* pitch */,
                 amplitude /* amplitude */,
+                0 /* bends_begin */,
+                0 /* num_bends */,
             });
         }
     }
-
-    sort_events(events);
-
-    if (convert_params.pitch_bend != NoPitchBend) {
-        add_pitch_bends(events, contours_posteriorgrams);
-        if (convert_params.pitch_bend == SinglePitchBend) {
-            drop_overlapping_pitch_bends(events);
-        }
-    }
-
-    return events;
 }
 
 void Notes::add_pitch_bends(
-    std::vector<Notes::Event> &target_events,
+    CompactEvents &target_events,
     const std::vector<std::vector<float>> &contour_posteriorgram_matrix,
     int num_bins_tolerance) {
+    // Bends are within +-num_bins_tolerance
+    assert(num_bins_tolerance <= INT8_MAX);
+
+    size_t num_bends = target_events.bends.size();
+    for (const auto &event : target_events.events) {
+        num_bends += (size_t)(event.end_frame - event.start_frame);
+    }
+    target_events.bends.reserve(num_bends);
+
     auto window_length = num_bins_tolerance * 2 + 1;
-    for (auto &event : target_events) {
+    for (auto &event : target_events.events) {
+        event.bends_begin = (uint32_t)target_events.bends.size();
+        event.num_bends = (uint32_t)(event.end_frame - event.start_frame);
+
         // midi_pitch_to_contour_bin
         int note_idx =
             CONTOURS_BINS_PER_SEMITONE *
@@ -271,7 +552,7 @@ void Notes::add_pitch_bends(
                     max = w;
                 }
             }
-            event.bends.emplace_back(bend - pb_shift);
+            target_events.bends.push_back((int8_t)(bend - pb_shift));
         }
     }
 }
\ No newline at end of file
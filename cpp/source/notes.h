@@ -1,9 +1,15 @@
+#pragma once
 
+#include <atomic>
+#include <climits>
 #include <cmath>
+#include <cstdint>
 #include <json.hpp>
+#include <unordered_map>
 #include <vector>
 
 #include "constants.h"
+#include "posteriorgram.h"
 
 enum PitchBendModes { NoPitchBend = 0, SinglePitchBend, MultiPitchBend };
 
@@ -32,6 +38,48 @@ class Notes {
         bool operator==(const struct Event &) const;
     } Event;
 
+    /**
+     * Note event whose pitch bends are stored in the bends array of its
+     * CompactEvents. A small POD, cheap to copy and sort.
+     */
+    typedef struct CompactEvent {
+        double start_time;
+        double end_time;
+        int start_frame;
+        int end_frame;
+        int midi_note_number;
+        double amplitude;
+        uint32_t bends_begin; // Index of the first bend in CompactEvents::bends
+        uint32_t num_bends;   // 0 or end_frame - start_frame
+    } CompactEvent;
+
+    /**
+     * Note events with all pitch bends in one contiguous array, instead of
+     * one allocation per event.
+     */
+    typedef struct CompactEvents {
+        std::vector<CompactEvent> events;
+        // One value of pitch bend per frame of each event. Units is 1/3 of
+        // semitones, within +-PITCH_BEND_NUM_BINS_TOLERANCE.
+        std::vector<int8_t> bends;
+
+        [[nodiscard]] size_t size() const { return events.size(); }
+
+        /**
+         * @param index Event index.
+         * @return Event with its pitch bends.
+         */
+        [[nodiscard]] Event event(size_t index) const;
+
+        /**
+         * Append events of another container, after the current ones.
+         * @param other Events to append.
+         */
+        void append(const CompactEvents &other);
+
+        void clear();
+    } CompactEvents;
+
     typedef struct ConvertParams {
         /* Note segmentation (0.05 - 0.95, Split-Merge Notes) */
         float onset_threshold = 0.3;
@@ -51,7 +99,8 @@ class Notes {
      * Create note events based on postegriorgram inputs
      * @param notes_posteriorgrams Note posteriorgrams
      * @param onsets_posteriorgrams Onset posteriorgrams
-     * @param contours_posteriorgrams Contour posteriorgrams
+     * @param contours_posteriorgrams Contour posteriorgrams. May be empty if
+     * convert_params.pitch_bend is NoPitchBend.
      * @param convert_params input parameters
      * @return
      */
@@ -61,16 +110,76 @@ class Notes {
             const std::vector<std::vector<float>> &contours_posteriorgrams,
             ConvertParams convert_params);
 
+    /**
+     * Same as convert_parallel, with events stored in a CompactEvents.
+     * @param cancel Checked between passes and segments. Once set, conversion
+     * stops early and returns no events. May be nullptr.
+     */
+    static CompactEvents convert_compact(
+        const std::vector<std::vector<float>> &notes_posteriorgrams,
+        const std::vector<std::vector<float>> &onsets_posteriorgrams,
+        const std::vector<std::vector<float>> &contours_posteriorgrams,
+        ConvertParams convert_params, int num_threads = 1,
+        const std::atomic<bool> *cancel = nullptr);
+
+    /**
+     * Same as convert_compact on half precision posteriorgrams, converted
+     * back to float once before extraction.
+     */
+    static CompactEvents
+    convert_compact(const HalfPosteriorgram &notes_posteriorgram,
+                    const HalfPosteriorgram &onsets_posteriorgram,
+                    const HalfPosteriorgram &contours_posteriorgram,
+                    ConvertParams convert_params, int num_threads = 1,
+                    const std::atomic<bool> *cancel = nullptr);
+
+    /**
+     * Upper bound of the memory convert_compact allocates besides its inputs
+     * and the events it returns, for memory budgets. Half precision inputs
+     * are converted to float first, which is not counted.
+     * @param num_frames Number of posteriorgram frames.
+     * @param convert_params Conversion parameters.
+     * @return Bytes.
+     */
+    static size_t working_memory(size_t num_frames,
+                                 const ConvertParams &convert_params);
+
+    /**
+     * @param events Compact events.
+     * @return The same events, each with its own pitch bend vector.
+     */
+    static std::vector<Notes::Event> to_events(const CompactEvents &events);
+
+    /**
+     * Same as convert, on several threads. The posteriorgrams are cut where
+     * all notes stay below frame_threshold for more than energy_threshold
+     * frames, which no note can cross, and the segments are converted in
+     * parallel. Events are the same as with convert.
+     * @param num_threads Maximum number of threads, including the calling
+     * one. 0 for the number of cores.
+     * Other parameters are the same as for convert.
+     */
+    static std::vector<Notes::Event> convert_parallel(
+        const std::vector<std::vector<float>> &notes_posteriorgrams,
+        const std::vector<std::vector<float>> &onsets_posteriorgrams,
+        const std::vector<std::vector<float>> &contours_posteriorgrams,
+        ConvertParams convert_params, int num_threads = 0);
+
     /**
      * Inplace sort of note events.
-     * @param events
+     * @param events Event or CompactEvent vector.
      */
-    static inline void sort_events(std::vector<Notes::Event> &events) {
+    template <typename EventType>
+    static inline void sort_events(std::vector<EventType> &events) {
         std::sort(events.begin(), events.end(),
-                  [](const Event &a, const Event &b) {
-                      return a.start_frame < b.start_frame ||
-                             (a.start_frame == b.start_frame &&
-                              a.end_frame < b.end_frame);
+                  [](const EventType &a, const EventType &b) {
+                      if (a.start_frame != b.start_frame) {
+                          return a.start_frame < b.start_frame;
+                      }
+                      if (a.end_frame != b.end_frame) {
+                          return a.end_frame < b.end_frame;
+                      }
+                      return a.midi_note_number < b.midi_note_number;
                   });
     }
 
@@ -78,20 +187,25 @@ class Notes {
      * drop_overlapping_pitch_bends sets bends to an empty array to all the note
      * events that are overlapping in time. inOutEvents is expected to be
      * sorted.
-     * @param events
+     * @param events Event or CompactEvent vector.
      */
-    static void
-    drop_overlapping_pitch_bends(std::vector<Notes::Event> &events) {
-        for (int i = 0; i < int(events.size()) - 1; i++) {
+    template <typename EventType>
+    static void drop_overlapping_pitch_bends(std::vector<EventType> &events) {
+        // Since events are sorted by start, an event overlaps a later one if
+        // it overlaps the next one, and an earlier one if it starts before
+        // the latest end so far.
+        int max_end_frame = INT_MIN;
+        for (size_t i = 0; i < events.size(); i++) {
             auto &event = events[i];
-            // if there is an overlap between events, remove pitch bends
-            for (int j = i + 1; j < events.size(); j++) {
-                auto &event2 = events[j];
-                if (event2.start_frame >= event.end_frame) {
-                    break;
-                }
-                event.bends = std::vector<int>();
-                event2.bends = std::vector<int>();
+            const bool overlaps_previous = event.start_frame < max_end_frame;
+            const bool overlaps_next =
+                i + 1 < events.size() &&
+                events[i + 1].start_frame < event.end_frame;
+
+            max_end_frame = std::max(max_end_frame, event.end_frame);
+
+            if (overlaps_previous || overlaps_next) {
+                clear_bends(event);
             }
         }
     }
@@ -99,49 +213,87 @@ class Notes {
     /**
      * mergeOverlappingNotes merges note events of same pitch that are
      * overlapping in time. inOutEvents is expected to be sorted.
-     * @param events
+     * @param events Event or CompactEvent vector.
      */
+    template <typename EventType>
     static void
-    merge_overlapping_notes_with_same_pitch(std::vector<Notes::Event> &events) {
+    merge_overlapping_notes_with_same_pitch(std::vector<EventType> &events) {
         sort_events(events);
-        for (int i = 0; i < int(events.size()) - 1; i++) {
+
+        // Each event absorbs the following events of same pitch that start
+        // before it ends, its end being updated at each merge. The event
+        // right after a merged one is not considered for that event, as in
+        // the original erase-in-loop version. Remaining events are kept in a
+        // linked list, and in one per pitch so only same pitch events are
+        // visited.
+        const int num_events = static_cast<int>(events.size());
+        std::vector<int> next(num_events);
+        std::vector<int> prev(num_events);
+        std::vector<int> next_same_pitch(num_events, -1);
+        std::vector<int> prev_same_pitch(num_events, -1);
+        std::vector<bool> is_merged(num_events, false);
+
+        std::unordered_map<int, int> last_of_pitch;
+        for (int i = 0; i < num_events; i++) {
+            next[i] = (i + 1 < num_events) ? i + 1 : -1;
+            prev[i] = i - 1;
+
+            auto last = last_of_pitch.find(events[i].midi_note_number);
+            if (last != last_of_pitch.end()) {
+                prev_same_pitch[i] = last->second;
+                next_same_pitch[last->second] = i;
+                last->second = i;
+            } else {
+                last_of_pitch.emplace(events[i].midi_note_number, i);
+            }
+        }
+
+        auto remove = [&](int j) {
+            if (prev[j] >= 0) {
+                next[prev[j]] = next[j];
+            }
+            if (next[j] >= 0) {
+                prev[next[j]] = prev[j];
+            }
+            if (prev_same_pitch[j] >= 0) {
+                next_same_pitch[prev_same_pitch[j]] = next_same_pitch[j];
+            }
+            if (next_same_pitch[j] >= 0) {
+                prev_same_pitch[next_same_pitch[j]] = prev_same_pitch[j];
+            }
+            is_merged[j] = true;
+        };
+
+        for (int i = 0; i >= 0 && i < num_events; i = next[i]) {
             auto &event = events[i];
-            for (auto j = i + 1; j < events.size(); j++) {
-                auto &event2 = events[j];
 
-                // If notes don't overlap, break
-                if (event2.start_frame >= event.end_frame) {
-                    break;
-                }
+            int j = next_same_pitch[i];
+            while (j >= 0 && events[j].start_frame < event.end_frame) {
+                event.end_time = events[j].end_time;
+                event.end_frame = events[j].end_frame;
+
+                const int skipped = next[j];
+                remove(j);
+
+                j = (skipped >= 0 && events[skipped].midi_note_number ==
+                                         event.midi_note_number)
+                        ? next_same_pitch[skipped]
+                        : next_same_pitch[j];
+            }
+        }
 
-                // If notes overlap and have the same pitch: merge them
-                if (event.midi_note_number == event2.midi_note_number) {
-                    event.end_time = event2.end_time;
-                    event.end_frame = event2.end_frame;
-                    events.erase(events.begin() + j);
+        int num_kept = 0;
+        for (int i = 0; i < num_events; i++) {
+            if (!is_merged[i]) {
+                if (num_kept != i) {
+                    events[num_kept] = std::move(events[i]);
                 }
+                num_kept++;
             }
         }
+        events.erase(events.begin() + num_kept, events.end());
     }
 
-  private:
-    typedef struct {
-        float *value;
-        int frame_index;
-        int note_index;
-    } PosteriorgramIndex;
-
-    /**
-     * Add pitch bend vector to note events.
-     * @param target_events event vector (input and output)
-     * @param contour_posteriorgram_matrix Contour posteriorgram matrix
-     * @param num_bins_tolerance
-     */
-    static void add_pitch_bends(
-        std::vector<Notes::Event> &target_events,
-        const std::vector<std::vector<float>> &contour_posteriorgram_matrix,
-        int num_bins_tolerance = 25);
-
     /**
      * Get time in seconds given frame index.
      * Different behaviour in test because of weirdness in basic-pitch code
@@ -185,6 +337,68 @@ class Notes {
                                69.0);
     }
 
+  private:
+    friend class NoteTracker;
+
+    static void clear_bends(Event &event) { event.bends = std::vector<int>(); }
+    static void clear_bends(CompactEvent &event) { event.num_bends = 0; }
+
+    typedef struct {
+        float *value;
+        int frame_index;
+        int note_index;
+    } PosteriorgramIndex;
+
+    /**
+     * @param notes_posteriorgrams Note posteriorgrams
+     * @param convert_params input parameters
+     * @param last_frame Frame past the last one where notes can start.
+     * @return Bounds of the segments convert can process independently: first
+     * frame of each segment, then last_frame.
+     */
+    static std::vector<int>
+    find_segments(const std::vector<std::vector<float>> &notes_posteriorgrams,
+                  const ConvertParams &convert_params, int last_frame);
+
+    /**
+     * Onset and melodia passes of convert on frames [begin_frame, end_frame),
+     * without sort nor pitch bends.
+     * @param notes_posteriorgrams Note posteriorgrams
+     * @param onsets Onset posteriorgrams, inferred if enabled.
+     * @param remaining_energy Copy of the note posteriorgrams, updated on
+     * frames of the segment.
+     * @param convert_params input parameters
+     * @param last_frame Frame past the last one where notes can start.
+     * @param begin_frame First frame of the segment.
+     * @param end_frame Frame past the last one of the segment.
+     * @param remaining_energy_index Buffer for the melodia pass, reused
+     * across segments.
+     * @param events Event vector the notes are added to.
+     * @param cancel Checked between the onset and melodia passes. May be
+     * nullptr.
+     */
+    static void
+    convert_segment(const std::vector<std::vector<float>> &notes_posteriorgrams,
+                    const std::vector<std::vector<float>> &onsets,
+                    std::vector<std::vector<float>> &remaining_energy,
+                    const ConvertParams &convert_params, int last_frame,
+                    int begin_frame, int end_frame,
+                    std::vector<PosteriorgramIndex> &remaining_energy_index,
+                    std::vector<Notes::CompactEvent> &events,
+                    const std::atomic<bool> *cancel = nullptr);
+
+    /**
+     * Add pitch bends to note events.
+     * @param target_events events (input and output), bends are appended to
+     * its bends array
+     * @param contour_posteriorgram_matrix Contour posteriorgram matrix
+     * @param num_bins_tolerance
+     */
+    static void add_pitch_bends(
+        CompactEvents &target_events,
+        const std::vector<std::vector<float>> &contour_posteriorgram_matrix,
+        int num_bins_tolerance = PITCH_BEND_NUM_BINS_TOLERANCE);
+
     /**
      * Returns a version of inOnsetsPG augmented by detecting differences in
      * note posteriorgrams across frames separated by varying offsets (up to
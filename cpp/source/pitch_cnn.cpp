@@ -1,6 +1,12 @@
 
 #include "pitch_cnn.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "trace.h"
+
 using json = nlohmann::json;
 
 PitchCnn::PitchCnn(BinaryBlob cnn_contour_model_json,
@@ -11,25 +17,116 @@ PitchCnn::PitchCnn(BinaryBlob cnn_contour_model_json,
         cnn_contour_model_json.data,
         cnn_contour_model_json.data + cnn_contour_model_json.num_bytes);
 
-    cnn_contour.parseJson(json_cnn_contour);
+    contour_conv_1.load(json_cnn_contour.at("layers").at(0));
+    contour_conv_2.load(json_cnn_contour.at("layers").at(1));
 
     const auto json_cnn_note =
         json::parse(cnn_note_model_json.data,
                     cnn_note_model_json.data + cnn_note_model_json.num_bytes);
 
-    cnn_note.parseJson(json_cnn_note);
+    note_conv_1.load(json_cnn_note.at("layers").at(0));
+    note_conv_2.load(json_cnn_note.at("layers").at(1));
 
     const auto json_cnn_onset_input = json::parse(
         cnn_onset_1_model_json.data,
         cnn_onset_1_model_json.data + cnn_onset_1_model_json.num_bytes);
 
-    cnn_onset_input.parseJson(json_cnn_onset_input);
+    onset_input_conv.load(json_cnn_onset_input.at("layers").at(0));
 
     const auto json_cnn_onset_output = json::parse(
         cnn_onset_2_model_json.data,
         cnn_onset_2_model_json.data + cnn_onset_2_model_json.num_bytes);
 
-    cnn_onset_output.parseJson(json_cnn_onset_output);
+    onset_output_conv.load(json_cnn_onset_output.at("layers").at(0));
+
+    // Checks on model shapes
+    assert(contour_conv_1.num_features_in() == NUM_FREQ_IN);
+    assert(contour_conv_1.num_channels_in() == NUM_HARMONICS);
+    assert(contour_conv_2.num_channels_out() == 1);
+    assert(note_conv_2.num_features_out() == NUM_FREQ_OUT);
+    assert(note_conv_2.num_channels_out() == 1);
+    assert(onset_input_conv.num_features_out() == NUM_FREQ_OUT);
+    assert(onset_input_conv.num_channels_out() == 32);
+    assert(onset_output_conv.num_channels_in() == 33);
+    assert(onset_input_conv.kernel_size_time() == num_input_stored);
+    assert(contour_conv_1.kernel_size_time() <= num_input_stored);
+    assert(onset_input_conv.num_features_in() == NUM_FREQ_IN);
+
+    prune_weights(0.0f);
+}
+
+// Layer shapes of the basic pitch model, in prepacked weight file order.
+static const std::array<Conv2d::Shape, PitchCnn::num_layers> model_shapes = {{
+    {3, 39, 1, NUM_HARMONICS, 8, NUM_FREQ_IN, Conv2d::Relu},
+    {5, 5, 1, 8, 1, NUM_FREQ_IN, Conv2d::Sigmoid},
+    {7, 7, 3, 1, 32, NUM_FREQ_IN, Conv2d::Relu},
+    {7, 3, 1, 32, 1, NUM_FREQ_OUT, Conv2d::Sigmoid},
+    {5, 5, 3, NUM_HARMONICS, 32, NUM_FREQ_IN, Conv2d::Relu},
+    {3, 3, 1, 33, 1, NUM_FREQ_OUT, Conv2d::Sigmoid},
+}};
+
+PitchCnn::PitchCnn(const std::vector<PackedConv2d> &cnn_layers) {
+    assert(is_valid_model(cnn_layers));
+
+    Conv2d *const conv_layers[num_layers] = {
+        &contour_conv_1, &contour_conv_2,   &note_conv_1,
+        &note_conv_2,    &onset_input_conv, &onset_output_conv};
+    for (int i = 0; i < num_layers; i++) {
+        conv_layers[i]->load(cnn_layers[i].shape, cnn_layers[i].weights,
+                             cnn_layers[i].bias);
+    }
+
+    prune_weights(0.0f);
+}
+
+bool PitchCnn::is_valid_model(const std::vector<PackedConv2d> &cnn_layers) {
+    if (cnn_layers.size() != num_layers) {
+        return false;
+    }
+
+    for (int i = 0; i < num_layers; i++) {
+        const auto &a = cnn_layers[i].shape;
+        const auto &b = model_shapes[i];
+        if (a.kernel_time != b.kernel_time ||
+            a.kernel_feature != b.kernel_feature || a.stride != b.stride ||
+            a.channels_in != b.channels_in ||
+            a.channels_out != b.channels_out ||
+            a.num_features_in != b.num_features_in ||
+            a.activation != b.activation) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::vector<const Conv2d *> PitchCnn::layers() const {
+    return {&contour_conv_1, &contour_conv_2,   &note_conv_1,
+            &note_conv_2,    &onset_input_conv, &onset_output_conv};
+}
+
+float PitchCnn::prune_weights(float tolerance) {
+    Conv2d *const conv_layers[num_layers] = {
+        &contour_conv_1, &contour_conv_2,   &note_conv_1,
+        &note_conv_2,    &onset_input_conv, &onset_output_conv};
+
+    double num_macs = 0.0;
+    double num_skipped_macs = 0.0;
+    for (auto *layer : conv_layers) {
+        const double layer_macs =
+            (double)layer->num_features_out() * layer->kernel_size_time() *
+            layer->shape().kernel_feature * layer->num_channels_in() *
+            layer->num_channels_out();
+        num_macs += layer_macs;
+        num_skipped_macs += layer->prune(tolerance) * layer_macs;
+    }
+
+    // Cached outputs and states were computed with the previous weights.
+    has_silent_outputs = false;
+    warm_state.clear();
+    reset();
+
+    return static_cast<float>(num_skipped_macs / num_macs);
 }
 
 void PitchCnn::reset() {
@@ -45,16 +142,209 @@ void PitchCnn::reset() {
         array.fill(0.0f);
     }
 
-    cnn_contour.reset();
-    cnn_note.reset();
-    cnn_onset_input.reset();
-    cnn_onset_output.reset();
+    contour_conv_1.reset();
+    contour_conv_2.reset();
+    note_conv_1.reset();
+    note_conv_2.reset();
+    onset_input_conv.reset();
+    onset_output_conv.reset();
 
     note_index = 0;
     contour_index = 0;
     concat_2_index = 0;
 
-    input_array.fill(0.0f);
+    num_silent_frames = 0;
+    num_skipped = 0;
+
+    for (auto &array : input_history) {
+        array.fill(0.0f);
+    }
+    input_index = 0;
+}
+
+void PitchCnn::warm_up() {
+    if (!warm_state.empty()) {
+        StateReader reader({warm_state.data(), warm_state.size()});
+        const bool is_restored = restore_state(reader);
+        assert(is_restored);
+        (void)is_restored;
+        return;
+    }
+
+    reset();
+
+    const std::vector<float> zero_frame(NUM_HARMONICS * NUM_FREQ_IN, 0.0f);
+    std::vector<float> contours(NUM_FREQ_IN);
+    std::vector<float> notes(NUM_FREQ_OUT);
+    std::vector<float> onsets(NUM_FREQ_OUT);
+    for (int i = 0; i < total_lookahead; i++) {
+        frame_inference(zero_frame.data(), contours, notes, onsets);
+    }
+
+    StateWriter writer(warm_state);
+    save_state(writer);
+}
+
+void PitchCnn::save_state(StateWriter &writer) const {
+    writer.write<int32_t>(enabled_outputs);
+    writer.write(silence_threshold);
+
+    for (const auto &frame : input_history) {
+        writer.write_floats(frame.data(), frame.size());
+    }
+    for (const auto &frame : contours_circular_buffer) {
+        writer.write_floats(frame.data(), frame.size());
+    }
+    for (const auto &frame : notes_circular_buffer) {
+        writer.write_floats(frame.data(), frame.size());
+    }
+    for (const auto &frame : concat_2_circular_buffer) {
+        writer.write_floats(frame.data(), frame.size());
+    }
+
+    writer.write<int32_t>(input_index);
+    writer.write<int32_t>(contour_index);
+    writer.write<int32_t>(note_index);
+    writer.write<int32_t>(concat_2_index);
+    writer.write<int32_t>(num_silent_frames);
+    writer.write<uint64_t>(num_skipped);
+
+    for (const auto *layer : layers()) {
+        layer->save_state(writer);
+    }
+}
+
+bool PitchCnn::restore_state(StateReader &reader) {
+    reader.expect<int32_t>(enabled_outputs);
+    reader.expect(silence_threshold);
+
+    for (auto &frame : input_history) {
+        reader.read_floats(frame.data(), frame.size());
+    }
+    for (auto &frame : contours_circular_buffer) {
+        reader.read_floats(frame.data(), frame.size());
+    }
+    for (auto &frame : notes_circular_buffer) {
+        reader.read_floats(frame.data(), frame.size());
+    }
+    for (auto &frame : concat_2_circular_buffer) {
+        reader.read_floats(frame.data(), frame.size());
+    }
+
+    int32_t indices[4] = {};
+    const int sizes[4] = {num_input_stored, num_contour_stored,
+                          num_note_stored, num_concat_2_stored};
+    for (int i = 0; i < 4; i++) {
+        if (reader.read(indices[i]) &&
+            (indices[i] < 0 || indices[i] >= sizes[i])) {
+            reader.fail();
+        }
+    }
+    int32_t silent_frames = 0;
+    uint64_t skipped = 0;
+    reader.read(silent_frames);
+    reader.read(skipped);
+
+    Conv2d *const conv_layers[num_layers] = {
+        &contour_conv_1, &contour_conv_2,   &note_conv_1,
+        &note_conv_2,    &onset_input_conv, &onset_output_conv};
+    for (auto *layer : conv_layers) {
+        if (reader.ok()) {
+            layer->restore_state(reader);
+        }
+    }
+
+    if (!reader.ok()) {
+        reset();
+        return false;
+    }
+
+    input_index = indices[0];
+    contour_index = indices[1];
+    note_index = indices[2];
+    concat_2_index = indices[3];
+    num_silent_frames = silent_frames;
+    num_skipped = skipped;
+    return true;
+}
+
+void PitchCnn::set_outputs(int outputs) {
+    if (outputs != enabled_outputs) {
+        enabled_outputs = outputs;
+
+        // Cached silent outputs may miss the newly enabled ones.
+        has_silent_outputs = false;
+        warm_state.clear();
+    }
+
+    reset();
+}
+
+void PitchCnn::set_silence_gate(float threshold) {
+    if (threshold != silence_threshold) {
+        warm_state.clear();
+    }
+    silence_threshold = threshold;
+    num_silent_frames = 0;
+}
+
+size_t PitchCnn::num_skipped_frames() const { return num_skipped; }
+
+bool PitchCnn::is_silent_frame(const float *in_data) const {
+    float max_abs = 0.0f;
+    for (size_t i = 0; i < NUM_HARMONICS * NUM_FREQ_IN; i++) {
+        max_abs = std::max(max_abs, std::abs(in_data[i]));
+    }
+    return max_abs <= silence_threshold;
+}
+
+void PitchCnn::set_note_range(int min_note_idx, int max_note_idx) {
+    const int note_begin = std::clamp(min_note_idx, 0, NUM_FREQ_OUT);
+    const int note_end = std::clamp(max_note_idx + 1, note_begin, NUM_FREQ_OUT);
+
+    // Walk the receptive fields back from the outputs.
+    onset_output_conv.set_output_range(note_begin, note_end);
+
+    // Notes and onset input features are concatenated as input of the onset
+    // output model.
+    const auto concat_range =
+        onset_output_conv.input_range(note_begin, note_end);
+    note_conv_2.set_output_range(concat_range.first, concat_range.second);
+    onset_input_conv.set_output_range(concat_range.first, concat_range.second);
+
+    const auto note_hidden_range =
+        note_conv_2.input_range(concat_range.first, concat_range.second);
+    note_conv_1.set_output_range(note_hidden_range.first,
+                                 note_hidden_range.second);
+
+    auto contour_range = note_conv_1.input_range(note_hidden_range.first,
+                                                 note_hidden_range.second);
+
+    // Contour bins read by Notes::add_pitch_bends
+    if (note_begin < note_end) {
+        contour_range.first =
+            std::max(0, std::min(contour_range.first,
+                                 CONTOURS_BINS_PER_SEMITONE * note_begin -
+                                     PITCH_BEND_NUM_BINS_TOLERANCE));
+        contour_range.second = std::min(
+            NUM_FREQ_IN,
+            std::max(contour_range.second,
+                     CONTOURS_BINS_PER_SEMITONE * (note_end - 1) +
+                         PITCH_BEND_NUM_BINS_TOLERANCE + 1));
+    }
+
+    contour_conv_2.set_output_range(contour_range.first, contour_range.second);
+
+    const auto contour_hidden_range =
+        contour_conv_2.input_range(contour_range.first, contour_range.second);
+    contour_conv_1.set_output_range(contour_hidden_range.first,
+                                    contour_hidden_range.second);
+
+    // Cached silent outputs and the warm state depend on the range.
+    has_silent_outputs = false;
+    warm_state.clear();
+
+    reset();
 }
 
 int PitchCnn::num_frames_lookahead() { return total_lookahead; }
@@ -63,34 +353,86 @@ void PitchCnn::frame_inference(const float *in_data,
                                std::vector<float> &out_contours,
                                std::vector<float> &out_notes,
                                std::vector<float> &out_onsets) {
-    // Checks on parameters
-    assert(out_contours.size() == NUM_FREQ_IN);
-    assert(out_notes.size() == NUM_FREQ_OUT);
-    assert(out_onsets.size() == NUM_FREQ_OUT);
+    TraceScope trace_scope("PitchCnn::frame_inference");
 
-    // Copy data in aligned input array for inference
-    std::copy(in_data, in_data + NUM_HARMONICS * NUM_FREQ_IN,
-              input_array.begin());
+    const bool has_contours = (enabled_outputs & ContoursOutput) != 0;
+    const bool has_notes = (enabled_outputs & NotesOutput) != 0;
+    const bool has_onsets = (enabled_outputs & OnsetsOutput) != 0;
+
+    // Checks on parameters
+    assert(!has_contours || out_contours.size() == NUM_FREQ_IN);
+    assert(!has_notes || out_notes.size() == NUM_FREQ_OUT);
+    assert(!has_onsets || out_onsets.size() == NUM_FREQ_OUT);
+
+    const bool is_silent = silence_threshold >= 0 && is_silent_frame(in_data);
+
+    if (is_silent) {
+        num_silent_frames++;
+
+        // Everything has settled: outputs and states won't change anymore.
+        if (has_silent_outputs && num_silent_frames > num_frames_to_silence) {
+            if (has_contours) {
+                std::copy(silent_contours.begin(), silent_contours.end(),
+                          out_contours.begin());
+            }
+            if (has_notes) {
+                std::copy(silent_notes.begin(), silent_notes.end(),
+                          out_notes.begin());
+            }
+            if (has_onsets) {
+                std::copy(silent_onsets.begin(), silent_onsets.end(),
+                          out_onsets.begin());
+            }
+            num_skipped++;
+            return;
+        }
+
+        input_history[(size_t)input_index].fill(0.0f);
+    } else {
+        num_silent_frames = 0;
+
+        // Copy data in aligned input history for inference
+        std::copy(in_data, in_data + NUM_HARMONICS * NUM_FREQ_IN,
+                  input_history[(size_t)input_index].begin());
+    }
 
     run_models();
 
     // Fill output vectors
-    std::copy(cnn_onset_output.getOutputs(),
-              cnn_onset_output.getOutputs() + NUM_FREQ_OUT, out_onsets.begin());
-
-    std::copy(notes_circular_buffer[wrap_index(note_index + 1, num_note_stored)]
-                  .begin(),
-              notes_circular_buffer[wrap_index(note_index + 1, num_note_stored)]
-                  .end(),
-              out_notes.begin());
-
-    std::copy(contours_circular_buffer[wrap_index(contour_index + 1,
-                                                  num_contour_stored)]
-                  .begin(),
-              contours_circular_buffer[wrap_index(contour_index + 1,
-                                                  num_contour_stored)]
-                  .end(),
-              out_contours.begin());
+    if (has_onsets) {
+        std::copy(onset_output_conv.outputs(),
+                  onset_output_conv.outputs() + NUM_FREQ_OUT,
+                  out_onsets.begin());
+    }
+
+    if (has_notes) {
+        const auto &notes =
+            notes_circular_buffer[wrap_index(note_index + 1, num_note_stored)];
+        std::copy(notes.begin(), notes.end(), out_notes.begin());
+    }
+
+    if (has_contours) {
+        const auto &contours = contours_circular_buffer[wrap_index(
+            contour_index + 1, num_contour_stored)];
+        std::copy(contours.begin(), contours.end(), out_contours.begin());
+    }
+
+    if (is_silent && !has_silent_outputs &&
+        num_silent_frames >= num_frames_to_silence) {
+        if (has_contours) {
+            std::copy(out_contours.begin(), out_contours.end(),
+                      silent_contours.begin());
+        }
+        if (has_notes) {
+            std::copy(out_notes.begin(), out_notes.end(),
+                      silent_notes.begin());
+        }
+        if (has_onsets) {
+            std::copy(out_onsets.begin(), out_onsets.end(),
+                      silent_onsets.begin());
+        }
+        has_silent_outputs = true;
+    }
 
     // Increment index for different circular buffers
     contour_index =
@@ -100,27 +442,83 @@ void PitchCnn::frame_inference(const float *in_data,
 
     concat_2_index =
         (concat_2_index == num_concat_2_stored - 1) ? 0 : concat_2_index + 1;
+
+    input_index = (input_index == num_input_stored - 1) ? 0 : input_index + 1;
 }
 
 void PitchCnn::run_models() {
-    // Run models and push results in appropriate circular buffer
-    cnn_onset_input.forward(input_array.data());
-    std::copy(cnn_onset_input.getOutputs(),
-              cnn_onset_input.getOutputs() + 32 * NUM_FREQ_OUT,
-              concat_2_circular_buffer[(size_t)concat_2_index].begin());
+    const bool has_onsets = (enabled_outputs & OnsetsOutput) != 0;
+
+    {
+        TraceScope trace_scope("contour_conv_1 + onset_input_conv");
+        run_input_layers();
+    }
+
+    // Push results in appropriate circular buffer and run the next models
+    if (has_onsets) {
+        std::copy(onset_input_conv.outputs(),
+                  onset_input_conv.outputs() + 32 * NUM_FREQ_OUT,
+                  concat_2_circular_buffer[(size_t)concat_2_index].begin());
+    }
+
+    {
+        TraceScope trace_scope("contour_conv_2");
+        contour_conv_2.forward(contour_conv_1.outputs());
+    }
+    if (enabled_outputs & ContoursOutput) {
+        std::copy(contour_conv_2.outputs(),
+                  contour_conv_2.outputs() + NUM_FREQ_IN,
+                  contours_circular_buffer[(size_t)contour_index].begin());
+    }
+
+    {
+        TraceScope trace_scope("note_conv_1");
+        note_conv_1.forward(contour_conv_2.outputs());
+    }
+    {
+        TraceScope trace_scope("note_conv_2");
+        note_conv_2.forward(note_conv_1.outputs());
+    }
+    if (enabled_outputs & NotesOutput) {
+        std::copy(note_conv_2.outputs(), note_conv_2.outputs() + NUM_FREQ_OUT,
+                  notes_circular_buffer[(size_t)note_index].begin());
+    }
 
-    cnn_contour.forward(input_array.data());
-    std::copy(cnn_contour.getOutputs(), cnn_contour.getOutputs() + NUM_FREQ_IN,
-              contours_circular_buffer[(size_t)contour_index].begin());
+    if (has_onsets) {
+        // Concat operation with correct frame shift
+        concat();
 
-    cnn_note.forward(cnn_contour.getOutputs());
-    std::copy(cnn_note.getOutputs(), cnn_note.getOutputs() + NUM_FREQ_OUT,
-              notes_circular_buffer[(size_t)note_index].begin());
+        TraceScope trace_scope("onset_output_conv");
+        onset_output_conv.forward(concat_array.data());
+    }
+}
 
-    // Concat operation with correct frame shift
-    concat();
+void PitchCnn::run_input_layers() {
+    const bool has_onsets = (enabled_outputs & OnsetsOutput) != 0;
 
-    cnn_onset_output.forward(concat_array.data());
+    // Oldest frame first
+    std::array<const float *, num_input_stored> frames{};
+    for (int t = 0; t < num_input_stored; t++) {
+        frames[(size_t)t] =
+            input_history[wrap_index(input_index + 1 + t, num_input_stored)]
+                .data();
+    }
+    const float *const *contour_frames =
+        frames.data() + num_input_stored - contour_conv_1.kernel_size_time();
+
+    // Onset input features are computed block by block, each followed by the
+    // contour features at the same frequencies, so the input window read by
+    // both layers is still in cache for the second one.
+    constexpr int block_size = 8;
+    const int stride = NUM_FREQ_IN / NUM_FREQ_OUT;
+
+    for (int j = 0; j < NUM_FREQ_OUT; j += block_size) {
+        if (has_onsets) {
+            onset_input_conv.forward_frames(frames.data(), j, j + block_size);
+        }
+        contour_conv_1.forward_frames(contour_frames, j * stride,
+                                      (j + block_size) * stride);
+    }
 }
 
 constexpr size_t PitchCnn::wrap_index(int index, int size) {
@@ -138,7 +536,7 @@ void PitchCnn::concat() {
         (size_t)wrap_index(concat_2_index + 1, num_concat_2_stored);
 
     for (size_t i = 0; i < NUM_FREQ_OUT; i++) {
-        concat_array[i * 33] = cnn_note.getOutputs()[i];
+        concat_array[i * 33] = note_conv_2.outputs()[i];
         std::copy(concat_2_circular_buffer[concat2_index].begin() + i * 32,
                   concat_2_circular_buffer[concat2_index].begin() + (i + 1) * 32,
                   concat_array.begin() + i * 33 + 1);
@@ -1,22 +1,92 @@
 
 #pragma once
 
-#include "RTNeural/RTNeural.h"
+#include <array>
+#include <vector>
+
 #include "json.hpp"
 
+#include "cnn_weights.h"
 #include "constants.h"
+#include "conv2d.h"
+#include "state_io.h"
 
 class PitchCnn {
   public:
+    /**
+     * Outputs of frame_inference, to combine as a bit mask.
+     */
+    enum Outputs {
+        ContoursOutput = 1 << 0,
+        NotesOutput = 1 << 1,
+        OnsetsOutput = 1 << 2,
+        AllOutputs = ContoursOutput | NotesOutput | OnsetsOutput,
+    };
+
     PitchCnn(BinaryBlob cnn_contour_model_json, BinaryBlob cnn_note_model_json,
              BinaryBlob cnn_onset_1_model_json,
              BinaryBlob cnn_onset_2_model_json);
 
+    /**
+     * Load the model from the layers of a prepacked weight file (see
+     * cnn_weights.h). Weights are used in place and must outlive the CNN.
+     * @param cnn_layers Layers, as returned by layers(). Must pass
+     * is_valid_model.
+     */
+    explicit PitchCnn(const std::vector<PackedConv2d> &cnn_layers);
+
+    // Number of conv layers of the model.
+    static constexpr int num_layers = 6;
+
+    /**
+     * @param cnn_layers Layers of a prepacked weight file.
+     * @return True if the layers have the shapes of the basic pitch model.
+     */
+    static bool is_valid_model(const std::vector<PackedConv2d> &cnn_layers);
+
+    /**
+     * @return Conv layers in prepacked weight file order: contour 1 and 2,
+     * note 1 and 2, onset input, onset output.
+     */
+    [[nodiscard]] std::vector<const Conv2d *> layers() const;
+
+    /**
+     * Prune the weights of the conv layers, see Conv2d::prune. Done with
+     * tolerance 0 when the model is loaded, so that zero weight rows are
+     * always skipped. Resets the internal state.
+     * @param tolerance Relative tolerance, applied to each layer.
+     * @return Fraction of the multiply-adds of a frame that are skipped.
+     */
+    float prune_weights(float tolerance);
+
     /**
      * Resets the internal state of the CNN.
      */
     void reset();
 
+    /**
+     * Reset, then run the num_frames_lookahead() zero frames that come before
+     * the first input frame and discard their outputs. The state they leave
+     * only depends on the settings: it is computed on the first call and
+     * restored on the next ones.
+     */
+    void warm_up();
+
+    /**
+     * Write the streaming state: input history, circular buffers and their
+     * indices, layer histories and silence gate counters, along with the
+     * settings they depend on (outputs, note range, silence threshold).
+     */
+    void save_state(StateWriter &writer) const;
+
+    /**
+     * Restore a state written by save_state, by this CNN or another one with
+     * the same weights and settings.
+     * @return False if the blob is truncated or was saved with other
+     * settings. The CNN is then reset.
+     */
+    bool restore_state(StateReader &reader);
+
     /**
      * @return The number of future lookahead of basic pitch cnn.
      * It corresponds to the number of padded frames done left and right (in
@@ -26,7 +96,9 @@ class PitchCnn {
     static int num_frames_lookahead();
 
     /**
-     * Run inference for a single frame. inData should have 8 * 264 elements
+     * Run inference for a single frame. inData should have 8 * 264 elements.
+     * Outputs that are not selected with set_outputs are left untouched and
+     * their vectors may be empty.
      * @param in_data input features (CQT harmonically stacked).
      * @param out_contours output vector for contour posteriorgrams. Size should
      * be 264
@@ -38,7 +110,46 @@ class PitchCnn {
                          std::vector<float> &out_notes,
                          std::vector<float> &out_onsets);
 
+    /**
+     * Select the outputs computed by frame_inference. Skipping onsets skips
+     * the onset models, skipping contours or notes skips their buffering and
+     * copies. Resets the internal state.
+     * @param outputs Bit mask of Outputs. AllOutputs by default.
+     */
+    void set_outputs(int outputs);
+
+    /**
+     * Enable silence gating. Input frames whose features are all below the
+     * threshold (in absolute value) are treated as zero frames. Once enough
+     * consecutive zero frames have gone through for every layer state and
+     * circular buffer to only hold silent values, the outputs no longer change
+     * and inference is skipped until a non silent frame comes in.
+     * @param threshold Silence threshold on the input features. Negative
+     * disables the gate (default).
+     */
+    void set_silence_gate(float threshold);
+
+    /**
+     * @return Number of frames for which inference was skipped by the silence
+     * gate since the last reset.
+     */
+    [[nodiscard]] size_t num_skipped_frames() const;
+
+    /**
+     * Band-limited inference: only compute the outputs of the given range of
+     * notes, plus the contour bins used for their pitch bends. Each layer
+     * then only computes the features its receptive field needs, so a narrow
+     * range saves most of the compute. Outputs outside the range are only
+     * computed where another output depends on them and are 0 otherwise.
+     * Resets the internal state.
+     * @param min_note_idx Index of the lowest note (0 is midi note 21).
+     * @param max_note_idx Index of the highest note, inclusive.
+     */
+    void set_note_range(int min_note_idx, int max_note_idx);
+
   private:
+    friend class MultiStreamPitchCnn;
+
     /**
      * Run different sequential models with correct time offset ...
      */
@@ -49,6 +160,12 @@ class PitchCnn {
      */
     void concat();
 
+    /**
+     * @return True if all features of the frame are within the silence
+     * threshold.
+     */
+    [[nodiscard]] bool is_silent_frame(const float *in_data) const;
+
     /**
      * Return in-range index for given size as if periodic.
      * @param index maybe out of range index
@@ -57,11 +174,20 @@ class PitchCnn {
      */
     static constexpr size_t wrap_index(int index, int size);
 
-    alignas(RTNEURAL_DEFAULT_ALIGNMENT)
-        std::array<float, NUM_FREQ_IN * NUM_HARMONICS> input_array{};
+    /**
+     * Run the first layers of the contour and onset input models, which read
+     * the same input frames, in one pass over the input features.
+     */
+    void run_input_layers();
 
-    alignas(RTNEURAL_DEFAULT_ALIGNMENT)
-        std::array<float, 33 * NUM_FREQ_OUT> concat_array{};
+    // Input frames shared by contour_conv_1 and onset_input_conv, which has
+    // the longest time kernel. input_index is the slot of the current frame.
+    static constexpr int num_input_stored = 5;
+    alignas(32) std::array<std::array<float, NUM_FREQ_IN * NUM_HARMONICS>,
+                           num_input_stored> input_history{};
+    int input_index = 0;
+
+    alignas(32) std::array<float, 33 * NUM_FREQ_OUT> concat_array{};
 
     static constexpr int lookahead_cnn_contour = 3;
     static constexpr int lookahead_cnn_note = 6;
@@ -89,33 +215,41 @@ class PitchCnn {
     int note_index = 0;
     int concat_2_index = 0;
 
-    using CnnContourModel = RTNeural::ModelT<
-        float, NUM_FREQ_IN * NUM_HARMONICS, NUM_FREQ_IN,
-        RTNeural::Conv2DT<float, NUM_HARMONICS, 8, NUM_FREQ_IN, 3, 39, 1, 1,
-                          false>,
-        RTNeural::ReLuActivationT<float, 8 * NUM_FREQ_IN>,
-        RTNeural::Conv2DT<float, 8, 1, NUM_FREQ_IN, 5, 5, 1, 1, false>,
-        RTNeural::SigmoidActivationT<float, NUM_FREQ_IN>>;
-
-    using CnnNoteModel = RTNeural::ModelT<
-        float, NUM_FREQ_IN, NUM_FREQ_OUT,
-        RTNeural::Conv2DT<float, 1, 32, NUM_FREQ_IN, 7, 7, 1, 3, false>,
-        RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>,
-        RTNeural::Conv2DT<float, 32, 1, NUM_FREQ_OUT, 7, 3, 1, 1, false>,
-        RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
-
-    using CnnOnsetInputModel = RTNeural::ModelT<
-        float, NUM_FREQ_IN * NUM_HARMONICS, 32 * NUM_FREQ_OUT,
-        RTNeural::Conv2DT<float, 8, 32, NUM_FREQ_IN, 5, 5, 1, 3, false>,
-        RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>>;
-
-    using CnnOnsetOutputModel = RTNeural::ModelT<
-        float, 33 * NUM_FREQ_OUT, NUM_FREQ_OUT,
-        RTNeural::Conv2DT<float, 33, 1, NUM_FREQ_OUT, 3, 3, 1, 1, false>,
-        RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
-
-    CnnContourModel cnn_contour;
-    CnnNoteModel cnn_note;
-    CnnOnsetInputModel cnn_onset_input;
-    CnnOnsetOutputModel cnn_onset_output;
+    // Upper bound on the number of consecutive zero frames after which all
+    // layer histories and circular buffers only hold values computed from
+    // zero frames: sum of the time kernel histories of all conv layers and of
+    // the circular buffer lengths.
+    static constexpr int num_frames_to_silence =
+        (3 - 1) + (5 - 1) + (7 - 1) + (7 - 1) + (5 - 1) + (3 - 1) +
+        num_contour_stored + num_note_stored + num_concat_2_stored;
+
+    int enabled_outputs = AllOutputs;
+
+    // State after warm_up, empty until the first warm_up with the current
+    // settings.
+    std::vector<uint8_t> warm_state;
+
+    float silence_threshold = -1.0f;
+    int num_silent_frames = 0;
+    size_t num_skipped = 0;
+
+    // Outputs once the network has settled on zero input.
+    bool has_silent_outputs = false;
+    std::array<float, NUM_FREQ_IN> silent_contours{};
+    std::array<float, NUM_FREQ_OUT> silent_notes{};
+    std::array<float, NUM_FREQ_OUT> silent_onsets{};
+
+    // Contour model
+    Conv2d contour_conv_1; // 8 -> 8 channels, kernel 3x39, relu
+    Conv2d contour_conv_2; // 8 -> 1 channel, kernel 5x5, sigmoid
+
+    // Note model
+    Conv2d note_conv_1; // 1 -> 32 channels, kernel 7x7, stride 3, relu
+    Conv2d note_conv_2; // 32 -> 1 channel, kernel 7x3, sigmoid
+
+    // Onset input model
+    Conv2d onset_input_conv; // 8 -> 32 channels, kernel 5x5, stride 3, relu
+
+    // Onset output model
+    Conv2d onset_output_conv; // 33 -> 1 channel, kernel 3x3, sigmoid
 };
@@ -1,17 +1,71 @@
 
 #include "pitch_detector.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <utility>
+
+#include "trace.h"
+
 PitchDetector::PitchDetector(PitchDetectorModelFiles mf)
     : features_calculator(mf.features_model_ort),
       pitch_cnn(mf.cnn_contour_model_json, mf.cnn_note_model_json,
-                mf.cnn_onset_1_model_json, mf.cnn_onset_2_model_json) {}
+                mf.cnn_onset_1_model_json, mf.cnn_onset_2_model_json),
+      feature_stream(features_calculator) {
+    features_model_hash = PosteriorgramCache::hash(
+        mf.features_model_ort.data, mf.features_model_ort.num_bytes);
+}
+
+PitchDetector::PitchDetector(MappedFile features_model,
+                             MappedFile cnn_weights,
+                             const std::vector<PackedConv2d> &cnn_layers)
+    : features_model_file(std::move(features_model)),
+      cnn_weights_file(std::move(cnn_weights)),
+      features_calculator(features_model_file.blob(), true),
+      pitch_cnn(cnn_layers), feature_stream(features_calculator) {
+    features_model_hash = PosteriorgramCache::hash(
+        features_model_file.data(), features_model_file.size());
+}
+
+std::unique_ptr<PitchDetector>
+PitchDetector::from_files(const char *features_model_path,
+                          const char *cnn_weights_path) {
+    MappedFile features_model(features_model_path);
+    MappedFile cnn_weights(cnn_weights_path);
+    if (!features_model.is_open() || !cnn_weights.is_open()) {
+        return nullptr;
+    }
+
+    // Layers point into the mapping, which doesn't move with the MappedFile.
+    const auto cnn_layers = unpack_cnn_weights(cnn_weights.blob());
+    if (!PitchCnn::is_valid_model(cnn_layers)) {
+        return nullptr;
+    }
+
+    // ONNX Runtime throws if the features model can't be loaded.
+    try {
+        return std::unique_ptr<PitchDetector>(new PitchDetector(
+            std::move(features_model), std::move(cnn_weights), cnn_layers));
+    } catch (const Ort::Exception &) {
+        return nullptr;
+    }
+}
+
+PitchDetector::~PitchDetector() { stop_stream(); }
 
 void PitchDetector::reset() {
+    stop_stream();
     pitch_cnn.reset();
     contours_posteriorgrams.clear();
     notes_posteriorgrams.clear();
     onsets_posteriorgrams.clear();
+    half_contours_posteriorgram.clear();
+    half_notes_posteriorgram.clear();
+    half_onsets_posteriorgram.clear();
     note_events.clear();
+    converted_note_events.clear();
+    are_note_events_converted = false;
 
     num_frames = 0;
 }
@@ -30,69 +84,878 @@ void PitchDetector::set_parameters(float note_sensibility,
     convert_params.infer_onsets = true;
 }
 
-void PitchDetector::transcribe_to_midi(float *audio, int num_samples) {
-    const float *stacked_cqt =
-        features_calculator.compute_features(audio, num_samples, num_frames);
+void PitchDetector::set_pitch_bend(PitchBendModes pitch_bend) {
+    convert_params.pitch_bend = pitch_bend;
+}
+
+void PitchDetector::set_frequency_range(float min_frequency,
+                                        float max_frequency,
+                                        bool band_limited_inference) {
+    convert_params.min_frequency = min_frequency;
+    convert_params.max_frequency = max_frequency;
+
+    if (!band_limited_inference) {
+        cnn_min_note_idx = 0;
+        cnn_max_note_idx = MAX_NOTE_IDX;
+        pitch_cnn.set_note_range(0, MAX_NOTE_IDX);
+        return;
+    }
 
-    onsets_posteriorgrams.resize(num_frames,
-                                 std::vector<float>(NUM_FREQ_OUT, 0.0f));
-    notes_posteriorgrams.resize(num_frames,
-                                std::vector<float>(NUM_FREQ_OUT, 0.0f));
-    contours_posteriorgrams.resize(num_frames,
-                                   std::vector<float>(NUM_FREQ_IN, 0.0f));
+    // Same note range as Notes::convert
+    const int min_note_idx =
+        (min_frequency < 0) ? 0 : Notes::ftom(min_frequency) - MIDI_OFFSET;
+    const int max_note_idx = (max_frequency < 0)
+                                 ? MAX_NOTE_IDX
+                                 : Notes::ftom(max_frequency) - MIDI_OFFSET;
 
-    pitch_cnn.reset();
+    cnn_min_note_idx = min_note_idx;
+    cnn_max_note_idx = max_note_idx;
+    pitch_cnn.set_note_range(min_note_idx, max_note_idx);
+}
+
+float PitchDetector::prune_cnn_weights(float tolerance) {
+    cnn_weights_hash = 0;
+    return pitch_cnn.prune_weights(tolerance);
+}
+
+void PitchDetector::set_silence_gate(float threshold) {
+    silence_gate_threshold = threshold;
+    pitch_cnn.set_silence_gate(threshold);
+}
+
+size_t PitchDetector::num_skipped_frames() const {
+    return pitch_cnn.num_skipped_frames();
+}
+
+void PitchDetector::set_num_note_threads(int num_threads) {
+    num_note_threads = std::max(num_threads, 0);
+}
+
+void PitchDetector::set_posteriorgram_precision(
+    PosteriorgramPrecision precision) {
+    posteriorgram_precision = precision;
+}
+
+void PitchDetector::set_segmented_features(bool segmented) {
+    segmented_features = segmented;
+}
+
+bool PitchDetector::use_optimized_features_model(
+    const char *features_model_path, float tolerance) {
+    assert(!is_streaming());
+
+    MappedFile model(features_model_path);
+    if (!model.is_open() ||
+        !features_calculator.use_optimized_model(model.blob(), tolerance,
+                                                 true)) {
+        return false;
+    }
+
+    // The previous mapping is no longer used by the features session.
+    optimized_features_model_file = std::move(model);
+    features_model_hash = PosteriorgramCache::hash(
+        optimized_features_model_file.data(),
+        optimized_features_model_file.size());
+    return true;
+}
+
+void PitchDetector::set_memory_limit(size_t max_bytes) {
+    memory_limit = max_bytes;
+}
+
+void PitchDetector::set_posteriorgram_cache(
+    std::shared_ptr<PosteriorgramCache> posteriorgram_cache) {
+    cache = std::move(posteriorgram_cache);
+}
+
+uint64_t PitchDetector::model_version() {
+    if (cnn_weights_hash == 0) {
+        uint64_t hash = 0;
+        for (const auto *layer : pitch_cnn.layers()) {
+            const auto shape = layer->shape();
+            const auto num_weights =
+                static_cast<size_t>(shape.kernel_time) * shape.kernel_feature *
+                shape.channels_in * shape.channels_out;
+            hash = PosteriorgramCache::hash(&shape, sizeof(shape), hash);
+            hash = PosteriorgramCache::hash(
+                layer->weight_values(), num_weights * sizeof(float), hash);
+            hash = PosteriorgramCache::hash(
+                layer->bias_values(), shape.channels_out * sizeof(float),
+                hash);
+        }
+        cnn_weights_hash = hash != 0 ? hash : 1;
+    }
+    return features_model_hash ^ (cnn_weights_hash * 0x9e3779b97f4a7c15ULL);
+}
+
+PosteriorgramCache::Key PitchDetector::cache_key(const float *audio,
+                                                 size_t num_samples,
+                                                 bool segmented) {
+    // Everything the posteriorgrams depend on besides audio and models. Any
+    // negative threshold disables the silence gate.
+    const float threshold = std::max(silence_gate_threshold, -1.0f);
+    int32_t threshold_bits = 0;
+    std::memcpy(&threshold_bits, &threshold, sizeof(threshold_bits));
+    const int32_t settings[] = {
+        convert_params.pitch_bend != NoPitchBend,
+        cnn_min_note_idx,
+        cnn_max_note_idx,
+        threshold_bits,
+        posteriorgram_precision,
+        segmented,
+    };
+
+    return {
+        PosteriorgramCache::hash(audio, num_samples * sizeof(float)),
+        num_samples,
+        model_version(),
+        PosteriorgramCache::hash(settings, sizeof(settings)),
+    };
+}
+
+std::shared_ptr<const PosteriorgramCache::Entry>
+PitchDetector::make_cache_entry() const {
+    auto entry = std::make_shared<PosteriorgramCache::Entry>();
+    entry->num_frames = num_frames;
+    entry->contours = contours_posteriorgrams;
+    entry->notes = notes_posteriorgrams;
+    entry->onsets = onsets_posteriorgrams;
+    entry->half_contours = half_contours_posteriorgram;
+    entry->half_notes = half_notes_posteriorgram;
+    entry->half_onsets = half_onsets_posteriorgram;
+    return entry;
+}
+
+void PitchDetector::load_cache_entry(const PosteriorgramCache::Entry &entry) {
+    num_frames = entry.num_frames;
+    contours_posteriorgrams = entry.contours;
+    notes_posteriorgrams = entry.notes;
+    onsets_posteriorgrams = entry.onsets;
+    half_contours_posteriorgram = entry.half_contours;
+    half_notes_posteriorgram = entry.half_notes;
+    half_onsets_posteriorgram = entry.half_onsets;
+}
+
+MemoryEstimate PitchDetector::estimate_memory(size_t num_samples) const {
+    auto estimate = estimate_memory(num_samples, segmented_features);
+    if (memory_limit > 0 && estimate.peak_bytes > memory_limit) {
+        estimate = estimate_memory(num_samples, true);
+    }
+    return estimate;
+}
+
+MemoryEstimate PitchDetector::estimate_memory(size_t num_samples,
+                                              bool segmented) const {
+    constexpr size_t features_frame_bytes =
+        NUM_HARMONICS * NUM_FREQ_IN * sizeof(float);
+    const size_t num_frames_out = num_samples / FFT_HOP + 1;
+    const bool keep_contours = convert_params.pitch_bend != NoPitchBend;
+
+    MemoryEstimate estimate{};
+    estimate.segmented_features = segmented;
+
+    // Model output, as much again for the intermediates, and the frames
+    // kept from the window and its audio for segmented features.
+    if (segmented) {
+        constexpr size_t window_num_frames = FeatureStream::window_num_hops + 1;
+        estimate.features_bytes =
+            3 * window_num_frames * features_frame_bytes +
+            (FeatureStream::window_num_samples +
+             FeatureStream::hop_num_frames * FFT_HOP) *
+                sizeof(float);
+    } else {
+        estimate.features_bytes = 2 * num_frames_out * features_frame_bytes;
+    }
+
+    const size_t float_posteriorgrams_bytes =
+        2 * float_posteriorgram_bytes(num_frames_out, NUM_FREQ_OUT) +
+        (keep_contours ? float_posteriorgram_bytes(num_frames_out, NUM_FREQ_IN)
+                       : 0);
+
+    estimate.notes_bytes =
+        Notes::working_memory(num_frames_out, convert_params);
+
+    if (posteriorgram_precision == Float32Precision) {
+        estimate.posteriorgrams_bytes = float_posteriorgrams_bytes;
+    } else {
+        estimate.posteriorgrams_bytes =
+            num_frames_out * sizeof(uint16_t) *
+            (2 * NUM_FREQ_OUT + (keep_contours ? NUM_FREQ_IN : 0));
+        estimate.notes_bytes += float_posteriorgrams_bytes;
+    }
+
+    estimate.peak_bytes =
+        estimate.posteriorgrams_bytes +
+        std::max(estimate.features_bytes, estimate.notes_bytes);
+    return estimate;
+}
+
+TranscriptionResult
+PitchDetector::transcribe_to_midi(float *audio, int num_samples,
+                                  TranscriptionControl *control) {
+    TraceScope trace_scope("PitchDetector::transcribe_to_midi");
+
+    const auto memory = estimate_memory(static_cast<size_t>(num_samples));
+
+    // Contours are only used for pitch bends
+    const bool keep_contours = convert_params.pitch_bend != NoPitchBend;
+
+    PosteriorgramCache::Key key{};
+    if (cache != nullptr) {
+        key = cache_key(audio, static_cast<size_t>(num_samples),
+                        memory.segmented_features);
+        if (const auto entry = cache->find(key)) {
+            load_cache_entry(*entry);
+            if (control != nullptr) {
+                control->num_frames.store(num_frames,
+                                          std::memory_order_relaxed);
+                control->num_frames_done.store(num_frames,
+                                               std::memory_order_relaxed);
+            }
+            if (!extract_notes(control != nullptr ? &control->cancel_requested
+                                                  : nullptr)) {
+                reset();
+                return TranscriptionCancelled;
+            }
+            return TranscriptionDone;
+        }
+    }
+
+    // A cached transcription only extracts notes: the limit is checked after
+    // the lookup.
+    if (memory_limit > 0 && memory.peak_bytes > memory_limit) {
+        reset();
+        return TranscriptionRejected;
+    }
+
+    // Segmented features are computed while the CNN runs.
+    const float *stacked_cqt = nullptr;
+    if (memory.segmented_features) {
+        feature_stream.reset();
+        num_frames = num_samples > 0 ? num_samples / FFT_HOP + 1 : 0;
+    } else {
+        stacked_cqt = features_calculator.compute_features(audio, num_samples,
+                                                           num_frames);
+    }
+
+    if (control != nullptr) {
+        control->num_frames_done.store(0, std::memory_order_relaxed);
+        control->num_frames.store(num_frames, std::memory_order_relaxed);
+    }
+
+    auto is_cancelled = [control]() {
+        return control != nullptr &&
+               control->cancel_requested.load(std::memory_order_relaxed);
+    };
+    auto frame_done = [control](size_t num_frames_done) {
+        if (control != nullptr) {
+            control->num_frames_done.store(num_frames_done,
+                                           std::memory_order_relaxed);
+        }
+    };
+
+    if (posteriorgram_precision == Float32Precision) {
+        half_contours_posteriorgram.clear();
+        half_notes_posteriorgram.clear();
+        half_onsets_posteriorgram.clear();
+
+        onsets_posteriorgrams.resize(num_frames,
+                                     std::vector<float>(NUM_FREQ_OUT, 0.0f));
+        notes_posteriorgrams.resize(num_frames,
+                                    std::vector<float>(NUM_FREQ_OUT, 0.0f));
+        if (keep_contours) {
+            contours_posteriorgrams.resize(
+                num_frames, std::vector<float>(NUM_FREQ_IN, 0.0f));
+        } else {
+            contours_posteriorgrams.clear();
+            contours_posteriorgrams.shrink_to_fit();
+        }
+    } else {
+        contours_posteriorgrams.clear();
+        contours_posteriorgrams.shrink_to_fit();
+        notes_posteriorgrams.clear();
+        notes_posteriorgrams.shrink_to_fit();
+        onsets_posteriorgrams.clear();
+        onsets_posteriorgrams.shrink_to_fit();
+
+        half_onsets_posteriorgram.resize(posteriorgram_precision, num_frames,
+                                         NUM_FREQ_OUT);
+        half_notes_posteriorgram.resize(posteriorgram_precision, num_frames,
+                                        NUM_FREQ_OUT);
+        if (keep_contours) {
+            half_contours_posteriorgram.resize(posteriorgram_precision,
+                                               num_frames, NUM_FREQ_IN);
+        } else {
+            half_contours_posteriorgram.clear();
+        }
+
+        scratch_contours_frame.resize(NUM_FREQ_IN);
+        scratch_notes_frame.resize(NUM_FREQ_OUT);
+        scratch_onsets_frame.resize(NUM_FREQ_OUT);
+    }
+
+    pitch_cnn.set_outputs(keep_contours ? PitchCnn::AllOutputs
+                                        : PitchCnn::NotesOutput |
+                                              PitchCnn::OnsetsOutput);
 
     const size_t num_lh_frames = PitchCnn::num_frames_lookahead();
 
+    TraceScope cnn_scope("PitchCnn inference");
+
     std::vector<float> zero_stacked_cqt(NUM_HARMONICS * NUM_FREQ_IN, 0.0f);
 
-    // Run the CNN with 0 input and discard output (only for num_lh_frames)
-    for (int i = 0; i < num_lh_frames; i++) {
-        pitch_cnn.frame_inference(
-            zero_stacked_cqt.data(), contours_posteriorgrams[0],
-            notes_posteriorgrams[0], onsets_posteriorgrams[0]);
+    // State after num_lh_frames zero frames
+    pitch_cnn.warm_up();
+
+    // Outputs are num_lh_frames late: input frame k gives output frame
+    // k - num_lh_frames, earlier outputs are discarded.
+    size_t num_frames_in = 0;
+    auto infer_frame = [&](const float *stacked_cqt_frame) {
+        const size_t out_idx = num_frames_in >= num_lh_frames
+                                   ? num_frames_in - num_lh_frames
+                                   : 0;
+        pitch_cnn.frame_inference(stacked_cqt_frame, contours_frame(out_idx),
+                                  notes_frame(out_idx), onsets_frame(out_idx));
+        if (num_frames_in >= num_lh_frames) {
+            store_frame(out_idx);
+            frame_done(out_idx + 1);
+        }
+        num_frames_in++;
+    };
+
+    // Run the CNN with real inputs
+    if (memory.segmented_features) {
+        constexpr size_t frame_size = NUM_HARMONICS * NUM_FREQ_IN;
+        constexpr size_t hop_num_samples =
+            FeatureStream::hop_num_frames * FFT_HOP;
+
+        std::vector<float> window_frames;
+        for (size_t num_pushed = 0; num_pushed < (size_t)num_samples;) {
+            const size_t num_new = std::min(hop_num_samples,
+                                            (size_t)num_samples - num_pushed);
+            feature_stream.push_audio(audio + num_pushed, num_new);
+            num_pushed += num_new;
+
+            window_frames.clear();
+            const size_t num_window_frames = feature_stream.compute_frames(
+                num_pushed == (size_t)num_samples, window_frames);
+
+            for (size_t i = 0; i < num_window_frames; i++) {
+                if (is_cancelled()) {
+                    reset();
+                    return TranscriptionCancelled;
+                }
+                infer_frame(window_frames.data() + i * frame_size);
+            }
+        }
+        feature_stream.reset();
+    } else {
+        for (size_t frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+            if (is_cancelled()) {
+                reset();
+                return TranscriptionCancelled;
+            }
+            infer_frame(stacked_cqt + frame_idx * NUM_HARMONICS * NUM_FREQ_IN);
+        }
     }
 
-    // Run the CNN with real inputs and discard outputs (only for num_lh_frames)
-    for (size_t frame_idx = 0; frame_idx < num_lh_frames; frame_idx++) {
-        pitch_cnn.frame_inference(
-            stacked_cqt + frame_idx * NUM_HARMONICS * NUM_FREQ_IN,
-            contours_posteriorgrams[0], notes_posteriorgrams[0],
-            onsets_posteriorgrams[0]);
+    // Run end with zeroes as input and last frames as output
+    for (size_t i = 0; i < num_lh_frames; i++) {
+        if (is_cancelled()) {
+            reset();
+            return TranscriptionCancelled;
+        }
+        infer_frame(zero_stacked_cqt.data());
     }
 
-    // Run the CNN with real inputs and correct outputs
-    for (size_t frame_idx = num_lh_frames; frame_idx < num_frames;
-         frame_idx++) {
-        pitch_cnn.frame_inference(
-            stacked_cqt + frame_idx * NUM_HARMONICS * NUM_FREQ_IN,
-            contours_posteriorgrams[frame_idx - num_lh_frames],
-            notes_posteriorgrams[frame_idx - num_lh_frames],
-            onsets_posteriorgrams[frame_idx - num_lh_frames]);
+    // Not needed for note extraction
+    features_calculator.release_features();
+
+    cnn_scope.end();
+
+    if (cache != nullptr) {
+        cache->insert(key, make_cache_entry());
     }
 
-    // Run end with zeroes as input and last frames as output
-    for (size_t frame_idx = num_frames; frame_idx < num_frames + num_lh_frames;
-         frame_idx++) {
-        pitch_cnn.frame_inference(
-            zero_stacked_cqt.data(),
-            contours_posteriorgrams[frame_idx - num_lh_frames],
-            notes_posteriorgrams[frame_idx - num_lh_frames],
-            onsets_posteriorgrams[frame_idx - num_lh_frames]);
+    if (!extract_notes(control != nullptr ? &control->cancel_requested
+                                          : nullptr)) {
+        reset();
+        return TranscriptionCancelled;
+    }
+    return TranscriptionDone;
+}
+
+std::vector<float> &PitchDetector::contours_frame(size_t frame_idx) {
+    if (!half_contours_posteriorgram.empty()) {
+        return scratch_contours_frame;
+    }
+    return contours_posteriorgrams.empty() ? no_contours_frame
+                                           : contours_posteriorgrams[frame_idx];
+}
+
+std::vector<float> &PitchDetector::notes_frame(size_t frame_idx) {
+    return half_notes_posteriorgram.empty() ? notes_posteriorgrams[frame_idx]
+                                            : scratch_notes_frame;
+}
+
+std::vector<float> &PitchDetector::onsets_frame(size_t frame_idx) {
+    return half_onsets_posteriorgram.empty() ? onsets_posteriorgrams[frame_idx]
+                                             : scratch_onsets_frame;
+}
+
+void PitchDetector::store_frame(size_t frame_idx) {
+    if (half_notes_posteriorgram.empty()) {
+        return;
     }
 
-    note_events =
-        notes_creator.convert(notes_posteriorgrams, onsets_posteriorgrams,
-                              contours_posteriorgrams, convert_params);
+    if (!half_contours_posteriorgram.empty()) {
+        half_contours_posteriorgram.set_frame(frame_idx,
+                                              scratch_contours_frame.data());
+    }
+    half_notes_posteriorgram.set_frame(frame_idx, scratch_notes_frame.data());
+    half_onsets_posteriorgram.set_frame(frame_idx, scratch_onsets_frame.data());
 }
 
-void PitchDetector::update_midi() {
-    note_events =
-        notes_creator.convert(notes_posteriorgrams, onsets_posteriorgrams,
-                              contours_posteriorgrams, convert_params);
+void PitchDetector::update_midi() { extract_notes(nullptr); }
+
+bool PitchDetector::extract_notes(const std::atomic<bool> *cancel) {
+    auto params = convert_params;
+
+    // Pitch bends can't be added if contours were not kept.
+    if (contours_posteriorgrams.empty() &&
+        half_contours_posteriorgram.empty()) {
+        params.pitch_bend = NoPitchBend;
+    }
+
+    if (!half_notes_posteriorgram.empty()) {
+        note_events = notes_creator.convert_compact(
+            half_notes_posteriorgram, half_onsets_posteriorgram,
+            half_contours_posteriorgram, params, num_note_threads, cancel);
+    } else {
+        note_events = notes_creator.convert_compact(
+            notes_posteriorgrams, onsets_posteriorgrams,
+            contours_posteriorgrams, params, num_note_threads, cancel);
+    }
+
+    converted_note_events.clear();
+    are_note_events_converted = false;
+
+    return cancel == nullptr || !cancel->load(std::memory_order_relaxed);
 }
 
 const std::vector<Notes::Event> &PitchDetector::latest_note_events() const {
+    if (!are_note_events_converted) {
+        converted_note_events = Notes::to_events(note_events);
+        are_note_events_converted = true;
+    }
+    return converted_note_events;
+}
+
+const Notes::CompactEvents &PitchDetector::latest_compact_note_events() const {
     return note_events;
 }
+
+void PitchDetector::latest_posteriorgrams(
+    std::vector<std::vector<float>> &out_contours,
+    std::vector<std::vector<float>> &out_notes,
+    std::vector<std::vector<float>> &out_onsets) const {
+    if (!half_notes_posteriorgram.empty()) {
+        out_contours = half_contours_posteriorgram.to_frames();
+        out_notes = half_notes_posteriorgram.to_frames();
+        out_onsets = half_onsets_posteriorgram.to_frames();
+        return;
+    }
+
+    out_contours = contours_posteriorgrams;
+    out_notes = notes_posteriorgrams;
+    out_onsets = onsets_posteriorgrams;
+}
+
+void PitchDetector::start_stream(size_t ring_buffer_num_samples,
+                                 bool online_notes,
+                                 int max_note_latency_frames) {
+    stop_stream();
+
+    stream_convert_params = convert_params;
+    stream_convert_params.pitch_bend = NoPitchBend;
+
+    stream_init(ring_buffer_num_samples, online_notes,
+                max_note_latency_frames);
+
+    // Same warm-up as transcribe_to_midi. Streamed notes have no pitch bends,
+    // so no contours.
+    pitch_cnn.set_outputs(PitchCnn::NotesOutput | PitchCnn::OnsetsOutput);
+    pitch_cnn.warm_up();
+
+    stream_start_worker();
+}
+
+void PitchDetector::stream_init(size_t ring_buffer_num_samples,
+                                bool online_notes,
+                                int max_note_latency_frames) {
+    stream_audio_queue =
+        std::make_unique<SpscQueue<float>>(ring_buffer_num_samples);
+    stream_event_queue = std::make_unique<SpscQueue<StreamNoteEvent>>(
+        stream_event_queue_capacity);
+
+    stream_note_tracker =
+        online_notes ? std::make_unique<NoteTracker>(stream_convert_params,
+                                                     max_note_latency_frames)
+                     : nullptr;
+    stream_max_note_latency_frames = max_note_latency_frames;
+
+    feature_stream.reset();
+
+    stream_notes_posteriorgrams.clear();
+    stream_onsets_posteriorgrams.clear();
+    stream_notes_frame.assign(NUM_FREQ_OUT, 0.0f);
+    stream_onsets_frame.assign(NUM_FREQ_OUT, 0.0f);
+    stream_zero_frame.assign(NUM_HARMONICS * NUM_FREQ_IN, 0.0f);
+
+    stream_num_frames_in = 0;
+    stream_num_samples_popped = 0;
+    stream_num_samples_done.store(0, std::memory_order_release);
+    stream_num_events_dropped.store(0, std::memory_order_relaxed);
+    stream_segment_start_frame = 0;
+    stream_num_quiet_frames = 0;
+    stream_segment_active = false;
+}
+
+void PitchDetector::stream_start_worker() {
+    stream_stop_requested.store(false, std::memory_order_release);
+    stream_pause_requested.store(false, std::memory_order_release);
+    stream_worker = std::thread([this] { stream_worker_loop(); });
+}
+
+size_t PitchDetector::push_audio(const float *audio, size_t num_samples) {
+    if (stream_audio_queue == nullptr) {
+        return 0;
+    }
+
+    return stream_audio_queue->push(audio, num_samples);
+}
+
+size_t PitchDetector::pop_stream_events(StreamNoteEvent *out_events,
+                                        size_t max_events) {
+    if (stream_event_queue == nullptr) {
+        return 0;
+    }
+
+    return stream_event_queue->pop(out_events, max_events);
+}
+
+void PitchDetector::stop_stream() {
+    if (!stream_worker.joinable()) {
+        return;
+    }
+
+    stream_stop_requested.store(true, std::memory_order_release);
+    stream_worker.join();
+}
+
+bool PitchDetector::is_streaming() const { return stream_worker.joinable(); }
+
+size_t PitchDetector::stream_num_samples_processed() const {
+    return stream_num_samples_done.load(std::memory_order_acquire);
+}
+
+size_t PitchDetector::num_dropped_stream_events() const {
+    return stream_num_events_dropped.load(std::memory_order_relaxed);
+}
+
+// Header of stream state blobs
+static constexpr char stream_state_magic[8] = {'N', 'P', 'S', 'T',
+                                               'R', 'E', 'A', 'M'};
+static constexpr uint32_t stream_state_version = 2;
+
+std::vector<uint8_t> PitchDetector::save_stream_state() {
+    if (!is_streaming()) {
+        return {};
+    }
+
+    TraceScope trace_scope("PitchDetector::save_stream_state");
+
+    stream_pause_requested.store(true, std::memory_order_release);
+    stream_worker.join();
+
+    // The worker is stopped: take over the audio it has not read yet.
+    std::vector<float> audio_chunk(4096);
+    size_t num_popped;
+    while ((num_popped = stream_audio_queue->pop(audio_chunk.data(),
+                                                 audio_chunk.size())) > 0) {
+        feature_stream.push_audio(audio_chunk.data(), num_popped);
+        stream_num_samples_popped += num_popped;
+    }
+
+    std::vector<uint8_t> state;
+    StateWriter writer(state);
+    writer.write(stream_state_magic);
+    writer.write(stream_state_version);
+    // The worker is stopped, the CNN weights can be hashed.
+    writer.write<uint64_t>(model_version());
+
+    writer.write(stream_convert_params);
+    writer.write<uint8_t>(stream_note_tracker != nullptr);
+    writer.write<int32_t>(stream_max_note_latency_frames);
+
+    writer.write<uint64_t>(stream_num_frames_in);
+    writer.write<uint64_t>(stream_segment_start_frame);
+    writer.write<uint64_t>(stream_num_quiet_frames);
+    writer.write<uint8_t>(stream_segment_active);
+
+    writer.write<uint64_t>(stream_notes_posteriorgrams.size());
+    for (size_t i = 0; i < stream_notes_posteriorgrams.size(); i++) {
+        writer.write_floats(stream_notes_posteriorgrams[i].data(),
+                            NUM_FREQ_OUT);
+        writer.write_floats(stream_onsets_posteriorgrams[i].data(),
+                            NUM_FREQ_OUT);
+    }
+
+    feature_stream.save_state(writer);
+    pitch_cnn.save_state(writer);
+    if (stream_note_tracker != nullptr) {
+        stream_note_tracker->save_state(writer);
+    }
+
+    stream_start_worker();
+    return state;
+}
+
+bool PitchDetector::restore_stream_state(BinaryBlob state,
+                                         size_t ring_buffer_num_samples) {
+    stop_stream();
+
+    StateReader reader(state);
+    reader.expect(stream_state_magic);
+    reader.expect(stream_state_version);
+    // Features and CNN states are only valid with the models that wrote them.
+    reader.expect(model_version());
+
+    Notes::ConvertParams params;
+    uint8_t online_notes = 0;
+    int32_t max_note_latency_frames = -1;
+    reader.read(params);
+    reader.read(online_notes);
+    reader.read(max_note_latency_frames);
+    if (!reader.ok()) {
+        return false;
+    }
+
+    stream_convert_params = params;
+    stream_init(ring_buffer_num_samples, online_notes != 0,
+                max_note_latency_frames);
+    pitch_cnn.set_outputs(PitchCnn::NotesOutput | PitchCnn::OnsetsOutput);
+
+    uint64_t num_frames_in = 0;
+    uint64_t segment_start_frame = 0;
+    uint64_t num_quiet_frames = 0;
+    uint8_t segment_active = 0;
+    reader.read(num_frames_in);
+    reader.read(segment_start_frame);
+    reader.read(num_quiet_frames);
+    reader.read(segment_active);
+
+    uint64_t segment_num_frames = 0;
+    if (reader.read(segment_num_frames) &&
+        segment_num_frames >
+            reader.remaining() / (2 * NUM_FREQ_OUT * sizeof(float))) {
+        reader.fail();
+    }
+    for (uint64_t i = 0; i < segment_num_frames && reader.ok(); i++) {
+        reader.read_floats(stream_notes_frame.data(), NUM_FREQ_OUT);
+        reader.read_floats(stream_onsets_frame.data(), NUM_FREQ_OUT);
+        stream_notes_posteriorgrams.push_back(stream_notes_frame);
+        stream_onsets_posteriorgrams.push_back(stream_onsets_frame);
+    }
+
+    if (reader.ok()) {
+        feature_stream.restore_state(reader);
+    }
+    if (reader.ok()) {
+        pitch_cnn.restore_state(reader);
+    }
+    if (reader.ok() && stream_note_tracker != nullptr) {
+        stream_note_tracker->restore_state(reader);
+    }
+
+    if (!reader.ok() || reader.remaining() != 0) {
+        pitch_cnn.reset();
+        feature_stream.reset();
+        stream_notes_posteriorgrams.clear();
+        stream_onsets_posteriorgrams.clear();
+        stream_note_tracker = nullptr;
+        stream_audio_queue = nullptr;
+        stream_event_queue = nullptr;
+        return false;
+    }
+
+    stream_num_frames_in = num_frames_in;
+    stream_segment_start_frame = segment_start_frame;
+    stream_num_quiet_frames = num_quiet_frames;
+    stream_segment_active = segment_active != 0;
+
+    stream_start_worker();
+    return true;
+}
+
+void PitchDetector::stream_worker_loop() {
+    trace_set_thread_name("stream worker");
+
+    std::vector<float> audio_chunk(4096);
+    std::vector<float> stacked_cqt;
+
+    bool stop_requested = false;
+
+    while (!stop_requested) {
+        // Paused by save_stream_state, which restarts the worker.
+        if (stream_pause_requested.load(std::memory_order_acquire)) {
+            return;
+        }
+
+        // Read the flag before draining so all audio pushed before
+        // stop_stream gets processed.
+        stop_requested = stream_stop_requested.load(std::memory_order_acquire);
+
+        size_t num_popped;
+        while ((num_popped = stream_audio_queue->pop(
+                    audio_chunk.data(), audio_chunk.size())) > 0) {
+            feature_stream.push_audio(audio_chunk.data(), num_popped);
+            stream_num_samples_popped += num_popped;
+        }
+
+        TraceScope features_scope("FeatureStream::compute_frames");
+        stacked_cqt.clear();
+        const auto num_new_frames =
+            feature_stream.compute_frames(stop_requested, stacked_cqt);
+        features_scope.end();
+
+        for (size_t i = 0; i < num_new_frames; i++) {
+            stream_frame_inference(stacked_cqt.data() +
+                                   i * NUM_HARMONICS * NUM_FREQ_IN);
+        }
+        stream_num_samples_done.store(stream_num_samples_popped,
+                                      std::memory_order_release);
+
+        if (!stop_requested && num_new_frames == 0) {
+            std::this_thread::sleep_for(stream_poll_interval);
+        }
+    }
+
+    // Run end with zeroes as input to get the last frames out
+    if (stream_num_frames_in > 0) {
+        for (int i = 0; i < PitchCnn::num_frames_lookahead(); i++) {
+            stream_frame_inference(nullptr);
+        }
+    }
+
+    if (stream_note_tracker != nullptr) {
+        stream_tracker_events.clear();
+        stream_note_tracker->flush(stream_tracker_events);
+        for (const auto &event : stream_tracker_events) {
+            stream_publish(event, 0);
+        }
+    } else if (stream_segment_active) {
+        stream_close_segment(0);
+    }
+}
+
+void PitchDetector::stream_frame_inference(const float *stacked_cqt) {
+    pitch_cnn.frame_inference(
+        stacked_cqt != nullptr ? stacked_cqt : stream_zero_frame.data(),
+        no_contours_frame, stream_notes_frame, stream_onsets_frame);
+
+    // The first num_frames_lookahead outputs belong to the warm-up.
+    if (stream_num_frames_in++ < (size_t)PitchCnn::num_frames_lookahead()) {
+        return;
+    }
+
+    if (stream_note_tracker != nullptr) {
+        TraceScope tracker_scope("NoteTracker::push_frame");
+        stream_tracker_events.clear();
+        stream_note_tracker->push_frame(stream_notes_frame.data(),
+                                        stream_onsets_frame.data(),
+                                        stream_tracker_events);
+        for (const auto &event : stream_tracker_events) {
+            stream_publish(event, 0);
+        }
+        return;
+    }
+
+    stream_notes_posteriorgrams.push_back(stream_notes_frame);
+    stream_onsets_posteriorgrams.push_back(stream_onsets_frame);
+
+    const bool is_quiet =
+        *std::max_element(stream_notes_frame.begin(),
+                          stream_notes_frame.end()) <
+        stream_convert_params.frame_threshold;
+
+    if (is_quiet) {
+        stream_num_quiet_frames++;
+    } else {
+        stream_num_quiet_frames = 0;
+        stream_segment_active = true;
+    }
+
+    const auto segment_num_frames = stream_notes_posteriorgrams.size();
+
+    if (!stream_segment_active) {
+        // Only keep a few quiet frames so an onset right before the next
+        // active frame is not lost.
+        if (segment_num_frames > stream_segment_lead_frames) {
+            stream_close_segment(stream_segment_lead_frames);
+        }
+    } else if (stream_num_quiet_frames >=
+               (size_t)stream_convert_params.energy_threshold + 2) {
+        // No note can extend past this many quiet frames.
+        stream_close_segment(stream_segment_lead_frames);
+    } else if (segment_num_frames >= stream_max_segment_frames) {
+        // Bound latency and memory: notes still sounding are split here.
+        stream_close_segment(0);
+    }
+}
+
+void PitchDetector::stream_close_segment(size_t num_frames_to_keep) {
+    TraceScope trace_scope("PitchDetector::stream_close_segment");
+
+    const auto segment_num_frames = stream_notes_posteriorgrams.size();
+    num_frames_to_keep = std::min(num_frames_to_keep, segment_num_frames);
+
+    if (stream_segment_active) {
+        const auto events = notes_creator.convert(
+            stream_notes_posteriorgrams, stream_onsets_posteriorgrams, {},
+            stream_convert_params);
+
+        for (const auto &event : events) {
+            stream_publish(event, static_cast<int>(stream_segment_start_frame));
+        }
+    }
+
+    const auto num_frames_to_drop = segment_num_frames - num_frames_to_keep;
+
+    for (auto *posteriorgrams :
+         {&stream_notes_posteriorgrams, &stream_onsets_posteriorgrams}) {
+        posteriorgrams->erase(posteriorgrams->begin(),
+                              posteriorgrams->begin() +
+                                  (long)num_frames_to_drop);
+    }
+
+    stream_segment_start_frame += num_frames_to_drop;
+    stream_segment_active = false;
+    stream_num_quiet_frames = 0;
+}
+
+void PitchDetector::stream_publish(const Notes::Event &event,
+                                   int frame_offset) {
+    const bool pushed = stream_event_queue->push(StreamNoteEvent{
+        Notes::model_frame_to_seconds(event.start_frame + frame_offset),
+        Notes::model_frame_to_seconds(event.end_frame + frame_offset),
+        event.start_frame + frame_offset,
+        event.end_frame + frame_offset,
+        event.midi_note_number,
+        event.amplitude,
+    });
+
+    if (!pushed) {
+        stream_num_events_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
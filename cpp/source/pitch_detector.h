@@ -1,8 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "cnn_weights.h"
 #include "features.h"
+#include "mapped_file.h"
+#include "note_tracker.h"
 #include "notes.h"
 #include "pitch_cnn.h"
+#include "posteriorgram_cache.h"
+#include "spsc_queue.h"
 
 struct PitchDetectorModelFiles {
     BinaryBlob features_model_ort;
@@ -12,10 +22,85 @@ struct PitchDetectorModelFiles {
     BinaryBlob cnn_onset_2_model_json;
 };
 
+/**
+ * Note event published by the streaming front end. Trivially copyable so it
+ * can go through a lock-free queue. Streamed notes carry no pitch bends.
+ */
+struct StreamNoteEvent {
+    double start_time;
+    double end_time;
+    int start_frame;
+    int end_frame;
+    int midi_note_number;
+    double amplitude;
+};
+
+/**
+ * Memory a transcription allocates on top of the detector itself, see
+ * PitchDetector::estimate_memory. The features and the note extraction
+ * working memory are not alive at the same time.
+ */
+struct MemoryEstimate {
+    // Features tensor, ONNX Runtime intermediates included (assumed no
+    // larger than the output).
+    size_t features_bytes;
+    // Posteriorgrams kept for update_midi.
+    size_t posteriorgrams_bytes;
+    // Copies made by Notes::convert_compact: remaining energy, inferred
+    // onsets, melodia index and float frames of half precision
+    // posteriorgrams.
+    size_t notes_bytes;
+    // Maximum over the CNN phase (features and posteriorgrams) and the note
+    // extraction phase (posteriorgrams and notes_bytes).
+    size_t peak_bytes;
+    // Features computed in windows, see PitchDetector::set_segmented_features.
+    bool segmented_features;
+};
+
+/**
+ * Outcome of PitchDetector::transcribe_to_midi.
+ */
+enum TranscriptionResult {
+    TranscriptionDone = 0,
+    // Cancelled through TranscriptionControl::cancel_requested.
+    TranscriptionCancelled,
+    // Not run: the estimated memory is over the limit, see
+    // PitchDetector::set_memory_limit.
+    TranscriptionRejected
+};
+
+/**
+ * Progress and cancellation of a transcription, shared with the thread that
+ * runs it. See PitchDetector::transcribe_to_midi.
+ */
+struct TranscriptionControl {
+    // Set by any thread to stop the transcription at the next check.
+    std::atomic<bool> cancel_requested{false};
+
+    // Written by the transcription: number of frames to compute, known once
+    // the features are computed, and number of frames done.
+    std::atomic<size_t> num_frames{0};
+    std::atomic<size_t> num_frames_done{0};
+};
+
 class PitchDetector {
   public:
     explicit PitchDetector(PitchDetectorModelFiles model_files);
 
+    /**
+     * Create a detector from model files. They are memory mapped and used in
+     * place: nothing is copied at startup and all processes using the same
+     * files share their pages.
+     * @param features_model_path Features model in ORT format.
+     * @param cnn_weights_path Prepacked CNN weight file (see cnn_weights.h).
+     * @return nullptr if a file can't be mapped, the weight file is not a
+     * valid basic pitch model or ONNX Runtime can't load the features model.
+     */
+    static std::unique_ptr<PitchDetector>
+    from_files(const char *features_model_path, const char *cnn_weights_path);
+
+    ~PitchDetector();
+
     /**
      * Resets all states of model, clear the posteriorgrams vector computed by
      * the CNN and the note event vector.
@@ -33,13 +118,150 @@ class PitchDetector {
     void set_parameters(float note_sensibility, float split_sensibility,
                         float min_note_duration_ms);
 
+    /**
+     * Set the pitch bend mode. set_parameters resets it to MultiPitchBend.
+     * Contour posteriorgrams are only computed and stored when pitch bends
+     * are on, so a transcription done with NoPitchBend keeps about 40% of the
+     * posteriorgram memory and update_midi can't add pitch bends to it.
+     * @param pitch_bend Pitch bend mode.
+     */
+    void set_pitch_bend(PitchBendModes pitch_bend);
+
+    /**
+     * Restrict transcription to a frequency range. Notes outside of it are
+     * not extracted and, with band-limited inference, the CNN only computes
+     * what the notes in the range depend on. Applies to the next
+     * transcription or stream. Since the posteriorgrams outside the range are
+     * not computed, update_midi can't widen the range afterwards.
+     *
+     * With band-limited inference, inferred onsets are scaled with maxima
+     * over the range instead of over all notes, so results can differ
+     * slightly from the full model.
+     * @param min_frequency Lowest frequency in Hz, -1 for no limit.
+     * @param max_frequency Highest frequency in Hz, -1 for no limit.
+     * @param band_limited_inference Only compute the CNN for the range.
+     */
+    void set_frequency_range(float min_frequency, float max_frequency,
+                             bool band_limited_inference = true);
+
+    /**
+     * Prune the CNN weights: weight rows within tolerance of zero are set
+     * to zero and skipped, see PitchCnn::prune_weights. Notes change
+     * slightly with the tolerance. Weights can't be restored afterwards.
+     * @param tolerance Relative tolerance, e.g. 0.08.
+     * @return Fraction of the CNN multiply-adds that are skipped.
+     */
+    float prune_cnn_weights(float tolerance);
+
+    /**
+     * Skip CNN inference on silent stretches. See PitchCnn::set_silence_gate.
+     * Applies to the next transcription or stream.
+     * @param threshold Silence threshold on the features, negative disables
+     * the gate (default).
+     */
+    void set_silence_gate(float threshold);
+
+    /**
+     * @return Number of frames skipped by the silence gate during the latest
+     * transcription or stream.
+     */
+    [[nodiscard]] size_t num_skipped_frames() const;
+
+    /**
+     * Number of threads note events are extracted with by transcribe_to_midi
+     * and update_midi. See Notes::convert_parallel. Events don't depend on
+     * it.
+     * @param num_threads Number of threads, 1 by default, 0 for the number of
+     * cores.
+     */
+    void set_num_note_threads(int num_threads);
+
+    /**
+     * Storage precision of the posteriorgrams kept for update_midi, from the
+     * next transcribe_to_midi. Float16Precision and BFloat16Precision halve
+     * their memory, frames are converted when the CNN writes them and when
+     * notes are extracted. Rounding can move a note boundary by a frame, see
+     * PosteriorgramPrecision. Streaming is not affected.
+     * @param precision Float32Precision by default.
+     */
+    void set_posteriorgram_precision(PosteriorgramPrecision precision);
+
+    /**
+     * Compute the features of transcribe_to_midi in 2 second windows, as
+     * Basic Pitch does for long files, instead of at once. The features then
+     * take a constant amount of memory instead of about 17 KB per frame (the
+     * largest part of a transcription), but notes can differ slightly since
+     * the features model normalizes its input.
+     * @param segmented Off by default.
+     */
+    void set_segmented_features(bool segmented);
+
+    /**
+     * Compute features with an optimized variant of the features model,
+     * memory mapped and used in place. See Features::use_optimized_model.
+     * Not while streaming.
+     * @param features_model_path Optimized model in ORT format.
+     * @param tolerance Maximum absolute difference from the current features
+     * model on a test signal.
+     * @return False if the file can't be mapped or loaded, or the model is
+     * out of tolerance. The current model is then kept.
+     */
+    bool use_optimized_features_model(
+        const char *features_model_path,
+        float tolerance = Features::default_optimized_model_tolerance);
+
+    /**
+     * Cap the memory of transcribe_to_midi. Features are computed in windows
+     * (see set_segmented_features) if the estimated peak is over the limit
+     * otherwise, and transcriptions that would still exceed it are not run
+     * (TranscriptionRejected) unless their posteriorgrams are cached.
+     * @param max_bytes Limit in bytes, 0 for no limit (default).
+     */
+    void set_memory_limit(size_t max_bytes);
+
+    /**
+     * Look the audio of transcribe_to_midi up in a posteriorgram cache, and
+     * store the posteriorgrams of audio that is not in it. On a hit, Features
+     * and the CNN are skipped and notes are extracted with the current
+     * parameters. Keys hold the models as used (pruned weights and optimized
+     * features model included) and the settings the posteriorgrams depend
+     * on: pitch bends on or off, frequency range, silence gate, precision and
+     * segmented features.
+     * @param cache Cache, can be shared with other detectors. nullptr
+     * (default) disables caching.
+     */
+    void set_posteriorgram_cache(std::shared_ptr<PosteriorgramCache> cache);
+
+    /**
+     * @return Cache set by set_posteriorgram_cache, nullptr if none.
+     */
+    [[nodiscard]] PosteriorgramCache *posteriorgram_cache() const {
+        return cache.get();
+    }
+
+    /**
+     * Estimate the memory transcribe_to_midi would allocate with the current
+     * options and memory limit.
+     * @param num_samples Number of input samples.
+     * @return Estimate. Events and pitch bends are not counted.
+     */
+    [[nodiscard]] MemoryEstimate estimate_memory(size_t num_samples) const;
+
     /**
      * Transcribe the input audio. The note event vector can be obtained after
      * this with latest_note_events
      * @param audio Pointer to raw audio (must be at 22050 Hz)
      * @param num_samples Number of input samples available.
+     * @param control Progress is reported to it frame by frame, and
+     * cancellation is checked between CNN frames and between note extraction
+     * passes. May be nullptr.
+     * @return TranscriptionDone, or TranscriptionCancelled or
+     * TranscriptionRejected and the detector is then reset. A cache hit is
+     * never rejected.
      */
-    void transcribe_to_midi(float *audio, int num_samples);
+    TranscriptionResult
+    transcribe_to_midi(float *audio, int num_samples,
+                       TranscriptionControl *control = nullptr);
 
     /**
      * Function to call to update the midi transcription with new parameters.
@@ -48,23 +270,337 @@ class PitchDetector {
     void update_midi();
 
     /**
-     * @return Note event vector.
+     * @return Note event vector. Converted from the compact events on the
+     * first call after a transcription, see latest_compact_note_events.
      */
     [[nodiscard]] const std::vector<Notes::Event> &latest_note_events() const;
 
+    /**
+     * @return Note events, as stored by the detector.
+     */
+    [[nodiscard]] const Notes::CompactEvents &
+    latest_compact_note_events() const;
+
+    /**
+     * Copy the posteriorgrams of the latest transcription, converted to
+     * float if they are stored in half precision.
+     * @param out_contours Contour posteriorgrams, empty if they were not kept
+     * (see set_pitch_bend).
+     * @param out_notes Note posteriorgrams.
+     * @param out_onsets Onset posteriorgrams.
+     */
+    void
+    latest_posteriorgrams(std::vector<std::vector<float>> &out_contours,
+                          std::vector<std::vector<float>> &out_notes,
+                          std::vector<std::vector<float>> &out_onsets) const;
+
+    /**
+     * Start streaming transcription. Audio is then fed with push_audio from
+     * any single thread (typically the audio callback), a worker thread runs
+     * Features and the CNN, and note events are read back with
+     * pop_stream_events. Parameters are captured when the stream starts.
+     * transcribe_to_midi and update_midi must not be called while streaming.
+     *
+     * By default, notes are extracted with Notes::convert on segments that
+     * are cut where all notes are quiet, so a note is only published once its
+     * segment ends. A segment is also cut after 1024 frames (about 12 s)
+     * while notes are still sounding, to bound latency and memory: notes
+     * sounding at the cut are split in two there. With online_notes, a
+     * NoteTracker publishes each note as soon as it is final, at the cost of
+     * the melodia pass, and only splits notes at max_note_latency_frames.
+     *
+     * When the ring buffer holds no complete frame, the worker checks it
+     * again every 5 ms, which adds up to 5 ms of latency. The features are
+     * computed in 2 s windows (see FeatureStream), so this is small next to
+     * the window latency.
+     * @param ring_buffer_num_samples Capacity of the audio ring buffer. Audio
+     * pushed while it is full is dropped.
+     * @param online_notes Use NoteTracker instead of segments.
+     * @param max_note_latency_frames Latency bound of the NoteTracker in
+     * frames, 1024 (about 12 s, as segments) by default. -1 for unbounded,
+     * which makes the worker time per frame grow with the longest note. See
+     * NoteTracker.
+     */
+    void start_stream(size_t ring_buffer_num_samples = 1 << 17,
+                      bool online_notes = false,
+                      int max_note_latency_frames = 1024);
+
+    /**
+     * Push audio to the stream. Wait-free and allocation free, safe to call
+     * from a real-time thread.
+     * @param audio Pointer to raw audio (must be at 22050 Hz)
+     * @param num_samples Number of input samples available.
+     * @return Number of samples accepted. Less than num_samples if the ring
+     * buffer is full.
+     */
+    size_t push_audio(const float *audio, size_t num_samples);
+
+    /**
+     * Read note events finalized by the stream worker. Lock-free. Must be
+     * called from a single thread. The event queue holds 4096 events, events
+     * published while it is full are dropped and counted, see
+     * num_dropped_stream_events.
+     * @param out_events Output buffer, at least max_events long.
+     * @param max_events Maximum number of events to read.
+     * @return Number of events written to out_events.
+     */
+    size_t pop_stream_events(StreamNoteEvent *out_events, size_t max_events);
+
+    /**
+     * Process all audio pushed so far, flush the last notes and stop the
+     * worker thread. Remaining events can still be read with
+     * pop_stream_events afterwards. No-op if not streaming.
+     */
+    void stop_stream();
+
+    /**
+     * @return True between start_stream and stop_stream.
+     */
+    [[nodiscard]] bool is_streaming() const;
+
+    /**
+     * @return Number of samples pushed since the stream started or was
+     * restored that the worker has processed: Features and the CNN have run
+     * on all the frames these samples complete. Can be read from any thread,
+     * e.g. to measure how long pushed audio waits.
+     */
+    [[nodiscard]] size_t stream_num_samples_processed() const;
+
+    /**
+     * @return Number of note events dropped since the stream started or was
+     * restored because the event queue was full, i.e. pop_stream_events was
+     * not called often enough. Can be read from any thread.
+     */
+    [[nodiscard]] size_t num_dropped_stream_events() const;
+
+    /**
+     * Checkpoint the stream, e.g. to resume it after a crash or in another
+     * process. The worker is paused at a frame boundary while the state is
+     * written and then goes on; audio pushed meanwhile waits in the ring
+     * buffer. The state holds the audio not processed yet, the Features and
+     * CNN states, the frames and notes not converted yet, the stream
+     * parameters and a hash of the models. Events already published are not
+     * part of it. Must be called from the thread that starts and stops the
+     * stream.
+     * @return State blob, empty if not streaming. Native byte order, to be
+     * restored by the same build.
+     */
+    std::vector<uint8_t> save_stream_state();
+
+    /**
+     * Start a stream from a state written by save_stream_state, possibly by
+     * another detector. It goes on from where it was saved: events published
+     * after the checkpoint are published again and frame numbers continue.
+     * The detector must have the same models (checked with a hash of the
+     * features model and CNN weights, as the posteriorgram cache keys),
+     * frequency range and silence gate as the one that saved the state.
+     * @param state State blob.
+     * @param ring_buffer_num_samples See start_stream.
+     * @return False if the state is invalid or doesn't match the detector
+     * settings. The detector is then not streaming.
+     */
+    bool restore_stream_state(BinaryBlob state,
+                              size_t ring_buffer_num_samples = 1 << 17);
+
   private:
+    /**
+     * See from_files.
+     * @param cnn_layers Layers of cnn_weights, checked by the caller.
+     */
+    PitchDetector(MappedFile features_model, MappedFile cnn_weights,
+                  const std::vector<PackedConv2d> &cnn_layers);
+
+    /**
+     * @param frame_idx Frame index.
+     * @return Output vector for contours of the given frame, or an empty
+     * vector if contours are not kept.
+     */
+    std::vector<float> &contours_frame(size_t frame_idx);
+
+    /**
+     * @param frame_idx Frame index.
+     * @return Output vector for notes of the given frame. A scratch frame,
+     * stored by store_frame, if posteriorgrams are half precision.
+     */
+    std::vector<float> &notes_frame(size_t frame_idx);
+
+    /**
+     * Same as notes_frame for onsets.
+     */
+    std::vector<float> &onsets_frame(size_t frame_idx);
+
+    /**
+     * Convert the scratch frames to half precision and store them. No-op if
+     * posteriorgrams are float.
+     * @param frame_idx Frame index.
+     */
+    void store_frame(size_t frame_idx);
+
+    /**
+     * See estimate_memory.
+     * @param segmented Features computed in windows.
+     */
+    [[nodiscard]] MemoryEstimate estimate_memory(size_t num_samples,
+                                                 bool segmented) const;
+
+    /**
+     * @return Hash of the models as used: features model and CNN weights.
+     */
+    uint64_t model_version();
+
+    /**
+     * @return Cache key of transcribe_to_midi audio with the current
+     * settings.
+     * @param segmented Features computed in windows.
+     */
+    PosteriorgramCache::Key cache_key(const float *audio, size_t num_samples,
+                                      bool segmented);
+
+    /**
+     * @return Copy of the posteriorgrams, as stored.
+     */
+    [[nodiscard]] std::shared_ptr<const PosteriorgramCache::Entry>
+    make_cache_entry() const;
+
+    /**
+     * Replace the posteriorgrams with the ones of a cache entry.
+     */
+    void load_cache_entry(const PosteriorgramCache::Entry &entry);
+
+    /**
+     * Extract note events from the posteriorgrams, see update_midi.
+     * @param cancel Passed to Notes::convert_compact. May be nullptr.
+     * @return False if cancelled.
+     */
+    bool extract_notes(const std::atomic<bool> *cancel);
+
+    /**
+     * Create the stream queues and the note tracker for
+     * stream_convert_params and clear the stream state.
+     * @param ring_buffer_num_samples See start_stream.
+     * @param online_notes See start_stream.
+     * @param max_note_latency_frames See start_stream.
+     */
+    void stream_init(size_t ring_buffer_num_samples, bool online_notes,
+                     int max_note_latency_frames);
+
+    /**
+     * Start the stream worker thread.
+     */
+    void stream_start_worker();
+
+    /**
+     * Main loop of the stream worker thread.
+     */
+    void stream_worker_loop();
+
+    /**
+     * Run the CNN on one features frame and append the resulting
+     * posteriorgram frame (if any) to the current segment.
+     * @param stacked_cqt Features frame. nullptr for a zero frame.
+     */
+    void stream_frame_inference(const float *stacked_cqt);
+
+    /**
+     * Convert the current segment to notes, publish them and start a new
+     * segment.
+     * @param num_frames_to_keep Number of trailing frames to carry over to
+     * the next segment.
+     */
+    void stream_close_segment(size_t num_frames_to_keep);
+
+    /**
+     * Push a note event to the event queue.
+     * @param event Note event.
+     * @param frame_offset Offset to add to the event frames.
+     */
+    void stream_publish(const Notes::Event &event, int frame_offset);
+
+
     // Posteriorgrams vector
     std::vector<std::vector<float>> contours_posteriorgrams;
     std::vector<std::vector<float>> notes_posteriorgrams;
     std::vector<std::vector<float>> onsets_posteriorgrams;
 
-    std::vector<Notes::Event> note_events;
+    // Used instead of the vectors above with half precision. The CNN writes
+    // to the scratch frames, which are then converted.
+    PosteriorgramPrecision posteriorgram_precision = Float32Precision;
+    HalfPosteriorgram half_contours_posteriorgram;
+    HalfPosteriorgram half_notes_posteriorgram;
+    HalfPosteriorgram half_onsets_posteriorgram;
+    std::vector<float> scratch_contours_frame;
+    std::vector<float> scratch_notes_frame;
+    std::vector<float> scratch_onsets_frame;
+
+    // Stays empty, passed as contours output when contours are not needed.
+    std::vector<float> no_contours_frame;
+
+    Notes::CompactEvents note_events;
+    // note_events with one pitch bend vector per event, converted lazily by
+    // latest_note_events.
+    mutable std::vector<Notes::Event> converted_note_events;
+    mutable bool are_note_events_converted = false;
 
     Notes::ConvertParams convert_params;
+    int num_note_threads = 1;
+
+    bool segmented_features = false;
+    size_t memory_limit = 0;
+
+    // Posteriorgram cache and what its keys depend on besides the audio.
+    std::shared_ptr<PosteriorgramCache> cache;
+    uint64_t features_model_hash = 0;
+    uint64_t cnn_weights_hash = 0; // 0 until computed
+    int cnn_min_note_idx = 0;
+    int cnn_max_note_idx = MAX_NOTE_IDX;
+    float silence_gate_threshold = -1.0f;
 
     size_t num_frames = 0;
 
+    // Model files used in place by from_files detectors and by
+    // use_optimized_features_model, empty otherwise. Declared before the
+    // models so they outlive them.
+    MappedFile features_model_file;
+    MappedFile cnn_weights_file;
+    MappedFile optimized_features_model_file;
+
     Features features_calculator;
     PitchCnn pitch_cnn;
     Notes notes_creator;
+
+    // Streaming front end. The segment posteriorgrams hold the frames that
+    // have not been converted to notes yet. A segment is closed once all
+    // notes have been quiet for long enough that no note can continue, or
+    // after stream_max_segment_frames (see start_stream).
+    static constexpr size_t stream_max_segment_frames = 1024;
+    static constexpr size_t stream_segment_lead_frames = 2;
+    static constexpr size_t stream_event_queue_capacity = 4096;
+    static constexpr auto stream_poll_interval = std::chrono::milliseconds(5);
+
+    std::unique_ptr<SpscQueue<float>> stream_audio_queue;
+    std::unique_ptr<SpscQueue<StreamNoteEvent>> stream_event_queue;
+    std::thread stream_worker;
+    std::atomic<bool> stream_stop_requested{false};
+    // Set by save_stream_state: the worker exits without flushing.
+    std::atomic<bool> stream_pause_requested{false};
+
+    FeatureStream feature_stream;
+    Notes::ConvertParams stream_convert_params;
+    std::unique_ptr<NoteTracker> stream_note_tracker;
+    int stream_max_note_latency_frames = -1;
+    std::vector<Notes::Event> stream_tracker_events;
+
+    std::vector<std::vector<float>> stream_notes_posteriorgrams;
+    std::vector<std::vector<float>> stream_onsets_posteriorgrams;
+    std::vector<float> stream_notes_frame;
+    std::vector<float> stream_onsets_frame;
+    std::vector<float> stream_zero_frame;
+
+    size_t stream_num_frames_in = 0;
+    size_t stream_num_samples_popped = 0;
+    std::atomic<size_t> stream_num_samples_done{0};
+    std::atomic<size_t> stream_num_events_dropped{0};
+    size_t stream_segment_start_frame = 0;
+    size_t stream_num_quiet_frames = 0;
+    bool stream_segment_active = false;
 };
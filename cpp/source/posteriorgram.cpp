@@ -0,0 +1,199 @@
+#include "posteriorgram.h"
+
+#include <cassert>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Portable conversions are branch free (all cases computed, then selected
+// with masks) so that the compiler can vectorize them. Same results as the
+// hardware conversions, see https://gist.github.com/rygorous/2156668
+
+static inline uint32_t float_bits(float x) {
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline float bits_float(uint32_t u) {
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+/**
+ * @return All bits set if condition is true, 0 otherwise.
+ */
+static inline uint32_t mask(bool condition) {
+    return 0u - static_cast<uint32_t>(condition);
+}
+
+static inline uint32_t select(uint32_t mask, uint32_t a, uint32_t b) {
+    return (a & mask) | (b & ~mask);
+}
+
+static inline uint16_t float_to_float16(float x) {
+    constexpr uint32_t f32_infinity = 255u << 23;
+    constexpr uint32_t f16_max = (127u + 16u) << 23;
+    constexpr uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    const uint32_t bits = float_bits(x);
+    const uint32_t sign = bits & 0x80000000u;
+    const uint32_t u = bits ^ sign;
+
+    // Infinity or NaN
+    const uint32_t special = select(mask(u > f32_infinity), 0x7e00u, 0x7c00u);
+
+    // Subnormal or 0: the float addition aligns and rounds the mantissa.
+    const uint32_t subnormal =
+        float_bits(bits_float(u) + bits_float(denorm_magic)) - denorm_magic;
+
+    // Normal: rebias the exponent and round to nearest even.
+    const uint32_t mantissa_odd = (u >> 13) & 1u;
+    const uint32_t normal =
+        (u + ((15u - 127u) << 23) + 0xfffu + mantissa_odd) >> 13;
+
+    const uint32_t magnitude =
+        select(mask(u >= f16_max), special,
+               select(mask(u < (113u << 23)), subnormal, normal));
+    return static_cast<uint16_t>(magnitude | (sign >> 16));
+}
+
+static inline float float16_to_float(uint16_t h) {
+    constexpr uint32_t shifted_exponent = 0x7c00u << 13;
+    constexpr uint32_t magic = 113u << 23;
+
+    const uint32_t shifted = (h & 0x7fffu) << 13;
+    const uint32_t exponent = shifted & shifted_exponent;
+    const uint32_t rebiased = shifted + ((127u - 15u) << 23);
+
+    // Infinity or NaN
+    const uint32_t special = rebiased + ((128u - 16u) << 23);
+    // Subnormal or 0: renormalize with a float subtraction.
+    const uint32_t subnormal =
+        float_bits(bits_float(rebiased + (1u << 23)) - bits_float(magic));
+
+    const uint32_t magnitude =
+        select(mask(exponent == shifted_exponent), special,
+               select(mask(exponent == 0), subnormal, rebiased));
+    return bits_float(magnitude | (static_cast<uint32_t>(h & 0x8000u) << 16));
+}
+
+static inline uint16_t float_to_bfloat16(float x) {
+    // Round to nearest even. Posteriorgrams are never NaN.
+    const uint32_t u = float_bits(x);
+    return static_cast<uint16_t>((u + 0x7fffu + ((u >> 16) & 1u)) >> 16);
+}
+
+static inline float bfloat16_to_float(uint16_t h) {
+    return bits_float(static_cast<uint32_t>(h) << 16);
+}
+
+static void encode_float16(const float *in, uint16_t *out, size_t num_values) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= num_values; i += 8) {
+        const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i),
+                                          _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), h);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= num_values; i += 4) {
+        const float16x4_t h = vcvt_f16_f32(vld1q_f32(in + i));
+        vst1_u16(out + i, vreinterpret_u16_f16(h));
+    }
+#endif
+    for (; i < num_values; i++) {
+        out[i] = float_to_float16(in[i]);
+    }
+}
+
+static void decode_float16(const uint16_t *in, float *out, size_t num_values) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= num_values; i += 8) {
+        const __m128i h =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= num_values; i += 4) {
+        const float16x4_t h = vreinterpret_f16_u16(vld1_u16(in + i));
+        vst1q_f32(out + i, vcvt_f32_f16(h));
+    }
+#endif
+    for (; i < num_values; i++) {
+        out[i] = float16_to_float(in[i]);
+    }
+}
+
+void HalfPosteriorgram::encode(PosteriorgramPrecision precision,
+                               const float *in, uint16_t *out,
+                               size_t num_values) {
+    assert(precision == Float16Precision || precision == BFloat16Precision);
+
+    if (precision == Float16Precision) {
+        encode_float16(in, out, num_values);
+        return;
+    }
+
+    for (size_t i = 0; i < num_values; i++) {
+        out[i] = float_to_bfloat16(in[i]);
+    }
+}
+
+void HalfPosteriorgram::decode(PosteriorgramPrecision precision,
+                               const uint16_t *in, float *out,
+                               size_t num_values) {
+    assert(precision == Float16Precision || precision == BFloat16Precision);
+
+    if (precision == Float16Precision) {
+        decode_float16(in, out, num_values);
+        return;
+    }
+
+    for (size_t i = 0; i < num_values; i++) {
+        out[i] = bfloat16_to_float(in[i]);
+    }
+}
+
+void HalfPosteriorgram::resize(PosteriorgramPrecision precision,
+                               size_t num_frames, int num_bins) {
+    assert(precision == Float16Precision || precision == BFloat16Precision);
+    assert(num_bins >= 0);
+
+    format = precision;
+    frames = num_frames;
+    bins = num_bins;
+    // 0 is +0 in both formats
+    values.assign(num_frames * static_cast<size_t>(num_bins), 0);
+}
+
+void HalfPosteriorgram::clear() {
+    frames = 0;
+    bins = 0;
+    values.clear();
+    values.shrink_to_fit();
+}
+
+void HalfPosteriorgram::set_frame(size_t frame_idx, const float *in) {
+    assert(frame_idx < frames);
+    encode(format, in, values.data() + frame_idx * bins, bins);
+}
+
+void HalfPosteriorgram::get_frame(size_t frame_idx, float *out) const {
+    assert(frame_idx < frames);
+    decode(format, values.data() + frame_idx * bins, out, bins);
+}
+
+std::vector<std::vector<float>> HalfPosteriorgram::to_frames() const {
+    std::vector<std::vector<float>> out(frames, std::vector<float>(bins));
+    for (size_t i = 0; i < frames; i++) {
+        get_frame(i, out[i].data());
+    }
+    return out;
+}
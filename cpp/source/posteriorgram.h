@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Storage precision of the posteriorgrams kept between transcriptions.
+ * Posteriorgrams are sigmoid outputs in [0, 1]: float16 keeps 11 significant
+ * bits, values move by at most 2.5e-4 and amplitudes by about 1e-4. A value
+ * within that of a threshold can round across it and move a note boundary
+ * by a frame (1 of the 68 notes of the conformance clips). bfloat16 keeps 8
+ * and converts with a shift, values move by up to 2e-3, and note boundaries
+ * and pitch bends change more often (on the conformance clips, the same
+ * boundary and one pitch bend by one step). Note events are therefore not
+ * guaranteed to be the same as with Float32Precision.
+ */
+enum PosteriorgramPrecision {
+    Float32Precision = 0,
+    Float16Precision,
+    BFloat16Precision
+};
+
+/**
+ * Memory held by a float posteriorgram stored as one vector per frame, for
+ * memory budgets. Allocator overhead is counted as 16 bytes per allocation.
+ * @param num_frames Number of frames.
+ * @param num_bins Number of values per frame.
+ * @return Bytes.
+ */
+inline size_t float_posteriorgram_bytes(size_t num_frames, int num_bins) {
+    constexpr size_t allocation_overhead = 16;
+    return num_frames * (sizeof(std::vector<float>) + allocation_overhead +
+                         static_cast<size_t>(num_bins) * sizeof(float));
+}
+
+/**
+ * Posteriorgram stored as 16-bit floats, for half the memory of float
+ * frames. Frames are written and read as floats, the conversion is
+ * vectorized (F16C on x86 if enabled at build time, NEON on arm64, portable
+ * branch free loops otherwise).
+ */
+class HalfPosteriorgram {
+  public:
+    /**
+     * Set the size and precision. Values are set to 0.
+     * @param precision Float16Precision or BFloat16Precision.
+     * @param num_frames Number of frames.
+     * @param num_bins Number of values per frame.
+     */
+    void resize(PosteriorgramPrecision precision, size_t num_frames,
+                int num_bins);
+
+    /**
+     * Remove all frames and release the memory.
+     */
+    void clear();
+
+    /**
+     * @param frame_idx Frame index.
+     * @param values num_bins() values, rounded to nearest even.
+     */
+    void set_frame(size_t frame_idx, const float *values);
+
+    /**
+     * @param frame_idx Frame index.
+     * @param out Output array of num_bins() values.
+     */
+    void get_frame(size_t frame_idx, float *out) const;
+
+    /**
+     * @return All frames converted to float.
+     */
+    [[nodiscard]] std::vector<std::vector<float>> to_frames() const;
+
+    [[nodiscard]] size_t num_frames() const { return frames; }
+    [[nodiscard]] int num_bins() const { return bins; }
+    [[nodiscard]] bool empty() const { return frames == 0; }
+    [[nodiscard]] PosteriorgramPrecision precision() const { return format; }
+
+    /**
+     * Convert floats to 16-bit floats, rounding to nearest even.
+     * @param precision Float16Precision or BFloat16Precision.
+     * @param in Input array.
+     * @param out Output array.
+     * @param num_values Number of values.
+     */
+    static void encode(PosteriorgramPrecision precision, const float *in,
+                       uint16_t *out, size_t num_values);
+
+    /**
+     * Convert 16-bit floats to floats. Exact.
+     * @param precision Float16Precision or BFloat16Precision.
+     * @param in Input array.
+     * @param out Output array.
+     * @param num_values Number of values.
+     */
+    static void decode(PosteriorgramPrecision precision, const uint16_t *in,
+                       float *out, size_t num_values);
+
+  private:
+    PosteriorgramPrecision format = Float16Precision;
+    size_t frames = 0;
+    int bins = 0;
+
+    // [frames][bins]
+    std::vector<uint16_t> values;
+};
@@ -0,0 +1,129 @@
+#include "posteriorgram_cache.h"
+
+#include <cstring>
+
+#include "constants.h"
+
+static size_t half_posteriorgram_bytes(const HalfPosteriorgram &posteriorgram) {
+    return posteriorgram.num_frames() *
+           static_cast<size_t>(posteriorgram.num_bins()) * sizeof(uint16_t);
+}
+
+size_t PosteriorgramCache::Entry::num_bytes() const {
+    return float_posteriorgram_bytes(contours.size(), NUM_FREQ_IN) +
+           float_posteriorgram_bytes(notes.size(), NUM_FREQ_OUT) +
+           float_posteriorgram_bytes(onsets.size(), NUM_FREQ_OUT) +
+           half_posteriorgram_bytes(half_contours) +
+           half_posteriorgram_bytes(half_notes) +
+           half_posteriorgram_bytes(half_onsets);
+}
+
+PosteriorgramCache::PosteriorgramCache(size_t max_bytes)
+    : budget(max_bytes) {}
+
+std::shared_ptr<const PosteriorgramCache::Entry>
+PosteriorgramCache::find(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = index.find(key);
+    if (it == index.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    hits.fetch_add(1, std::memory_order_relaxed);
+    items.splice(items.begin(), items, it->second);
+    return it->second->entry;
+}
+
+void PosteriorgramCache::insert(const Key &key,
+                                std::shared_ptr<const Entry> entry) {
+    const size_t entry_bytes = entry->num_bytes();
+    if (entry_bytes > budget) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = index.find(key);
+    if (it != index.end()) {
+        bytes_used -= it->second->num_bytes;
+        items.erase(it->second);
+        index.erase(it);
+    }
+
+    items.push_front({key, std::move(entry), entry_bytes});
+    index.emplace(key, items.begin());
+    bytes_used += entry_bytes;
+    evict();
+}
+
+void PosteriorgramCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.clear();
+    index.clear();
+    bytes_used = 0;
+}
+
+size_t PosteriorgramCache::num_entries() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+}
+
+size_t PosteriorgramCache::num_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes_used;
+}
+
+void PosteriorgramCache::evict() {
+    while (bytes_used > budget && !items.empty()) {
+        bytes_used -= items.back().num_bytes;
+        index.erase(items.back().key);
+        items.pop_back();
+    }
+}
+
+static inline uint64_t rotate_left(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t mix(uint64_t x) {
+    // Finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t PosteriorgramCache::hash(const void *data, size_t num_bytes,
+                                  uint64_t seed) {
+    constexpr uint64_t prime_1 = 0x9e3779b185ebca87ULL;
+    constexpr uint64_t prime_2 = 0xc2b2ae3d27d4eb4fULL;
+
+    const auto *bytes = static_cast<const uint8_t *>(data);
+
+    // Four independent lanes, so that the multiplications overlap.
+    uint64_t lanes[4] = {seed + prime_1, seed ^ prime_2, seed - prime_1,
+                         ~seed};
+    size_t offset = 0;
+    for (; offset + 32 <= num_bytes; offset += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, bytes + offset + lane * 8, sizeof(word));
+            lanes[lane] = rotate_left(lanes[lane] + word * prime_2, 31) *
+                          prime_1;
+        }
+    }
+
+    uint64_t h = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) +
+                 rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+    for (; offset + 8 <= num_bytes; offset += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + offset, sizeof(word));
+        h = rotate_left(h ^ (word * prime_2), 27) * prime_1;
+    }
+    for (; offset < num_bytes; offset++) {
+        h = rotate_left(h ^ (bytes[offset] * prime_1), 11) * prime_2;
+    }
+
+    return mix(h ^ num_bytes);
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "posteriorgram.h"
+
+/**
+ * Posteriorgrams of recent transcriptions, so that transcribing the same
+ * audio again (duplicates, retries, new note parameters) skips Features and
+ * the CNN and only extracts notes. Entries are keyed by a hash of the audio,
+ * the model version and the settings the posteriorgrams depend on, and the
+ * least recently used ones are evicted to stay within a memory budget.
+ * Thread safe: a cache can be shared by several detectors, with the same
+ * models or not.
+ */
+class PosteriorgramCache {
+  public:
+    struct Key {
+        uint64_t audio_hash;
+        size_t num_samples;
+        // Hash of the models and of the settings, see PitchDetector.
+        uint64_t model_version;
+        uint64_t settings_hash;
+
+        bool operator==(const Key &other) const {
+            return audio_hash == other.audio_hash &&
+                   num_samples == other.num_samples &&
+                   model_version == other.model_version &&
+                   settings_hash == other.settings_hash;
+        }
+    };
+
+    /**
+     * Posteriorgrams as a detector stores them: float frames or half
+     * precision, see PosteriorgramPrecision. Contours may be empty.
+     */
+    struct Entry {
+        size_t num_frames = 0;
+        std::vector<std::vector<float>> contours;
+        std::vector<std::vector<float>> notes;
+        std::vector<std::vector<float>> onsets;
+        HalfPosteriorgram half_contours;
+        HalfPosteriorgram half_notes;
+        HalfPosteriorgram half_onsets;
+
+        /**
+         * @return Memory held by the entry, see float_posteriorgram_bytes.
+         */
+        [[nodiscard]] size_t num_bytes() const;
+    };
+
+    /**
+     * @param max_bytes Memory budget of the entries. Entries larger than it
+     * are not stored.
+     */
+    explicit PosteriorgramCache(size_t max_bytes);
+
+    /**
+     * Look an entry up and mark it as most recently used. Counts a hit or a
+     * miss.
+     * @return The entry, nullptr if there is none. It stays valid after
+     * being evicted.
+     */
+    std::shared_ptr<const Entry> find(const Key &key);
+
+    /**
+     * Store an entry, replacing any entry with the same key, and evict the
+     * least recently used ones over the budget.
+     */
+    void insert(const Key &key, std::shared_ptr<const Entry> entry);
+
+    /**
+     * Remove all entries. Counters are kept.
+     */
+    void clear();
+
+    [[nodiscard]] size_t num_hits() const {
+        return hits.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] size_t num_misses() const {
+        return misses.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return Number of entries stored.
+     */
+    [[nodiscard]] size_t num_entries() const;
+
+    /**
+     * @return Memory held by the entries stored.
+     */
+    [[nodiscard]] size_t num_bytes() const;
+
+    /**
+     * Fast non-cryptographic 64-bit hash, 8 bytes per step (a few GB/s).
+     * @param data Bytes to hash.
+     * @param num_bytes Number of bytes.
+     * @param seed Previous hash, to chain several buffers.
+     * @return Hash.
+     */
+    static uint64_t hash(const void *data, size_t num_bytes,
+                         uint64_t seed = 0);
+
+  private:
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return static_cast<size_t>(key.audio_hash ^ key.model_version ^
+                                       key.settings_hash ^ key.num_samples);
+        }
+    };
+
+    struct Item {
+        Key key;
+        std::shared_ptr<const Entry> entry;
+        size_t num_bytes;
+    };
+
+    /**
+     * Evict least recently used entries until within budget. Lock held.
+     */
+    void evict();
+
+    const size_t budget;
+
+    mutable std::mutex mutex;
+    // Most recently used first.
+    std::list<Item> items;
+    std::unordered_map<Key, std::list<Item>::iterator, KeyHash> index;
+    size_t bytes_used = 0;
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+};
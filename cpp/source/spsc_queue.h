@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Lock-free single-producer single-consumer ring buffer.
+ * push and pop are wait-free and never allocate, so one side can safely run
+ * on a real-time audio thread.
+ * @tparam T Element type. Must be trivially copyable.
+ */
+template <typename T> class SpscQueue {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "SpscQueue only holds trivially copyable types");
+
+  public:
+    /**
+     * @param min_capacity Minimum number of elements the queue can hold.
+     * Rounded up to the next power of two.
+     */
+    explicit SpscQueue(size_t min_capacity) {
+        size_t capacity = 1;
+        while (capacity < min_capacity) {
+            capacity <<= 1;
+        }
+        buffer.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    /**
+     * Push as many elements as fit. Producer side only.
+     * @param items Elements to push.
+     * @param num_items Number of elements in items.
+     * @return Number of elements actually pushed.
+     */
+    size_t push(const T *items, size_t num_items) {
+        const auto write = write_pos.load(std::memory_order_relaxed);
+        const auto read = read_pos.load(std::memory_order_acquire);
+        const auto num_to_push =
+            std::min(num_items, buffer.size() - (write - read));
+
+        const auto start = write & mask;
+        const auto first_part = std::min(num_to_push, buffer.size() - start);
+        std::copy(items, items + first_part, buffer.begin() + start);
+        std::copy(items + first_part, items + num_to_push, buffer.begin());
+
+        write_pos.store(write + num_to_push, std::memory_order_release);
+        return num_to_push;
+    }
+
+    bool push(const T &item) { return push(&item, 1) == 1; }
+
+    /**
+     * Pop up to max_items elements. Consumer side only.
+     * @param items Output buffer, at least max_items long.
+     * @param max_items Maximum number of elements to pop.
+     * @return Number of elements popped.
+     */
+    size_t pop(T *items, size_t max_items) {
+        const auto read = read_pos.load(std::memory_order_relaxed);
+        const auto write = write_pos.load(std::memory_order_acquire);
+        const auto num_to_pop = std::min(max_items, write - read);
+
+        const auto start = read & mask;
+        const auto first_part = std::min(num_to_pop, buffer.size() - start);
+        std::copy(buffer.begin() + start, buffer.begin() + start + first_part,
+                  items);
+        std::copy(buffer.begin(), buffer.begin() + (num_to_pop - first_part),
+                  items + first_part);
+
+        read_pos.store(read + num_to_pop, std::memory_order_release);
+        return num_to_pop;
+    }
+
+    bool pop(T &item) { return pop(&item, 1) == 1; }
+
+    /**
+     * @return Number of elements currently available to the consumer. Only
+     * exact when called from one of the two sides while the other is idle.
+     */
+    [[nodiscard]] size_t size() const {
+        return write_pos.load(std::memory_order_acquire) -
+               read_pos.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] size_t capacity() const { return buffer.size(); }
+
+  private:
+    std::vector<T> buffer;
+    size_t mask = 0;
+
+    // Monotonic positions, wrapped with mask on access. Kept on separate
+    // cache lines so producer and consumer don't false-share.
+    alignas(64) std::atomic<size_t> write_pos{0};
+    alignas(64) std::atomic<size_t> read_pos{0};
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "constants.h"
+
+/**
+ * Appends values to a state blob, see StateReader. Values are written in
+ * native byte order without padding: blobs are meant to be read back by the
+ * same build, on the same or another machine of the same architecture.
+ */
+class StateWriter {
+  public:
+    explicit StateWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    template <typename T> void write(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "Only trivially copyable values can be written");
+        write_bytes(&value, sizeof(T));
+    }
+
+    void write_floats(const float *values, size_t num_values) {
+        write_bytes(values, num_values * sizeof(float));
+    }
+
+    /**
+     * Write a vector of floats, preceded by its size.
+     */
+    void write_vector(const std::vector<float> &values) {
+        write<uint64_t>(values.size());
+        write_floats(values.data(), values.size());
+    }
+
+  private:
+    void write_bytes(const void *data, size_t num_bytes) {
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        out.insert(out.end(), bytes, bytes + num_bytes);
+    }
+
+    std::vector<uint8_t> &out;
+};
+
+/**
+ * Reads back the values of a StateWriter, in the same order. Reading past the
+ * end of the blob or a value that doesn't match what the reader expects
+ * fails the reader: all later reads fail too and read nothing, so callers
+ * only need to check ok() once at the end.
+ */
+class StateReader {
+  public:
+    explicit StateReader(BinaryBlob blob) : blob(blob) {}
+
+    template <typename T> bool read(T &value) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "Only trivially copyable values can be read");
+        return read_bytes(&value, sizeof(T));
+    }
+
+    bool read_floats(float *values, size_t num_values) {
+        return num_values <= remaining() / sizeof(float) &&
+               read_bytes(values, num_values * sizeof(float));
+    }
+
+    /**
+     * Read a vector written by StateWriter::write_vector.
+     * @param expected_size Required size, or SIZE_MAX for any size.
+     */
+    bool read_vector(std::vector<float> &values,
+                     size_t expected_size = SIZE_MAX) {
+        uint64_t size = 0;
+        if (!read(size) ||
+            (expected_size != SIZE_MAX && size != expected_size) ||
+            size > remaining() / sizeof(float)) {
+            return fail();
+        }
+        values.resize(size);
+        return read_floats(values.data(), size);
+    }
+
+    /**
+     * Read a value and check that it is the expected one, e.g. a size or a
+     * setting the state was saved with.
+     */
+    template <typename T> bool expect(const T &expected) {
+        T value{};
+        if (!read(value) || std::memcmp(&value, &expected, sizeof(T)) != 0) {
+            return fail();
+        }
+        return true;
+    }
+
+    /**
+     * Fail the reader, e.g. on a value out of range.
+     * @return false.
+     */
+    bool fail() {
+        failed = true;
+        return false;
+    }
+
+    /**
+     * @return Number of bytes not read yet.
+     */
+    [[nodiscard]] size_t remaining() const {
+        return failed ? 0 : blob.num_bytes - offset;
+    }
+
+    /**
+     * @return True if no read failed.
+     */
+    [[nodiscard]] bool ok() const { return !failed; }
+
+  private:
+    bool read_bytes(void *data, size_t num_bytes) {
+        if (num_bytes > remaining()) {
+            return fail();
+        }
+        if (num_bytes > 0) {
+            std::memcpy(data, blob.data + offset, num_bytes);
+        }
+        offset += num_bytes;
+        return true;
+    }
+
+    BinaryBlob blob;
+    size_t offset = 0;
+    bool failed = false;
+};
@@ -0,0 +1,196 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "spsc_queue.h"
+
+std::atomic<bool> trace_is_enabled{false};
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    int64_t start_ns;
+    int64_t end_ns;
+};
+
+/**
+ * Events of one thread. The thread is the producer, trace_dump the consumer.
+ * Once its thread exits, a buffer is reused by the next new thread.
+ */
+struct ThreadBuffer {
+    ThreadBuffer(size_t capacity, int id) : events(capacity), tid(id) {}
+
+    SpscQueue<TraceEvent> events;
+    std::atomic<uint64_t> num_dropped{0};
+    const int tid;
+
+    // Guarded by Registry::mutex
+    bool in_use = true;
+    std::string thread_name;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    size_t events_per_thread = 1 << 18;
+    int64_t origin_ns = -1;
+    int next_tid = 1;
+};
+
+// Never destroyed: threads may still record during static destruction.
+Registry &registry() {
+    static auto *instance = new Registry;
+    return *instance;
+}
+
+/**
+ * Buffer of the calling thread, released when the thread exits.
+ */
+struct ThreadBufferOwner {
+    ThreadBuffer *buffer = nullptr;
+    // Set before the thread has a buffer, copied to it once it gets one.
+    std::string thread_name;
+
+    ~ThreadBufferOwner() {
+        if (buffer != nullptr) {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            // The name stays for the events left to dump.
+            buffer->in_use = false;
+        }
+    }
+};
+
+thread_local ThreadBufferOwner thread_buffer_owner;
+
+ThreadBuffer &thread_buffer() {
+    auto &owner = thread_buffer_owner;
+    if (owner.buffer != nullptr) {
+        return *owner.buffer;
+    }
+
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    // Take the buffer of an exited thread once its events are dumped, so
+    // short lived worker threads don't add a buffer each.
+    for (auto &buffer : reg.buffers) {
+        if (!buffer->in_use && buffer->events.size() == 0 &&
+            buffer->events.capacity() >= reg.events_per_thread) {
+            buffer->in_use = true;
+            buffer->thread_name = owner.thread_name;
+            owner.buffer = buffer.get();
+            return *owner.buffer;
+        }
+    }
+
+    reg.buffers.push_back(
+        std::make_unique<ThreadBuffer>(reg.events_per_thread, reg.next_tid++));
+    owner.buffer = reg.buffers.back().get();
+    owner.buffer->thread_name = owner.thread_name;
+    return *owner.buffer;
+}
+
+void append_escaped(std::string &out, const char *text) {
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if (static_cast<unsigned char>(*c) < 0x20) {
+            out += ' ';
+        } else {
+            out += *c;
+        }
+    }
+}
+
+} // namespace
+
+void trace_set_enabled(bool enabled, size_t events_per_thread) {
+    auto &reg = registry();
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.events_per_thread = events_per_thread;
+        if (enabled && reg.origin_ns < 0) {
+            reg.origin_ns = trace_now_ns();
+        }
+    }
+    trace_is_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void trace_set_thread_name(const char *name) {
+    // Buffers are only allocated by threads that record events.
+    auto &owner = thread_buffer_owner;
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    owner.thread_name = name;
+    if (owner.buffer != nullptr) {
+        owner.buffer->thread_name = name;
+    }
+}
+
+void trace_record(const char *name, int64_t start_ns, int64_t end_ns) {
+    auto &buffer = thread_buffer();
+    if (!buffer.events.push(TraceEvent{name, start_ns, end_ns})) {
+        buffer.num_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::string trace_dump() {
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char number[128];
+
+    auto begin_event = [&]() {
+        if (!first) {
+            json += ',';
+        }
+        json += '\n';
+        first = false;
+    };
+
+    uint64_t num_dropped = 0;
+    std::vector<TraceEvent> events(1024);
+    for (auto &buffer : reg.buffers) {
+        num_dropped += buffer->num_dropped.exchange(0);
+
+        if (!buffer->thread_name.empty()) {
+            begin_event();
+            snprintf(number, sizeof(number),
+                     "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                     "\"name\":\"thread_name\",\"args\":{\"name\":\"",
+                     buffer->tid);
+            json += number;
+            append_escaped(json, buffer->thread_name.c_str());
+            json += "\"}}";
+        }
+
+        size_t num_popped = 0;
+        while ((num_popped = buffer->events.pop(events.data(),
+                                                events.size())) > 0) {
+            for (size_t i = 0; i < num_popped; i++) {
+                const auto &event = events[i];
+                begin_event();
+                json += "{\"ph\":\"X\",\"pid\":1,\"name\":\"";
+                append_escaped(json, event.name);
+                snprintf(number, sizeof(number),
+                         "\",\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                         buffer->tid,
+                         (double)(event.start_ns - reg.origin_ns) * 1e-3,
+                         (double)(event.end_ns - event.start_ns) * 1e-3);
+                json += number;
+            }
+        }
+    }
+
+    snprintf(number, sizeof(number),
+             "\n],\"otherData\":{\"dropped_events\":%llu}}\n",
+             (unsigned long long)num_dropped);
+    json += number;
+    return json;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Timeline of the transcription pipeline, exported as Chrome trace JSON
+ * (chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Stages are marked with TraceScope. Recording is off by default, a scope
+ * then costs one relaxed atomic load. Once on, each thread records its
+ * events in its own lock-free buffer (an SpscQueue with trace_dump as the
+ * consumer), so traced threads never wait on each other nor on the dump.
+ * Events that don't fit in a full buffer are dropped and counted.
+ */
+
+/**
+ * Start or stop recording. Events already recorded are kept until
+ * trace_dump.
+ * @param enabled True to record.
+ * @param events_per_thread Capacity of each thread buffer.
+ */
+void trace_set_enabled(bool enabled, size_t events_per_thread = 1 << 18);
+
+/**
+ * Name the calling thread in the trace, e.g. "stream worker".
+ * @param name Thread name. Copied.
+ */
+void trace_set_thread_name(const char *name);
+
+/**
+ * Take all recorded events out of the thread buffers.
+ * @return The events as Chrome trace JSON, with timestamps in microseconds
+ * since recording was first enabled.
+ */
+std::string trace_dump();
+
+/**
+ * Record a complete event for the calling thread. Use TraceScope instead.
+ * @param name Event name. Must be a string literal, it is not copied.
+ * @param start_ns Start, from trace_now_ns.
+ * @param end_ns End, from trace_now_ns.
+ */
+void trace_record(const char *name, int64_t start_ns, int64_t end_ns);
+
+extern std::atomic<bool> trace_is_enabled;
+
+inline int64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * Records the time between its construction and end() or destruction as an
+ * event, if recording is enabled at construction.
+ */
+class TraceScope {
+  public:
+    /**
+     * @param name Event name. Must be a string literal, it is not copied.
+     */
+    explicit TraceScope(const char *name)
+        : event_name(name),
+          start_ns(trace_is_enabled.load(std::memory_order_relaxed)
+                       ? trace_now_ns()
+                       : -1) {}
+
+    ~TraceScope() { end(); }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    /**
+     * End the event before the end of the scope. Later calls do nothing.
+     */
+    void end() {
+        if (start_ns >= 0) {
+            trace_record(event_name, start_ns, trace_now_ns());
+            start_ns = -1;
+        }
+    }
+
+  private:
+    const char *event_name;
+    int64_t start_ns;
+};
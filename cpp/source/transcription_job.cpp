@@ -0,0 +1,60 @@
+#include "transcription_job.h"
+
+#include <algorithm>
+
+#include "trace.h"
+
+TranscriptionJob::TranscriptionJob(PitchDetector &detector, const float *audio,
+                                   int num_samples)
+    : audio(audio, audio + std::max(num_samples, 0)) {
+    worker = std::thread([this, &detector]() {
+        trace_set_thread_name("transcription job");
+
+        const auto result = detector.transcribe_to_midi(
+            this->audio.data(), static_cast<int>(this->audio.size()),
+            &control);
+        status.store(result == TranscriptionDone        ? Done
+                     : result == TranscriptionCancelled ? Cancelled
+                                                        : Rejected,
+                     std::memory_order_release);
+    });
+}
+
+TranscriptionJob::~TranscriptionJob() {
+    cancel();
+    wait();
+}
+
+TranscriptionJob::Status TranscriptionJob::poll() const {
+    return status.load(std::memory_order_acquire);
+}
+
+TranscriptionJob::Status TranscriptionJob::wait() {
+    {
+        std::lock_guard<std::mutex> lock(join_mutex);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    return poll();
+}
+
+float TranscriptionJob::progress() const {
+    if (poll() == Done) {
+        return 1.0f;
+    }
+
+    const auto num_frames = control.num_frames.load(std::memory_order_relaxed);
+    if (num_frames == 0) {
+        return 0.0f;
+    }
+    const auto num_frames_done =
+        control.num_frames_done.load(std::memory_order_relaxed);
+    return std::min(static_cast<float>(num_frames_done) /
+                        static_cast<float>(num_frames),
+                    1.0f);
+}
+
+void TranscriptionJob::cancel() {
+    control.cancel_requested.store(true, std::memory_order_relaxed);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pitch_detector.h"
+
+/**
+ * Transcription running on its own thread. The detector must not be used
+ * until the job is done (or cancelled or rejected, and waited for), its note
+ * events are then read as after transcribe_to_midi.
+ */
+class TranscriptionJob {
+  public:
+    // Rejected: not run, over the memory limit (see
+    // PitchDetector::set_memory_limit).
+    enum Status { Running = 0, Done, Cancelled, Rejected };
+
+    /**
+     * Start transcribing. The audio is copied.
+     * @param detector Detector to run. Must outlive the job.
+     * @param audio Pointer to raw audio (must be at 22050 Hz)
+     * @param num_samples Number of input samples available.
+     */
+    TranscriptionJob(PitchDetector &detector, const float *audio,
+                     int num_samples);
+
+    /**
+     * Cancel the transcription and wait for it.
+     */
+    ~TranscriptionJob();
+
+    TranscriptionJob(const TranscriptionJob &) = delete;
+    TranscriptionJob &operator=(const TranscriptionJob &) = delete;
+
+    /**
+     * @return Status, without blocking.
+     */
+    [[nodiscard]] Status poll() const;
+
+    /**
+     * Block until the transcription has finished. Can be called from several
+     * threads.
+     * @return Final status.
+     */
+    Status wait();
+
+    /**
+     * @return Fraction of the CNN frames computed, in [0, 1]. 1 once done.
+     */
+    [[nodiscard]] float progress() const;
+
+    /**
+     * Request cancellation. The transcription stops at its next check (see
+     * PitchDetector::transcribe_to_midi), wait returns Cancelled unless it
+     * had already finished.
+     */
+    void cancel();
+
+  private:
+    std::vector<float> audio;
+    TranscriptionControl control;
+    std::atomic<Status> status{Running};
+
+    std::mutex join_mutex;
+    std::thread worker;
+};
@@ -0,0 +1,165 @@
+// Conv2d::prune on the layers of the basic pitch model, with each kernel
+// level the CPU supports: prune(0) must not change the outputs, and the
+// block-sparse kernels of a pruned layer must match the dense kernels and
+// the generic loop run on the same pruned weights, over the full output
+// range and a restricted one. PitchCnn::prune_weights(0) must not change the
+// posteriorgrams of a pruned CNN either.
+//
+// Usage: conv2d_prune_test <model_data directory>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "source/conv2d.h"
+#include "source/cpu_features.h"
+#include "source/pitch_cnn.h"
+#include "test_utils.h"
+
+static constexpr int num_frames = 40;
+
+/**
+ * Non-negative input frames with half of the values zero, as after a ReLU.
+ */
+static std::vector<float> layer_inputs(const Conv2d &layer, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<float> inputs((size_t)num_frames * layer.num_features_in() *
+                              layer.num_channels_in());
+    for (auto &value : inputs) {
+        value = uniform(rng) < 0.5f ? 0.0f : uniform(rng);
+    }
+    return inputs;
+}
+
+/**
+ * @return Maximum difference between the outputs of two layers over all
+ * frames, relative to the magnitude of the outputs where it is above 1.
+ */
+static float max_difference(Conv2d &a, Conv2d &b,
+                            const std::vector<float> &inputs) {
+    const size_t frame_size =
+        (size_t)a.num_features_in() * a.num_channels_in();
+    const size_t num_outputs =
+        (size_t)a.num_features_out() * a.num_channels_out();
+    float max_diff = 0.0f;
+    for (int i = 0; i < num_frames; i++) {
+        a.forward(inputs.data() + i * frame_size);
+        b.forward(inputs.data() + i * frame_size);
+        for (size_t j = 0; j < num_outputs; j++) {
+            const float diff = std::abs(a.outputs()[j] - b.outputs()[j]) /
+                               std::max(1.0f, std::abs(b.outputs()[j]));
+            if (std::isnan(diff)) {
+                return INFINITY;
+            }
+            max_diff = std::max(max_diff, diff);
+        }
+    }
+    return max_diff;
+}
+
+/**
+ * @return Dense layer on the weights of the given one, used in place.
+ */
+static Conv2d dense_copy(const Conv2d &layer) {
+    Conv2d copy;
+    copy.load(layer.shape(), layer.weight_values(), layer.bias_values());
+    return copy;
+}
+
+static void check_layer(const Conv2d &model_layer, int layer_idx) {
+    const auto inputs = layer_inputs(model_layer, layer_idx);
+    const Conv2d dense = dense_copy(model_layer);
+
+    Conv2d pruned = dense;
+    const float fraction = pruned.prune(0.1f);
+    Conv2d pruned_dense = dense_copy(pruned);
+    Conv2d pruned_generic = dense_copy(pruned);
+    pruned_generic.set_specialized_kernel(false);
+
+    // prune(0) only skips rows that are already zero: nothing on the model
+    // weights, the pruned rows on weights pruned beforehand.
+    Conv2d zero_pruned = dense;
+    CHECK(zero_pruned.prune(0.0f) == 0.0f);
+    Conv2d reference = dense;
+    float zero_diff = max_difference(zero_pruned, reference, inputs);
+    Conv2d zero_repruned = dense_copy(pruned);
+    CHECK(zero_repruned.prune(0.0f) == fraction);
+    zero_diff = std::max(zero_diff,
+                         max_difference(zero_repruned, pruned_dense, inputs));
+    CHECK(zero_diff < 1e-5f);
+
+    // Sparse kernel of the pruned layer against the dense kernel and the
+    // generic loop on its weights.
+    pruned_dense.reset();
+    float diff = max_difference(pruned, pruned_dense, inputs);
+    pruned.reset();
+    diff = std::max(diff, max_difference(pruned, pruned_generic, inputs));
+
+    // Restricted output range.
+    const int begin = pruned.num_features_out() / 3;
+    const int end = pruned.num_features_out() * 2 / 3;
+    pruned.set_output_range(begin, end);
+    pruned_dense.set_output_range(begin, end);
+    diff = std::max(diff, max_difference(pruned, pruned_dense, inputs));
+
+    printf("  layer %d: %.2f of the rows pruned, prune(0) diff %.2e, sparse "
+           "diff %.2e\n",
+           layer_idx, fraction, zero_diff, diff);
+    CHECK(diff < 1e-5f);
+}
+
+int main(int argc, char **argv) {
+    CHECK(argc == 2);
+    const std::string model_dir = argv[1];
+    auto contour_data = read_file(model_dir + "/cnn_contour_model.json");
+    auto note_data = read_file(model_dir + "/cnn_note_model.json");
+    auto onset_1_data = read_file(model_dir + "/cnn_onset_1_model.json");
+    auto onset_2_data = read_file(model_dir + "/cnn_onset_2_model.json");
+
+    for (int level = CpuGeneric; level <= detected_cpu_level(); level++) {
+        set_cpu_level(level);
+        printf("%s\n", cpu_level_name(static_cast<CpuLevel>(level)));
+
+        PitchCnn cnn(blob(contour_data), blob(note_data), blob(onset_1_data),
+                     blob(onset_2_data));
+        const auto layers = cnn.layers();
+        int num_sparse = 0;
+        for (int i = 0; i < static_cast<int>(layers.size()); i++) {
+            check_layer(*layers[i], i);
+            Conv2d pruned = dense_copy(*layers[i]);
+            num_sparse += pruned.prune(0.1f) > 0.0f ? 1 : 0;
+        }
+        // The sparse kernels must have been run.
+        CHECK(num_sparse > 0);
+    }
+    set_cpu_level(-1);
+
+    // prune_weights(0) on a pruned CNN.
+    constexpr int num_cnn_frames = 150;
+    const auto frames = cnn_input_frames(num_cnn_frames, 4);
+    PitchCnn cnn(blob(contour_data), blob(note_data), blob(onset_1_data),
+                 blob(onset_2_data));
+    PitchCnn zero_pruned_cnn(blob(contour_data), blob(note_data),
+                             blob(onset_1_data), blob(onset_2_data));
+    const float cnn_fraction = cnn.prune_weights(0.1f);
+    CHECK(cnn_fraction > 0.0f);
+    zero_pruned_cnn.prune_weights(0.1f);
+    CHECK(zero_pruned_cnn.prune_weights(0.0f) == cnn_fraction);
+    std::vector<float> contours(NUM_FREQ_IN), expected_contours(NUM_FREQ_IN);
+    std::vector<float> notes(NUM_FREQ_OUT), expected_notes(NUM_FREQ_OUT);
+    std::vector<float> onsets(NUM_FREQ_OUT), expected_onsets(NUM_FREQ_OUT);
+    for (int i = 0; i < num_cnn_frames; i++) {
+        const float *frame =
+            frames.data() + (size_t)i * NUM_HARMONICS * NUM_FREQ_IN;
+        zero_pruned_cnn.frame_inference(frame, contours, notes, onsets);
+        cnn.frame_inference(frame, expected_contours, expected_notes,
+                            expected_onsets);
+        CHECK(contours == expected_contours);
+        CHECK(notes == expected_notes);
+        CHECK(onsets == expected_onsets);
+    }
+    return 0;
+}
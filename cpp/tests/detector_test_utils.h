@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "source/pitch_detector.h"
+#include "test_utils.h"
+
+/**
+ * Model files of the model directory, as PitchDetector takes them.
+ */
+struct DetectorModels {
+    explicit DetectorModels(const std::string &model_dir)
+        : features_model(read_file(model_dir + "/features_model.ort")),
+          contour(read_file(model_dir + "/cnn_contour_model.json")),
+          note(read_file(model_dir + "/cnn_note_model.json")),
+          onset_1(read_file(model_dir + "/cnn_onset_1_model.json")),
+          onset_2(read_file(model_dir + "/cnn_onset_2_model.json")) {}
+
+    PitchDetectorModelFiles files() {
+        return {blob(features_model), blob(contour), blob(note),
+                blob(onset_1), blob(onset_2)};
+    }
+
+    std::vector<uint8_t> features_model;
+    std::vector<uint8_t> contour;
+    std::vector<uint8_t> note;
+    std::vector<uint8_t> onset_1;
+    std::vector<uint8_t> onset_2;
+};
@@ -0,0 +1,126 @@
+// MultiStreamPitchCnn against one PitchCnn per stream: streams of different
+// inputs run interleaved, with each kernel level the CPU supports, must give
+// the outputs of separate single stream runs. Zero frames given as nullptr,
+// skipped outputs and a stream reset mid-run must not affect other streams.
+//
+// Usage: multi_stream_pitch_cnn_test <model_data directory>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "source/cpu_features.h"
+#include "source/multi_stream_pitch_cnn.h"
+#include "test_utils.h"
+
+int main(int argc, char **argv) {
+    CHECK(argc == 2);
+    const std::string model_dir = argv[1];
+    auto contour_data = read_file(model_dir + "/cnn_contour_model.json");
+    auto note_data = read_file(model_dir + "/cnn_note_model.json");
+    auto onset_1_data = read_file(model_dir + "/cnn_onset_1_model.json");
+    auto onset_2_data = read_file(model_dir + "/cnn_onset_2_model.json");
+
+    constexpr int num_streams = 5;
+    constexpr int num_frames = 300;
+    const size_t frame_size = NUM_HARMONICS * NUM_FREQ_IN;
+
+    // Stream 1 is reset at reset_frame, stream 2 gets zero frames as nullptr
+    // from zero_begin to zero_end, stream 3 skips its contours.
+    constexpr int reset_stream = 1;
+    constexpr int reset_frame = 170;
+    constexpr int zero_stream = 2;
+    constexpr int zero_begin = 40;
+    constexpr int zero_end = 90;
+    constexpr int no_contours_stream = 3;
+
+    std::vector<std::vector<float>> inputs;
+    for (int s = 0; s < num_streams; s++) {
+        inputs.push_back(cnn_input_frames(num_frames, 10 + s));
+    }
+    const std::vector<float> zero_frame(frame_size, 0.0f);
+
+    for (int level = CpuGeneric; level <= detected_cpu_level(); level++) {
+        set_cpu_level(level);
+
+        MultiStreamPitchCnn multi_cnn(num_streams, blob(contour_data),
+                                      blob(note_data), blob(onset_1_data),
+                                      blob(onset_2_data));
+        std::vector<std::unique_ptr<PitchCnn>> cnns;
+        for (int s = 0; s < num_streams; s++) {
+            cnns.push_back(std::make_unique<PitchCnn>(
+                blob(contour_data), blob(note_data), blob(onset_1_data),
+                blob(onset_2_data)));
+        }
+
+        std::vector<std::vector<float>> contours(
+            num_streams, std::vector<float>(NUM_FREQ_IN));
+        std::vector<std::vector<float>> notes(
+            num_streams, std::vector<float>(NUM_FREQ_OUT));
+        std::vector<std::vector<float>> onsets(
+            num_streams, std::vector<float>(NUM_FREQ_OUT));
+        std::vector<float> expected_contours(NUM_FREQ_IN);
+        std::vector<float> expected_notes(NUM_FREQ_OUT);
+        std::vector<float> expected_onsets(NUM_FREQ_OUT);
+
+        float max_difference = 0.0f;
+        float max_note = 0.0f;
+        for (int i = 0; i < num_frames; i++) {
+            if (i == reset_frame) {
+                multi_cnn.reset_stream(reset_stream);
+                cnns[reset_stream]->reset();
+            }
+
+            std::array<const float *, num_streams> in_data{};
+            std::array<float *, num_streams> out_contours{};
+            std::array<float *, num_streams> out_notes{};
+            std::array<float *, num_streams> out_onsets{};
+            for (int s = 0; s < num_streams; s++) {
+                const bool is_zero =
+                    s == zero_stream && i >= zero_begin && i < zero_end;
+                in_data[s] =
+                    is_zero ? nullptr : inputs[s].data() + i * frame_size;
+                out_contours[s] =
+                    s == no_contours_stream ? nullptr : contours[s].data();
+                out_notes[s] = notes[s].data();
+                out_onsets[s] = onsets[s].data();
+            }
+            multi_cnn.frame_inference(in_data.data(), out_contours.data(),
+                                      out_notes.data(), out_onsets.data());
+
+            for (int s = 0; s < num_streams; s++) {
+                const float *in =
+                    in_data[s] != nullptr ? in_data[s] : zero_frame.data();
+                cnns[s]->frame_inference(in, expected_contours,
+                                         expected_notes, expected_onsets);
+                if (out_contours[s] != nullptr) {
+                    for (int bin = 0; bin < NUM_FREQ_IN; bin++) {
+                        const float difference =
+                            contours[s][bin] - expected_contours[bin];
+                        max_difference =
+                            std::max(max_difference, std::abs(difference));
+                    }
+                }
+                for (int note = 0; note < NUM_FREQ_OUT; note++) {
+                    max_difference = std::max(
+                        {max_difference,
+                         std::abs(notes[s][note] - expected_notes[note]),
+                         std::abs(onsets[s][note] - expected_onsets[note])});
+                    max_note = std::max(max_note, expected_notes[note]);
+                }
+            }
+        }
+
+        printf("%s, %d streams: max difference %.2e, max note %.3f\n",
+               cpu_level_name(static_cast<CpuLevel>(level)), num_streams,
+               max_difference, max_note);
+        CHECK(max_note > 0.5f);
+        CHECK(max_difference < 1e-5f);
+    }
+
+    set_cpu_level(-1);
+    return 0;
+}
@@ -0,0 +1,231 @@
+// NoteTracker against Notes::convert: with the melodia trick off, raw onsets
+// and unbounded latency, the online notes must be exactly the offline ones.
+// With a latency bound, notes must be emitted and cut within the bound, and
+// the parts of a split sustained note must join back into the offline note.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "source/note_tracker.h"
+#include "source/notes.h"
+#include "test_utils.h"
+
+/**
+ * Push all frames to a tracker and flush it.
+ * @param max_emission_latency Largest number of frames between the start of a
+ * note and the last frame pushed when it was emitted, flush excluded.
+ * @return Emitted notes, sorted as Notes::convert sorts them.
+ */
+static std::vector<Notes::Event>
+track(const Posteriorgram &notes, const Posteriorgram &onsets,
+      const Notes::ConvertParams &params, int max_latency_frames,
+      int &max_emission_latency) {
+    NoteTracker tracker(params, max_latency_frames);
+    std::vector<Notes::Event> events;
+    max_emission_latency = 0;
+
+    for (size_t frame = 0; frame < notes.size(); frame++) {
+        const auto num_events = events.size();
+        tracker.push_frame(notes[frame].data(), onsets[frame].data(), events);
+        for (size_t i = num_events; i < events.size(); i++) {
+            max_emission_latency =
+                std::max(max_emission_latency,
+                         static_cast<int>(frame) - events[i].start_frame);
+        }
+    }
+    tracker.flush(events);
+
+    Notes::sort_events(events);
+    return events;
+}
+
+/**
+ * Join notes of the same pitch where one ends on the frame the next starts,
+ * i.e. undo the splits of a latency bound. Amplitudes are not meaningful
+ * after joining.
+ */
+static std::vector<Notes::Event> join_splits(std::vector<Notes::Event> events) {
+    std::vector<Notes::Event> joined;
+    std::vector<bool> is_joined(events.size(), false);
+
+    for (size_t i = 0; i < events.size(); i++) {
+        if (is_joined[i]) {
+            continue;
+        }
+        auto event = events[i];
+        for (size_t j = i + 1; j < events.size(); j++) {
+            if (!is_joined[j] &&
+                events[j].midi_note_number == event.midi_note_number &&
+                events[j].start_frame == event.end_frame) {
+                event.end_frame = events[j].end_frame;
+                is_joined[j] = true;
+            }
+        }
+        joined.push_back(event);
+    }
+
+    Notes::sort_events(joined);
+    return joined;
+}
+
+int main() {
+    size_t num_events = 0;
+    size_t num_split_events = 0;
+
+    for (unsigned seed = 0; seed < 60; seed++) {
+        Posteriorgram notes;
+        Posteriorgram onsets;
+        const int num_frames = 50 + static_cast<int>(seed * 7 % 900);
+        random_posteriorgrams(num_frames, seed, 0.05f + (seed % 5) * 0.1f,
+                              notes, onsets);
+
+        Notes::ConvertParams params;
+        params.melodia_trick = false;
+        params.infer_onsets = false;
+        if (seed % 2 == 1) {
+            params.min_note_len_frames = static_cast<int>(1 + seed % 13);
+        }
+        if (seed % 7 == 0) {
+            params.energy_threshold = static_cast<int>(3 + seed % 15);
+        }
+
+        const auto expected = Notes::convert(notes, onsets, {}, params);
+        num_events += expected.size();
+
+        int latency = 0;
+        CHECK(track(notes, onsets, params, -1, latency) == expected);
+
+        // Longer than any note: nothing is split.
+        CHECK(track(notes, onsets, params, num_frames, latency) == expected);
+
+        const int min_latency =
+            params.min_note_len_frames + params.energy_threshold + 2;
+        for (int max_latency : {min_latency, min_latency + 17, 60}) {
+            const auto events =
+                track(notes, onsets, params, max_latency, latency);
+            CHECK(latency <= max_latency + 1);
+            for (const auto &event : events) {
+                CHECK(event.end_frame - event.start_frame <= max_latency + 1);
+            }
+            num_split_events += events.size() - join_splits(events).size();
+        }
+    }
+
+    // The random notes are up to 62 frames long, some must have been split.
+    CHECK(num_events > 1000);
+    CHECK(num_split_events > 0);
+
+    // Melodia trick and inferred onsets on: the tracker gives the notes of the
+    // onset pass, which are those of Notes::convert without the melodia pass
+    // and are kept by the melodia pass. Inferred onsets are scaled with the
+    // maxima seen so far: they match the offline ones if the maxima are
+    // reached by frame 2, the first frame with a note difference.
+    for (unsigned seed = 0; seed < 20; seed++) {
+        Posteriorgram notes;
+        Posteriorgram onsets;
+        const int num_frames = 100 + static_cast<int>(seed * 31 % 600);
+        random_posteriorgrams(num_frames, seed, 0.05f + (seed % 5) * 0.1f,
+                              notes, onsets);
+        onsets[2][0] = 1.0f;
+        notes[0][MAX_NOTE_IDX] = 0.0f;
+        notes[1][MAX_NOTE_IDX] = 0.0f;
+        notes[2][MAX_NOTE_IDX] = 1.0f;
+
+        Notes::ConvertParams params;
+        CHECK(params.melodia_trick && params.infer_onsets);
+        auto onset_pass_params = params;
+        onset_pass_params.melodia_trick = false;
+        const auto expected =
+            Notes::convert(notes, onsets, {}, onset_pass_params);
+        const auto with_melodia = Notes::convert(notes, onsets, {}, params);
+        CHECK(with_melodia.size() >= expected.size());
+        for (const auto &event : expected) {
+            CHECK(std::find(with_melodia.begin(), with_melodia.end(), event) !=
+                  with_melodia.end());
+        }
+
+        int latency = 0;
+        CHECK(track(notes, onsets, params, -1, latency) == expected);
+        CHECK(track(notes, onsets, params, num_frames, latency) == expected);
+    }
+
+    // A state whose buffer lacks the frame before base_frame, read by the
+    // onset peak picking, is rejected.
+    {
+        Posteriorgram notes;
+        Posteriorgram onsets;
+        random_posteriorgrams(300, 1, 0.1f, notes, onsets);
+        NoteTracker tracker(Notes::ConvertParams{}, 60);
+        std::vector<Notes::Event> events;
+        for (int frame = 0; frame < 200; frame++) {
+            tracker.push_frame(notes[frame].data(), onsets[frame].data(),
+                               events);
+        }
+        std::vector<uint8_t> state;
+        StateWriter writer(state);
+        tracker.save_state(writer);
+
+        int32_t header[3]; // buffer_first_frame, base_frame, frame_count
+        uint64_t num_buffered = 0;
+        std::memcpy(header, state.data(), sizeof(header));
+        std::memcpy(&num_buffered, state.data() + sizeof(header),
+                    sizeof(num_buffered));
+        CHECK(header[1] > 0 && header[0] == header[1] - 1);
+
+        StateReader reader({state.data(), state.size()});
+        NoteTracker restored(Notes::ConvertParams{}, 60);
+        CHECK(restored.restore_state(reader));
+
+        // Drop the first buffered frame.
+        header[0]++;
+        num_buffered--;
+        std::memcpy(state.data(), header, sizeof(header));
+        std::memcpy(state.data() + sizeof(header), &num_buffered,
+                    sizeof(num_buffered));
+        const auto frame_start = state.begin() + sizeof(header) +
+                                 sizeof(num_buffered);
+        state.erase(frame_start,
+                    frame_start + 2 * NUM_FREQ_OUT * sizeof(float));
+        StateReader truncated_reader({state.data(), state.size()});
+        CHECK(!restored.restore_state(truncated_reader));
+    }
+
+    // A sustained note, alone: the parts of its splits join back exactly,
+    // and their amplitudes average to the offline amplitude.
+    Posteriorgram notes(400, std::vector<float>(NUM_FREQ_OUT, 0.0f));
+    Posteriorgram onsets = notes;
+    for (int frame = 20; frame < 340; frame++) {
+        notes[frame][40] = 0.6f + 0.3f * static_cast<float>(frame % 7) / 7.0f;
+    }
+    onsets[20][40] = 0.9f;
+
+    Notes::ConvertParams params;
+    params.melodia_trick = false;
+    params.infer_onsets = false;
+    const auto expected = Notes::convert(notes, onsets, {}, params);
+    CHECK(expected.size() == 1);
+
+    int latency = 0;
+    const auto events = track(notes, onsets, params, 50, latency);
+    CHECK(events.size() == 7);
+
+    const auto joined = join_splits(events);
+    CHECK(joined.size() == 1);
+    CHECK(joined[0].start_frame == expected[0].start_frame);
+    CHECK(joined[0].end_frame == expected[0].end_frame);
+
+    double amplitude_sum = 0.0;
+    for (const auto &event : events) {
+        amplitude_sum +=
+            event.amplitude * (event.end_frame - event.start_frame);
+    }
+    const double amplitude =
+        amplitude_sum / (expected[0].end_frame - expected[0].start_frame);
+    CHECK(std::abs(amplitude - expected[0].amplitude) < 1e-6);
+
+    printf("%zu notes, %zu extra notes from latency bound splits\n",
+           num_events, num_split_events);
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Notes::merge_overlapping_notes_with_same_pitch and
+// Notes::drop_overlapping_pitch_bends against the nested loop versions they
+// replaced, on random event lists: dense overlaps of the same pitch, events
+// of zero or negative length, with Event and CompactEvent.
+
+#include <type_traits>
+#include <vector>
+
+#include "source/notes.h"
+#include "test_utils.h"
+
+/**
+ * Notes::merge_overlapping_notes_with_same_pitch as it was: erase in loop.
+ */
+template <typename EventType>
+static void reference_merge(std::vector<EventType> &events) {
+    Notes::sort_events(events);
+    for (int i = 0; i < int(events.size()) - 1; i++) {
+        auto &event = events[i];
+        for (auto j = i + 1; j < int(events.size()); j++) {
+            auto &event2 = events[j];
+
+            // If notes don't overlap, break
+            if (event2.start_frame >= event.end_frame) {
+                break;
+            }
+
+            // If notes overlap and have the same pitch: merge them
+            if (event.midi_note_number == event2.midi_note_number) {
+                event.end_time = event2.end_time;
+                event.end_frame = event2.end_frame;
+                events.erase(events.begin() + j);
+            }
+        }
+    }
+}
+
+static void reference_clear_bends(Notes::Event &event) { event.bends.clear(); }
+
+static void reference_clear_bends(Notes::CompactEvent &event) {
+    event.num_bends = 0;
+}
+
+/**
+ * Notes::drop_overlapping_pitch_bends as it was: nested scan.
+ */
+template <typename EventType>
+static void reference_drop_bends(std::vector<EventType> &events) {
+    for (int i = 0; i < int(events.size()) - 1; i++) {
+        auto &event = events[i];
+        for (int j = i + 1; j < int(events.size()); j++) {
+            auto &event2 = events[j];
+            if (event2.start_frame >= event.end_frame) {
+                break;
+            }
+            reference_clear_bends(event);
+            reference_clear_bends(event2);
+        }
+    }
+}
+
+static bool same_events(const std::vector<Notes::Event> &a,
+                        const std::vector<Notes::Event> &b) {
+    return a == b;
+}
+
+static bool same_events(const std::vector<Notes::CompactEvent> &a,
+                        const std::vector<Notes::CompactEvent> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].start_time != b[i].start_time ||
+            a[i].end_time != b[i].end_time ||
+            a[i].start_frame != b[i].start_frame ||
+            a[i].end_frame != b[i].end_frame ||
+            a[i].midi_note_number != b[i].midi_note_number ||
+            a[i].amplitude != b[i].amplitude ||
+            a[i].bends_begin != b[i].bends_begin ||
+            a[i].num_bends != b[i].num_bends) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Random events, not sorted. Few pitches and short spans for dense same
+ * pitch overlaps, and some events of zero or negative length.
+ */
+template <typename EventType>
+static std::vector<EventType> random_events(unsigned seed) {
+    std::mt19937 rng(seed);
+    const int num_events = static_cast<int>(rng() % 300);
+    const int num_frames = 1 + static_cast<int>(rng() % 1000);
+    const int num_pitches = 1 + static_cast<int>(rng() % 12);
+    const int max_length = 1 + static_cast<int>(rng() % 80);
+
+    std::vector<EventType> events(num_events);
+    for (int i = 0; i < num_events; i++) {
+        auto &event = events[i];
+        event.start_frame = static_cast<int>(rng() % num_frames);
+        event.end_frame = event.start_frame +
+                          static_cast<int>(rng() % (max_length + 3)) - 2;
+        event.start_time = Notes::model_frame_to_seconds(event.start_frame);
+        event.end_time = Notes::model_frame_to_seconds(event.end_frame);
+        event.midi_note_number =
+            MIDI_OFFSET + static_cast<int>(rng() % num_pitches);
+        event.amplitude = i;
+        const int num_bends = std::max(event.end_frame - event.start_frame, 1);
+        if constexpr (std::is_same<EventType, Notes::Event>::value) {
+            event.bends.assign(num_bends, i % 3 - 1);
+        } else {
+            event.bends_begin = static_cast<uint32_t>(i);
+            event.num_bends = static_cast<uint32_t>(num_bends);
+        }
+    }
+    return events;
+}
+
+template <typename EventType>
+static void check_seed(unsigned seed, size_t &num_merged, size_t &num_cleared) {
+    const auto events = random_events<EventType>(seed);
+
+    auto merged = events;
+    auto expected_merged = events;
+    Notes::merge_overlapping_notes_with_same_pitch(merged);
+    reference_merge(expected_merged);
+    CHECK(same_events(merged, expected_merged));
+    num_merged += events.size() - merged.size();
+
+    auto dropped = events;
+    Notes::sort_events(dropped);
+    auto expected_dropped = dropped;
+    Notes::drop_overlapping_pitch_bends(dropped);
+    reference_drop_bends(expected_dropped);
+    CHECK(same_events(dropped, expected_dropped));
+    for (size_t i = 0; i < dropped.size(); i++) {
+        if constexpr (std::is_same<EventType, Notes::Event>::value) {
+            num_cleared += dropped[i].bends.empty() ? 1 : 0;
+        } else {
+            num_cleared += dropped[i].num_bends == 0 ? 1 : 0;
+        }
+    }
+}
+
+int main() {
+    size_t num_merged = 0;
+    size_t num_cleared = 0;
+    for (unsigned seed = 0; seed < 2000; seed++) {
+        check_seed<Notes::Event>(seed, num_merged, num_cleared);
+        check_seed<Notes::CompactEvent>(seed, num_merged, num_cleared);
+    }
+
+    CHECK(num_merged > 10000);
+    CHECK(num_cleared > 10000);
+
+    printf("%zu events merged, %zu pitch bends dropped\n", num_merged,
+           num_cleared);
+    return 0;
+}
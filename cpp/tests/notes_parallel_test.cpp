@@ -0,0 +1,314 @@
+// Notes::convert_parallel and convert_compact against the single pass
+// Notes::convert they replaced: cutting the posteriorgrams at quiet stretches
+// and converting the segments on 1, 2, 3 or 8 threads must give exactly the
+// events of one backward pass over all frames. Quiet stretches are placed
+// around energy_threshold frames long, where segment cuts start.
+
+#include <algorithm>
+#include <vector>
+
+#include "source/notes.h"
+#include "test_utils.h"
+
+/**
+ * Notes::inferred_onsets, which is private.
+ */
+static Posteriorgram reference_inferred_onsets(const Posteriorgram &onsets,
+                                               const Posteriorgram &notes) {
+    constexpr int num_diffs = 2;
+    const int n_frames = static_cast<int>(notes.size());
+    const int n_notes = static_cast<int>(notes[0].size());
+
+    Posteriorgram notes_diff(n_frames, std::vector<float>(n_notes, 1.0f));
+    float max_min_notes_diff = 0;
+    float max_onset = 0;
+
+    for (int offset = 1; offset <= num_diffs; offset++) {
+        for (int i = 0; i < n_frames; i++) {
+            const int i_behind = i - offset;
+            for (int j = 0; j < n_notes; j++) {
+                auto diff =
+                    notes[i][j] - ((i_behind >= 0) ? notes[i_behind][j] : 0);
+                auto &min = notes_diff[i][j];
+                if (diff < min) {
+                    diff = (diff < 0) ? 0 : diff;
+                    min = (i >= num_diffs) ? diff : 0;
+                }
+                if (offset == num_diffs) {
+                    max_onset = std::max(max_onset, onsets[i][j]);
+                    max_min_notes_diff = std::max(max_min_notes_diff, min);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n_frames; i++) {
+        for (int j = 0; j < n_notes; j++) {
+            auto &inferred = notes_diff[i][j];
+            inferred = max_onset * inferred / max_min_notes_diff;
+            inferred = std::max(inferred, onsets[i][j]);
+        }
+    }
+    return notes_diff;
+}
+
+/**
+ * Notes::convert as it was before segments: one onset pass backwards over
+ * all frames, then one melodia pass over all remaining energy. No pitch
+ * bends.
+ */
+static std::vector<Notes::Event>
+reference_convert(const Posteriorgram &notes_posteriorgrams,
+                  const Posteriorgram &onsets_posteriorgrams,
+                  const Notes::ConvertParams &params) {
+    std::vector<Notes::Event> events;
+    const int n_frames = static_cast<int>(notes_posteriorgrams.size());
+    const int n_notes = static_cast<int>(notes_posteriorgrams[0].size());
+
+    const auto onsets =
+        params.infer_onsets ? reference_inferred_onsets(onsets_posteriorgrams,
+                                                        notes_posteriorgrams)
+                            : onsets_posteriorgrams;
+    auto remaining_energy = notes_posteriorgrams;
+
+    struct Index {
+        float *value;
+        int frame_index;
+        int note_index;
+    };
+    std::vector<Index> remaining_energy_index;
+
+    const float frame_threshold = params.frame_threshold;
+    const int max_note_idx =
+        (params.max_frequency < 0)
+            ? n_notes - 1
+            : Notes::ftom(params.max_frequency) - MIDI_OFFSET;
+    const int min_note_idx =
+        (params.min_frequency < 0)
+            ? 0
+            : Notes::ftom(params.min_frequency) - MIDI_OFFSET;
+    const int last_frame = n_frames - 1;
+
+    auto add_event = [&events](int start, int end, int note_idx,
+                               double amplitude) {
+        events.push_back(Notes::Event{
+            Notes::model_frame_to_seconds(start),
+            Notes::model_frame_to_seconds(end), start, end,
+            note_idx + MIDI_OFFSET, amplitude, {}});
+    };
+
+    for (int frame_idx = last_frame - 1; frame_idx >= 0; frame_idx--) {
+        for (int note_idx = max_note_idx; note_idx >= min_note_idx;
+             note_idx--) {
+            const auto onset = onsets[frame_idx][note_idx];
+            if (params.melodia_trick) {
+                remaining_energy_index.push_back(
+                    {&remaining_energy[frame_idx][note_idx], frame_idx,
+                     note_idx});
+            }
+
+            const auto prev =
+                (frame_idx <= 0) ? onset : onsets[frame_idx - 1][note_idx];
+            const auto next = (frame_idx >= last_frame)
+                                  ? onset
+                                  : onsets[frame_idx + 1][note_idx];
+            if (onset < params.onset_threshold || onset < prev ||
+                onset < next) {
+                continue;
+            }
+
+            int i = frame_idx + 1;
+            int k = 0;
+            while (i < last_frame && k < params.energy_threshold) {
+                k = (remaining_energy[i][note_idx] < frame_threshold) ? k + 1
+                                                                      : 0;
+                i++;
+            }
+            i -= k;
+
+            if (i - frame_idx <= params.min_note_len_frames) {
+                continue;
+            }
+
+            double amplitude = 0.0;
+            for (int f = frame_idx; f < i; f++) {
+                amplitude += remaining_energy[f][note_idx];
+                remaining_energy[f][note_idx] = 0;
+                if (note_idx < MAX_NOTE_IDX) {
+                    remaining_energy[f][note_idx + 1] = 0;
+                }
+                if (note_idx > 0) {
+                    remaining_energy[f][note_idx - 1] = 0;
+                }
+            }
+            add_event(frame_idx, i, note_idx, amplitude / (i - frame_idx));
+        }
+    }
+
+    if (params.melodia_trick) {
+        std::sort(remaining_energy_index.begin(), remaining_energy_index.end(),
+                  [](const Index &a, const Index &b) {
+                      return *a.value > *b.value;
+                  });
+
+        auto inhibit = [&](int frame_idx, int note_idx, int k) {
+            auto &frame = remaining_energy[frame_idx];
+            k = (frame[note_idx] < frame_threshold) ? k + 1 : 0;
+            frame[note_idx] = 0;
+            if (note_idx < MAX_NOTE_IDX) {
+                frame[note_idx + 1] = 0;
+            }
+            if (note_idx > 0) {
+                frame[note_idx - 1] = 0;
+            }
+            return k;
+        };
+
+        for (const auto &index : remaining_energy_index) {
+            const int frame_idx = index.frame_index;
+            const int note_idx = index.note_index;
+            if (*index.value == 0) {
+                continue;
+            }
+            if (*index.value <= frame_threshold) {
+                break;
+            }
+            *index.value = 0;
+
+            int i = frame_idx + 1;
+            int k = 0;
+            while (i < last_frame && k < params.energy_threshold) {
+                k = inhibit(i, note_idx, k);
+                i++;
+            }
+            const int i_end = i - 1 - k;
+
+            i = frame_idx - 1;
+            k = 0;
+            while (i > 0 && k < params.energy_threshold) {
+                k = inhibit(i, note_idx, k);
+                i--;
+            }
+            const int i_start = i + 1 + k;
+
+            if (i_end - i_start <= params.min_note_len_frames) {
+                continue;
+            }
+
+            double amplitude = 0.0;
+            for (int f = i_start; f < i_end; f++) {
+                amplitude += notes_posteriorgrams[f][note_idx];
+            }
+            add_event(i_start, i_end, note_idx, amplitude / (i_end - i_start));
+        }
+    }
+
+    Notes::sort_events(events);
+    return events;
+}
+
+/**
+ * Random posteriorgrams with quiet stretches of energy_threshold - 1 to
+ * energy_threshold + 2 frames: all notes below frame_threshold, some of them
+ * just below.
+ */
+static void posteriorgrams_with_gaps(int num_frames, unsigned seed,
+                                     const Notes::ConvertParams &params,
+                                     Posteriorgram &notes,
+                                     Posteriorgram &onsets) {
+    random_posteriorgrams(num_frames, seed, 0.03f + (seed % 4) * 0.05f, notes,
+                          onsets);
+
+    std::mt19937 rng(seed);
+    const int num_gaps = num_frames / 40;
+    for (int gap = 0; gap < num_gaps; gap++) {
+        const int length = std::max(1, params.energy_threshold - 1 + gap % 4);
+        const int start = static_cast<int>(rng() % num_frames);
+        for (int frame = start; frame < std::min(num_frames, start + length);
+             frame++) {
+            for (auto &value : notes[frame]) {
+                value = std::min(value, params.frame_threshold - 0.01f);
+            }
+        }
+    }
+}
+
+int main() {
+    std::vector<Notes::ConvertParams> param_sets(6);
+    // 0: defaults
+    param_sets[1].melodia_trick = false;
+    param_sets[1].infer_onsets = false;
+    param_sets[2].min_note_len_frames = 0;
+    param_sets[3].min_note_len_frames = 0;
+    param_sets[3].energy_threshold = 2;
+    param_sets[3].infer_onsets = false;
+    param_sets[4].energy_threshold = 20;
+    param_sets[4].onset_threshold = 0.5f;
+    param_sets[4].frame_threshold = 0.4f;
+    param_sets[5].min_frequency = 80.0f;
+    param_sets[5].max_frequency = 1000.0f;
+    param_sets[5].pitch_bend = MultiPitchBend;
+
+    size_t num_events = 0;
+    size_t num_multi_segment = 0;
+
+    for (unsigned seed = 0; seed < 40; seed++) {
+        const int num_frames = 40 + static_cast<int>(seed * 97 % 700);
+
+        for (const auto &params : param_sets) {
+            Posteriorgram notes;
+            Posteriorgram onsets;
+            posteriorgrams_with_gaps(num_frames, seed, params, notes, onsets);
+
+            // Random contours, only read for pitch bends
+            Posteriorgram contours;
+            if (params.pitch_bend != NoPitchBend) {
+                std::mt19937 rng(seed);
+                std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+                contours.assign(num_frames, std::vector<float>(NUM_FREQ_IN));
+                for (auto &frame : contours) {
+                    for (auto &value : frame) {
+                        value = uniform(rng);
+                    }
+                }
+            }
+
+            auto no_bends = params;
+            no_bends.pitch_bend = NoPitchBend;
+            const auto expected = reference_convert(notes, onsets, no_bends);
+            CHECK(Notes::convert(notes, onsets, {}, no_bends) == expected);
+            num_events += expected.size();
+
+            const auto sequential = Notes::convert(notes, onsets, contours,
+                                                   params);
+            for (int num_threads : {1, 2, 3, 8}) {
+                CHECK(Notes::convert_parallel(notes, onsets, contours, params,
+                                              num_threads) == sequential);
+                CHECK(Notes::to_events(Notes::convert_compact(
+                          notes, onsets, contours, params, num_threads)) ==
+                      sequential);
+            }
+
+            // Quiet stretches longer than energy_threshold cut segments.
+            bool has_cut = false;
+            int num_quiet = 0;
+            for (const auto &frame : notes) {
+                if (*std::max_element(frame.begin(), frame.end()) <
+                    params.frame_threshold) {
+                    num_quiet++;
+                } else {
+                    has_cut |= num_quiet > params.energy_threshold;
+                    num_quiet = 0;
+                }
+            }
+            num_multi_segment += has_cut ? 1 : 0;
+        }
+    }
+
+    CHECK(num_events > 2000);
+    CHECK(num_multi_segment > 100);
+
+    printf("%zu notes, %zu of 240 conversions with several segments\n",
+           num_events, num_multi_segment);
+    return 0;
+}
@@ -0,0 +1,300 @@
+// PitchCnn against the RTNeural models it replaced: the contour, note and
+// onset posteriorgrams of every frame must match the RTNeural inference of
+// the same json models over the full note range, with each kernel level the
+// CPU supports. A restricted note range must not change the outputs within
+// the range. The silence gate must not change them either, on silence, on
+// sound and on sound resuming after skipped frames.
+//
+// Usage: pitch_cnn_test <model_data directory>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "RTNeural/RTNeural.h"
+
+#include "source/cpu_features.h"
+#include "source/pitch_cnn.h"
+#include "test_utils.h"
+
+using json = nlohmann::json;
+
+/**
+ * PitchCnn as it ran on RTNeural ModelT models, before Conv2d.
+ */
+class ReferencePitchCnn {
+  public:
+    ReferencePitchCnn(const json &contour_json, const json &note_json,
+                      const json &onset_1_json, const json &onset_2_json) {
+        cnn_contour.parseJson(contour_json);
+        cnn_note.parseJson(note_json);
+        cnn_onset_input.parseJson(onset_1_json);
+        cnn_onset_output.parseJson(onset_2_json);
+
+        cnn_contour.reset();
+        cnn_note.reset();
+        cnn_onset_input.reset();
+        cnn_onset_output.reset();
+    }
+
+    void frame_inference(const float *in_data, std::vector<float> &out_contours,
+                         std::vector<float> &out_notes,
+                         std::vector<float> &out_onsets) {
+        std::copy(in_data, in_data + NUM_HARMONICS * NUM_FREQ_IN,
+                  input_array.begin());
+
+        cnn_onset_input.forward(input_array.data());
+        std::copy(cnn_onset_input.getOutputs(),
+                  cnn_onset_input.getOutputs() + 32 * NUM_FREQ_OUT,
+                  concat_2_buffer[concat_2_index].begin());
+
+        cnn_contour.forward(input_array.data());
+        std::copy(cnn_contour.getOutputs(),
+                  cnn_contour.getOutputs() + NUM_FREQ_IN,
+                  contours_buffer[contour_index].begin());
+
+        cnn_note.forward(cnn_contour.getOutputs());
+        std::copy(cnn_note.getOutputs(), cnn_note.getOutputs() + NUM_FREQ_OUT,
+                  notes_buffer[note_index].begin());
+
+        const auto &concat_2 =
+            concat_2_buffer[(concat_2_index + 1) % num_concat_2_stored];
+        for (size_t i = 0; i < NUM_FREQ_OUT; i++) {
+            concat_array[i * 33] = cnn_note.getOutputs()[i];
+            std::copy(concat_2.begin() + i * 32,
+                      concat_2.begin() + (i + 1) * 32,
+                      concat_array.begin() + i * 33 + 1);
+        }
+        cnn_onset_output.forward(concat_array.data());
+
+        std::copy(cnn_onset_output.getOutputs(),
+                  cnn_onset_output.getOutputs() + NUM_FREQ_OUT,
+                  out_onsets.begin());
+        const auto &notes = notes_buffer[(note_index + 1) % num_note_stored];
+        std::copy(notes.begin(), notes.end(), out_notes.begin());
+        const auto &contours =
+            contours_buffer[(contour_index + 1) % num_contour_stored];
+        std::copy(contours.begin(), contours.end(), out_contours.begin());
+
+        contour_index = (contour_index + 1) % num_contour_stored;
+        note_index = (note_index + 1) % num_note_stored;
+        concat_2_index = (concat_2_index + 1) % num_concat_2_stored;
+    }
+
+  private:
+    // Lookaheads: contour 3, note 6, onset input 2, onset output 1.
+    static constexpr size_t num_contour_stored = 8;
+    static constexpr size_t num_note_stored = 2;
+    static constexpr size_t num_concat_2_stored = 8;
+
+    using CnnContourModel = RTNeural::ModelT<
+        float, NUM_FREQ_IN * NUM_HARMONICS, NUM_FREQ_IN,
+        RTNeural::Conv2DT<float, NUM_HARMONICS, 8, NUM_FREQ_IN, 3, 39, 1, 1,
+                          false>,
+        RTNeural::ReLuActivationT<float, 8 * NUM_FREQ_IN>,
+        RTNeural::Conv2DT<float, 8, 1, NUM_FREQ_IN, 5, 5, 1, 1, false>,
+        RTNeural::SigmoidActivationT<float, NUM_FREQ_IN>>;
+
+    using CnnNoteModel = RTNeural::ModelT<
+        float, NUM_FREQ_IN, NUM_FREQ_OUT,
+        RTNeural::Conv2DT<float, 1, 32, NUM_FREQ_IN, 7, 7, 1, 3, false>,
+        RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>,
+        RTNeural::Conv2DT<float, 32, 1, NUM_FREQ_OUT, 7, 3, 1, 1, false>,
+        RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
+
+    using CnnOnsetInputModel = RTNeural::ModelT<
+        float, NUM_FREQ_IN * NUM_HARMONICS, 32 * NUM_FREQ_OUT,
+        RTNeural::Conv2DT<float, 8, 32, NUM_FREQ_IN, 5, 5, 1, 3, false>,
+        RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>>;
+
+    using CnnOnsetOutputModel = RTNeural::ModelT<
+        float, 33 * NUM_FREQ_OUT, NUM_FREQ_OUT,
+        RTNeural::Conv2DT<float, 33, 1, NUM_FREQ_OUT, 3, 3, 1, 1, false>,
+        RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
+
+    CnnContourModel cnn_contour;
+    CnnNoteModel cnn_note;
+    CnnOnsetInputModel cnn_onset_input;
+    CnnOnsetOutputModel cnn_onset_output;
+
+    alignas(RTNEURAL_DEFAULT_ALIGNMENT)
+        std::array<float, NUM_FREQ_IN * NUM_HARMONICS> input_array{};
+    alignas(RTNEURAL_DEFAULT_ALIGNMENT)
+        std::array<float, 33 * NUM_FREQ_OUT> concat_array{};
+
+    std::array<std::array<float, NUM_FREQ_IN>, num_contour_stored>
+        contours_buffer{};
+    std::array<std::array<float, NUM_FREQ_OUT>, num_note_stored>
+        notes_buffer{};
+    std::array<std::array<float, 32 * NUM_FREQ_OUT>, num_concat_2_stored>
+        concat_2_buffer{};
+    size_t contour_index = 0;
+    size_t note_index = 0;
+    size_t concat_2_index = 0;
+};
+
+static json parse(const std::vector<uint8_t> &data) {
+    return json::parse(data.begin(), data.end());
+}
+
+int main(int argc, char **argv) {
+    CHECK(argc == 2);
+    const std::string model_dir = argv[1];
+    auto contour_data = read_file(model_dir + "/cnn_contour_model.json");
+    auto note_data = read_file(model_dir + "/cnn_note_model.json");
+    auto onset_1_data = read_file(model_dir + "/cnn_onset_1_model.json");
+    auto onset_2_data = read_file(model_dir + "/cnn_onset_2_model.json");
+
+    constexpr int num_frames = 400;
+    const auto frames = cnn_input_frames(num_frames, 1);
+    auto frame = [&frames](int index) {
+        return frames.data() + (size_t)index * NUM_HARMONICS * NUM_FREQ_IN;
+    };
+
+    // RTNeural outputs of all frames, for the full range.
+    const size_t frame_outputs = NUM_FREQ_IN + 2 * NUM_FREQ_OUT;
+    std::vector<float> expected((size_t)num_frames * frame_outputs);
+    {
+        auto reference = std::make_unique<ReferencePitchCnn>(
+            parse(contour_data), parse(note_data), parse(onset_1_data),
+            parse(onset_2_data));
+        std::vector<float> contours(NUM_FREQ_IN);
+        std::vector<float> notes(NUM_FREQ_OUT);
+        std::vector<float> onsets(NUM_FREQ_OUT);
+        for (int i = 0; i < num_frames; i++) {
+            reference->frame_inference(frame(i), contours, notes, onsets);
+            auto *out = expected.data() + i * frame_outputs;
+            std::copy(contours.begin(), contours.end(), out);
+            std::copy(notes.begin(), notes.end(), out + NUM_FREQ_IN);
+            std::copy(onsets.begin(), onsets.end(),
+                      out + NUM_FREQ_IN + NUM_FREQ_OUT);
+        }
+    }
+
+    // The inputs must give notes, not just silence.
+    float max_note = 0.0f;
+    for (int i = 0; i < num_frames; i++) {
+        const auto *notes = expected.data() + i * frame_outputs + NUM_FREQ_IN;
+        max_note =
+            std::max(max_note, *std::max_element(notes, notes + NUM_FREQ_OUT));
+    }
+    printf("max note posteriorgram %.3f\n", max_note);
+    CHECK(max_note > 0.5f);
+
+    for (int level = CpuGeneric; level <= detected_cpu_level(); level++) {
+        set_cpu_level(level);
+        PitchCnn cnn(blob(contour_data), blob(note_data), blob(onset_1_data),
+                     blob(onset_2_data));
+
+        // Full range, then notes 30 to 50: only compare what the range keeps.
+        for (const bool narrow : {false, true}) {
+            const int min_note = narrow ? 30 : 0;
+            const int max_note = narrow ? 50 : NUM_FREQ_OUT - 1;
+            if (narrow) {
+                cnn.set_note_range(min_note, max_note);
+            } else {
+                cnn.reset();
+            }
+
+            std::vector<float> contours(NUM_FREQ_IN);
+            std::vector<float> notes(NUM_FREQ_OUT);
+            std::vector<float> onsets(NUM_FREQ_OUT);
+            float max_difference = 0.0f;
+            for (int i = 0; i < num_frames; i++) {
+                cnn.frame_inference(frame(i), contours, notes, onsets);
+                const auto *out = expected.data() + i * frame_outputs;
+                if (!narrow) {
+                    for (int bin = 0; bin < NUM_FREQ_IN; bin++) {
+                        max_difference = std::max(
+                            max_difference, std::abs(contours[bin] - out[bin]));
+                    }
+                }
+                for (int note = min_note; note <= max_note; note++) {
+                    max_difference = std::max(
+                        {max_difference,
+                         std::abs(notes[note] - out[NUM_FREQ_IN + note]),
+                         std::abs(onsets[note] -
+                                  out[NUM_FREQ_IN + NUM_FREQ_OUT + note])});
+                }
+            }
+
+            printf("%s, %s range: max difference %.2e\n",
+                   cpu_level_name(static_cast<CpuLevel>(level)),
+                   narrow ? "narrow" : "full", max_difference);
+            CHECK(max_difference < 1e-5f);
+        }
+    }
+
+    set_cpu_level(-1);
+
+    // Silence, sound, silence, sound, silence. The gated run gets noise below
+    // its threshold in the silent stretches, the ungated run zeros.
+    constexpr int num_silent = 150;
+    constexpr float threshold = 1e-3f;
+    const size_t frame_size = NUM_HARMONICS * NUM_FREQ_IN;
+    std::vector<float> gated_frames;
+    std::vector<float> ungated_frames;
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> noise(-threshold, threshold);
+    auto append_silence = [&]() {
+        for (size_t i = 0; i < num_silent * frame_size; i++) {
+            gated_frames.push_back(noise(rng));
+            ungated_frames.push_back(0.0f);
+        }
+    };
+    auto append_sound = [&](int first_frame, int num_sound) {
+        gated_frames.insert(gated_frames.end(), frame(first_frame),
+                            frame(first_frame + num_sound));
+        ungated_frames.insert(ungated_frames.end(), frame(first_frame),
+                              frame(first_frame + num_sound));
+    };
+    append_silence();
+    append_sound(0, 150);
+    append_silence();
+    append_sound(200, 150);
+    append_silence();
+    const int num_gated_frames =
+        static_cast<int>(gated_frames.size() / frame_size);
+
+    PitchCnn gated_cnn(blob(contour_data), blob(note_data),
+                       blob(onset_1_data), blob(onset_2_data));
+    PitchCnn ungated_cnn(blob(contour_data), blob(note_data),
+                         blob(onset_1_data), blob(onset_2_data));
+    gated_cnn.set_silence_gate(threshold);
+    std::vector<float> contours(NUM_FREQ_IN), expected_contours(NUM_FREQ_IN);
+    std::vector<float> notes(NUM_FREQ_OUT), expected_notes(NUM_FREQ_OUT);
+    std::vector<float> onsets(NUM_FREQ_OUT), expected_onsets(NUM_FREQ_OUT);
+    float max_difference = 0.0f;
+    for (int i = 0; i < num_gated_frames; i++) {
+        gated_cnn.frame_inference(gated_frames.data() + i * frame_size,
+                                  contours, notes, onsets);
+        ungated_cnn.frame_inference(ungated_frames.data() + i * frame_size,
+                                    expected_contours, expected_notes,
+                                    expected_onsets);
+        for (int bin = 0; bin < NUM_FREQ_IN; bin++) {
+            max_difference =
+                std::max(max_difference,
+                         std::abs(contours[bin] - expected_contours[bin]));
+        }
+        for (int note = 0; note < NUM_FREQ_OUT; note++) {
+            max_difference =
+                std::max({max_difference,
+                          std::abs(notes[note] - expected_notes[note]),
+                          std::abs(onsets[note] - expected_onsets[note])});
+        }
+    }
+
+    // Each silent stretch is skipped once the network has settled, within
+    // 50 frames. The short gaps in the sound are not.
+    printf("silence gate: %zu of %d frames skipped, max difference %.2e\n",
+           gated_cnn.num_skipped_frames(), num_gated_frames, max_difference);
+    CHECK(gated_cnn.num_skipped_frames() > 3 * (num_silent - 50));
+    CHECK(gated_cnn.num_skipped_frames() <= 3 * num_silent);
+    CHECK(ungated_cnn.num_skipped_frames() == 0);
+    CHECK(max_difference < 1e-6f);
+    return 0;
+}
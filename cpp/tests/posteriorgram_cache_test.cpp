@@ -0,0 +1,210 @@
+// PosteriorgramCache, on its own and through PitchDetector: a cache hit must
+// give the events of a fresh transcription, with the current note
+// parameters, and any change to the audio, the models or the settings the
+// posteriorgrams depend on must miss. Entries are evicted least recently
+// used first to stay within the budget.
+//
+// Usage: posteriorgram_cache_test <model_data directory>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "detector_test_utils.h"
+#include "source/pitch_detector.h"
+#include "source/posteriorgram_cache.h"
+#include "test_utils.h"
+
+/**
+ * A change to a detector and its audio.
+ */
+struct Change {
+    const char *name;
+    std::function<void(PitchDetector &, std::vector<float> &)> apply;
+};
+
+static std::vector<Notes::Event> transcribe(PitchDetector &detector,
+                                            std::vector<float> &audio) {
+    CHECK(detector.transcribe_to_midi(audio.data(),
+                                      static_cast<int>(audio.size())) ==
+          TranscriptionDone);
+    return detector.latest_note_events();
+}
+
+static void set_parameters(PitchDetector &detector) {
+    detector.set_parameters(0.7f, 0.5f, 127.7f);
+}
+
+static void check_detector_cache(DetectorModels &models) {
+    const auto melody = random_melody(4.0f, 5);
+
+    std::vector<Notes::Event> expected;
+    std::vector<Notes::Event> expected_new_parameters;
+    {
+        auto audio = melody;
+        PitchDetector detector(models.files());
+        set_parameters(detector);
+        expected = transcribe(detector, audio);
+        detector.set_parameters(0.6f, 0.4f, 80.0f);
+        expected_new_parameters = transcribe(detector, audio);
+    }
+    CHECK(!expected.empty() && expected != expected_new_parameters);
+
+    auto cache = std::make_shared<PosteriorgramCache>(64 << 20);
+    {
+        auto audio = melody;
+        PitchDetector detector(models.files());
+        detector.set_posteriorgram_cache(cache);
+        set_parameters(detector);
+        CHECK(transcribe(detector, audio) == expected);
+        CHECK(cache->num_hits() == 0 && cache->num_misses() == 1);
+        CHECK(transcribe(detector, audio) == expected);
+        CHECK(cache->num_hits() == 1 && cache->num_misses() == 1);
+
+        // Notes are extracted with the parameters of the hit.
+        detector.set_parameters(0.6f, 0.4f, 80.0f);
+        CHECK(transcribe(detector, audio) == expected_new_parameters);
+        CHECK(cache->num_hits() == 2 && cache->num_misses() == 1);
+    }
+    {
+        // Shared with another detector.
+        auto audio = melody;
+        PitchDetector detector(models.files());
+        detector.set_posteriorgram_cache(cache);
+        set_parameters(detector);
+        CHECK(transcribe(detector, audio) == expected);
+        CHECK(cache->num_hits() == 3 && cache->num_misses() == 1);
+    }
+
+    const std::vector<Change> changes = {
+        {"audio",
+         [](PitchDetector &, std::vector<float> &audio) {
+             audio[audio.size() / 2] *= 0.5f;
+         }},
+        {"audio length",
+         [](PitchDetector &, std::vector<float> &audio) {
+             audio.resize(audio.size() - 1);
+         }},
+        {"pitch bends",
+         [](PitchDetector &detector, std::vector<float> &) {
+             detector.set_pitch_bend(NoPitchBend);
+         }},
+        {"frequency range",
+         [](PitchDetector &detector, std::vector<float> &) {
+             detector.set_frequency_range(200.0f, 1000.0f);
+         }},
+        {"silence gate",
+         [](PitchDetector &detector, std::vector<float> &) {
+             detector.set_silence_gate(0.01f);
+         }},
+        {"precision",
+         [](PitchDetector &detector, std::vector<float> &) {
+             detector.set_posteriorgram_precision(Float16Precision);
+         }},
+        {"segmented features",
+         [](PitchDetector &detector, std::vector<float> &) {
+             detector.set_segmented_features(true);
+         }},
+        {"pruned weights",
+         [](PitchDetector &detector, std::vector<float> &) {
+             CHECK(detector.prune_cnn_weights(0.1f) > 0.0f);
+         }},
+    };
+
+    for (const auto &change : changes) {
+        // Events of the change without cache.
+        auto audio = melody;
+        PitchDetector uncached(models.files());
+        set_parameters(uncached);
+        change.apply(uncached, audio);
+        const auto changed_events = transcribe(uncached, audio);
+
+        audio = melody;
+        PitchDetector detector(models.files());
+        detector.set_posteriorgram_cache(cache);
+        set_parameters(detector);
+        change.apply(detector, audio);
+
+        const size_t num_hits = cache->num_hits();
+        const size_t num_misses = cache->num_misses();
+        CHECK(transcribe(detector, audio) == changed_events);
+        CHECK(cache->num_hits() == num_hits);
+        CHECK(cache->num_misses() == num_misses + 1);
+        CHECK(transcribe(detector, audio) == changed_events);
+        CHECK(cache->num_hits() == num_hits + 1);
+        printf("%s: miss\n", change.name);
+    }
+    printf("%zu entries, %zu bytes\n", cache->num_entries(),
+           cache->num_bytes());
+}
+
+static std::shared_ptr<const PosteriorgramCache::Entry>
+make_entry(size_t num_frames) {
+    auto entry = std::make_shared<PosteriorgramCache::Entry>();
+    entry->num_frames = num_frames;
+    entry->notes.assign(num_frames, std::vector<float>(NUM_FREQ_OUT, 0.5f));
+    entry->onsets = entry->notes;
+    return entry;
+}
+
+static PosteriorgramCache::Key make_key(uint64_t audio_hash) {
+    return {audio_hash, 1000, 1, 1};
+}
+
+static void check_eviction() {
+    const size_t entry_bytes = make_entry(100)->num_bytes();
+    PosteriorgramCache cache(3 * entry_bytes + entry_bytes / 2);
+
+    for (uint64_t i = 0; i < 3; i++) {
+        cache.insert(make_key(i), make_entry(100));
+    }
+    CHECK(cache.num_entries() == 3);
+    CHECK(cache.num_bytes() == 3 * entry_bytes);
+
+    // 0 becomes the most recently used: 1 is evicted first, then 2.
+    const auto entry_0 = cache.find(make_key(0));
+    CHECK(entry_0 != nullptr);
+    cache.insert(make_key(3), make_entry(100));
+    CHECK(cache.num_entries() == 3);
+    CHECK(cache.find(make_key(1)) == nullptr);
+    const auto entry_2 = cache.find(make_key(2));
+    CHECK(entry_2 != nullptr);
+    CHECK(cache.find(make_key(0)) != nullptr);
+
+    // A larger entry evicts as many as needed, an evicted entry stays valid.
+    cache.insert(make_key(4), make_entry(200));
+    CHECK(cache.num_entries() == 2);
+    CHECK(cache.find(make_key(3)) == nullptr);
+    CHECK(cache.find(make_key(2)) == nullptr);
+    CHECK(cache.find(make_key(0)) != nullptr);
+    CHECK(entry_2->notes.size() == 100);
+    CHECK(cache.num_bytes() == 3 * entry_bytes);
+
+    // Replacing an entry doesn't count it twice, and entries over the budget
+    // are not stored.
+    cache.insert(make_key(0), make_entry(100));
+    CHECK(cache.num_entries() == 2 && cache.num_bytes() == 3 * entry_bytes);
+    cache.insert(make_key(5), make_entry(400));
+    CHECK(cache.find(make_key(5)) == nullptr);
+    CHECK(cache.num_bytes() <= 3 * entry_bytes + entry_bytes / 2);
+
+    // Keys differing in any field are different entries.
+    cache.clear();
+    cache.insert(make_key(6), make_entry(10));
+    for (const auto &key : {PosteriorgramCache::Key{6, 999, 1, 1},
+                            PosteriorgramCache::Key{6, 1000, 2, 1},
+                            PosteriorgramCache::Key{6, 1000, 1, 2}}) {
+        CHECK(cache.find(key) == nullptr);
+    }
+    CHECK(cache.find(make_key(6)) != nullptr);
+}
+
+int main(int argc, char **argv) {
+    CHECK(argc == 2);
+    check_eviction();
+
+    DetectorModels models(argv[1]);
+    check_detector_cache(models);
+    return 0;
+}
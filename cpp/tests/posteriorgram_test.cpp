@@ -0,0 +1,132 @@
+// HalfPosteriorgram float16 conversions against the F16C instructions: all
+// 65536 halves decoded, and floats of all exponents, halfway cases and
+// special values encoded. Values converted one at a time go through the
+// portable conversions whatever the build flags, arrays through the
+// vectorized ones if enabled. Skipped on CPUs without F16C.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "source/cpu_features.h"
+#include "source/posteriorgram.h"
+#include "test_utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("f16c"))) static uint16_t f16c_encode(float x) {
+    return static_cast<uint16_t>(_mm_extract_epi16(
+        _mm_cvtps_ph(_mm_set_ss(x), _MM_FROUND_TO_NEAREST_INT), 0));
+}
+
+__attribute__((target("f16c"))) static float f16c_decode(uint16_t h) {
+    return _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(h)));
+}
+
+static uint32_t float_bits(float x) {
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static float bits_float(uint32_t u) {
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+static bool is_nan_half(uint16_t h) {
+    return (h & 0x7c00u) == 0x7c00u && (h & 0x3ffu) != 0;
+}
+
+/**
+ * Floats to encode: all exponents with random mantissas, the halves and the
+ * values halfway between consecutive halves with their neighbours, and
+ * special values.
+ */
+static std::vector<float> encode_inputs() {
+    std::vector<float> values;
+    std::mt19937 rng(0);
+    for (uint32_t exponent = 0; exponent < 256; exponent++) {
+        for (int i = 0; i < 64; i++) {
+            const uint32_t sign = (rng() & 1u) << 31;
+            values.push_back(
+                bits_float(sign | (exponent << 23) | (rng() & 0x7fffffu)));
+        }
+    }
+
+    for (uint32_t h = 0; h < 0x7c00u; h++) {
+        const float x = f16c_decode(static_cast<uint16_t>(h));
+        const float next = f16c_decode(static_cast<uint16_t>(h + 1));
+        const float halfway = x + (next - x) / 2.0f;
+        for (const float v : {x, halfway, std::nextafter(halfway, 0.0f),
+                              std::nextafter(halfway, 1e9f)}) {
+            values.push_back(v);
+            values.push_back(-v);
+        }
+    }
+
+    for (const float v : {0.0f, -0.0f, INFINITY, -INFINITY, NAN, 65504.0f,
+                          65520.0f, 1e-8f, 6e-8f, 3e-8f}) {
+        values.push_back(v);
+    }
+    return values;
+}
+
+int main() {
+    if (detected_cpu_level() < CpuAvx2) {
+        // Every CPU with AVX2 has F16C.
+        printf("No F16C, skipped\n");
+        return 0;
+    }
+
+    // Decode
+    std::vector<uint16_t> halves(65536);
+    for (uint32_t h = 0; h < 65536; h++) {
+        halves[h] = static_cast<uint16_t>(h);
+    }
+    std::vector<float> decoded(halves.size());
+    HalfPosteriorgram::decode(Float16Precision, halves.data(), decoded.data(),
+                              halves.size());
+    for (uint32_t h = 0; h < 65536; h++) {
+        float one;
+        HalfPosteriorgram::decode(Float16Precision, &halves[h], &one, 1);
+        const float expected = f16c_decode(halves[h]);
+        if (is_nan_half(halves[h])) {
+            CHECK(std::isnan(one) && std::isnan(decoded[h]));
+        } else {
+            CHECK(float_bits(one) == float_bits(expected));
+            CHECK(float_bits(decoded[h]) == float_bits(expected));
+        }
+    }
+
+    // Encode
+    const auto values = encode_inputs();
+    std::vector<uint16_t> encoded(values.size());
+    HalfPosteriorgram::encode(Float16Precision, values.data(), encoded.data(),
+                              values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        uint16_t one;
+        HalfPosteriorgram::encode(Float16Precision, &values[i], &one, 1);
+        const uint16_t expected = f16c_encode(values[i]);
+        if (std::isnan(values[i])) {
+            CHECK(is_nan_half(one) && is_nan_half(encoded[i]));
+        } else {
+            CHECK(one == expected);
+            CHECK(encoded[i] == expected);
+        }
+    }
+
+    printf("%zu halves decoded, %zu floats encoded\n", halves.size(),
+           values.size());
+    return 0;
+}
+#else
+int main() {
+    printf("No F16C, skipped\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,161 @@
+// PitchDetector::save_stream_state and restore_stream_state: a stream saved
+// midway and restored into a fresh detector must publish the events of an
+// uninterrupted stream, with segments and with the NoteTracker. Truncated or
+// corrupted states and states of other models must be rejected, and leave
+// the detector able to restore a valid state.
+//
+// Usage: stream_state_test <model_data directory>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "detector_test_utils.h"
+#include "source/pitch_detector.h"
+#include "test_utils.h"
+
+static constexpr size_t ring_buffer_num_samples = 1 << 16;
+
+/**
+ * Push audio, waiting while the ring buffer is full.
+ */
+static void push_audio(PitchDetector &detector, const float *audio,
+                       size_t num_samples) {
+    while (num_samples > 0) {
+        const size_t num_pushed =
+            detector.push_audio(audio, std::min<size_t>(num_samples, 4096));
+        if (num_pushed == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        audio += num_pushed;
+        num_samples -= num_pushed;
+    }
+}
+
+/**
+ * Wait until the worker has processed num_samples samples.
+ */
+static void wait_processed(const PitchDetector &detector, size_t num_samples) {
+    while (detector.stream_num_samples_processed() < num_samples) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void pop_events(PitchDetector &detector,
+                       std::vector<StreamNoteEvent> &out_events) {
+    StreamNoteEvent event{};
+    while (detector.pop_stream_events(&event, 1) == 1) {
+        out_events.push_back(event);
+    }
+}
+
+static bool same_events(const std::vector<StreamNoteEvent> &a,
+                        const std::vector<StreamNoteEvent> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].start_frame != b[i].start_frame ||
+            a[i].end_frame != b[i].end_frame ||
+            a[i].midi_note_number != b[i].midi_note_number ||
+            a[i].amplitude != b[i].amplitude) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Start a stream of the given mode.
+ */
+static void start(PitchDetector &detector, bool online_notes,
+                  int max_note_latency_frames) {
+    detector.start_stream(ring_buffer_num_samples, online_notes,
+                          max_note_latency_frames);
+}
+
+/**
+ * @return True if restoring the state fails and leaves the detector not
+ * streaming.
+ */
+static bool rejected(PitchDetector &detector, std::vector<uint8_t> state) {
+    const bool restored = detector.restore_stream_state(
+        {state.data(), state.size()}, ring_buffer_num_samples);
+    return !restored && !detector.is_streaming();
+}
+
+static void check_mode(DetectorModels &models, const std::vector<float> &audio,
+                       bool online_notes, int max_note_latency_frames) {
+    // Uninterrupted run.
+    std::vector<StreamNoteEvent> expected;
+    {
+        PitchDetector detector(models.files());
+        start(detector, online_notes, max_note_latency_frames);
+        push_audio(detector, audio.data(), audio.size());
+        detector.stop_stream();
+        pop_events(detector, expected);
+    }
+
+    // Saved midway, once the worker has caught up so that no event it
+    // publishes afterwards is missed.
+    const size_t num_first = audio.size() * 9 / 20 + 123;
+    std::vector<StreamNoteEvent> events;
+    std::vector<uint8_t> state;
+    {
+        PitchDetector detector(models.files());
+        start(detector, online_notes, max_note_latency_frames);
+        push_audio(detector, audio.data(), num_first);
+        wait_processed(detector, num_first);
+        pop_events(detector, events);
+        state = detector.save_stream_state();
+    }
+    const size_t num_saved_events = events.size();
+    CHECK(!state.empty());
+
+    PitchDetector detector(models.files());
+
+    // Magic, version, model hash: first 20 bytes.
+    for (size_t size : {size_t(0), size_t(7), size_t(19), size_t(20),
+                        state.size() / 3, state.size() - 1}) {
+        CHECK(rejected(detector, {state.begin(), state.begin() + size}));
+    }
+    auto longer = state;
+    longer.push_back(0);
+    CHECK(rejected(detector, longer));
+    for (size_t byte : {size_t(0), size_t(8), size_t(12), size_t(19)}) {
+        auto corrupted = state;
+        corrupted[byte] ^= 0x40;
+        CHECK(rejected(detector, corrupted));
+    }
+    {
+        PitchDetector pruned(models.files());
+        CHECK(pruned.prune_cnn_weights(0.1f) > 0.0f);
+        CHECK(rejected(pruned, state));
+    }
+
+    CHECK(detector.restore_stream_state({state.data(), state.size()},
+                                        ring_buffer_num_samples));
+    CHECK(detector.is_streaming());
+    push_audio(detector, audio.data() + num_first, audio.size() - num_first);
+    detector.stop_stream();
+    pop_events(detector, events);
+
+    printf("%s, latency %d: %zu events, %zu before the save, state %zu "
+           "bytes\n",
+           online_notes ? "tracker" : "segments", max_note_latency_frames,
+           expected.size(), num_saved_events, state.size());
+    CHECK(num_saved_events > 0 && num_saved_events < expected.size());
+    CHECK(same_events(events, expected));
+}
+
+int main(int argc, char **argv) {
+    CHECK(argc == 2);
+    DetectorModels models(argv[1]);
+    const auto audio = random_melody(12.0f, 3);
+
+    check_mode(models, audio, false, 1024);
+    check_mode(models, audio, true, 1024);
+    check_mode(models, audio, true, 40);
+    return 0;
+}
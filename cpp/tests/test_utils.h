@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "source/constants.h"
+
+/**
+ * Check a condition, print it and exit with a failure status if it doesn't
+ * hold. Unlike assert, also checked in release builds.
+ */
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+                    #condition);                                               \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+/**
+ * @param path File path, checked to exist.
+ * @return File contents.
+ */
+inline std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    CHECK(file);
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+inline BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+typedef std::vector<std::vector<float>> Posteriorgram;
+
+/**
+ * Random note and onset posteriorgrams: low noise everywhere, and notes of 3
+ * to 62 frames with an onset peak at their start, a weaker neighbour bin and
+ * occasional dips below the frame threshold.
+ * @param num_frames Number of frames.
+ * @param seed Random seed.
+ * @param density Number of notes per frame.
+ * @param out_notes Note posteriorgram.
+ * @param out_onsets Onset posteriorgram.
+ */
+inline void random_posteriorgrams(int num_frames, unsigned seed,
+                                  float density, Posteriorgram &out_notes,
+                                  Posteriorgram &out_onsets) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    out_notes.assign(num_frames, std::vector<float>(NUM_FREQ_OUT, 0.0f));
+    out_onsets = out_notes;
+    for (int frame = 0; frame < num_frames; frame++) {
+        for (int note = 0; note < NUM_FREQ_OUT; note++) {
+            out_notes[frame][note] = 0.3f * uniform(rng) * uniform(rng);
+            out_onsets[frame][note] = 0.2f * uniform(rng) * uniform(rng);
+        }
+    }
+
+    const int num_notes = static_cast<int>(num_frames * density);
+    for (int i = 0; i < num_notes; i++) {
+        const int start = static_cast<int>(rng() % num_frames);
+        const int length = 3 + static_cast<int>(rng() % 60);
+        const int note = static_cast<int>(rng() % NUM_FREQ_OUT);
+        const float amplitude = 0.5f + 0.5f * uniform(rng);
+
+        for (int frame = start; frame < std::min(num_frames, start + length);
+             frame++) {
+            float value = amplitude * (0.7f + 0.3f * uniform(rng));
+            if (uniform(rng) < 0.08f) {
+                value *= 0.3f;
+            }
+            auto &notes = out_notes[frame];
+            notes[note] = std::max(notes[note], value);
+            if (note + 1 < NUM_FREQ_OUT) {
+                notes[note + 1] =
+                    std::max(notes[note + 1], value * uniform(rng));
+            }
+        }
+
+        out_onsets[start][note] =
+            std::max(out_onsets[start][note], 0.4f + 0.6f * uniform(rng));
+        if (start + 1 < num_frames) {
+            out_onsets[start + 1][note] =
+                std::max(out_onsets[start + 1][note], 0.3f * uniform(rng));
+        }
+    }
+}
+
+/**
+ * CNN input frames: held harmonic tones over low noise, stacked as Features
+ * stacks its harmonics, with 20 silent frames every 100.
+ * @param num_frames Number of frames.
+ * @param seed Random seed, also shifts the tones.
+ * @return Harmonic CQT frames in [0, 1].
+ */
+inline std::vector<float> cnn_input_frames(int num_frames, unsigned seed) {
+    constexpr float harmonics[NUM_HARMONICS] = {0.5f, 1.0f, 2.0f, 3.0f,
+                                                4.0f, 5.0f, 6.0f, 7.0f};
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<float> frames((size_t)num_frames * NUM_HARMONICS * NUM_FREQ_IN,
+                              0.0f);
+
+    for (int frame = 0; frame < num_frames; frame++) {
+        if (frame % 100 >= 80) {
+            continue;
+        }
+        float *x = frames.data() + (size_t)frame * NUM_HARMONICS * NUM_FREQ_IN;
+        const float fundamental_bin =
+            static_cast<float>(12 + (frame / 20 + (int)seed) * 37 % 150);
+
+        // CQT of a tone with decaying partials, 3 bins per semitone.
+        auto spectrum = [fundamental_bin](float bin) {
+            float value = 0.0f;
+            for (int partial = 1; partial <= 8; partial++) {
+                const float distance =
+                    bin - fundamental_bin - 36.0f * std::log2(partial);
+                value += std::pow(0.8f, partial - 1) *
+                         std::exp(-distance * distance / 2.0f);
+            }
+            return value;
+        };
+
+        for (int bin = 0; bin < NUM_FREQ_IN; bin++) {
+            for (int h = 0; h < NUM_HARMONICS; h++) {
+                const float shifted =
+                    static_cast<float>(bin) + 36.0f * std::log2(harmonics[h]);
+                const float noise = 0.05f * uniform(rng);
+                x[bin * NUM_HARMONICS + h] =
+                    std::min(1.0f, spectrum(shifted) + noise);
+            }
+        }
+    }
+    return frames;
+}
+
+/**
+ * Random melody of harmonic tones, with overlaps and gaps.
+ * @param seconds Duration.
+ * @param seed Random seed.
+ * @return Audio at 22050 Hz.
+ */
+inline std::vector<float> random_melody(float seconds, unsigned seed) {
+    constexpr double two_pi = 6.28318530718;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<float> audio(
+        static_cast<size_t>(seconds * AUDIO_SAMPLE_RATE), 0.0f);
+
+    size_t start = 0;
+    while (start < audio.size()) {
+        const auto num_samples = static_cast<size_t>(
+            (0.15f + 0.5f * uniform(rng)) * AUDIO_SAMPLE_RATE);
+        const int midi_note = 40 + static_cast<int>(rng() % 45);
+        const double hz = 440.0 * std::pow(2.0, (midi_note - 69) / 12.0);
+        const float amplitude = 0.1f + 0.3f * uniform(rng);
+        for (size_t i = 0; i < num_samples && start + i < audio.size(); i++) {
+            const float t = static_cast<float>(i) / AUDIO_SAMPLE_RATE;
+            const float envelope =
+                amplitude * std::min(t / 0.01f, 1.0f) * std::exp(-2.0f * t);
+            const auto phase = static_cast<float>(
+                std::fmod(two_pi * hz * i / AUDIO_SAMPLE_RATE, two_pi));
+            audio[start + i] += envelope * (std::sin(phase) +
+                                            0.5f * std::sin(2.0f * phase));
+        }
+        // Overlap the next note, or leave a gap after this one.
+        start += static_cast<size_t>(num_samples * (0.5f + uniform(rng)));
+    }
+    return audio;
+}
@@ -0,0 +1,208 @@
+#include "audio_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include "source/constants.h"
+#include "source/mapped_file.h"
+
+static uint32_t read_u16(const uint8_t *data) {
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t read_u32(const uint8_t *data) {
+    return read_u16(data) | (read_u16(data + 2) << 16);
+}
+
+const char *decode_wav(const uint8_t *data, size_t num_bytes,
+                       std::vector<float> &out_samples, int &out_sample_rate) {
+    if (num_bytes < 12 || std::memcmp(data, "RIFF", 4) != 0 ||
+        std::memcmp(data + 8, "WAVE", 4) != 0) {
+        return "not a WAV file";
+    }
+
+    constexpr uint32_t format_pcm = 1;
+    constexpr uint32_t format_float = 3;
+    constexpr uint32_t format_extensible = 0xfffe;
+
+    uint32_t format = 0;
+    uint32_t num_channels = 0;
+    uint32_t bits_per_sample = 0;
+    const uint8_t *samples = nullptr;
+    size_t samples_num_bytes = 0;
+
+    // Chunks are word aligned
+    size_t offset = 12;
+    while (offset + 8 <= num_bytes) {
+        const uint8_t *chunk = data + offset;
+        const size_t chunk_size =
+            std::min<size_t>(read_u32(chunk + 4), num_bytes - offset - 8);
+
+        if (std::memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+            format = read_u16(chunk + 8);
+            num_channels = read_u16(chunk + 10);
+            out_sample_rate = static_cast<int>(read_u32(chunk + 12));
+            bits_per_sample = read_u16(chunk + 22);
+            if (format == format_extensible && chunk_size >= 40) {
+                // First two bytes of the sub format GUID
+                format = read_u16(chunk + 32);
+            }
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            samples = chunk + 8;
+            samples_num_bytes = chunk_size;
+        }
+
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    if (num_channels == 0 || out_sample_rate <= 0) {
+        return "missing or invalid fmt chunk";
+    }
+    if (samples == nullptr) {
+        return "missing data chunk";
+    }
+
+    const bool is_pcm = format == format_pcm &&
+                        (bits_per_sample == 8 || bits_per_sample == 16 ||
+                         bits_per_sample == 24 || bits_per_sample == 32);
+    const bool is_float = format == format_float &&
+                          (bits_per_sample == 32 || bits_per_sample == 64);
+    if (!is_pcm && !is_float) {
+        return "unsupported sample format";
+    }
+
+    const size_t bytes_per_sample = bits_per_sample / 8;
+    const size_t num_frames =
+        samples_num_bytes / (bytes_per_sample * num_channels);
+
+    auto sample_at = [&](const uint8_t *p) -> float {
+        if (is_float) {
+            if (bits_per_sample == 32) {
+                float x;
+                std::memcpy(&x, p, sizeof(x));
+                return x;
+            }
+            double x;
+            std::memcpy(&x, p, sizeof(x));
+            return static_cast<float>(x);
+        }
+
+        switch (bits_per_sample) {
+        case 8:
+            return (static_cast<int>(p[0]) - 128) / 128.0f;
+        case 16:
+            return static_cast<int16_t>(read_u16(p)) / 32768.0f;
+        case 24:
+            return static_cast<int32_t>((p[0] << 8) | (p[1] << 16) |
+                                        (static_cast<uint32_t>(p[2]) << 24)) /
+                   2147483648.0f;
+        default:
+            return static_cast<int32_t>(read_u32(p)) / 2147483648.0f;
+        }
+    };
+
+    out_samples.resize(num_frames);
+    const float gain = 1.0f / static_cast<float>(num_channels);
+    const uint8_t *p = samples;
+    for (size_t i = 0; i < num_frames; i++) {
+        float sum = 0.0f;
+        for (uint32_t c = 0; c < num_channels; c++) {
+            sum += sample_at(p);
+            p += bytes_per_sample;
+        }
+        out_samples[i] = sum * gain;
+    }
+
+    return nullptr;
+}
+
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+Resampler::Resampler(int in_sample_rate, int out_sample_rate) {
+    const int divisor = std::gcd(in_sample_rate, out_sample_rate);
+    up = out_sample_rate / divisor;
+    down = in_sample_rate / divisor;
+
+    // Cut a bit below the lowest Nyquist frequency, in input samples.
+    const double cutoff = 0.97 * std::min(1.0, static_cast<double>(up) / down);
+    half_length = static_cast<int>(std::ceil(num_zero_crossings / cutoff));
+
+    const double beta = 8.6;
+    filters.resize(static_cast<size_t>(up) * 2 * half_length);
+    for (int phase = 0; phase < up; phase++) {
+        for (int j = -half_length + 1; j <= half_length; j++) {
+            // Distance between the output and input j, in input samples
+            const double t = static_cast<double>(phase) / up - j;
+            const double x = t / half_length;
+            const double window =
+                std::abs(x) >= 1.0
+                    ? 0.0
+                    : bessel_i0(beta * std::sqrt(1.0 - x * x)) /
+                          bessel_i0(beta);
+            const double sinc =
+                t == 0.0 ? 1.0
+                         : std::sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+            filters[filter_index(phase, j)] =
+                static_cast<float>(cutoff * sinc * window);
+        }
+    }
+}
+
+std::vector<float> Resampler::process(const std::vector<float> &in) const {
+    if (up == down) {
+        return in;
+    }
+
+    const auto num_in = static_cast<int64_t>(in.size());
+    const int64_t num_out = (num_in * up + down - 1) / down;
+    std::vector<float> out(static_cast<size_t>(num_out));
+
+    for (int64_t n = 0; n < num_out; n++) {
+        const int64_t position = n * down;
+        const int64_t base = position / up;
+        const int phase = static_cast<int>(position % up);
+        const float *filter = filters.data() + filter_index(phase, 0);
+
+        // Taps base + j, j in [-half_length + 1, half_length]
+        const int64_t first = std::max<int64_t>(base - half_length + 1, 0);
+        const int64_t last =
+            std::min<int64_t>(base + half_length, num_in - 1);
+        float sum = 0.0f;
+        for (int64_t k = first; k <= last; k++) {
+            sum += filter[k - base] * in[static_cast<size_t>(k)];
+        }
+        out[static_cast<size_t>(n)] = sum;
+    }
+
+    return out;
+}
+
+const char *read_wav_file(const char *path, std::vector<float> &out_samples) {
+    const MappedFile file(path);
+    if (!file.is_open()) {
+        return "can't open";
+    }
+
+    int sample_rate = 0;
+    const char *error =
+        decode_wav(file.data(), file.size(), out_samples, sample_rate);
+    if (error != nullptr) {
+        return error;
+    }
+
+    if (sample_rate != AUDIO_SAMPLE_RATE) {
+        out_samples =
+            Resampler(sample_rate, AUDIO_SAMPLE_RATE).process(out_samples);
+    }
+    return nullptr;
+}
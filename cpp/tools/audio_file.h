@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Decode the samples of a WAV file, mixed down to mono. 8, 16, 24 and 32-bit
+ * PCM and 32 and 64-bit float are supported, extensible format included.
+ * @param data File bytes.
+ * @param num_bytes File size.
+ * @param out_samples Output samples.
+ * @param out_sample_rate Sample rate of the file.
+ * @return Error message, nullptr on success.
+ */
+const char *decode_wav(const uint8_t *data, size_t num_bytes,
+                       std::vector<float> &out_samples, int &out_sample_rate);
+
+/**
+ * Memory map a WAV file and decode it to mono at the Basic Pitch sample rate
+ * (22050 Hz), resampled if needed.
+ * @param path File path.
+ * @param out_samples Output samples.
+ * @return Error message, nullptr on success.
+ */
+const char *read_wav_file(const char *path, std::vector<float> &out_samples);
+
+/**
+ * Polyphase resampler with a Kaiser windowed sinc low-pass filter, for any
+ * ratio of integer sample rates.
+ */
+class Resampler {
+  public:
+    Resampler(int in_sample_rate, int out_sample_rate);
+
+    /**
+     * @param in Input samples.
+     * @return Resampled samples.
+     */
+    [[nodiscard]] std::vector<float>
+    process(const std::vector<float> &in) const;
+
+  private:
+    static constexpr int num_zero_crossings = 16;
+
+    [[nodiscard]] size_t filter_index(int phase, int j) const {
+        return static_cast<size_t>(phase) * 2 * half_length +
+               static_cast<size_t>(j + half_length - 1);
+    }
+
+    int up = 1;
+    int down = 1;
+    int half_length = 0;
+    // [up][2 * half_length]
+    std::vector<float> filters;
+};
@@ -0,0 +1,258 @@
+// Transcribe all WAV files of a directory to Standard MIDI Files, on several
+// worker threads, each running its own PitchDetector. WAV files are memory
+// mapped, mixed down to mono and resampled to 22050 Hz if needed.
+//
+// Usage: batch_transcribe [options] <model_data directory> <input directory>
+//                         <output directory>
+//   -j <num_workers>          Number of worker threads, default: cores.
+//   -w <cnn weight file>      Load the models with PitchDetector::from_files
+//                             (see pack_cnn_weights) instead of the json
+//                             models: all workers share the mapped files.
+//   -n <note sensibility>     Default 0.5.
+//   -s <split sensibility>    Default 0.5.
+//   -d <min note duration>    In ms, default 100.
+//   -b <none|single|multi>    Pitch bends, default multi.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_file.h"
+#include "source/constants.h"
+#include "source/midi_file.h"
+#include "source/pitch_detector.h"
+
+namespace fs = std::filesystem;
+
+struct Options {
+    int num_workers = 0;
+    std::string cnn_weights_path;
+    float note_sensibility = 0.5f;
+    float split_sensibility = 0.5f;
+    float min_note_duration_ms = 100.0f;
+    PitchBendModes pitch_bend = MultiPitchBend;
+    std::string model_dir;
+    std::string input_dir;
+    std::string output_dir;
+};
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc) {
+            const std::string value = argv[++i];
+            switch (arg[1]) {
+            case 'j':
+                options.num_workers = std::stoi(value);
+                break;
+            case 'w':
+                options.cnn_weights_path = value;
+                break;
+            case 'n':
+                options.note_sensibility = std::stof(value);
+                break;
+            case 's':
+                options.split_sensibility = std::stof(value);
+                break;
+            case 'd':
+                options.min_note_duration_ms = std::stof(value);
+                break;
+            case 'b':
+                if (value == "none") {
+                    options.pitch_bend = NoPitchBend;
+                } else if (value == "single") {
+                    options.pitch_bend = SinglePitchBend;
+                } else if (value == "multi") {
+                    options.pitch_bend = MultiPitchBend;
+                } else {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() != 3) {
+        return false;
+    }
+    options.model_dir = positional[0];
+    options.input_dir = positional[1];
+    options.output_dir = positional[2];
+    return true;
+}
+
+static bool is_wav_file(const fs::directory_entry &entry) {
+    if (!entry.is_regular_file()) {
+        return false;
+    }
+    auto extension = entry.path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == ".wav";
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr,
+                "Usage: %s [-j num_workers] [-w cnn_weight_file] "
+                "[-n note_sensibility] [-s split_sensibility] "
+                "[-d min_note_duration_ms] [-b none|single|multi] "
+                "<model_data directory> <input directory> "
+                "<output directory>\n",
+                argv[0]);
+        return 1;
+    }
+
+    std::vector<fs::path> input_paths;
+    std::error_code error;
+    for (const auto &entry : fs::directory_iterator(options.input_dir, error)) {
+        if (is_wav_file(entry)) {
+            input_paths.push_back(entry.path());
+        }
+    }
+    if (error) {
+        fprintf(stderr, "Can't read %s: %s\n", options.input_dir.c_str(),
+                error.message().c_str());
+        return 1;
+    }
+    std::sort(input_paths.begin(), input_paths.end());
+
+    fs::create_directories(options.output_dir, error);
+    if (error) {
+        fprintf(stderr, "Can't create %s: %s\n", options.output_dir.c_str(),
+                error.message().c_str());
+        return 1;
+    }
+
+    // Models are read once and shared by the detectors of all workers.
+    const std::string features_model_path =
+        options.model_dir + "/features_model.ort";
+    std::vector<uint8_t> features_model, contour, note, onset_1, onset_2;
+    if (options.cnn_weights_path.empty()) {
+        features_model = read_file(features_model_path);
+        contour = read_file(options.model_dir + "/cnn_contour_model.json");
+        note = read_file(options.model_dir + "/cnn_note_model.json");
+        onset_1 = read_file(options.model_dir + "/cnn_onset_1_model.json");
+        onset_2 = read_file(options.model_dir + "/cnn_onset_2_model.json");
+    }
+
+    auto create_detector = [&]() -> std::unique_ptr<PitchDetector> {
+        if (!options.cnn_weights_path.empty()) {
+            return PitchDetector::from_files(features_model_path.c_str(),
+                                             options.cnn_weights_path.c_str());
+        }
+        return std::make_unique<PitchDetector>(PitchDetectorModelFiles{
+            blob(features_model), blob(contour), blob(note), blob(onset_1),
+            blob(onset_2)});
+    };
+
+    int num_workers =
+        options.num_workers > 0
+            ? options.num_workers
+            : static_cast<int>(std::thread::hardware_concurrency());
+    num_workers = std::clamp(num_workers, 1,
+                             std::max(static_cast<int>(input_paths.size()), 1));
+
+    std::atomic<size_t> next_input{0};
+    std::atomic<size_t> num_failed{0};
+    std::atomic<size_t> num_samples_done{0};
+    std::atomic<size_t> num_notes{0};
+
+    auto worker = [&]() {
+        auto detector = create_detector();
+        if (!detector) {
+            fprintf(stderr, "Can't load the models\n");
+            exit(1);
+        }
+        detector->set_parameters(options.note_sensibility,
+                                 options.split_sensibility,
+                                 options.min_note_duration_ms);
+        detector->set_pitch_bend(options.pitch_bend);
+
+        std::vector<float> samples;
+        for (size_t i = next_input++; i < input_paths.size();
+             i = next_input++) {
+            const auto &input_path = input_paths[i];
+
+            const char *wav_error = read_wav_file(input_path.c_str(), samples);
+            if (wav_error != nullptr) {
+                fprintf(stderr, "%s: %s\n", input_path.c_str(), wav_error);
+                num_failed++;
+                continue;
+            }
+
+            detector->transcribe_to_midi(samples.data(),
+                                         static_cast<int>(samples.size()));
+            const auto &events = detector->latest_note_events();
+            const auto midi = MidiFile::from_note_events(events);
+
+            const auto output_path =
+                fs::path(options.output_dir) /
+                input_path.filename().replace_extension(".mid");
+            std::ofstream out(output_path, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(midi.data()),
+                      static_cast<std::streamsize>(midi.size()));
+            if (!out) {
+                fprintf(stderr, "Can't write %s\n", output_path.c_str());
+                num_failed++;
+                continue;
+            }
+
+            num_samples_done += samples.size();
+            num_notes += events.size();
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_workers; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    const double audio_seconds =
+        static_cast<double>(num_samples_done) / AUDIO_SAMPLE_RATE;
+    const size_t num_done = input_paths.size() - num_failed;
+
+    printf("%zu files transcribed, %zu failed, %zu notes, %d workers\n",
+           num_done, num_failed.load(), num_notes.load(), num_workers);
+    printf("%.1f s of audio in %.2f s: %.1fx real time, %.2f files/s\n",
+           audio_seconds, seconds, audio_seconds / std::max(seconds, 1e-9),
+           static_cast<double>(num_done) / std::max(seconds, 1e-9));
+
+    return num_failed > 0 ? 1 : 0;
+}
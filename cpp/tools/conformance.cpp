@@ -0,0 +1,888 @@
+// Conformance check of the pipeline against stored reference outputs, to
+// gate optimized code paths on. For each clip, the reference file holds the
+// audio, the features, the three posteriorgrams and the note events.
+//
+// record computes them with the reference configuration: generic kernels,
+// json models, float posteriorgrams and a single note thread. check
+// recomputes them with the variant selected by its options and compares
+// each stage: features and posteriorgrams within a maximum absolute
+// difference, note events exactly (frames, pitch and pitch bends, amplitude
+// within the posteriorgram tolerance) unless frame or bend tolerances are
+// given.
+//
+// To keep reference files small enough to commit, audio is stored as 16-bit
+// samples (clips are quantized before being recorded) and features and
+// posteriorgrams only every frame stride frames. Note events are stored for
+// all frames.
+//
+// Usage: conformance record [-s <frame stride>] <model_data directory>
+//                           <reference file> [wav files]
+//        conformance check [options] <model_data directory> <reference file>
+//   -c <generic|avx2|avx512>         CNN kernels, default: detected.
+//   -w <cnn weight file>             Load the CNN from a prepacked weight
+//                                    file (see pack_cnn_weights).
+//   -m <features model>              Optimized features model (see
+//                                    optimize_features_model).
+//   -p <float32|float16|bfloat16>    Posteriorgram precision.
+//   -t <num note threads>            Default 1.
+//   -f <tolerance>                   Features, default 1e-4.
+//   -o <tolerance>                   Posteriorgrams, default 1e-4.
+//   -b <frames>                      Note boundaries, default 0. Half
+//                                    precision posteriorgrams can move a
+//                                    boundary where a value rounds across a
+//                                    threshold.
+//   -e <steps>                       Pitch bends, default 0.
+//
+// Synthetic clips are always recorded, wav files are added as real clips,
+// padded with silence to one 2 s window if shorter.
+// Reference files are in native byte order. The stride defaults to 1.
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "audio_file.h"
+#include "source/constants.h"
+#include "source/cpu_features.h"
+#include "source/features.h"
+#include "source/pitch_detector.h"
+
+struct ReferenceEvent {
+    int32_t start_frame;
+    int32_t end_frame;
+    int32_t midi_note_number;
+    double amplitude;
+    std::vector<int32_t> bends;
+};
+
+struct ReferenceClip {
+    std::string name;
+    std::vector<float> audio;
+    size_t num_frames = 0;
+    // Stages of frames 0, stride, 2 * stride... see num_stored_frames.
+    // [frames][NUM_HARMONICS * NUM_FREQ_IN]
+    std::vector<float> features;
+    // [frames][NUM_FREQ_IN] and [frames][NUM_FREQ_OUT]
+    std::vector<float> contours;
+    std::vector<float> notes;
+    std::vector<float> onsets;
+    std::vector<ReferenceEvent> events;
+};
+
+struct Options {
+    std::string mode;
+    std::string model_dir;
+    std::string reference_path;
+    std::vector<std::string> wav_paths;
+
+    uint32_t frame_stride = 1;
+    int cpu_level = -1;
+    std::string cnn_weights_path;
+    std::string features_model_path;
+    PosteriorgramPrecision precision = Float32Precision;
+    int num_note_threads = 1;
+    float features_tolerance = 1e-4f;
+    float posteriorgram_tolerance = 1e-4f;
+    int frame_tolerance = 0;
+    int bend_tolerance = 0;
+};
+
+static constexpr char reference_magic[8] = "NPCONF2";
+
+// Basic Pitch defaults: onset threshold 0.5, frame threshold 0.3, minimum
+// note length 127.7 ms.
+static constexpr float note_sensibility = 0.7f;
+static constexpr float split_sensibility = 0.5f;
+static constexpr float min_note_duration_ms = 127.7f;
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+/**
+ * Models read from the model directory.
+ */
+struct Models {
+    explicit Models(const std::string &model_dir)
+        : features_model(read_file(model_dir + "/features_model.ort")),
+          contour(read_file(model_dir + "/cnn_contour_model.json")),
+          note(read_file(model_dir + "/cnn_note_model.json")),
+          onset_1(read_file(model_dir + "/cnn_onset_1_model.json")),
+          onset_2(read_file(model_dir + "/cnn_onset_2_model.json")) {}
+
+    PitchDetectorModelFiles files() {
+        return {blob(features_model), blob(contour), blob(note),
+                blob(onset_1), blob(onset_2)};
+    }
+
+    std::vector<uint8_t> features_model;
+    std::vector<uint8_t> contour;
+    std::vector<uint8_t> note;
+    std::vector<uint8_t> onset_1;
+    std::vector<uint8_t> onset_2;
+};
+
+static float midi_to_hz(float midi_note) {
+    return 440.0f * std::pow(2.0f, (midi_note - 69.0f) / 12.0f);
+}
+
+/**
+ * Append a tone with a few harmonics, a short attack and an exponential
+ * decay.
+ * @param pitch Pitch of each sample in MIDI notes, for vibrato and glides.
+ */
+static void add_tone(std::vector<float> &audio, size_t start,
+                     const std::vector<float> &pitch, float amplitude) {
+    constexpr float two_pi = 6.28318530718f;
+    constexpr float attack_samples = 0.01f * AUDIO_SAMPLE_RATE;
+
+    if (audio.size() < start + pitch.size()) {
+        audio.resize(start + pitch.size(), 0.0f);
+    }
+
+    double phase = 0.0;
+    for (size_t i = 0; i < pitch.size(); i++) {
+        const float t = static_cast<float>(i);
+        const float envelope =
+            amplitude * std::min(t / attack_samples, 1.0f) *
+            std::exp(-2.0f * t / AUDIO_SAMPLE_RATE);
+        const auto p = static_cast<float>(phase);
+        audio[start + i] +=
+            envelope * (std::sin(p) + 0.5f * std::sin(2.0f * p) +
+                        0.25f * std::sin(3.0f * p));
+        phase += two_pi * midi_to_hz(pitch[i]) / AUDIO_SAMPLE_RATE;
+        phase = std::fmod(phase, static_cast<double>(two_pi));
+    }
+}
+
+static std::vector<float> constant_pitch(float midi_note, float seconds) {
+    return std::vector<float>(
+        static_cast<size_t>(seconds * AUDIO_SAMPLE_RATE), midi_note);
+}
+
+static size_t seconds_to_samples(float seconds) {
+    return static_cast<size_t>(seconds * AUDIO_SAMPLE_RATE);
+}
+
+/**
+ * @return Synthetic clips covering silence, single notes, chords, pitch
+ * bends, noise and transients.
+ */
+static std::vector<ReferenceClip> synthetic_clips() {
+    std::vector<ReferenceClip> clips;
+
+    auto add_clip = [&clips](const char *name, std::vector<float> audio) {
+        ReferenceClip clip;
+        clip.name = name;
+        clip.audio = std::move(audio);
+        clips.push_back(std::move(clip));
+    };
+
+    add_clip("silence", std::vector<float>(seconds_to_samples(2.0f), 0.0f));
+
+    std::vector<float> audio;
+    add_tone(audio, 0, constant_pitch(69.0f, 2.0f), 0.5f);
+    add_clip("single_note", audio);
+
+    audio.clear();
+    for (float note : {60.0f, 64.0f, 67.0f, 72.0f}) {
+        add_tone(audio, 0, constant_pitch(note, 2.0f), 0.2f);
+    }
+    add_clip("chord", audio);
+
+    // Chromatic scale with vibrato, then a glide: pitch bends.
+    audio.clear();
+    for (int n = 0; n < 8; n++) {
+        auto pitch = constant_pitch(48.0f + 3.0f * n, 0.3f);
+        for (size_t i = 0; i < pitch.size(); i++) {
+            pitch[i] += 0.4f * std::sin(6.28318530718f * 6.0f * i /
+                                        AUDIO_SAMPLE_RATE);
+        }
+        add_tone(audio, seconds_to_samples(0.3f * n), pitch, 0.4f);
+    }
+    auto glide = constant_pitch(60.0f, 1.0f);
+    for (size_t i = 0; i < glide.size(); i++) {
+        glide[i] += 1.5f * i / glide.size();
+    }
+    add_tone(audio, audio.size(), glide, 0.4f);
+    add_clip("vibrato_glide", audio);
+
+    // Random melody with overlapping notes over noise
+    audio.clear();
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<int> notes(36, 96);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    size_t start = 0;
+    for (int n = 0; n < 16; n++) {
+        const float seconds = 0.1f + 0.5f * uniform(rng);
+        add_tone(audio, start,
+                 constant_pitch(static_cast<float>(notes(rng)), seconds),
+                 0.1f + 0.4f * uniform(rng));
+        start += seconds_to_samples(seconds * uniform(rng));
+    }
+    std::normal_distribution<float> noise(0.0f, 0.01f);
+    for (auto &x : audio) {
+        x += noise(rng);
+    }
+    add_clip("melody_noise", audio);
+
+    audio.assign(seconds_to_samples(2.0f), 0.0f);
+    for (size_t i = 0; i < audio.size(); i += seconds_to_samples(0.25f)) {
+        audio[i] = 0.9f;
+        audio[i + 1] = -0.9f;
+    }
+    add_clip("impulses", audio);
+
+    return clips;
+}
+
+template <typename T>
+static void write_values(std::FILE *file, const T *values, size_t count) {
+    std::fwrite(values, sizeof(T), count, file);
+}
+
+template <typename T> static void write_value(std::FILE *file, T value) {
+    write_values(file, &value, 1);
+}
+
+template <typename T>
+static bool read_values(std::FILE *file, T *values, size_t count) {
+    return std::fread(values, sizeof(T), count, file) == count;
+}
+
+template <typename T> static bool read_value(std::FILE *file, T &value) {
+    return read_values(file, &value, 1);
+}
+
+template <typename T>
+static bool read_vector(std::FILE *file, std::vector<T> &values,
+                        size_t count) {
+    // Sizes come from the file: refuse ones that can't fit in it.
+    constexpr size_t max_count = size_t(1) << 34;
+    if (count > max_count / sizeof(T)) {
+        return false;
+    }
+    values.resize(count);
+    return read_values(file, values.data(), count);
+}
+
+/**
+ * @return Number of frames stored for a clip of num_frames frames.
+ */
+static size_t num_stored_frames(size_t num_frames, uint32_t frame_stride) {
+    return (num_frames + frame_stride - 1) / frame_stride;
+}
+
+/**
+ * Keep the stages of one frame every frame_stride frames.
+ */
+static void keep_stored_frames(ReferenceClip &clip, uint32_t frame_stride) {
+    auto keep = [&clip, frame_stride](std::vector<float> &values) {
+        if (values.empty() || frame_stride == 1) {
+            return;
+        }
+        const size_t frame_size = values.size() / clip.num_frames;
+        const size_t num_frames =
+            num_stored_frames(clip.num_frames, frame_stride);
+        for (size_t i = 1; i < num_frames; i++) {
+            std::copy_n(values.begin() + i * frame_stride * frame_size,
+                        frame_size, values.begin() + i * frame_size);
+        }
+        values.resize(num_frames * frame_size);
+    };
+    keep(clip.features);
+    keep(clip.contours);
+    keep(clip.notes);
+    keep(clip.onsets);
+}
+
+/**
+ * @return Scale of the 16-bit samples of the audio: its peak maps to 32767.
+ */
+static float audio_scale(const std::vector<float> &audio) {
+    float peak = 0.0f;
+    for (const float x : audio) {
+        peak = std::max(peak, std::abs(x));
+    }
+    return peak > 0.0f ? peak / 32767.0f : 1.0f;
+}
+
+/**
+ * Round the audio to the 16-bit samples it is stored as.
+ */
+static void quantize_audio(std::vector<float> &audio) {
+    const float scale = audio_scale(audio);
+    for (auto &x : audio) {
+        x = static_cast<float>(std::lrint(x / scale)) * scale;
+    }
+}
+
+static void write_clip(std::FILE *file, const ReferenceClip &clip) {
+    write_value<uint32_t>(file, static_cast<uint32_t>(clip.name.size()));
+    write_values(file, clip.name.data(), clip.name.size());
+    const float scale = audio_scale(clip.audio);
+    std::vector<int16_t> samples(clip.audio.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = static_cast<int16_t>(std::lrint(clip.audio[i] / scale));
+    }
+    write_value<uint64_t>(file, samples.size());
+    write_value(file, scale);
+    write_values(file, samples.data(), samples.size());
+    write_value<uint64_t>(file, clip.num_frames);
+    write_values(file, clip.features.data(), clip.features.size());
+    write_value<uint8_t>(file, clip.contours.empty() ? 0 : 1);
+    write_values(file, clip.contours.data(), clip.contours.size());
+    write_values(file, clip.notes.data(), clip.notes.size());
+    write_values(file, clip.onsets.data(), clip.onsets.size());
+
+    write_value<uint64_t>(file, clip.events.size());
+    for (const auto &event : clip.events) {
+        write_value(file, event.start_frame);
+        write_value(file, event.end_frame);
+        write_value(file, event.midi_note_number);
+        write_value(file, event.amplitude);
+        write_value<uint32_t>(file, static_cast<uint32_t>(event.bends.size()));
+        write_values(file, event.bends.data(), event.bends.size());
+    }
+}
+
+static bool read_clip(std::FILE *file, uint32_t frame_stride,
+                      ReferenceClip &clip) {
+    uint32_t name_size = 0;
+    uint64_t num_samples = 0;
+    float scale = 0.0f;
+    std::vector<int16_t> samples;
+    uint64_t num_frames = 0;
+    uint8_t has_contours = 0;
+    uint64_t num_events = 0;
+
+    if (!read_value(file, name_size) || name_size > 4096) {
+        return false;
+    }
+    clip.name.resize(name_size);
+    if (!read_values(file, clip.name.data(), name_size) ||
+        !read_value(file, num_samples) || !read_value(file, scale) ||
+        !read_vector(file, samples, num_samples) ||
+        !read_value(file, num_frames)) {
+        return false;
+    }
+    const size_t stored = num_stored_frames(num_frames, frame_stride);
+    if (!read_vector(file, clip.features,
+                     stored * NUM_HARMONICS * NUM_FREQ_IN) ||
+        !read_value(file, has_contours) ||
+        !read_vector(file, clip.contours,
+                     has_contours ? stored * NUM_FREQ_IN : 0) ||
+        !read_vector(file, clip.notes, stored * NUM_FREQ_OUT) ||
+        !read_vector(file, clip.onsets, stored * NUM_FREQ_OUT) ||
+        !read_value(file, num_events)) {
+        return false;
+    }
+    clip.num_frames = num_frames;
+    clip.audio.resize(samples.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        clip.audio[i] = static_cast<float>(samples[i]) * scale;
+    }
+
+    clip.events.resize(num_events);
+    for (auto &event : clip.events) {
+        uint32_t num_bends = 0;
+        if (!read_value(file, event.start_frame) ||
+            !read_value(file, event.end_frame) ||
+            !read_value(file, event.midi_note_number) ||
+            !read_value(file, event.amplitude) ||
+            !read_value(file, num_bends) ||
+            !read_vector(file, event.bends, num_bends)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::vector<float>
+flatten(const std::vector<std::vector<float>> &frames) {
+    std::vector<float> out;
+    for (const auto &frame : frames) {
+        out.insert(out.end(), frame.begin(), frame.end());
+    }
+    return out;
+}
+
+/**
+ * Outputs of all stages for one clip.
+ */
+static void run_clip(Features &features, PitchDetector &detector,
+                     ReferenceClip &clip) {
+    auto audio = clip.audio;
+
+    size_t num_frames = 0;
+    const float *stacked_cqt = features.compute_features(
+        audio.data(), audio.size(), num_frames);
+    clip.num_frames = num_frames;
+    clip.features.assign(stacked_cqt,
+                         stacked_cqt +
+                             num_frames * NUM_HARMONICS * NUM_FREQ_IN);
+
+    detector.transcribe_to_midi(audio.data(), static_cast<int>(audio.size()));
+
+    std::vector<std::vector<float>> contours, notes, onsets;
+    detector.latest_posteriorgrams(contours, notes, onsets);
+    clip.contours = flatten(contours);
+    clip.notes = flatten(notes);
+    clip.onsets = flatten(onsets);
+
+    clip.events.clear();
+    for (const auto &event : detector.latest_note_events()) {
+        clip.events.push_back({event.start_frame, event.end_frame,
+                               event.midi_note_number, event.amplitude,
+                               {event.bends.begin(), event.bends.end()}});
+    }
+}
+
+static std::unique_ptr<PitchDetector> create_detector(const Options &options,
+                                                      Models &models) {
+    std::unique_ptr<PitchDetector> detector;
+    if (options.cnn_weights_path.empty()) {
+        detector = std::make_unique<PitchDetector>(models.files());
+    } else {
+        const auto features_model_path =
+            options.model_dir + "/features_model.ort";
+        detector = PitchDetector::from_files(features_model_path.c_str(),
+                                             options.cnn_weights_path.c_str());
+        if (!detector) {
+            fprintf(stderr, "Can't load %s\n",
+                    options.cnn_weights_path.c_str());
+            exit(1);
+        }
+    }
+
+    detector->set_parameters(note_sensibility, split_sensibility,
+                             min_note_duration_ms);
+    detector->set_pitch_bend(MultiPitchBend);
+    detector->set_posteriorgram_precision(options.precision);
+    detector->set_num_note_threads(options.num_note_threads);
+    return detector;
+}
+
+static int record(const Options &options) {
+    auto clips = synthetic_clips();
+    for (const auto &path : options.wav_paths) {
+        ReferenceClip clip;
+        clip.name = path.substr(path.find_last_of('/') + 1);
+        const char *error = read_wav_file(path.c_str(), clip.audio);
+        if (error != nullptr) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), error);
+            return 1;
+        }
+        // The features model needs about 1.5 s of audio: pad short clips
+        // with silence to one window.
+        clip.audio.resize(std::max(clip.audio.size(),
+                                   seconds_to_samples(AUDIO_WINDOW_LENGTH)),
+                          0.0f);
+        clips.push_back(std::move(clip));
+    }
+    for (auto &clip : clips) {
+        quantize_audio(clip.audio);
+    }
+
+    // Reference configuration
+    set_cpu_level(CpuGeneric);
+    Models models(options.model_dir);
+    Options reference_options = options;
+    reference_options.cnn_weights_path.clear();
+    reference_options.precision = Float32Precision;
+    reference_options.num_note_threads = 1;
+
+    Features features(blob(models.features_model));
+    auto detector = create_detector(reference_options, models);
+
+    std::FILE *file = std::fopen(options.reference_path.c_str(), "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Can't write %s\n", options.reference_path.c_str());
+        return 1;
+    }
+    write_values(file, reference_magic, sizeof(reference_magic));
+    write_value(file, options.frame_stride);
+    write_value<uint32_t>(file, static_cast<uint32_t>(clips.size()));
+
+    for (auto &clip : clips) {
+        run_clip(features, *detector, clip);
+        keep_stored_frames(clip, options.frame_stride);
+        write_clip(file, clip);
+        printf("%-24s %6zu frames %5zu events\n", clip.name.c_str(),
+               clip.num_frames, clip.events.size());
+    }
+
+    const bool ok = std::ferror(file) == 0;
+    if (std::fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Can't write %s\n", options.reference_path.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @return Maximum absolute difference, infinity if the sizes differ.
+ */
+static float max_difference(const std::vector<float> &a,
+                            const std::vector<float> &b) {
+    if (a.size() != b.size()) {
+        return INFINITY;
+    }
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < a.size(); i++) {
+        // NaN compares false: count it as a mismatch.
+        const float diff = std::abs(a[i] - b[i]);
+        max_diff = diff <= max_diff ? max_diff : diff;
+    }
+    return max_diff;
+}
+
+/**
+ * @return Largest difference between two pitch bend lists, INT_MAX if their
+ * lengths differ.
+ */
+static int bends_difference(const std::vector<int32_t> &a,
+                            const std::vector<int32_t> &b) {
+    if (a.size() != b.size()) {
+        return INT_MAX;
+    }
+    int max_diff = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        max_diff = std::max(max_diff, std::abs(a[i] - b[i]));
+    }
+    return max_diff;
+}
+
+/**
+ * Compare events with boundaries allowed to move: each expected event must
+ * have an unmatched actual event of the same pitch with start and end frames
+ * within the tolerance. Amplitudes and pitch bends are only compared when
+ * the frames are the same.
+ * @return Description of the first mismatch, empty if the events match.
+ */
+static std::string
+compare_moved_events(const std::vector<ReferenceEvent> &expected,
+                     const std::vector<ReferenceEvent> &actual,
+                     float amplitude_tolerance, int frame_tolerance,
+                     int bend_tolerance) {
+    char message[256];
+    std::vector<bool> is_matched(actual.size(), false);
+    for (size_t i = 0; i < expected.size(); i++) {
+        const auto &e = expected[i];
+        size_t match = actual.size();
+        for (size_t j = 0; j < actual.size() && match == actual.size(); j++) {
+            const auto &a = actual[j];
+            if (!is_matched[j] && a.midi_note_number == e.midi_note_number &&
+                std::abs(a.start_frame - e.start_frame) <= frame_tolerance &&
+                std::abs(a.end_frame - e.end_frame) <= frame_tolerance) {
+                match = j;
+            }
+        }
+        if (match == actual.size()) {
+            snprintf(message, sizeof(message),
+                     "event %zu: no event within %d frames of %d-%d note %d",
+                     i, frame_tolerance, e.start_frame, e.end_frame,
+                     e.midi_note_number);
+            return message;
+        }
+        is_matched[match] = true;
+
+        const auto &a = actual[match];
+        if (a.start_frame != e.start_frame || a.end_frame != e.end_frame) {
+            continue;
+        }
+        if (!(std::abs(e.amplitude - a.amplitude) <= amplitude_tolerance)) {
+            snprintf(message, sizeof(message),
+                     "event %zu: amplitude %.6f, expected %.6f", i,
+                     a.amplitude, e.amplitude);
+            return message;
+        }
+        if (!(bends_difference(e.bends, a.bends) <= bend_tolerance)) {
+            snprintf(message, sizeof(message),
+                     "event %zu: pitch bends differ by %d", i,
+                     bends_difference(e.bends, a.bends));
+            return message;
+        }
+    }
+
+    if (expected.size() != actual.size()) {
+        snprintf(message, sizeof(message), "%zu events, expected %zu",
+                 actual.size(), expected.size());
+        return message;
+    }
+    return {};
+}
+
+/**
+ * @param frame_tolerance Frames note boundaries may move by, see
+ * compare_moved_events. 0 for exact frames.
+ * @param bend_tolerance Maximum difference of each pitch bend.
+ * @return Description of the first mismatch, empty if the events match.
+ */
+static std::string compare_events(const std::vector<ReferenceEvent> &expected,
+                                  const std::vector<ReferenceEvent> &actual,
+                                  float amplitude_tolerance,
+                                  int frame_tolerance, int bend_tolerance) {
+    if (frame_tolerance > 0) {
+        return compare_moved_events(expected, actual, amplitude_tolerance,
+                                    frame_tolerance, bend_tolerance);
+    }
+
+    char message[256];
+    for (size_t i = 0; i < std::min(expected.size(), actual.size()); i++) {
+        const auto &e = expected[i];
+        const auto &a = actual[i];
+        if (e.start_frame != a.start_frame || e.end_frame != a.end_frame ||
+            e.midi_note_number != a.midi_note_number) {
+            snprintf(message, sizeof(message),
+                     "event %zu: frames %d-%d note %d, expected %d-%d note %d",
+                     i, a.start_frame, a.end_frame, a.midi_note_number,
+                     e.start_frame, e.end_frame, e.midi_note_number);
+            return message;
+        }
+        if (!(std::abs(e.amplitude - a.amplitude) <= amplitude_tolerance)) {
+            snprintf(message, sizeof(message),
+                     "event %zu: amplitude %.6f, expected %.6f", i,
+                     a.amplitude, e.amplitude);
+            return message;
+        }
+        if (!(bends_difference(e.bends, a.bends) <= bend_tolerance)) {
+            snprintf(message, sizeof(message),
+                     "event %zu: pitch bends differ by %d", i,
+                     bends_difference(e.bends, a.bends));
+            return message;
+        }
+    }
+
+    if (expected.size() != actual.size()) {
+        snprintf(message, sizeof(message), "%zu events, expected %zu",
+                 actual.size(), expected.size());
+        return message;
+    }
+    return {};
+}
+
+static int check(const Options &options) {
+    std::FILE *file = std::fopen(options.reference_path.c_str(), "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Can't open %s\n", options.reference_path.c_str());
+        return 1;
+    }
+
+    char magic[sizeof(reference_magic)];
+    uint32_t frame_stride = 0;
+    uint32_t num_clips = 0;
+    std::vector<ReferenceClip> references;
+    bool ok = read_values(file, magic, sizeof(magic)) &&
+              std::memcmp(magic, reference_magic, sizeof(magic)) == 0 &&
+              read_value(file, frame_stride) && frame_stride > 0 &&
+              read_value(file, num_clips);
+    for (uint32_t i = 0; ok && i < num_clips; i++) {
+        references.emplace_back();
+        ok = read_clip(file, frame_stride, references.back());
+    }
+    std::fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s is not a valid reference file\n",
+                options.reference_path.c_str());
+        return 1;
+    }
+
+    if (options.cpu_level >= 0) {
+        set_cpu_level(options.cpu_level);
+    }
+    Models models(options.model_dir);
+    Features features(blob(models.features_model));
+    auto detector = create_detector(options, models);
+
+    if (!options.features_model_path.empty()) {
+        // Stages are compared below, load it whatever its difference.
+        auto features_model = read_file(options.features_model_path);
+        if (!features.use_optimized_model(blob(features_model), INFINITY) ||
+            !detector->use_optimized_features_model(
+                options.features_model_path.c_str(), INFINITY)) {
+            fprintf(stderr, "Can't use %s\n",
+                    options.features_model_path.c_str());
+            return 1;
+        }
+    }
+
+    printf("cpu level %s, %s features model, %s weights, %s posteriorgrams, "
+           "%d note threads\n",
+           cpu_level_name(cpu_level()),
+           options.features_model_path.empty() ? "reference" : "optimized",
+           options.cnn_weights_path.empty() ? "json" : "prepacked",
+           options.precision == Float32Precision   ? "float32"
+           : options.precision == Float16Precision ? "float16"
+                                                   : "bfloat16",
+           options.num_note_threads);
+
+    int num_failures = 0;
+    for (const auto &reference : references) {
+        ReferenceClip clip;
+        clip.name = reference.name;
+        clip.audio = reference.audio;
+        run_clip(features, *detector, clip);
+        if (clip.num_frames != reference.num_frames) {
+            num_failures++;
+            printf("%-24s %zu frames, expected %zu FAIL\n", clip.name.c_str(),
+                   clip.num_frames, reference.num_frames);
+            continue;
+        }
+        keep_stored_frames(clip, frame_stride);
+
+        struct Stage {
+            const char *name;
+            float max_diff;
+            float tolerance;
+        };
+        const Stage stages[] = {
+            {"features", max_difference(reference.features, clip.features),
+             options.features_tolerance},
+            {"contours", max_difference(reference.contours, clip.contours),
+             options.posteriorgram_tolerance},
+            {"notes", max_difference(reference.notes, clip.notes),
+             options.posteriorgram_tolerance},
+            {"onsets", max_difference(reference.onsets, clip.onsets),
+             options.posteriorgram_tolerance},
+        };
+
+        for (const auto &stage : stages) {
+            const bool pass = stage.max_diff <= stage.tolerance;
+            num_failures += pass ? 0 : 1;
+            printf("%-24s %-10s max diff %.2e (tolerance %.0e) %s\n",
+                   clip.name.c_str(), stage.name, stage.max_diff,
+                   stage.tolerance, pass ? "ok" : "FAIL");
+        }
+
+        const auto mismatch =
+            compare_events(reference.events, clip.events,
+                           options.posteriorgram_tolerance,
+                           options.frame_tolerance, options.bend_tolerance);
+        num_failures += mismatch.empty() ? 0 : 1;
+        printf("%-24s %-10s %zu events %s\n", clip.name.c_str(), "events",
+               clip.events.size(),
+               mismatch.empty() ? "ok" : ("FAIL: " + mismatch).c_str());
+    }
+
+    printf("%s: %d failures\n", num_failures == 0 ? "PASS" : "FAIL",
+           num_failures);
+    return num_failures == 0 ? 0 : 1;
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    if (argc < 2) {
+        return false;
+    }
+    options.mode = argv[1];
+
+    std::vector<std::string> positional;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc) {
+            const std::string value = argv[++i];
+            if ((arg[1] == 's') != (options.mode == "record")) {
+                return false;
+            }
+            switch (arg[1]) {
+            case 's':
+                options.frame_stride =
+                    static_cast<uint32_t>(std::max(std::stoi(value), 1));
+                break;
+            case 'c':
+                if (value == "generic") {
+                    options.cpu_level = CpuGeneric;
+                } else if (value == "avx2") {
+                    options.cpu_level = CpuAvx2;
+                } else if (value == "avx512") {
+                    options.cpu_level = CpuAvx512;
+                } else {
+                    return false;
+                }
+                break;
+            case 'w':
+                options.cnn_weights_path = value;
+                break;
+            case 'm':
+                options.features_model_path = value;
+                break;
+            case 'p':
+                if (value == "float32") {
+                    options.precision = Float32Precision;
+                } else if (value == "float16") {
+                    options.precision = Float16Precision;
+                } else if (value == "bfloat16") {
+                    options.precision = BFloat16Precision;
+                } else {
+                    return false;
+                }
+                break;
+            case 't':
+                options.num_note_threads = std::stoi(value);
+                break;
+            case 'f':
+                options.features_tolerance = std::stof(value);
+                break;
+            case 'o':
+                options.posteriorgram_tolerance = std::stof(value);
+                break;
+            case 'b':
+                options.frame_tolerance = std::stoi(value);
+                break;
+            case 'e':
+                options.bend_tolerance = std::stoi(value);
+                break;
+            default:
+                return false;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() < 2 ||
+        (options.mode == "check" && positional.size() != 2) ||
+        (options.mode != "check" && options.mode != "record")) {
+        return false;
+    }
+    options.model_dir = positional[0];
+    options.reference_path = positional[1];
+    options.wav_paths.assign(positional.begin() + 2, positional.end());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr,
+                "Usage: %s record [-s frame_stride] <model_data directory> "
+                "<reference file> [wav files]\n"
+                "       %s check [-c generic|avx2|avx512] [-w cnn_weight_file] "
+                "[-m features_model] [-p float32|float16|bfloat16] "
+                "[-t num_note_threads] [-f features_tolerance] "
+                "[-o posteriorgram_tolerance] [-b boundary_frames] "
+                "<model_data directory> <reference file>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    return options.mode == "record" ? record(options) : check(options);
+}
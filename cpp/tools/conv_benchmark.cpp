@@ -0,0 +1,170 @@
+// Benchmark of the CNN layers: RTNeural models, as PitchCnn used to run
+// them, against Conv2d with the generic loop and with the specialized
+// kernels.
+//
+// Usage: conv_benchmark <model_data directory> [num_frames]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "RTNeural/RTNeural.h"
+
+#include "source/constants.h"
+#include "source/conv2d.h"
+#include "source/cpu_features.h"
+
+using json = nlohmann::json;
+
+using CnnContourModel = RTNeural::ModelT<
+    float, NUM_FREQ_IN * NUM_HARMONICS, NUM_FREQ_IN,
+    RTNeural::Conv2DT<float, NUM_HARMONICS, 8, NUM_FREQ_IN, 3, 39, 1, 1, false>,
+    RTNeural::ReLuActivationT<float, 8 * NUM_FREQ_IN>,
+    RTNeural::Conv2DT<float, 8, 1, NUM_FREQ_IN, 5, 5, 1, 1, false>,
+    RTNeural::SigmoidActivationT<float, NUM_FREQ_IN>>;
+
+using CnnNoteModel = RTNeural::ModelT<
+    float, NUM_FREQ_IN, NUM_FREQ_OUT,
+    RTNeural::Conv2DT<float, 1, 32, NUM_FREQ_IN, 7, 7, 1, 3, false>,
+    RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>,
+    RTNeural::Conv2DT<float, 32, 1, NUM_FREQ_OUT, 7, 3, 1, 1, false>,
+    RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
+
+using CnnOnsetInputModel = RTNeural::ModelT<
+    float, NUM_FREQ_IN * NUM_HARMONICS, 32 * NUM_FREQ_OUT,
+    RTNeural::Conv2DT<float, 8, 32, NUM_FREQ_IN, 5, 5, 1, 3, false>,
+    RTNeural::ReLuActivationT<float, 32 * NUM_FREQ_OUT>>;
+
+using CnnOnsetOutputModel = RTNeural::ModelT<
+    float, 33 * NUM_FREQ_OUT, NUM_FREQ_OUT,
+    RTNeural::Conv2DT<float, 33, 1, NUM_FREQ_OUT, 3, 3, 1, 1, false>,
+    RTNeural::SigmoidActivationT<float, NUM_FREQ_OUT>>;
+
+static json read_json(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return json::parse(file);
+}
+
+/**
+ * @return Mean time of one call in microseconds.
+ */
+static double time_us(const std::function<void()> &run, int num_frames) {
+    // Warm up caches
+    for (int i = 0; i < 16; i++) {
+        run();
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_frames; i++) {
+        run();
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::micro>(end - start).count() /
+           num_frames;
+}
+
+template <typename RTNeuralModel>
+static void benchmark_model(const char *name, const json &model_json,
+                            int num_frames) {
+    const auto num_inputs = (size_t)model_json.at("layers")
+                                .at(0)
+                                .at("num_features_in")
+                                .get<int>() *
+                            model_json.at("layers")
+                                .at(0)
+                                .at("num_filters_in")
+                                .get<int>();
+
+    std::vector<float> input(num_inputs);
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    for (auto &x : input) {
+        x = uniform(rng);
+    }
+
+    auto rtneural_model = std::make_unique<RTNeuralModel>();
+    rtneural_model->parseJson(model_json);
+    rtneural_model->reset();
+
+    std::vector<Conv2d> generic_layers(model_json.at("layers").size());
+    std::vector<Conv2d> direct_layers(model_json.at("layers").size());
+    for (size_t i = 0; i < generic_layers.size(); i++) {
+        generic_layers[i].set_specialized_kernel(false);
+        generic_layers[i].load(model_json.at("layers").at(i));
+        direct_layers[i].load(model_json.at("layers").at(i));
+    }
+
+    auto run_layers = [&input](std::vector<Conv2d> &layers) {
+        const float *x = input.data();
+        for (auto &layer : layers) {
+            layer.forward(x);
+            x = layer.outputs();
+        }
+    };
+
+    const auto rtneural_us =
+        time_us([&] { rtneural_model->forward(input.data()); }, num_frames);
+    const auto generic_us =
+        time_us([&] { run_layers(generic_layers); }, num_frames);
+    const auto direct_us =
+        time_us([&] { run_layers(direct_layers); }, num_frames);
+
+    // Same number of frames went through all of them: outputs should match.
+    const auto num_outputs = (size_t)direct_layers.back().num_features_out() *
+                             direct_layers.back().num_channels_out();
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < num_outputs; i++) {
+        max_diff = std::max(
+            max_diff, std::abs(rtneural_model->getOutputs()[i] -
+                               direct_layers.back().outputs()[i]));
+        max_diff = std::max(
+            max_diff, std::abs(generic_layers.back().outputs()[i] -
+                               direct_layers.back().outputs()[i]));
+    }
+
+    printf("%-14s rtneural %8.2f us   generic %8.2f us   direct %8.2f us   "
+           "speedup %5.2fx   max diff %.2e\n",
+           name, rtneural_us, generic_us, direct_us, rtneural_us / direct_us,
+           max_diff);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <model_data directory> [num_frames]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const std::string model_dir = argv[1];
+    const int num_frames = (argc > 2) ? std::stoi(argv[2]) : 1000;
+
+    // NEURAL_PITCH_CPU_LEVEL selects the kernels to compare
+    printf("cpu level: %s (detected %s)\n", cpu_level_name(cpu_level()),
+           cpu_level_name(detected_cpu_level()));
+
+    benchmark_model<CnnContourModel>(
+        "contour", read_json(model_dir + "/cnn_contour_model.json"),
+        num_frames);
+    benchmark_model<CnnNoteModel>(
+        "note", read_json(model_dir + "/cnn_note_model.json"), num_frames);
+    benchmark_model<CnnOnsetInputModel>(
+        "onset input", read_json(model_dir + "/cnn_onset_1_model.json"),
+        num_frames);
+    benchmark_model<CnnOnsetOutputModel>(
+        "onset output", read_json(model_dir + "/cnn_onset_2_model.json"),
+        num_frames);
+
+    return 0;
+}
@@ -0,0 +1,478 @@
+// Load test of concurrent streams, to size hosts and to catch regressions
+// under contention: N streaming PitchDetectors are fed with synthetic audio,
+// in real time or faster, each from its own feeder thread.
+//
+// The latency of a chunk is the time from its push until the detector has
+// processed it (see PitchDetector::stream_num_samples_processed), polled
+// every millisecond. Most chunks only wait for the worker to pick them up,
+// the ones that complete a features window also wait for Features and the
+// CNN on the window. Throughput is audio processed over wall time, CPU use is
+// the process user and system time over wall time.
+// At full speed, latencies are mostly the backlog of the ring buffers and
+// throughput is the figure to read.
+//
+// Usage: load_test [options] <model_data directory>
+//   -n <num streams>          Default 8.
+//   -d <seconds>              Audio per stream, default 30.
+//   -s <speed>                Feeding speed, 1 for real time (default), 0 for
+//                             as fast as the ring buffers take it.
+//   -c <chunk ms>             Chunk length, default 20.
+//   -m <segments|online>      Note extraction of the stream, default
+//                             segments.
+//   -w <cnn weight file>      Load the models with PitchDetector::from_files
+//                             (see pack_cnn_weights) instead of the json
+//                             models: all detectors share the mapped files.
+//   -o <report file>          Also write the report as JSON.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "source/constants.h"
+#include "source/pitch_detector.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int num_streams = 8;
+    float seconds = 30.0f;
+    float speed = 1.0f;
+    float chunk_ms = 20.0f;
+    bool online_notes = false;
+    std::string cnn_weights_path;
+    std::string report_path;
+    std::string model_dir;
+};
+
+struct StreamResult {
+    std::vector<double> latencies_ms;
+    size_t num_samples_processed = 0;
+    size_t num_samples_dropped = 0;
+    size_t num_events = 0;
+};
+
+// Upper bounds of the latency histogram buckets, the last one is open.
+static constexpr double histogram_bounds_ms[] = {
+    0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+static constexpr size_t num_histogram_buckets =
+    std::size(histogram_bounds_ms) + 1;
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+/**
+ * @return Overlapping tones with a few harmonics over low noise, different
+ * for each seed.
+ */
+static std::vector<float> synthetic_audio(size_t num_samples,
+                                          unsigned seed) {
+    constexpr float two_pi = 6.28318530718f;
+
+    std::vector<float> audio(num_samples, 0.0f);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> notes(36, 96);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::normal_distribution<float> noise(0.0f, 0.005f);
+
+    size_t start = 0;
+    while (start < num_samples) {
+        const auto length = static_cast<size_t>(
+            (0.1f + 0.6f * uniform(rng)) * AUDIO_SAMPLE_RATE);
+        const float frequency =
+            440.0f *
+            std::pow(2.0f, static_cast<float>(notes(rng) - 69) / 12.0f);
+        const float amplitude = 0.05f + 0.2f * uniform(rng);
+        for (size_t i = 0; i < length && start + i < num_samples; i++) {
+            const float t = static_cast<float>(i) / AUDIO_SAMPLE_RATE;
+            const float envelope =
+                amplitude * std::min(t / 0.01f, 1.0f) * std::exp(-2.0f * t);
+            const float p = two_pi * frequency * t;
+            audio[start + i] +=
+                envelope * (std::sin(p) + 0.5f * std::sin(2.0f * p) +
+                            0.25f * std::sin(3.0f * p));
+        }
+        start += static_cast<size_t>(static_cast<float>(length) *
+                                     uniform(rng));
+    }
+
+    for (auto &x : audio) {
+        x += noise(rng);
+    }
+    return audio;
+}
+
+/**
+ * Feed one stream and measure the latency of its chunks.
+ */
+static void run_stream(PitchDetector &detector, const std::vector<float> &audio,
+                       const Options &options, Clock::time_point start_time,
+                       StreamResult &result) {
+    struct PendingChunk {
+        size_t end_sample;
+        Clock::time_point push_time;
+    };
+
+    const auto chunk_size = std::max<size_t>(
+        1, static_cast<size_t>(options.chunk_ms * AUDIO_SAMPLE_RATE / 1000));
+    const auto chunk_duration = std::chrono::duration<double>(
+        options.speed > 0 ? static_cast<double>(chunk_size) /
+                                AUDIO_SAMPLE_RATE / options.speed
+                          : 0.0);
+    constexpr auto poll_interval = std::chrono::milliseconds(1);
+
+    std::deque<PendingChunk> pending;
+    std::vector<StreamNoteEvent> events(256);
+    size_t num_pushed = 0;
+    size_t num_offered = 0;
+    size_t chunk_index = 0;
+
+    auto poll = [&]() {
+        const auto processed = detector.stream_num_samples_processed();
+        const auto now = Clock::now();
+        while (!pending.empty() && pending.front().end_sample <= processed) {
+            result.latencies_ms.push_back(
+                std::chrono::duration<double, std::milli>(
+                    now - pending.front().push_time)
+                    .count());
+            pending.pop_front();
+        }
+        result.num_events +=
+            detector.pop_stream_events(events.data(), events.size());
+        return processed;
+    };
+
+    while (num_offered < audio.size()) {
+        const auto push_time =
+            start_time +
+            std::chrono::duration_cast<Clock::duration>(chunk_duration *
+                                                        chunk_index);
+        while (Clock::now() < push_time) {
+            poll();
+            std::this_thread::sleep_until(
+                std::min(push_time, Clock::now() + poll_interval));
+        }
+
+        const size_t num_samples =
+            std::min(chunk_size, audio.size() - num_offered);
+        size_t num_accepted =
+            detector.push_audio(audio.data() + num_offered, num_samples);
+
+        // Faster than real time: wait for room in the ring buffer.
+        // Real time: the rest of the chunk is lost, as in an audio callback.
+        while (options.speed <= 0 && num_accepted < num_samples) {
+            poll();
+            std::this_thread::sleep_for(poll_interval);
+            num_accepted += detector.push_audio(
+                audio.data() + num_offered + num_accepted,
+                num_samples - num_accepted);
+        }
+
+        num_offered += num_samples;
+        result.num_samples_dropped += num_samples - num_accepted;
+        if (num_accepted > 0) {
+            num_pushed += num_accepted;
+            pending.push_back({num_pushed, Clock::now()});
+        }
+        chunk_index++;
+    }
+
+    // Wait for the last chunks. The frames of the last window are only
+    // computed by stop_stream, which is not part of the latency.
+    const auto drain_deadline = Clock::now() + std::chrono::seconds(60);
+    while (poll() < num_pushed && Clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(poll_interval);
+    }
+
+    detector.stop_stream();
+    poll();
+    result.num_samples_processed = detector.stream_num_samples_processed();
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const auto index = static_cast<size_t>(
+        std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::clamp<size_t>(index, 1, sorted.size()) - 1];
+}
+
+static double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           static_cast<double>(usage.ru_utime.tv_usec +
+                               usage.ru_stime.tv_usec) *
+               1e-6;
+}
+
+static double peak_rss_mb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<double>(usage.ru_maxrss) / (1 << 20);
+#else
+    return static_cast<double>(usage.ru_maxrss) / (1 << 10);
+#endif
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc) {
+            const std::string value = argv[++i];
+            switch (arg[1]) {
+            case 'n':
+                options.num_streams = std::stoi(value);
+                break;
+            case 'd':
+                options.seconds = std::stof(value);
+                break;
+            case 's':
+                options.speed = std::stof(value);
+                break;
+            case 'c':
+                options.chunk_ms = std::stof(value);
+                break;
+            case 'm':
+                if (value == "segments") {
+                    options.online_notes = false;
+                } else if (value == "online") {
+                    options.online_notes = true;
+                } else {
+                    return false;
+                }
+                break;
+            case 'w':
+                options.cnn_weights_path = value;
+                break;
+            case 'o':
+                options.report_path = value;
+                break;
+            default:
+                return false;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() != 1 || options.num_streams < 1 ||
+        options.seconds <= 0 || options.chunk_ms <= 0) {
+        return false;
+    }
+    options.model_dir = positional[0];
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr,
+                "Usage: %s [-n num_streams] [-d seconds] [-s speed] "
+                "[-c chunk_ms] [-m segments|online] [-w cnn_weight_file] "
+                "[-o report_file] <model_data directory>\n",
+                argv[0]);
+        return 1;
+    }
+
+    // Models are read once and shared by all detectors.
+    const std::string features_model_path =
+        options.model_dir + "/features_model.ort";
+    std::vector<uint8_t> features_model, contour, note, onset_1, onset_2;
+    if (options.cnn_weights_path.empty()) {
+        features_model = read_file(features_model_path);
+        contour = read_file(options.model_dir + "/cnn_contour_model.json");
+        note = read_file(options.model_dir + "/cnn_note_model.json");
+        onset_1 = read_file(options.model_dir + "/cnn_onset_1_model.json");
+        onset_2 = read_file(options.model_dir + "/cnn_onset_2_model.json");
+    }
+
+    const auto num_streams = static_cast<size_t>(options.num_streams);
+    const auto num_samples =
+        static_cast<size_t>(options.seconds * AUDIO_SAMPLE_RATE);
+
+    std::vector<std::vector<float>> audio(num_streams);
+    for (size_t i = 0; i < num_streams; i++) {
+        audio[i] = synthetic_audio(num_samples, static_cast<unsigned>(i));
+    }
+
+    const double rss_before_mb = peak_rss_mb();
+    std::vector<std::unique_ptr<PitchDetector>> detectors(num_streams);
+    for (auto &detector : detectors) {
+        if (options.cnn_weights_path.empty()) {
+            detector = std::make_unique<PitchDetector>(PitchDetectorModelFiles{
+                blob(features_model), blob(contour), blob(note),
+                blob(onset_1), blob(onset_2)});
+        } else {
+            detector = PitchDetector::from_files(
+                features_model_path.c_str(), options.cnn_weights_path.c_str());
+            if (!detector) {
+                fprintf(stderr, "Can't load %s\n",
+                        options.cnn_weights_path.c_str());
+                return 1;
+            }
+        }
+        // Basic Pitch defaults, as in conformance.
+        detector->set_parameters(0.7f, 0.5f, 127.7f);
+        // Ring buffers hold a features window and a few chunks at any speed.
+        detector->start_stream(1 << 17, options.online_notes);
+    }
+    const double rss_detectors_mb = peak_rss_mb() - rss_before_mb;
+
+    std::vector<StreamResult> results(num_streams);
+    std::vector<std::thread> feeders;
+    const double cpu_start = cpu_seconds();
+    const auto start_time = Clock::now();
+    for (size_t i = 0; i < num_streams; i++) {
+        feeders.emplace_back([&, i]() {
+            run_stream(*detectors[i], audio[i], options, start_time,
+                       results[i]);
+        });
+    }
+    for (auto &feeder : feeders) {
+        feeder.join();
+    }
+    const double wall_seconds =
+        std::chrono::duration<double>(Clock::now() - start_time).count();
+    const double cpu_used = (cpu_seconds() - cpu_start) / wall_seconds;
+
+    std::vector<double> latencies;
+    size_t num_processed = 0;
+    size_t num_dropped = 0;
+    size_t num_events = 0;
+    for (const auto &result : results) {
+        latencies.insert(latencies.end(), result.latencies_ms.begin(),
+                         result.latencies_ms.end());
+        num_processed += result.num_samples_processed;
+        num_dropped += result.num_samples_dropped;
+        num_events += result.num_events;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    size_t histogram[num_histogram_buckets] = {};
+    for (double latency : latencies) {
+        const auto bucket =
+            std::lower_bound(std::begin(histogram_bounds_ms),
+                             std::end(histogram_bounds_ms), latency) -
+            std::begin(histogram_bounds_ms);
+        histogram[bucket]++;
+    }
+
+    const double mean_ms =
+        latencies.empty()
+            ? 0.0
+            : std::accumulate(latencies.begin(), latencies.end(), 0.0) /
+                  static_cast<double>(latencies.size());
+    const double audio_seconds =
+        static_cast<double>(num_processed) / AUDIO_SAMPLE_RATE;
+    const double throughput = audio_seconds / wall_seconds;
+    const unsigned num_cores =
+        std::max(1u, std::thread::hardware_concurrency());
+
+    char speed[32] = "full speed";
+    if (options.speed > 0) {
+        snprintf(speed, sizeof(speed), "%gx real time", options.speed);
+    }
+    printf("%zu streams, %.1f s of audio each at %s, %.0f ms chunks, %s\n",
+           num_streams, options.seconds, speed, options.chunk_ms,
+           options.online_notes ? "online notes" : "segments");
+    printf("chunk latency (%zu chunks): mean %.2f ms, p50 %.2f, p90 %.2f, "
+           "p99 %.2f, p99.9 %.2f, max %.2f\n",
+           latencies.size(), mean_ms, percentile(latencies, 50),
+           percentile(latencies, 90), percentile(latencies, 99),
+           percentile(latencies, 99.9), percentile(latencies, 100));
+    for (size_t i = 0; i < num_histogram_buckets; i++) {
+        if (i < std::size(histogram_bounds_ms)) {
+            printf("  <= %6.1f ms", histogram_bounds_ms[i]);
+        } else {
+            printf("   > %6.1f ms", histogram_bounds_ms[i - 1]);
+        }
+        printf(" %8zu  %5.1f%%\n", histogram[i],
+               latencies.empty() ? 0.0
+                                 : 100.0 * static_cast<double>(histogram[i]) /
+                                       static_cast<double>(latencies.size()));
+    }
+    printf("throughput: %.1f s of audio in %.2f s, %.1fx real time "
+           "(%.2fx per stream)\n",
+           audio_seconds, wall_seconds, throughput,
+           throughput / static_cast<double>(num_streams));
+    printf("cpu: %.2f cores busy of %u (%.0f%%)\n", cpu_used, num_cores,
+           100.0 * cpu_used / num_cores);
+    printf("memory: peak rss %.1f MB, detectors %.1f MB (%.1f MB each)\n",
+           peak_rss_mb(), rss_detectors_mb,
+           rss_detectors_mb / static_cast<double>(num_streams));
+    printf("%zu samples dropped, %zu note events\n", num_dropped, num_events);
+
+    if (options.report_path.empty()) {
+        return 0;
+    }
+
+    std::FILE *report = std::fopen(options.report_path.c_str(), "w");
+    if (report == nullptr) {
+        fprintf(stderr, "Can't write %s\n", options.report_path.c_str());
+        return 1;
+    }
+    fprintf(report,
+            "{\n  \"streams\": %zu,\n  \"seconds_per_stream\": %g,\n"
+            "  \"speed\": %g,\n  \"chunk_ms\": %g,\n"
+            "  \"online_notes\": %s,\n  \"prepacked_weights\": %s,\n",
+            num_streams, options.seconds, options.speed, options.chunk_ms,
+            options.online_notes ? "true" : "false",
+            options.cnn_weights_path.empty() ? "false" : "true");
+    fprintf(report,
+            "  \"latency_ms\": {\"chunks\": %zu, \"mean\": %.4f, "
+            "\"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"p999\": %.4f, "
+            "\"max\": %.4f},\n",
+            latencies.size(), mean_ms, percentile(latencies, 50),
+            percentile(latencies, 90), percentile(latencies, 99),
+            percentile(latencies, 99.9), percentile(latencies, 100));
+    fprintf(report, "  \"latency_histogram_ms\": [");
+    for (size_t i = 0; i < num_histogram_buckets; i++) {
+        if (i < std::size(histogram_bounds_ms)) {
+            fprintf(report, "%s{\"le\": %g, \"count\": %zu}",
+                    i > 0 ? ", " : "", histogram_bounds_ms[i], histogram[i]);
+        } else {
+            fprintf(report, ", {\"le\": null, \"count\": %zu}", histogram[i]);
+        }
+    }
+    fprintf(report,
+            "],\n  \"wall_seconds\": %.3f,\n  \"audio_seconds\": %.3f,\n"
+            "  \"throughput_real_time\": %.3f,\n  \"cpu_cores_busy\": %.3f,\n"
+            "  \"host_cores\": %u,\n  \"peak_rss_mb\": %.1f,\n"
+            "  \"detectors_rss_mb\": %.1f,\n  \"samples_dropped\": %zu,\n"
+            "  \"note_events\": %zu\n}\n",
+            wall_seconds, audio_seconds, throughput, cpu_used, num_cores,
+            peak_rss_mb(), rss_detectors_mb, num_dropped, num_events);
+
+    const bool ok = std::ferror(report) == 0;
+    if (std::fclose(report) != 0 || !ok) {
+        fprintf(stderr, "Can't write %s\n", options.report_path.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+// Save a graph optimized features model, for
+// PitchDetector::use_optimized_features_model: graph optimizations are then
+// not run at startup. The input can be the reference model or a float16 or
+// int8 variant of it (see quantize_features_model.py). The saved model is
+// checked against the reference model and timed.
+//
+// Usage: optimize_features_model [options] <input model> <output model>
+//   -r <reference model>        Default: the input model.
+//   -t <tolerance>              Maximum features difference, default 1e-3.
+//   -l <basic|extended|all>     Graph optimizations, default extended. all
+//                               adds layout optimizations specific to the
+//                               CPU the model is optimized on.
+//
+// The output is in ORT format if its name ends with .ort, ONNX otherwise.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <onnxruntime_cxx_api.h>
+#include <onnxruntime_session_options_config_keys.h>
+#include <string>
+#include <vector>
+
+#include "source/constants.h"
+#include "source/features.h"
+
+struct Options {
+    std::string input_path;
+    std::string output_path;
+    std::string reference_path;
+    float tolerance = Features::default_optimized_model_tolerance;
+    GraphOptimizationLevel level = ORT_ENABLE_EXTENDED;
+};
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+static bool ends_with(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * @return Best time of a few runs of compute_features on 30 seconds of
+ * tones, in ms.
+ */
+static double time_features(Features &features) {
+    std::vector<float> audio(30 * AUDIO_SAMPLE_RATE);
+    for (size_t i = 0; i < audio.size(); i++) {
+        const float t = static_cast<float>(i) / AUDIO_SAMPLE_RATE;
+        const float frequency = 110.0f * (1.0f + std::floor(t * 2.0f) / 8.0f);
+        audio[i] = 0.5f * std::sin(6.28318530718f * frequency * t);
+    }
+
+    double best_ms = INFINITY;
+    for (int run = 0; run < 3; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        size_t num_frames = 0;
+        features.compute_features(audio.data(), audio.size(), num_frames);
+        features.release_features();
+        best_ms = std::min(
+            best_ms, std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+    }
+    return best_ms;
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc) {
+            const std::string value = argv[++i];
+            switch (arg[1]) {
+            case 'r':
+                options.reference_path = value;
+                break;
+            case 't':
+                options.tolerance = std::stof(value);
+                break;
+            case 'l':
+                if (value == "basic") {
+                    options.level = ORT_ENABLE_BASIC;
+                } else if (value == "extended") {
+                    options.level = ORT_ENABLE_EXTENDED;
+                } else if (value == "all") {
+                    options.level = ORT_ENABLE_ALL;
+                } else {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() != 2) {
+        return false;
+    }
+    options.input_path = positional[0];
+    options.output_path = positional[1];
+    if (options.reference_path.empty()) {
+        options.reference_path = options.input_path;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr,
+                "Usage: %s [-r <reference model>] [-t <tolerance>] "
+                "[-l <basic|extended|all>] <input model> <output model>\n",
+                argv[0]);
+        return 1;
+    }
+
+    auto input = read_file(options.input_path);
+    auto reference = read_file(options.reference_path);
+
+    // Creating the session saves the optimized graph.
+    {
+        Ort::Env env;
+        Ort::SessionOptions session_options;
+        session_options.SetGraphOptimizationLevel(options.level);
+        session_options.SetOptimizedModelFilePath(
+            options.output_path.c_str());
+        if (ends_with(options.output_path, ".ort")) {
+            session_options.AddConfigEntry(
+                kOrtSessionOptionsConfigSaveModelFormat, "ORT");
+        }
+        Ort::Session session(env, input.data(), input.size(),
+                             session_options);
+    }
+
+    auto output = read_file(options.output_path);
+
+    Features features(blob(reference));
+    const double reference_ms = time_features(features);
+
+    float max_difference = 0.0f;
+    if (!features.use_optimized_model(blob(output), options.tolerance, false,
+                                      &max_difference)) {
+        fprintf(stderr,
+                "%s: features differ by %.2e from %s, over the tolerance "
+                "%.0e\n",
+                options.output_path.c_str(), max_difference,
+                options.reference_path.c_str(), options.tolerance);
+        return 1;
+    }
+    const double optimized_ms = time_features(features);
+
+    printf("%s: %zu bytes, max features difference %.2e\n",
+           options.output_path.c_str(), output.size(), max_difference);
+    printf("30 s of audio: reference %.1f ms, optimized %.1f ms\n",
+           reference_ms, optimized_ms);
+    return 0;
+}
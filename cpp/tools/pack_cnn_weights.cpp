@@ -0,0 +1,80 @@
+// Write the prepacked CNN weight file (see cnn_weights.h) of the json models,
+// for PitchDetector::from_files.
+//
+// Usage: pack_cnn_weights <model_data directory> <output file> [tolerance]
+//
+// With a tolerance, the weights are pruned first (see PitchCnn::prune_weights)
+// and the pruned rows are stored as zeros: the sparse kernels pick them up
+// when the file is loaded, without copying the weights.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "source/cnn_weights.h"
+#include "source/pitch_cnn.h"
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static BinaryBlob blob(std::vector<uint8_t> &data) {
+    return {data.data(), data.size()};
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr,
+                "Usage: %s <model_data directory> <output file> "
+                "[tolerance]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const std::string model_dir = argv[1];
+
+    auto contour = read_file(model_dir + "/cnn_contour_model.json");
+    auto note = read_file(model_dir + "/cnn_note_model.json");
+    auto onset_1 = read_file(model_dir + "/cnn_onset_1_model.json");
+    auto onset_2 = read_file(model_dir + "/cnn_onset_2_model.json");
+
+    // PitchCnn holds large buffers, keep it off the stack.
+    const auto cnn = std::make_unique<PitchCnn>(
+        blob(contour), blob(note), blob(onset_1), blob(onset_2));
+
+    if (argc > 3) {
+        const float tolerance = std::strtof(argv[3], nullptr);
+        printf("Pruned with tolerance %g: %.1f%% of multiply-adds skipped\n",
+               tolerance, 100.0f * cnn->prune_weights(tolerance));
+    }
+
+    auto packed = pack_cnn_weights(cnn->layers());
+
+    // Read back as PitchDetector::from_files will.
+    const auto layers = unpack_cnn_weights(blob(packed));
+    if (!PitchCnn::is_valid_model(layers)) {
+        fprintf(stderr, "Unexpected model shapes\n");
+        return 1;
+    }
+
+    std::ofstream out(argv[2], std::ios::binary);
+    out.write(reinterpret_cast<const char *>(packed.data()),
+              static_cast<std::streamsize>(packed.size()));
+    if (!out) {
+        fprintf(stderr, "Can't write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %zu layers, %zu bytes\n", argv[2], layers.size(),
+           packed.size());
+    return 0;
+}
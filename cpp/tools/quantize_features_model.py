@@ -0,0 +1,49 @@
+"""Write a float16 or int8 variant of the features model, to optimize and
+check against the reference model with optimize_features_model.
+
+The model input and output stay float32, so the runtime is unchanged. float16
+converts the whole graph. int8 quantizes the weights of the CQT convolutions
+dynamically, activations are quantized at run time.
+
+Needs the onnx, onnxconverter-common (float16) and onnxruntime (int8)
+packages.
+
+Usage: python quantize_features_model.py <float16|int8> <input model.onnx>
+           <output model.onnx>
+"""
+
+import sys
+
+import onnx
+
+
+def main():
+    if len(sys.argv) != 4 or sys.argv[1] not in ("float16", "int8"):
+        print(__doc__.split("\n\n")[-1], file=sys.stderr)
+        return 1
+
+    mode, input_path, output_path = sys.argv[1:]
+
+    if mode == "float16":
+        from onnxconverter_common import float16
+
+        model = float16.convert_float_to_float16(
+            onnx.load(input_path), keep_io_types=True
+        )
+        onnx.save(model, output_path)
+    else:
+        from onnxruntime.quantization import QuantType, quantize_dynamic
+
+        quantize_dynamic(
+            input_path,
+            output_path,
+            op_types_to_quantize=["Conv"],
+            weight_type=QuantType.QInt8,
+        )
+
+    print(f"{output_path}: {mode}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,4 +1,5 @@
-use std::ffi::c_void;
+use std::ffi::{c_char, c_void, CStr, CString};
+use std::path::Path;
 
 #[repr(C)]
 #[derive(Copy, Clone, Debug)]
@@ -45,6 +46,25 @@ impl PitchDetector {
         }
     }
 
+    /// Create a detector from model files, memory mapped and shared by all
+    /// processes using them. `cnn_weights` is a prepacked CNN weight file
+    /// written by the `pack_cnn_weights` tool. `None` if a file can't be
+    /// mapped, the weight file is not valid or the features model can't be
+    /// loaded.
+    pub fn from_files(features_model_ort: &Path, cnn_weights: &Path) -> Option<Self> {
+        let features_model_ort = CString::new(features_model_ort.to_str()?).ok()?;
+        let cnn_weights = CString::new(cnn_weights.to_str()?).ok()?;
+
+        let raw_detector = unsafe {
+            pitch_detector_create_from_files(features_model_ort.as_ptr(), cnn_weights.as_ptr())
+        };
+        if raw_detector.is_null() {
+            return None;
+        }
+
+        Some(Self { raw_detector })
+    }
+
     pub fn reset(&mut self) {
         unsafe {
             pitch_detector_reset(self.raw_detector);
@@ -60,11 +80,13 @@ impl PitchDetector {
         }
     }
 
-    pub fn transcribe_to_midi(&mut self, audio: &[f32]) {
+    /// Transcribe `audio` (at 22050 Hz). Returns false if it was not run
+    /// because it would exceed the memory limit, see `set_memory_limit`.
+    pub fn transcribe_to_midi(&mut self, audio: &[f32]) -> bool {
         unsafe {
             let raw_audio_ptr = audio.as_ptr();
             let num_samples = audio.len() as i32;
-            pitch_detector_transcribe_to_midi(self.raw_detector, raw_audio_ptr, num_samples);
+            pitch_detector_transcribe_to_midi(self.raw_detector, raw_audio_ptr, num_samples) != 0
         }
     }
 
@@ -83,6 +105,365 @@ impl PitchDetector {
             );
         }
     }
+
+    /// Start transcribing on another thread. The audio is copied. The
+    /// detector stays borrowed by the job; its note events are read once the
+    /// job is done, a cancelled job leaves it reset.
+    pub fn submit(&mut self, audio: &[f32]) -> TranscriptionJob<'_> {
+        let raw_job = unsafe {
+            pitch_detector_submit(self.raw_detector, audio.as_ptr(), audio.len() as i32)
+        };
+        TranscriptionJob {
+            raw_job,
+            _detector: std::marker::PhantomData,
+        }
+    }
+
+    /// Start streaming transcription. Audio pushed while the ring buffer is full is dropped.
+    /// Notes still sounding after about 12 s of uninterrupted notes are split in two.
+    pub fn start_stream(&mut self, ring_buffer_num_samples: usize) {
+        unsafe {
+            pitch_detector_start_stream(self.raw_detector, ring_buffer_num_samples as i32);
+        }
+    }
+
+    /// Start streaming transcription where each note is published as soon as it is final
+    /// (no melodia pass). `max_note_latency_frames` bounds the delay between the start of a
+    /// note and its publication, `None` for unbounded. The worker time per frame then grows with
+    /// the longest note; `Some(1024)` bounds it as `start_stream` does.
+    pub fn start_online_stream(
+        &mut self,
+        ring_buffer_num_samples: usize,
+        max_note_latency_frames: Option<u32>,
+    ) {
+        let max_latency = max_note_latency_frames.map_or(-1, |frames| frames as i32);
+        unsafe {
+            pitch_detector_start_online_stream(
+                self.raw_detector,
+                ring_buffer_num_samples as i32,
+                max_latency,
+            );
+        }
+    }
+
+    /// Push audio (22050 Hz) to the stream without blocking.
+    /// Returns the number of samples accepted. To push and read events on different threads,
+    /// see `stream_handles`.
+    pub fn push_audio(&mut self, audio: &[f32]) -> usize {
+        unsafe {
+            pitch_detector_push_audio(self.raw_detector, audio.as_ptr(), audio.len() as i32) as usize
+        }
+    }
+
+    /// Read the note events the stream has finalized so far.
+    pub fn pop_stream_events(&mut self) -> Vec<NoteEvent> {
+        unsafe { pop_stream_events(self.raw_detector) }
+    }
+
+    /// Split the running stream into a producer, to push audio from the audio callback, and a
+    /// consumer, to read the note events on another thread. Both can be sent to their thread
+    /// and used at the same time, the stream queues are single producer, single consumer. The
+    /// detector stays borrowed by them: the stream is stopped or saved once both are dropped.
+    pub fn stream_handles(&mut self) -> (StreamProducer<'_>, StreamConsumer<'_>) {
+        (
+            StreamProducer {
+                raw_detector: self.raw_detector,
+                _detector: std::marker::PhantomData,
+            },
+            StreamConsumer {
+                raw_detector: self.raw_detector,
+                _detector: std::marker::PhantomData,
+            },
+        )
+    }
+
+    /// Number of events dropped because the event queue (4096 events) was full, i.e.
+    /// `pop_stream_events` was not called often enough.
+    pub fn num_dropped_stream_events(&self) -> usize {
+        unsafe { pitch_detector_get_num_dropped_stream_events(self.raw_detector) as usize }
+    }
+
+    /// Process all pushed audio and stop the stream worker.
+    pub fn stop_stream(&mut self) {
+        unsafe {
+            pitch_detector_stop_stream(self.raw_detector);
+        }
+    }
+
+    /// Checkpoint the running stream, to resume it later with
+    /// `restore_stream_state`, possibly in another process running the same build.
+    /// Returns `None` if not streaming.
+    pub fn save_stream_state(&mut self) -> Option<Vec<u8>> {
+        unsafe {
+            let state = pitch_detector_save_stream_state(self.raw_detector);
+            let bytes = if state.num_bytes > 0 {
+                Some(std::slice::from_raw_parts(state.data, state.num_bytes).to_vec())
+            } else {
+                None
+            };
+            pitch_detector_free_stream_state(state);
+            bytes
+        }
+    }
+
+    /// Start a stream from a saved state. The detector must have the same models, frequency
+    /// range and silence gate as the one that saved it. Returns false if the state doesn't match.
+    pub fn restore_stream_state(&mut self, state: &[u8], ring_buffer_num_samples: usize) -> bool {
+        unsafe {
+            pitch_detector_restore_stream_state(
+                self.raw_detector,
+                BinaryFile::from_bytes(state),
+                ring_buffer_num_samples as i32,
+            ) != 0
+        }
+    }
+
+    /// Note events carry no pitch bends: disabling them skips the contour
+    /// posteriorgrams. Re-enabled by `set_parameters`.
+    pub fn set_pitch_bends(&mut self, enabled: bool) {
+        unsafe {
+            pitch_detector_set_pitch_bend(self.raw_detector, if enabled { 2 } else { 0 });
+        }
+    }
+
+    /// Only transcribe notes between `min_frequency` and `max_frequency` (in
+    /// Hz). The CNN then only computes what these notes depend on.
+    pub fn set_frequency_range(&mut self, min_frequency: Option<f32>, max_frequency: Option<f32>) {
+        unsafe {
+            pitch_detector_set_frequency_range(
+                self.raw_detector,
+                min_frequency.unwrap_or(-1.0),
+                max_frequency.unwrap_or(-1.0),
+            );
+        }
+    }
+
+    /// Skip CNN inference on silent stretches. A negative threshold disables
+    /// the gate.
+    pub fn set_silence_gate(&mut self, threshold: f32) {
+        unsafe {
+            pitch_detector_set_silence_gate(self.raw_detector, threshold);
+        }
+    }
+
+    /// Number of frames skipped by the silence gate in the latest run.
+    pub fn num_skipped_frames(&self) -> usize {
+        unsafe { pitch_detector_get_num_skipped_frames(self.raw_detector) as usize }
+    }
+
+    /// Prune the CNN weights below `tolerance` times the largest weight of
+    /// their layer and skip them. Returns the fraction of CNN multiply-adds
+    /// skipped. Notes degrade noticeably from a tolerance of ~0.1.
+    pub fn prune_cnn_weights(&mut self, tolerance: f32) -> f32 {
+        unsafe { pitch_detector_prune_cnn_weights(self.raw_detector, tolerance) }
+    }
+
+    /// Number of threads note events are extracted with, 0 for the number of
+    /// cores. Note events don't depend on it.
+    pub fn set_num_note_threads(&mut self, num_threads: usize) {
+        unsafe { pitch_detector_set_num_note_threads(self.raw_detector, num_threads as i32) }
+    }
+
+    /// Storage precision of the posteriorgrams kept by the detector, from the
+    /// next transcription. Half precision formats halve their memory, and can
+    /// move a note boundary by a frame where a value rounds across a threshold.
+    pub fn set_posteriorgram_precision(&mut self, precision: PosteriorgramPrecision) {
+        unsafe { pitch_detector_set_posteriorgram_precision(self.raw_detector, precision as i32) }
+    }
+
+    /// Compute the features in 2 second windows, as Basic Pitch does for long
+    /// files: constant memory instead of about 17 KB per frame, but notes can
+    /// differ slightly.
+    pub fn set_segmented_features(&mut self, segmented: bool) {
+        unsafe { pitch_detector_set_segmented_features(self.raw_detector, segmented as i32) }
+    }
+
+    /// Cap the memory of transcriptions, `None` for no limit. Features are
+    /// segmented if needed; transcriptions that would still exceed the limit
+    /// are not run and give no note events: `transcribe_to_midi` returns
+    /// false and jobs are `JobStatus::Rejected`. Cached audio always runs.
+    pub fn set_memory_limit(&mut self, max_bytes: Option<usize>) {
+        unsafe {
+            pitch_detector_set_memory_limit(self.raw_detector, max_bytes.unwrap_or(0) as i64)
+        }
+    }
+
+    /// Estimated peak memory in bytes of transcribing `num_samples` samples
+    /// with the current options and memory limit.
+    pub fn estimate_memory(&self, num_samples: usize) -> usize {
+        unsafe { pitch_detector_estimate_memory(self.raw_detector, num_samples as i32) as usize }
+    }
+
+    /// Cache the posteriorgrams of up to `max_bytes` of recent
+    /// transcriptions, so that transcribing the same audio again with the
+    /// same settings only extracts notes. `None` disables the cache.
+    pub fn set_posteriorgram_cache_size(&mut self, max_bytes: Option<usize>) {
+        unsafe {
+            pitch_detector_set_posteriorgram_cache_size(
+                self.raw_detector,
+                max_bytes.unwrap_or(0) as i64,
+            )
+        }
+    }
+
+    /// Number of transcriptions found in the posteriorgram cache, and not
+    /// found, since it was enabled.
+    pub fn cache_hits_and_misses(&self) -> (usize, usize) {
+        unsafe {
+            (
+                pitch_detector_get_cache_hits(self.raw_detector) as usize,
+                pitch_detector_get_cache_misses(self.raw_detector) as usize,
+            )
+        }
+    }
+}
+
+/// Read all the events in the stream event queue.
+unsafe fn pop_stream_events(raw_detector: *mut PitchDetectorHandle) -> Vec<NoteEvent> {
+    let mut events = Vec::new();
+    let mut buffer = [NoteEvent {
+        start_time: 0.0,
+        end_time: 0.0,
+        midi_note: 0,
+        amplitude: 0.0,
+    }; 64];
+
+    loop {
+        let num_events = pitch_detector_pop_stream_events(
+            raw_detector,
+            buffer.as_mut_ptr(),
+            buffer.len() as i32,
+        );
+        events.extend_from_slice(&buffer[..num_events as usize]);
+        if (num_events as usize) < buffer.len() {
+            return events;
+        }
+    }
+}
+
+/// Audio side of a stream, see `PitchDetector::stream_handles`.
+pub struct StreamProducer<'a> {
+    raw_detector: *mut PitchDetectorHandle,
+    _detector: std::marker::PhantomData<&'a mut PitchDetector>,
+}
+
+// Only pushes to the audio ring buffer, which one thread at a time may do.
+unsafe impl Send for StreamProducer<'_> {}
+
+impl StreamProducer<'_> {
+    /// Push audio (22050 Hz) to the stream. Wait-free and allocation free, safe to call from a
+    /// real-time thread. Returns the number of samples accepted.
+    pub fn push_audio(&mut self, audio: &[f32]) -> usize {
+        unsafe {
+            pitch_detector_push_audio(self.raw_detector, audio.as_ptr(), audio.len() as i32)
+                as usize
+        }
+    }
+}
+
+/// Event side of a stream, see `PitchDetector::stream_handles`.
+pub struct StreamConsumer<'a> {
+    raw_detector: *mut PitchDetectorHandle,
+    _detector: std::marker::PhantomData<&'a mut PitchDetector>,
+}
+
+// Only pops from the event queue, which one thread at a time may do.
+unsafe impl Send for StreamConsumer<'_> {}
+
+impl StreamConsumer<'_> {
+    /// Read the note events the stream has finalized so far.
+    pub fn pop_events(&mut self) -> Vec<NoteEvent> {
+        unsafe { pop_stream_events(self.raw_detector) }
+    }
+
+    /// See `PitchDetector::num_dropped_stream_events`.
+    pub fn num_dropped_events(&self) -> usize {
+        unsafe { pitch_detector_get_num_dropped_stream_events(self.raw_detector) as usize }
+    }
+}
+
+/// Storage precision of the posteriorgrams, see
+/// `PitchDetector::set_posteriorgram_precision`.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum PosteriorgramPrecision {
+    Float32 = 0,
+    Float16 = 1,
+    BFloat16 = 2,
+}
+
+/// Status of a `TranscriptionJob`.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum JobStatus {
+    Running = 0,
+    Done = 1,
+    Cancelled = 2,
+    /// Not run, over the memory limit.
+    Rejected = 3,
+}
+
+impl JobStatus {
+    fn from_raw(status: i32) -> Self {
+        match status {
+            1 => JobStatus::Done,
+            2 => JobStatus::Cancelled,
+            3 => JobStatus::Rejected,
+            _ => JobStatus::Running,
+        }
+    }
+}
+
+/// Transcription running on its own thread, see `PitchDetector::submit`.
+/// Dropping the job cancels it and waits for it.
+pub struct TranscriptionJob<'a> {
+    raw_job: *mut TranscriptionJobHandle,
+    _detector: std::marker::PhantomData<&'a mut PitchDetector>,
+}
+
+impl Drop for TranscriptionJob<'_> {
+    fn drop(&mut self) {
+        unsafe { pitch_detector_job_destroy(self.raw_job) };
+    }
+}
+
+impl TranscriptionJob<'_> {
+    /// Status, without blocking.
+    pub fn poll(&self) -> JobStatus {
+        JobStatus::from_raw(unsafe { pitch_detector_job_poll(self.raw_job) })
+    }
+
+    /// Block until the job has finished.
+    pub fn wait(&self) -> JobStatus {
+        JobStatus::from_raw(unsafe { pitch_detector_job_wait(self.raw_job) })
+    }
+
+    /// Fraction of the CNN frames computed, from 0 to 1.
+    pub fn progress(&self) -> f32 {
+        unsafe { pitch_detector_job_progress(self.raw_job) }
+    }
+
+    /// Request cancellation, checked between CNN frames and between note
+    /// extraction passes.
+    pub fn cancel(&self) {
+        unsafe { pitch_detector_job_cancel(self.raw_job) }
+    }
+}
+
+/// Record a timeline of the pipeline stages of all detectors, see
+/// `dump_trace`. Each thread buffers up to `events_per_thread` events (0 for
+/// the default), later ones are dropped.
+pub fn set_tracing(enabled: bool, events_per_thread: usize) {
+    unsafe { pitch_detector_set_tracing(enabled as i32, events_per_thread as i32) }
+}
+
+/// Take the recorded events, as Chrome trace JSON for chrome://tracing or
+/// ui.perfetto.dev.
+pub fn dump_trace() -> String {
+    unsafe {
+        let trace = pitch_detector_dump_trace();
+        let json = CStr::from_ptr(trace).to_string_lossy().into_owned();
+        pitch_detector_free_trace(trace);
+        json
+    }
 }
 
 #[repr(C)]
@@ -114,9 +495,17 @@ struct ModelFiles {
 #[repr(C)]
 struct PitchDetectorHandle(c_void);
 
+#[repr(C)]
+struct TranscriptionJobHandle(c_void);
+
 extern "C" {
     fn pitch_detector_create(model_files: ModelFiles) -> *mut PitchDetectorHandle;
 
+    fn pitch_detector_create_from_files(
+        features_model_path: *const c_char,
+        cnn_weights_path: *const c_char,
+    ) -> *mut PitchDetectorHandle;
+
     fn pitch_detector_reset(detector: *mut PitchDetectorHandle);
 
     fn pitch_detector_set_parameters(
@@ -130,7 +519,7 @@ extern "C" {
         detector: *mut PitchDetectorHandle,
         audio: *const f32,
         num_samples: i32,
-    );
+    ) -> i32;
 
     fn pitch_detector_get_note_events(
         detector: *mut PitchDetectorHandle,
@@ -139,4 +528,93 @@ extern "C" {
     );
 
     fn pitch_detector_destroy(pitch_detector: *mut PitchDetectorHandle);
+
+    fn pitch_detector_submit(
+        detector: *mut PitchDetectorHandle,
+        audio: *const f32,
+        num_samples: i32,
+    ) -> *mut TranscriptionJobHandle;
+
+    fn pitch_detector_job_poll(job: *mut TranscriptionJobHandle) -> i32;
+
+    fn pitch_detector_job_wait(job: *mut TranscriptionJobHandle) -> i32;
+
+    fn pitch_detector_job_progress(job: *mut TranscriptionJobHandle) -> f32;
+
+    fn pitch_detector_job_cancel(job: *mut TranscriptionJobHandle);
+
+    fn pitch_detector_job_destroy(job: *mut TranscriptionJobHandle);
+
+    fn pitch_detector_start_stream(
+        detector: *mut PitchDetectorHandle,
+        ring_buffer_num_samples: i32,
+    );
+
+    fn pitch_detector_start_online_stream(
+        detector: *mut PitchDetectorHandle,
+        ring_buffer_num_samples: i32,
+        max_note_latency_frames: i32,
+    );
+
+    fn pitch_detector_push_audio(
+        detector: *mut PitchDetectorHandle,
+        audio: *const f32,
+        num_samples: i32,
+    ) -> i32;
+
+    fn pitch_detector_pop_stream_events(
+        detector: *mut PitchDetectorHandle,
+        out_events: *mut NoteEvent,
+        max_events: i32,
+    ) -> i32;
+
+    fn pitch_detector_get_num_dropped_stream_events(detector: *mut PitchDetectorHandle) -> i32;
+
+    fn pitch_detector_stop_stream(detector: *mut PitchDetectorHandle);
+
+    fn pitch_detector_save_stream_state(detector: *mut PitchDetectorHandle) -> BinaryFile;
+
+    fn pitch_detector_free_stream_state(state: BinaryFile);
+
+    fn pitch_detector_restore_stream_state(
+        detector: *mut PitchDetectorHandle,
+        state: BinaryFile,
+        ring_buffer_num_samples: i32,
+    ) -> i32;
+
+    fn pitch_detector_set_pitch_bend(detector: *mut PitchDetectorHandle, pitch_bend: i32);
+
+    fn pitch_detector_set_frequency_range(
+        detector: *mut PitchDetectorHandle,
+        min_frequency: f32,
+        max_frequency: f32,
+    );
+
+    fn pitch_detector_set_silence_gate(detector: *mut PitchDetectorHandle, threshold: f32);
+
+    fn pitch_detector_get_num_skipped_frames(detector: *mut PitchDetectorHandle) -> i32;
+
+    fn pitch_detector_prune_cnn_weights(detector: *mut PitchDetectorHandle, tolerance: f32) -> f32;
+
+    fn pitch_detector_set_num_note_threads(detector: *mut PitchDetectorHandle, num_threads: i32);
+
+    fn pitch_detector_set_posteriorgram_precision(detector: *mut PitchDetectorHandle, precision: i32);
+
+    fn pitch_detector_set_segmented_features(detector: *mut PitchDetectorHandle, segmented: i32);
+
+    fn pitch_detector_set_memory_limit(detector: *mut PitchDetectorHandle, max_bytes: i64);
+
+    fn pitch_detector_estimate_memory(detector: *mut PitchDetectorHandle, num_samples: i32) -> i64;
+
+    fn pitch_detector_set_posteriorgram_cache_size(detector: *mut PitchDetectorHandle, max_bytes: i64);
+
+    fn pitch_detector_get_cache_hits(detector: *mut PitchDetectorHandle) -> i64;
+
+    fn pitch_detector_get_cache_misses(detector: *mut PitchDetectorHandle) -> i64;
+
+    fn pitch_detector_set_tracing(enabled: i32, events_per_thread: i32);
+
+    fn pitch_detector_dump_trace() -> *mut c_char;
+
+    fn pitch_detector_free_trace(trace: *mut c_char);
 }